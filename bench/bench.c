@@ -0,0 +1,593 @@
+// SPDX-License-Identifier: MIT
+// Author:  Giovanni Santini
+// Mail:    giovanni.santini@proton.me
+// Github:  @San7o
+//
+// bench
+// =====
+//
+// Measure the cost of a log call and the throughput of the outputs
+// of micro-log.h, from 1, 4, 16 and 64 threads.
+//
+// Usage:
+//
+//    bench [-n calls] [-t threads] [scenario...]
+//
+// The scenarios are:
+//
+//  - disabled: a call below the level of the logger
+//  - devnull:  text records written to /dev/null
+//  - file:     text records written to a file
+//  - json:     json records written to a file
+//  - inet:     text records sent to a local TCP server
+//  - unix:     text records sent to a local unix socket server
+//  - span:     a prebuilt 256 byte message logged with "%.*s", to
+//              /dev/null
+//  - raw:      the same message logged with `micro_log_write_raw2`
+//
+// All of them are run if none is given. Each run makes [calls] log
+// calls in total, 262144 by default, split between the threads. With
+// [-t] only the given number of threads is used.
+//
+// For each run, the output has the mean time of a call, the records
+// written per second, and the 50th, 99th and 99.9th percentiles of
+// the time of a call, in nanoseconds. The time of a call includes
+// one read of the monotonic clock, which is printed at the start.
+//
+// The socket outputs drop records instead of blocking when the
+// server does not keep up, so for the inet and unix scenarios the
+// output also has the records the server received and the bytes the
+// logger dropped. Their records/s only counts the received records.
+//
+// Other compile time settings can be benchmarked by passing them to
+// make, for example:
+//
+//    make bench DEFINES="-DMICRO_LOG_ASYNC"
+//
+// With MICRO_LOG_ASYNC the logger is initialized with
+// `micro_log_init_async2`, and each run includes waiting for the
+// queue to be written.
+//
+// The same logger is used by all the runs, and only its output is
+// changed between them.
+
+#define MICRO_LOG_MULTITHREADED
+#define MICRO_LOG_SOCKETS
+#define MICRO_LOG_IMPLEMENTATION
+#include "../micro-log.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define BENCH_CALLS       262144
+#define BENCH_ASYNC_QUEUE 65536
+#define BENCH_FILE        "/tmp/micro-log-bench.log"
+#define BENCH_UNIX_SOCKET "/tmp/micro-log-bench.sock"
+#define BENCH_SPAN_SIZE   256
+
+// Buckets of the latency histograms
+//
+// The values below 16ns have a bucket each, then every power of two
+// is split in 16 buckets, so a percentile is within 6.25% of the
+// real value.
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t count;
+  uint64_t sum;
+} Histogram;
+
+typedef enum {
+  SCENARIO_DISABLED = 0,
+  SCENARIO_DEVNULL,
+  SCENARIO_FILE,
+  SCENARIO_JSON,
+  SCENARIO_INET,
+  SCENARIO_UNIX,
+  SCENARIO_SPAN,
+  SCENARIO_RAW,
+  SCENARIO_MAX,
+} Scenario;
+
+static const char *scenario_names[SCENARIO_MAX] = {
+  "disabled", "devnull", "file", "json", "inet", "unix", "span", "raw",
+};
+
+static const int thread_counts[] = { 1, 4, 16, 64 };
+
+// A server that reads and discards what the logger sends to it
+typedef struct {
+  int fd;
+  volatile bool stop;
+  pthread_t thread;
+  // Records received, counted by their newline
+  size_t received;
+} Server;
+
+typedef struct {
+  MicroLog *micro_log;
+  Scenario scenario;
+  pthread_barrier_t *barrier;
+  Histogram hist;
+  size_t calls;
+  int id;
+  uint64_t start;
+  uint64_t end;
+} Worker;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static int hist_index(uint64_t value)
+{
+  if (value < HIST_SUB)
+    return (int) value;
+  int msb = 63 - __builtin_clzll(value);
+  return (msb - HIST_SUB_BITS + 1) * HIST_SUB
+    + (int) ((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// The lowest value of the bucket [index]
+static uint64_t hist_value(int index)
+{
+  if (index < HIST_SUB)
+    return (uint64_t) index;
+  int msb = index / HIST_SUB + HIST_SUB_BITS - 1;
+  uint64_t sub = (uint64_t) (index % HIST_SUB);
+  return (HIST_SUB + sub) << (msb - HIST_SUB_BITS);
+}
+
+static void hist_add(Histogram *hist, uint64_t value)
+{
+  hist->counts[hist_index(value)]++;
+  hist->count++;
+  hist->sum += value;
+}
+
+static void hist_merge(Histogram *dst, const Histogram *src)
+{
+  for (int i = 0; i < HIST_BUCKETS; ++i)
+    dst->counts[i] += src->counts[i];
+  dst->count += src->count;
+  dst->sum   += src->sum;
+}
+
+static uint64_t hist_percentile(const Histogram *hist, double percentile)
+{
+  uint64_t rank = (uint64_t) (percentile / 100.0 * (double) hist->count);
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; ++i)
+  {
+    seen += hist->counts[i];
+    if (seen > rank)
+      return hist_value(i);
+  }
+  return 0;
+}
+
+static void *server_run(void *arg)
+{
+  Server *server = arg;
+  char buf[65536];
+  while (!server->stop)
+  {
+    int conn = accept(server->fd, NULL, NULL);
+    if (conn < 0)
+      continue;
+    ssize_t n;
+    while ((n = read(conn, buf, sizeof(buf))) > 0)
+    {
+      size_t lines = 0;
+      for (ssize_t i = 0; i < n; ++i)
+        lines += (buf[i] == '\n');
+      __atomic_add_fetch(&server->received, lines, __ATOMIC_RELAXED);
+    }
+    close(conn);
+  }
+  return NULL;
+}
+
+// Listen on [addr] and start reading from the connections
+static bool server_start(Server *server,
+                         struct sockaddr *addr,
+                         socklen_t addr_len)
+{
+  server->stop = false;
+  server->received = 0;
+  server->fd = socket(addr->sa_family, SOCK_STREAM, 0);
+  if (server->fd < 0)
+  {
+    perror("Error creating socket");
+    return false;
+  }
+  if (bind(server->fd, addr, addr_len) < 0
+      || listen(server->fd, 16) < 0
+      || getsockname(server->fd, addr, &addr_len) < 0)
+  {
+    perror("Error listening on socket");
+    close(server->fd);
+    return false;
+  }
+  if (pthread_create(&server->thread, NULL, server_run, server) != 0)
+  {
+    fprintf(stderr, "Error: could not start the server thread\n");
+    close(server->fd);
+    return false;
+  }
+  return true;
+}
+
+static void server_stop(Server *server)
+{
+  server->stop = true;
+  // Wakes up the accept
+  shutdown(server->fd, SHUT_RDWR);
+  pthread_join(server->thread, NULL);
+  close(server->fd);
+}
+
+static void *worker_run(void *arg)
+{
+  Worker *worker = arg;
+  MicroLog *micro_log = worker->micro_log;
+  char span[BENCH_SPAN_SIZE];
+  memset(span, 'x', sizeof(span));
+  pthread_barrier_wait(worker->barrier);
+
+  uint64_t start = now_ns();
+  worker->start = start;
+  for (size_t i = 0; i < worker->calls; ++i)
+  {
+    if (worker->scenario == SCENARIO_SPAN)
+      micro_log_info2(micro_log, "%.*s", (int) sizeof(span), span);
+    else if (worker->scenario == SCENARIO_RAW)
+      micro_log_write_raw2(micro_log, MICRO_LOG_LEVEL_INFO,
+                           span, sizeof(span));
+    else
+      micro_log_info2(micro_log, "Benchmark record %zu from worker %d",
+                      i, worker->id);
+    uint64_t end = now_ns();
+    hist_add(&worker->hist, end - start);
+    start = end;
+  }
+  worker->end = start;
+  return NULL;
+}
+
+// Wait for the records queued by the socket output [out] of
+// [micro_log] to reach [server], and return how many it received
+// since [received]
+static size_t server_wait(Server *server,
+                          size_t received,
+                          MicroLog *micro_log,
+                          int out,
+                          size_t expected)
+{
+  // The queue of the logger is only sent when it logs or flushes
+  MicroLogSocketState state;
+  for (int i = 0; i < 1000; ++i)
+  {
+    micro_log_flush2(micro_log);
+    if (micro_log_get_socket_state2(micro_log, out, &state) != MICRO_LOG_OK
+        || state.bytes_queued == 0)
+      break;
+    usleep(1000);
+  }
+
+  // Then wait until the server stops reading new records
+  size_t count = __atomic_load_n(&server->received, __ATOMIC_RELAXED);
+  for (int idle = 0; idle < 50 && count - received < expected; ++idle)
+  {
+    usleep(1000);
+    size_t now = __atomic_load_n(&server->received, __ATOMIC_RELAXED);
+    if (now != count)
+      idle = 0;
+    count = now;
+  }
+  return count - received;
+}
+
+// Make [calls] log calls split between [threads] threads, [server]
+// is not NULL if the records are sent to it through the socket
+// output [out]
+static bool run(MicroLog *micro_log,
+                Scenario scenario,
+                int threads,
+                size_t calls,
+                Server *server,
+                int out)
+{
+  pthread_t *ids = malloc(threads * sizeof(*ids));
+  Worker *workers = calloc(threads, sizeof(*workers));
+  if (ids == NULL || workers == NULL)
+  {
+    fprintf(stderr, "Error: out of memory\n");
+    free(ids);
+    free(workers);
+    return false;
+  }
+
+  MicroLogSocketState before = {0};
+  size_t received = 0;
+  if (server != NULL)
+  {
+    micro_log_get_socket_state2(micro_log, out, &before);
+    received = __atomic_load_n(&server->received, __ATOMIC_RELAXED);
+  }
+
+  pthread_barrier_t barrier;
+  pthread_barrier_init(&barrier, NULL, threads + 1);
+  for (int i = 0; i < threads; ++i)
+  {
+    workers[i].micro_log = micro_log;
+    workers[i].scenario  = scenario;
+    workers[i].barrier   = &barrier;
+    workers[i].calls     = calls / threads
+                           + ((size_t) i < calls % threads ? 1 : 0);
+    workers[i].id        = i;
+    if (pthread_create(&ids[i], NULL, worker_run, &workers[i]) != 0)
+    {
+      // The started threads would wait on the barrier forever
+      fprintf(stderr, "Error: could not start %d threads\n", threads);
+      exit(1);
+    }
+  }
+
+  pthread_barrier_wait(&barrier);
+  for (int i = 0; i < threads; ++i)
+    pthread_join(ids[i], NULL);
+  micro_log_flush2(micro_log);
+  uint64_t end = now_ns();
+  pthread_barrier_destroy(&barrier);
+
+  // From when the first worker started to when the records were
+  // written
+  Histogram total = {0};
+  uint64_t start = end;
+  for (int i = 0; i < threads; ++i)
+  {
+    hist_merge(&total, &workers[i].hist);
+    if (workers[i].start < start)
+      start = workers[i].start;
+  }
+  uint64_t elapsed = end - start;
+
+  // Only the records that made it to the server
+  char delivered[24] = "-";
+  char dropped[24] = "-";
+  size_t records = total.count;
+  if (server != NULL)
+  {
+    records = server_wait(server, received, micro_log, out, total.count);
+    MicroLogSocketState after = {0};
+    micro_log_get_socket_state2(micro_log, out, &after);
+    snprintf(delivered, sizeof(delivered), "%zu", records);
+    snprintf(dropped, sizeof(dropped), "%zu",
+             after.bytes_dropped - before.bytes_dropped);
+  }
+
+  printf("%-8s %7d %9llu %9.1f %11.0f %7llu %7llu %7llu %9s %9s\n",
+         scenario_names[scenario], threads,
+         (unsigned long long) total.count,
+         (double) total.sum / (double) total.count,
+         (double) records * 1e9 / (double) elapsed,
+         (unsigned long long) hist_percentile(&total, 50.0),
+         (unsigned long long) hist_percentile(&total, 99.0),
+         (unsigned long long) hist_percentile(&total, 99.9),
+         delivered, dropped);
+  fflush(stdout);
+
+  free(ids);
+  free(workers);
+  return true;
+}
+
+// Point [micro_log] to the output of [scenario]
+static micro_log_error setup(MicroLog *micro_log,
+                             Scenario scenario,
+                             int inet_port)
+{
+  long unsigned int flags = MICRO_LOG_FLAG_LEVEL | MICRO_LOG_FLAG_DATE
+    | MICRO_LOG_FLAG_TIME | MICRO_LOG_FLAG_TID;
+  MicroLogLevel level = MICRO_LOG_LEVEL_INFO;
+  int out = MICRO_LOG_OUT_FILE;
+
+  // Keep the records of the setters out of the table
+  micro_log_error error = micro_log_set_out2(micro_log, 0);
+  if (error != MICRO_LOG_OK)
+    return error;
+
+  switch (scenario)
+  {
+  case SCENARIO_DISABLED:
+    level = MICRO_LOG_LEVEL_WARN;
+    error = micro_log_set_file2(micro_log, "/dev/null");
+    break;
+  case SCENARIO_DEVNULL:
+  case SCENARIO_SPAN:
+  case SCENARIO_RAW:
+    error = micro_log_set_file2(micro_log, "/dev/null");
+    break;
+  case SCENARIO_JSON:
+    flags |= MICRO_LOG_FLAG_JSON;
+    // fallthrough
+  case SCENARIO_FILE:
+    error = micro_log_set_file2(micro_log, BENCH_FILE);
+    break;
+  case SCENARIO_INET:
+    out = MICRO_LOG_OUT_SOCK_INET;
+    error = micro_log_set_socket_inet2(micro_log, "127.0.0.1", inet_port,
+                                       MICRO_LOG_PROTO_TCP);
+    break;
+  case SCENARIO_UNIX:
+    out = MICRO_LOG_OUT_SOCK_UNIX;
+    error = micro_log_set_socket_unix2(micro_log, BENCH_UNIX_SOCKET);
+    break;
+  default:
+    break;
+  }
+
+  if (error == MICRO_LOG_OK)
+    error = micro_log_set_level2(micro_log, level);
+  if (error == MICRO_LOG_OK)
+    error = micro_log_set_flags2(micro_log, flags);
+  if (error == MICRO_LOG_OK)
+    error = micro_log_set_out2(micro_log, out);
+  return error;
+}
+
+static void usage(const char *program)
+{
+  fprintf(stderr, "Usage: %s [-n calls] [-t threads] [scenario...]\n",
+          program);
+}
+
+int main(int argc, char **argv)
+{
+  bool scenarios[SCENARIO_MAX] = {0};
+  bool any_scenario = false;
+  size_t calls = BENCH_CALLS;
+  int only_threads = 0;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+    {
+      calls = strtoul(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+    {
+      only_threads = atoi(argv[++i]);
+    }
+    else
+    {
+      int s = 0;
+      while (s < SCENARIO_MAX && strcmp(argv[i], scenario_names[s]) != 0)
+        s++;
+      if (s == SCENARIO_MAX)
+      {
+        usage(argv[0]);
+        return 1;
+      }
+      scenarios[s] = true;
+      any_scenario = true;
+    }
+  }
+  if (calls == 0 || only_threads < 0)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+  if (!any_scenario)
+    for (int s = 0; s < SCENARIO_MAX; ++s)
+      scenarios[s] = true;
+
+  Server inet_server, unix_server;
+  struct sockaddr_in inet_addr = {
+    .sin_family = AF_INET,
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  struct sockaddr_un unix_addr = { .sun_family = AF_UNIX };
+  strcpy(unix_addr.sun_path, BENCH_UNIX_SOCKET);
+  unlink(BENCH_UNIX_SOCKET);
+
+  if (scenarios[SCENARIO_INET]
+      && !server_start(&inet_server, (struct sockaddr*) &inet_addr,
+                       sizeof(inet_addr)))
+    return 1;
+  if (scenarios[SCENARIO_UNIX]
+      && !server_start(&unix_server, (struct sockaddr*) &unix_addr,
+                       sizeof(unix_addr)))
+    return 1;
+
+  MicroLog micro_log;
+  #ifdef MICRO_LOG_ASYNC
+  micro_log_error error = micro_log_init_async2(&micro_log,
+                                                BENCH_ASYNC_QUEUE);
+  #else
+  micro_log_error error = micro_log_init2(&micro_log);
+  #endif
+  if (error != MICRO_LOG_OK)
+  {
+    fprintf(stderr, "Error: could not initialize the logger, error %d\n",
+            error);
+    if (scenarios[SCENARIO_INET])
+      server_stop(&inet_server);
+    if (scenarios[SCENARIO_UNIX])
+      server_stop(&unix_server);
+    unlink(BENCH_UNIX_SOCKET);
+    return 1;
+  }
+  micro_log_flush2(&micro_log);
+
+  uint64_t clock_start = now_ns();
+  for (int i = 0; i < 1000; ++i)
+    (void) now_ns();
+  printf("Clock read: %.1f ns\n",
+         (double) (now_ns() - clock_start) / 1000.0);
+  printf("%-8s %7s %9s %9s %11s %7s %7s %7s %9s %9s\n", "scenario",
+         "threads", "calls", "ns/call", "records/s", "p50", "p99", "p999",
+         "delivered", "dropped");
+  fflush(stdout);
+
+  for (int s = 0; s < SCENARIO_MAX && error == MICRO_LOG_OK; ++s)
+  {
+    if (!scenarios[s])
+      continue;
+    error = setup(&micro_log, s, ntohs(inet_addr.sin_port));
+    if (error != MICRO_LOG_OK)
+    {
+      fprintf(stderr, "Error: could not set up the %s scenario, error %d\n",
+              scenario_names[s], error);
+      break;
+    }
+
+    Server *server = NULL;
+    int out = 0;
+    if (s == SCENARIO_INET)
+    {
+      server = &inet_server;
+      out = MICRO_LOG_OUT_SOCK_INET;
+    }
+    else if (s == SCENARIO_UNIX)
+    {
+      server = &unix_server;
+      out = MICRO_LOG_OUT_SOCK_UNIX;
+    }
+
+    size_t runs = sizeof(thread_counts) / sizeof(thread_counts[0]);
+    for (size_t t = 0; t < runs && error == MICRO_LOG_OK; ++t)
+    {
+      if (only_threads != 0 && t > 0)
+        break;
+      int threads = (only_threads != 0) ? only_threads : thread_counts[t];
+      if (!run(&micro_log, s, threads, calls, server, out))
+        error = MICRO_LOG_ERROR_ALLOC;
+    }
+  }
+
+  micro_log_set_out2(&micro_log, 0);
+  micro_log_close2(&micro_log);
+
+  if (scenarios[SCENARIO_INET])
+    server_stop(&inet_server);
+  if (scenarios[SCENARIO_UNIX])
+    server_stop(&unix_server);
+  unlink(BENCH_UNIX_SOCKET);
+  unlink(BENCH_FILE);
+  return (error == MICRO_LOG_OK) ? 0 : 1;
+}
@@ -0,0 +1,331 @@
+// SPDX-License-Identifier: MIT
+// Author:  Giovanni Santini
+// Mail:    giovanni.santini@proton.me
+// Github:  @San7o
+//
+// micro-log-decode
+// ================
+//
+// Turn a binary log written by micro-log.h (see
+// `micro_log_set_binary_file`) back into text or json.
+//
+// Usage:
+//
+//    micro-log-decode [-j] [-f "flags"] FILE
+//
+// Records are rendered with the flags they were logged with, unless
+// [-f] is used to override them with a list of flag names like in
+// the `flags:` setting, for example -f "level date time".
+// With [-j] the records are rendered as json.
+//
+// The binary log must have been written on a machine with the same
+// architecture as the one decoding it.
+
+#define MICRO_LOG_IMPLEMENTATION
+#include "micro-log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  char *file;
+  int line;
+  char *fmt;
+} Format;
+
+typedef struct {
+  Format *formats;
+  uint32_t count;
+  uint32_t cap;
+  // If not MICRO_LOG_FLAG_NONE, used instead of the flags of the records
+  long unsigned int flags;
+  bool json;
+} Decoder;
+
+static void usage(const char *program)
+{
+  fprintf(stderr, "Usage: %s [-j] [-f \"flags\"] FILE\n", program);
+}
+
+static bool read_header(FILE *file)
+{
+  _MicroLogBinaryHeader header, expected;
+  _micro_log_binary_header(&expected);
+  if (fread(&header, sizeof(header), 1, file) != 1)
+  {
+    fprintf(stderr, "Error: could not read the header\n");
+    return false;
+  }
+  if (memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0)
+  {
+    fprintf(stderr, "Error: not a micro-log binary file\n");
+    return false;
+  }
+  if (header.version != expected.version)
+  {
+    fprintf(stderr, "Error: unsupported version %u\n",
+            (unsigned int) header.version);
+    return false;
+  }
+  if (memcmp(&header, &expected, sizeof(header)) != 0)
+  {
+    fprintf(stderr, "Error: the file was written on a different architecture\n");
+    return false;
+  }
+  return true;
+}
+
+// Copy [len] bytes of [src] as a null terminated string
+static char *copy_string(const char *src, size_t len)
+{
+  char *str = malloc(len + 1);
+  if (str == NULL) return NULL;
+  memcpy(str, src, len);
+  str[len] = '\0';
+  return str;
+}
+
+static bool add_format(Decoder *decoder, const char *payload, uint32_t len)
+{
+  uint32_t id, file_len;
+  int32_t line;
+  if (len < sizeof(id) + sizeof(line) + sizeof(file_len))
+    return false;
+  memcpy(&id, payload, sizeof(id));
+  memcpy(&line, payload + sizeof(id), sizeof(line));
+  memcpy(&file_len, payload + sizeof(id) + sizeof(line), sizeof(file_len));
+  payload += sizeof(id) + sizeof(line) + sizeof(file_len);
+  len     -= sizeof(id) + sizeof(line) + sizeof(file_len);
+  if (file_len > len || id != decoder->count)
+    return false;
+
+  if (decoder->count == decoder->cap)
+  {
+    uint32_t cap = decoder->cap ? 2 * decoder->cap : 64;
+    Format *formats = realloc(decoder->formats, cap * sizeof(*formats));
+    if (formats == NULL) return false;
+    decoder->formats = formats;
+    decoder->cap = cap;
+  }
+
+  Format *format = &decoder->formats[decoder->count];
+  format->line = line;
+  format->file = copy_string(payload, file_len);
+  format->fmt  = copy_string(payload + file_len, len - file_len);
+  if (format->file == NULL || format->fmt == NULL)
+  {
+    free(format->file);
+    free(format->fmt);
+    return false;
+  }
+  decoder->count++;
+  return true;
+}
+
+// [logged_flags] is set to the flags the record was logged with
+static bool read_record(const Decoder *decoder,
+                        MicroLogRecord *record,
+                        long unsigned int *logged_flags,
+                        const char *payload,
+                        uint32_t len)
+{
+  if (len < _MICRO_LOG_BINARY_RECORD_SIZE)
+    return false;
+  _micro_log_binary_record_decode(payload, record);
+  if (record->level >= MICRO_LOG_LEVEL_MAX)
+    return false;
+  *logged_flags = record->flags;
+
+  if (decoder->flags != MICRO_LOG_FLAG_NONE)
+    record->flags = decoder->flags;
+  if (decoder->json)
+    record->flags |= MICRO_LOG_FLAG_JSON;
+  return true;
+}
+
+static bool decode_frame(Decoder *decoder,
+                         _MicroLogBuf *buf,
+                         char type,
+                         const char *payload,
+                         uint32_t len)
+{
+  MicroLogRecord record;
+  long unsigned int logged_flags;
+  micro_log_error error = MICRO_LOG_OK;
+
+  switch (type)
+  {
+  case _MICRO_LOG_BINARY_FORMAT:
+    return add_format(decoder, payload, len);
+  case _MICRO_LOG_BINARY_RECORD:
+  {
+    uint32_t id;
+    if (len < sizeof(id)) return false;
+    memcpy(&id, payload, sizeof(id));
+    if (id >= decoder->count) return false;
+    payload += sizeof(id);
+    len     -= sizeof(id);
+    if (!read_record(decoder, &record, &logged_flags, payload, len))
+      return false;
+    payload += _MICRO_LOG_BINARY_RECORD_SIZE;
+    len     -= _MICRO_LOG_BINARY_RECORD_SIZE;
+
+    const Format *format = &decoder->formats[id];
+    record.file = format->file;
+    record.line = format->line;
+    error = _micro_log_render_header(buf, &record);
+    size_t begin = buf->len;
+    if (error == MICRO_LOG_OK)
+      error = _micro_log_deferred_format(buf, format->fmt, payload, len);
+    if (error == MICRO_LOG_OK)
+      error = _micro_log_render_escape(buf, &record, begin);
+    break;
+  }
+  case _MICRO_LOG_BINARY_TEXT:
+  {
+    uint32_t file_len;
+    int32_t line;
+    if (!read_record(decoder, &record, &logged_flags, payload, len))
+      return false;
+    payload += _MICRO_LOG_BINARY_RECORD_SIZE;
+    len     -= _MICRO_LOG_BINARY_RECORD_SIZE;
+    if (len < sizeof(line) + sizeof(file_len)) return false;
+    memcpy(&line, payload, sizeof(line));
+    memcpy(&file_len, payload + sizeof(line), sizeof(file_len));
+    payload += sizeof(line) + sizeof(file_len);
+    len     -= sizeof(line) + sizeof(file_len);
+    record.line = line;
+    if (file_len > len) return false;
+
+    char *file = copy_string(payload, file_len);
+    if (file == NULL) return false;
+    record.file = file;
+    error = _micro_log_render_header(buf, &record);
+    size_t begin = buf->len;
+    if (error == MICRO_LOG_OK)
+      error = _micro_log_buf_append(buf, payload + file_len,
+                                    len - file_len);
+    // The message is already escaped if it was logged as json
+    if (error == MICRO_LOG_OK && !(logged_flags & MICRO_LOG_FLAG_JSON))
+      error = _micro_log_render_escape(buf, &record, begin);
+    free(file);
+    break;
+  }
+  default:
+    return false;
+  }
+
+  if (error == MICRO_LOG_OK)
+    error = _micro_log_render_footer(buf, &record);
+  return error == MICRO_LOG_OK;
+}
+
+int main(int argc, char **argv)
+{
+  Decoder decoder = {0};
+  const char *filename = NULL;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "-j") == 0)
+    {
+      decoder.json = true;
+    }
+    else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+    {
+      if (_micro_log_parse_flags(argv[++i], &decoder.flags) != MICRO_LOG_OK)
+      {
+        fprintf(stderr, "Error: unknown flag in \"%s\"\n", argv[i]);
+        return 1;
+      }
+    }
+    else if (filename == NULL && argv[i][0] != '-')
+    {
+      filename = argv[i];
+    }
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (filename == NULL)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  FILE *file = fopen(filename, "rb");
+  if (file == NULL)
+  {
+    perror("Error opening file");
+    return 1;
+  }
+
+  int ret = 0;
+  char *payload = NULL;
+  uint32_t payload_cap = 0;
+
+  if (!read_header(file))
+  {
+    ret = 1;
+    goto done;
+  }
+
+  char type;
+  uint32_t len;
+  while (fread(&type, 1, 1, file) == 1)
+  {
+    if (fread(&len, sizeof(len), 1, file) != 1)
+    {
+      fprintf(stderr, "Error: truncated frame\n");
+      ret = 1;
+      goto done;
+    }
+    if (len > payload_cap)
+    {
+      char *tmp = realloc(payload, len);
+      if (tmp == NULL)
+      {
+        fprintf(stderr, "Error: out of memory\n");
+        ret = 1;
+        goto done;
+      }
+      payload = tmp;
+      payload_cap = len;
+    }
+    if (len > 0 && fread(payload, 1, len, file) != len)
+    {
+      // The writer may have been interrupted in the middle of a frame
+      fprintf(stderr, "Error: truncated frame\n");
+      ret = 1;
+      goto done;
+    }
+
+    char stack[MICRO_LOG_RECORD_SIZE];
+    _MicroLogBuf buf;
+    _micro_log_buf_init(&buf, stack, sizeof(stack));
+    bool ok = decode_frame(&decoder, &buf, type, payload, len);
+    if (ok && buf.len > 0)
+      fwrite(buf.data, 1, buf.len, stdout);
+    _micro_log_buf_free(&buf);
+    if (!ok)
+    {
+      fprintf(stderr, "Error: invalid frame of type '%c'\n", type);
+      ret = 1;
+      goto done;
+    }
+  }
+
+ done:
+  for (uint32_t i = 0; i < decoder.count; ++i)
+  {
+    free(decoder.formats[i].file);
+    free(decoder.formats[i].fmt);
+  }
+  free(decoder.formats);
+  free(payload);
+  fclose(file);
+  return ret;
+}
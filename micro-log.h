@@ -22,9 +22,25 @@
 //
 //  - Multiple logging levels
 //  - Log to stdout, file, UNIX sockets, and network sockets
+//  - Non-blocking socket outputs that reconnect automatically
 //  - Configurable metadata (level, date, time, pid, tid, etc.)
-//  - JSON serialization support
+//  - Settings file, reloaded when it changes
+//  - Rotation of the output file on size and time, with compression
+//  - Memory mapped file output, written without locks
+//  - Crash handler that writes the buffered records before exiting
+//  - Flight recorder that writes the recent debug records on errors
+//  - Rate limits per call site, and collapsing of repeated records
+//  - Sampling of high frequency call sites
+//  - Renderer compiled for a fixed set of flags
+//  - Structured records with typed fields
+//  - JSON serialization support, one valid object per line
+//  - Logfmt and GELF encodings, and octet counted framing, per output
+//  - Custom outputs, and a level for each output
+//  - Native journald and syslog outputs
+//  - Counters of the logger's own cost, behind MICRO_LOG_STATS
 //  - Thread-safe logging
+//  - Optional asynchronous logging with a background writer thread
+//  - Compact binary output, decoded offline with `micro-log-decode`
 //  - read settings from file (see the file `settings`)
 //  - optional colored output
 //  - compile time settings
@@ -77,6 +93,13 @@
 // to support logging from multiple threads, then define
 // MICRO_LOG_MULTITHREADED before including this file.
 //
+// If logging must never wait on slow outputs, define MICRO_LOG_ASYNC as
+// well and initialize the logger with `micro_log_init_async`: records
+// are then queued in a lock-free ring buffer and written by a
+// background thread. On Linux, also define MICRO_LOG_IO_URING to let
+// that thread write each batch to the file and stdout with a single
+// io_uring_enter.
+//
 // (Almost) All log function have two versions: one that interacts
 // with a global logger, and another that uses a logger instance you
 // supply. This is wanted because most of the time you just want a
@@ -115,11 +138,82 @@
 //
 // You can format the logs like printf(3).
 //
+// You can give a subsystem its own runtime level with a category.
+// Define it once with `MICRO_LOG_CATEGORY(net)`, declare it in other
+// files with `MICRO_LOG_CATEGORY_EXTERN(net)`, and log with the `_c`
+// macros:
+//
+// ```
+// micro_log_set_category_level("net", MICRO_LOG_LEVEL_DEBUG);
+// micro_log_debug_c(net, "Connected to %s", host);
+// ```
+//
+// Hot call sites can be rate limited, or sampled:
+//
+// ```
+// micro_log_warn_ratelimited(10, "Retrying %s", host);  // 10 per second
+// micro_log_trace_sampled(1000, "Got packet %d", id);   // 1 in 1000
+// ```
+//
+// Records can also carry typed fields, which are numbers, booleans
+// and strings in json:
+//
+// ```
+// micro_log_info_kv("Request served", MICRO_LOG_INT("status", 200),
+//                   MICRO_LOG_STR("path", path));
+// ```
+//
+// Bytes that are already formatted can be logged without a format
+// string, as they are or in hex:
+//
+// ```
+// micro_log_write_raw(MICRO_LOG_LEVEL_INFO, line, line_len);
+// micro_log_write_hex(MICRO_LOG_LEVEL_DEBUG, packet, packet_len);
+// ```
+//
+// Each text output can be encoded as logfmt or GELF instead of the
+// rendered text, and prefixed with its length for syslog over TCP:
+//
+// ```
+// micro_log_set_encoding(MICRO_LOG_OUT_SOCK_INET, MICRO_LOG_ENCODING_GELF);
+// micro_log_set_framing(MICRO_LOG_OUT_SOCK_UNIX, MICRO_LOG_FRAMING_OCTET_COUNTED);
+// ```
+//
+// Each output can have its own level, and you can add your own
+// outputs with `micro_log_add_sink`:
+//
+// ```
+// micro_log_set_out_level(MICRO_LOG_OUT_SOCK_INET, MICRO_LOG_LEVEL_WARN);
+// micro_log_add_sink(&(MicroLogSink){ .write = ring_write, .user = ring });
+// ```
+//
+// The records can also go straight to the journal, or to the local
+// syslog daemon as RFC 5424 messages:
+//
+// ```
+// micro_log_add_journald(MICRO_LOG_LEVEL_INFO);
+// micro_log_add_syslog(NULL, MICRO_LOG_LEVEL_WARN);     // "/dev/log"
+// ```
+//
+// With MICRO_LOG_STATS defined, the logger counts the records it writes
+// and drops, the bytes and the time spent writing to each output, and
+// the time spent holding its lock. Read them, or have them logged as an
+// info record every given number of seconds:
+//
+// ```
+// MicroLogStats stats;
+// micro_log_get_stats(&stats);
+// micro_log_set_stats_interval(60);
+// ```
+//
 // Check out more examples at the end of the header.
 //
 // You can also read some settings from a file. Check out the file
 // `settings` for additional information.
 //
+// Run `make bench` to measure the cost of a log call and the throughput
+// of the outputs from 1 to 64 threads, see `bench/bench.c`.
+//
 //
 // Code
 // ----
@@ -153,6 +247,9 @@ extern "C" {
 #ifndef _POSIX_C_SOURCE
   #define _POSIX_C_SOURCE 200809L // dprintf, vdprintf (UNIX)
 #endif
+#if defined(MICRO_LOG_IMPLEMENTATION) && !defined(_GNU_SOURCE)
+  #define _GNU_SOURCE // syscall (Linux)
+#endif
 
 //
 // Configuration
@@ -171,6 +268,261 @@ extern "C" {
 //
 //#define MICRO_LOG_SOCKETS
 
+// Config: Enable the asynchronous backend by defining MICRO_LOG_ASYNC
+//
+// Callers render records into a lock-free ring buffer and a
+// background thread writes them to the outputs, so logging never
+// waits on a slow file or socket. The backend is started with
+// `micro_log_init_async`.
+//
+// Note: Requires MICRO_LOG_MULTITHREADED
+//
+//#define MICRO_LOG_ASYNC
+
+// Config: Defer formatting to the writer thread by defining
+// MICRO_LOG_DEFERRED
+//
+// When the asynchronous backend is running, callers do not format
+// the message: they only copy the address of the format string and
+// the raw bytes of its arguments in the ring buffer, and the writer
+// thread formats them later. This makes a log call much cheaper.
+//
+// Note: Requires MICRO_LOG_ASYNC. The format string must outlive the
+// logger, which is always the case for string literals. "%s"
+// arguments are copied when the record is logged. Format strings
+// using %n, wide characters or positional arguments are formatted
+// right away. On a crash, the records still in the ring are written
+// by `micro_log_install_crash_handler` with only their level and
+// without the widths and precisions of their format.
+//
+//#define MICRO_LOG_DEFERRED
+
+// Config: Write the file and stdout outputs of the async writer with
+// io_uring by defining MICRO_LOG_IO_URING
+//
+// The writer thread copies the records of a batch in buffers that
+// are registered with the kernel, and writes all of them with a
+// single io_uring_enter at the end of the batch, instead of going
+// through stdio. When the kernel does not support io_uring, the
+// writer uses stdio as usual.
+//
+// Note: Linux only, requires MICRO_LOG_ASYNC
+//
+//#define MICRO_LOG_IO_URING
+
+// Config: Size of the io_uring buffer of each output, see
+// MICRO_LOG_IO_URING
+//
+// A batch is written as soon as its records do not fit anymore.
+// Raising MICRO_LOG_ASYNC_BATCH lets more records share a write.
+//
+#ifndef MICRO_LOG_IO_URING_BUFFER
+  #define MICRO_LOG_IO_URING_BUFFER 262144
+#endif
+
+// Config: Maximum size of a UDP datagram holding several records
+//
+// The async writer sends the records of a batch to a UDP socket with
+// as few syscalls as possible. By default each datagram holds
+// exactly one record; records that fit together in this many bytes
+// are sent in the same datagram instead, always whole.
+//
+#ifndef MICRO_LOG_UDP_DATAGRAM_SIZE
+  #define MICRO_LOG_UDP_DATAGRAM_SIZE 0
+#endif
+
+// Config: Maximum size of a GELF datagram
+//
+// GELF records sent over UDP that are larger than this are split in
+// chunks of this size, up to 128 of them. The default fits in the
+// MTU of most networks, up to 8192 is fine on a local one.
+//
+#ifndef MICRO_LOG_GELF_CHUNK_SIZE
+  #define MICRO_LOG_GELF_CHUNK_SIZE 1420
+#endif
+
+// Config: Maximum number of custom outputs of a logger
+//
+// See `micro_log_add_sink`.
+//
+#ifndef MICRO_LOG_SINKS_MAX
+  #define MICRO_LOG_SINKS_MAX 8
+#endif
+
+// Config: Syslog facility of the records encoded for syslog
+//
+// The default is 1, user-level messages. Use 16 to 23 for local0 to
+// local7.
+//
+#ifndef MICRO_LOG_SYSLOG_FACILITY
+  #define MICRO_LOG_SYSLOG_FACILITY 1
+#endif
+
+// Config: Structured data id of the records encoded for syslog
+//
+// The metadata and the fields of a record are sent as the
+// parameters of this element. The default uses 32473, the private
+// enterprise number that RFC 5424 reserves for examples; use your
+// own number if you have one.
+//
+#ifndef MICRO_LOG_SYSLOG_SD_ID
+  #define MICRO_LOG_SYSLOG_SD_ID "micro-log@32473"
+#endif
+
+// Config: Maximum number of bytes queued for a socket output
+//
+// Writes to sockets never block: when the socket can not take a
+// record right away, or while it is reconnecting, the record is
+// queued and sent with the next ones. Records that do not fit in
+// the queue are dropped, see `micro_log_get_socket_state`.
+//
+#ifndef MICRO_LOG_SOCKET_QUEUE
+  #define MICRO_LOG_SOCKET_QUEUE 65536
+#endif
+
+// Config: Maximum size of a datagram sent to systemd-journald
+//
+// Larger records are written to a memfd, which is passed to the
+// journal instead, see `micro_log_add_journald`. Must be smaller than
+// MICRO_LOG_SOCKET_QUEUE, so that the datagrams can be queued.
+//
+#ifndef MICRO_LOG_JOURNALD_DATAGRAM_SIZE
+  #define MICRO_LOG_JOURNALD_DATAGRAM_SIZE 32768
+#endif
+
+// Config: Minimum and maximum time in milliseconds between two
+// attempts to reconnect a socket output
+//
+// The time doubles after each failed attempt.
+//
+#ifndef MICRO_LOG_SOCKET_BACKOFF_MIN_MS
+  #define MICRO_LOG_SOCKET_BACKOFF_MIN_MS 100
+#endif
+#ifndef MICRO_LOG_SOCKET_BACKOFF_MAX_MS
+  #define MICRO_LOG_SOCKET_BACKOFF_MAX_MS 30000
+#endif
+
+// Config: Stage the records written to the file in a buffer per
+// thread by defining MICRO_LOG_THREAD_BUFFER to its size in bytes
+//
+// Instead of taking the write mutex for every record, each thread
+// appends the records it writes to the file to its own buffer, and
+// writes the whole buffer at once when it is full, when it stages a
+// record of level WARN or above, or on `micro_log_flush`. A
+// background thread also writes all the buffers every
+// MICRO_LOG_THREAD_BUFFER_MS milliseconds, so a staged record is held
+// for about that long at most, even if its thread stops logging.
+// The records of a thread keep their order, but the records of
+// different threads are interleaved by batch: use
+// MICRO_LOG_FLAG_NSEC or MICRO_LOG_FLAG_MONO to sort them.
+//
+// Note: Requires MICRO_LOG_MULTITHREADED. Only the file output is
+// buffered.
+//
+//#define MICRO_LOG_THREAD_BUFFER 65536
+
+// Config: Maximum time in milliseconds a record stays in a thread
+// buffer, see MICRO_LOG_THREAD_BUFFER
+//
+#ifndef MICRO_LOG_THREAD_BUFFER_MS
+  #define MICRO_LOG_THREAD_BUFFER_MS 100
+#endif
+
+// Config: Maximum number of log categories, see `MICRO_LOG_CATEGORY`
+//
+#ifndef MICRO_LOG_CATEGORY_MAX
+  #define MICRO_LOG_CATEGORY_MAX 64
+#endif
+
+// Config: Maximum length of the name of a log category
+//
+#ifndef MICRO_LOG_CATEGORY_NAME_SIZE
+  #define MICRO_LOG_CATEGORY_NAME_SIZE 32
+#endif
+
+// Config: Enable the memory mapped file output by defining
+// MICRO_LOG_MMAP, see `micro_log_set_mmap_file`
+//
+// Note: Requires MICRO_LOG_MULTITHREADED
+//
+//#define MICRO_LOG_MMAP
+
+// Config: Size in bytes of the segments of the memory mapped file,
+// a multiple of 64KiB
+//
+#ifndef MICRO_LOG_MMAP_SEGMENT
+  #define MICRO_LOG_MMAP_SEGMENT (16 * 1024 * 1024)
+#endif
+
+// Config: Time in milliseconds between two syncs of the memory
+// mapped file to the disk
+//
+#ifndef MICRO_LOG_MMAP_SYNC_MS
+  #define MICRO_LOG_MMAP_SYNC_MS 1000
+#endif
+
+// Config: Time in milliseconds between two checks of a settings file
+// watched with `micro_log_watch_file`
+//
+#ifndef MICRO_LOG_WATCH_MS
+  #define MICRO_LOG_WATCH_MS 1000
+#endif
+
+// Config: Keep counters of what the logger does and how long it
+// takes by defining MICRO_LOG_STATS, see `micro_log_get_stats`
+//
+// Note: This adds a few relaxed atomic additions to every record that
+// is written, and a clock read around each write to an output
+//
+//#define MICRO_LOG_STATS
+
+// Config: Enable the flight recorder by defining
+// MICRO_LOG_FLIGHT_RECORDER, see `micro_log_set_flight_recorder`
+//
+// Note: This adds a load to the level check of every log call
+//
+//#define MICRO_LOG_FLIGHT_RECORDER
+
+// Config: Size of a slot in the flight recorder
+//
+// Each slot holds the packed arguments of one record, or the
+// rendered record if they can not be packed. Records that do not fit
+// are truncated.
+//
+#ifndef MICRO_LOG_FLIGHT_SLOT_SIZE
+  #define MICRO_LOG_FLIGHT_SLOT_SIZE 256
+#endif
+
+// Config: Minimum time in milliseconds between two reports of the
+// records held back by a rate limit or collapsed as repeated
+//
+#ifndef MICRO_LOG_SUPPRESSED_REPORT_MS
+  #define MICRO_LOG_SUPPRESSED_REPORT_MS 10000
+#endif
+
+// Config: Maximum size of the packed arguments of a record that can
+// be collapsed as repeated, see `micro_log_set_collapse`
+//
+#ifndef MICRO_LOG_COLLAPSE_SIZE
+  #define MICRO_LOG_COLLAPSE_SIZE 256
+#endif
+
+// Use the MICRO_LOG_LEVEL_ macros for this value
+//
+// Defined before the configuration, so that MICRO_LOG_LEVEL_DEF can
+// be compared with them by the preprocessor
+typedef unsigned int MicroLogLevel;
+#define MICRO_LOG_LEVEL_TRACE     0
+#define MICRO_LOG_LEVEL_DEBUG     1
+#define MICRO_LOG_LEVEL_INFO      2
+#define MICRO_LOG_LEVEL_WARN      3
+#define MICRO_LOG_LEVEL_ERROR     4
+#define MICRO_LOG_LEVEL_FATAL     5
+#define MICRO_LOG_LEVEL_DISABLED  6
+#define MICRO_LOG_LEVEL_MAX       7
+// Level of a category that follows the level of the logger
+#define MICRO_LOG_LEVEL_INHERIT   0xff
+
 // Config: compiler-time log level, value 0 to 6 (included)
 //
 // All calls to log functions in the family `micro_log_{level}` and
@@ -183,8 +535,81 @@ extern "C" {
 //
 //     MICRO_LOG_LEVEL_{TRACE|DEBUF|INFO|WARN|ERROR|FATAL|DISABLED}
 //
-#define MICRO_LOG_LEVEL_DEF MICRO_LOG_LEVEL_TRACE
+#ifndef MICRO_LOG_LEVEL_DEF
+  #define MICRO_LOG_LEVEL_DEF MICRO_LOG_LEVEL_TRACE
+#endif
+
+// Config: compile-time flags, a MICRO_LOG_FLAG bitfield
+//
+// By defining MICRO_LOG_FIXED_FLAGS, all records are rendered with
+// these flags, and the renderer is compiled for them only: the
+// checks of the flags are resolved by the compiler, leaving a
+// straight sequence of writes for the fields that are enabled.
+// `micro_log_set_flags` then fails with MICRO_LOG_ERROR_FIXED_FLAGS
+// for any other flags.
+//
+// For example:
+//
+//     #define MICRO_LOG_FIXED_FLAGS (MICRO_LOG_FLAG_LEVEL | MICRO_LOG_FLAG_TIME)
+//
+//#define MICRO_LOG_FIXED_FLAGS MICRO_LOG_FLAG_LEVEL
   
+// Config: Size of the buffer used to render a single record
+//
+// Every record (metadata, message and newline) is rendered once in a
+// buffer of this size on the stack, and then written to each output
+// with a single write. Records that do not fit are rendered on the
+// heap instead.
+//
+#ifndef MICRO_LOG_RECORD_SIZE
+  #define MICRO_LOG_RECORD_SIZE 1024
+#endif
+
+// Config: Size of a slot in the async ring buffer
+//
+// Each slot holds one rendered record. Records that do not fit are
+// truncated.
+//
+#ifndef MICRO_LOG_ASYNC_SLOT_SIZE
+  #define MICRO_LOG_ASYNC_SLOT_SIZE MICRO_LOG_RECORD_SIZE
+#endif
+
+// Config: Default number of slots in the async ring buffer
+//
+// Used when `micro_log_init_async` is called with a capacity of 0.
+//
+#ifndef MICRO_LOG_ASYNC_CAPACITY
+  #define MICRO_LOG_ASYNC_CAPACITY 1024
+#endif
+
+// Config: Maximum number of records the writer thread writes with a
+// single acquisition of the write mutex
+//
+#ifndef MICRO_LOG_ASYNC_BATCH
+  #define MICRO_LOG_ASYNC_BATCH 64
+#endif
+
+// Config: Clock used to timestamp records
+//
+// Must be a wall clock. On Linux, CLOCK_REALTIME_COARSE is much
+// cheaper to read than the default, but only advances every few
+// milliseconds.
+//
+#ifndef MICRO_LOG_CLOCK
+  #define MICRO_LOG_CLOCK CLOCK_REALTIME
+#endif
+
+// Config: Log the kernel thread id by defining MICRO_LOG_KERNEL_TID
+//
+// By default MICRO_LOG_FLAG_TID logs the value of pthread_self(),
+// which is an address. With this option it logs the id the kernel
+// gives to the thread instead, the same shown by tools like top -H,
+// perf or gdb.
+//
+// Note: Linux only
+//
+//#define MICRO_LOG_KERNEL_TID
+
 // Config: Prefix for all functions
 // For function inlining, set this to `static inline` and then define
 // the implementation in all the files
@@ -232,7 +657,25 @@ extern "C" {
 #define MICRO_LOG_ERROR_INVALID_INET_ADDR    31
 #define MICRO_LOG_ERROR_INVALID_PORT         32
 #define MICRO_LOG_ERROR_INVALID_PROTOCOL     33
-#define _MICRO_LOG_ERROR_MAX                 34
+#define MICRO_LOG_ERROR_ALLOC                34
+#define MICRO_LOG_ERROR_FORMAT               35
+#define MICRO_LOG_ERROR_THREAD_CREATE        36
+#define MICRO_LOG_ERROR_THREAD_JOIN          37
+#define MICRO_LOG_ERROR_UNKNOWN_OVERFLOW     38
+#define MICRO_LOG_ERROR_PRINTF_BINARY        39
+#define MICRO_LOG_ERROR_UNKNOWN_SOCKET       40
+#define MICRO_LOG_ERROR_INVALID_CATEGORY     41
+#define MICRO_LOG_ERROR_INVALID_ROTATION     42
+#define MICRO_LOG_ERROR_ROTATE_FILE          43
+#define MICRO_LOG_ERROR_MMAP                 44
+#define MICRO_LOG_ERROR_CRASH_HANDLER        45
+#define MICRO_LOG_ERROR_FIXED_FLAGS          46
+#define MICRO_LOG_ERROR_ENCODING             47
+#define MICRO_LOG_ERROR_SINKS_FULL           48
+#define MICRO_LOG_ERROR_INVALID_SINK         49
+#define MICRO_LOG_ERROR_INVALID_INTERVAL     50
+#define MICRO_LOG_ERROR_RAW_NULL             51
+#define _MICRO_LOG_ERROR_MAX                 52
 
 //
 // Macros
@@ -245,9 +688,40 @@ extern "C" {
   #include <pthread.h>
 #endif
 
+#if defined(MICRO_LOG_ASYNC) && !defined(MICRO_LOG_MULTITHREADED)
+  #error "MICRO_LOG_ASYNC requires MICRO_LOG_MULTITHREADED"
+#endif
+
+#if defined(MICRO_LOG_DEFERRED) && !defined(MICRO_LOG_ASYNC)
+  #error "MICRO_LOG_DEFERRED requires MICRO_LOG_ASYNC"
+#endif
+
+#if defined(MICRO_LOG_IO_URING) && !defined(MICRO_LOG_ASYNC)
+  #error "MICRO_LOG_IO_URING requires MICRO_LOG_ASYNC"
+#endif
+
+#if defined(MICRO_LOG_IO_URING) && !defined(__linux__)
+  #error "MICRO_LOG_IO_URING is only supported on Linux"
+#endif
+
+#if defined(MICRO_LOG_THREAD_BUFFER) && !defined(MICRO_LOG_MULTITHREADED)
+  #error "MICRO_LOG_THREAD_BUFFER requires MICRO_LOG_MULTITHREADED"
+#endif
+
+#if defined(MICRO_LOG_MMAP) && !defined(MICRO_LOG_MULTITHREADED)
+  #error "MICRO_LOG_MMAP requires MICRO_LOG_MULTITHREADED"
+#endif
+
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(MICRO_LOG_SOCKETS) && !defined(_WIN32)
+  #include <sys/socket.h>
+#endif
   
 #define MICRO_LOG_FLAG_NONE  (0)
 #define MICRO_LOG_FLAG_LEVEL (1 << 0)
@@ -259,6 +733,12 @@ extern "C" {
 #define MICRO_LOG_FLAG_COLOR (1 << 6)
 #define MICRO_LOG_FLAG_FILE  (1 << 7)
 #define MICRO_LOG_FLAG_LINE  (1 << 8)
+// Microseconds of the time, appended to MICRO_LOG_FLAG_TIME
+#define MICRO_LOG_FLAG_USEC  (1 << 9)
+// Nanoseconds of the time, appended to MICRO_LOG_FLAG_TIME
+#define MICRO_LOG_FLAG_NSEC  (1 << 10)
+// Nanoseconds since the logger was initialized, from CLOCK_MONOTONIC
+#define MICRO_LOG_FLAG_MONO  (1 << 11)
 
 #define MICRO_LOG_OUT_STDOUT    (1 << 0)
 #define MICRO_LOG_OUT_FILE      (1 << 1)
@@ -268,7 +748,23 @@ extern "C" {
 #define MICRO_LOG_OUT_SOCK_UNIX (1 << 3)
 #endif // __unix__
 #endif // MICRO_LOG_SOCKETS
-#define _MICRO_LOG_OUT_MAX      (1 << 4)
+#define MICRO_LOG_OUT_BINARY    (1 << 4)
+#ifdef MICRO_LOG_MMAP
+#define MICRO_LOG_OUT_MMAP      (1 << 5)
+#endif // MICRO_LOG_MMAP
+// The custom outputs added with `micro_log_add_sink`
+#define MICRO_LOG_OUT_SINKS     (1 << 6)
+#define _MICRO_LOG_OUT_MAX      (1 << 7)
+
+// Outputs that receive rendered text
+#define _MICRO_LOG_OUT_TEXT     (_MICRO_LOG_OUT_MAX - 1 - MICRO_LOG_OUT_BINARY)
+// Socket outputs, MICRO_LOG_OUT_SOCK_INET and MICRO_LOG_OUT_SOCK_UNIX
+#define _MICRO_LOG_OUT_SOCK     ((1 << 2) | (1 << 3))
+// Number of outputs, the bits below _MICRO_LOG_OUT_MAX
+#define _MICRO_LOG_OUT_COUNT    7
+
+_Static_assert((1 << _MICRO_LOG_OUT_COUNT) == _MICRO_LOG_OUT_MAX,
+               "Updated MICRO_LOG_OUT, should also update _MICRO_LOG_OUT_COUNT");
 
 #define MICRO_LOG_RST  "\x1B[0m"
 #define MICRO_LOG_RED(x) "\x1B[31m" x MICRO_LOG_RST
@@ -331,1377 +827,11145 @@ extern "C" {
 #else
   #define micro_log_fatal(...) micro_log_disabled()
 #endif
-  
-// Local logger
 
 // Functions
-// micro_log_{write2|trace2|debug2|info2|warn2|error2|fatal2}
+// micro_log_{write|trace|debug|info|warn|error|fatal}_c
+//
+// Log to the category [category] defined with `MICRO_LOG_CATEGORY`,
+// with the level of the category instead of the one of the logger if
+// it was set.
 
-#define micro_log_write2(micro_log, log_level, ...)                     \
-  _micro_log_write_impl(micro_log, log_level, __FILE__, __LINE__, __VA_ARGS__)
+#define micro_log_write_c(category, log_level, ...)                   \
+  micro_log_write_c2(&micro_log_global, category, log_level, __VA_ARGS__)
 
 #if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_TRACE
-  #define micro_log_trace2(micro_log, ...)                          \
-    micro_log_write2(micro_log, MICRO_LOG_LEVEL_TRACE, __VA_ARGS__)
+  #define micro_log_trace_c(category, ...)                  \
+    micro_log_write_c(category, MICRO_LOG_LEVEL_TRACE, __VA_ARGS__)
 #else
-  #define micro_log_trace2(micro_log, ...) micro_log_disabled()
+  #define micro_log_trace_c(category, ...) micro_log_disabled()
 #endif
 
 #if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_DEBUG
-  #define micro_log_debug2(micro_log, ...)                          \
-    micro_log_write2(micro_log, MICRO_LOG_LEVEL_DEBUG, __VA_ARGS__)
+  #define micro_log_debug_c(category, ...)                  \
+    micro_log_write_c(category, MICRO_LOG_LEVEL_DEBUG, __VA_ARGS__)
 #else
-  #define micro_log_debug2(micro_log, ...) micro_log_disabled()
+  #define micro_log_debug_c(category, ...) micro_log_disabled()
 #endif
 
 #if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_INFO
-  #define micro_log_info2(micro_log, ...)                           \
-    micro_log_write2(micro_log, MICRO_LOG_LEVEL_INFO, __VA_ARGS__)
+  #define micro_log_info_c(category, ...)                   \
+    micro_log_write_c(category, MICRO_LOG_LEVEL_INFO, __VA_ARGS__)
 #else
-  #define micro_log_info2(micro_log, ...) micro_log_disabled()
+  #define micro_log_info_c(category, ...) micro_log_disabled()
 #endif
 
 #if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_WARN
-  #define micro_log_warn2(micro_log, ...)                           \
-    micro_log_write2(micro_log, MICRO_LOG_LEVEL_WARN, __VA_ARGS__)
+  #define micro_log_warn_c(category, ...)                   \
+    micro_log_write_c(category, MICRO_LOG_LEVEL_WARN, __VA_ARGS__)
 #else
-  #define micro_log_warn2(micro_log, ...) micro_log_disabled()
+  #define micro_log_warn_c(category, ...) micro_log_disabled()
 #endif
 
 #if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_ERROR
-  #define micro_log_error2(micro_log, ...)                          \
-    micro_log_write2(micro_log, MICRO_LOG_LEVEL_ERROR, __VA_ARGS__)
+  #define micro_log_error_c(category, ...)                  \
+    micro_log_write_c(category, MICRO_LOG_LEVEL_ERROR, __VA_ARGS__)
 #else
-  #define micro_log_error2(micro_log, ...) micro_log_disabled()
+  #define micro_log_error_c(category, ...) micro_log_disabled()
 #endif
 
 #if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_FATAL
-  #define micro_log_fatal2(micro_log, ...)                          \
-    micro_log_write2(micro_log, MICRO_LOG_LEVEL_FATAL, __VA_ARGS__)
+  #define micro_log_fatal_c(category, ...)                  \
+    micro_log_write_c(category, MICRO_LOG_LEVEL_FATAL, __VA_ARGS__)
 #else
-  #define micro_log_fatal2(micro_log, ...) micro_log_disabled()
+  #define micro_log_fatal_c(category, ...) micro_log_disabled()
 #endif
   
+// Functions
+// micro_log_{write|trace|debug|info|warn|error|fatal}_ratelimited
 //
-// Types and functions
+// Log at most [per_sec] records per second from this call site, with
+// a burst of up to [per_sec] records. The records held back are
+// counted, and reported by a record of the same call site at most
+// every MICRO_LOG_SUPPRESSED_REPORT_MS milliseconds. With a
+// [per_sec] of 0 or less, only the first record is logged.
 //
+// Note: unlike the other macros these are statements, they do not
+// return an error.
 
-// Use the MICRO_LOG_LEVEL_ macros for this value
-typedef unsigned int MicroLogLevel;
-#define MICRO_LOG_LEVEL_TRACE     0
-#define MICRO_LOG_LEVEL_DEBUG     1
-#define MICRO_LOG_LEVEL_INFO      2
-#define MICRO_LOG_LEVEL_WARN      3
-#define MICRO_LOG_LEVEL_ERROR     4
-#define MICRO_LOG_LEVEL_FATAL     5
-#define MICRO_LOG_LEVEL_DISABLED  6
-#define MICRO_LOG_LEVEL_MAX       7
+#define micro_log_write_ratelimited(log_level, per_sec, ...)           \
+  micro_log_write_ratelimited2(&micro_log_global, log_level, per_sec,  \
+                               __VA_ARGS__)
 
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_TRACE
+  #define micro_log_trace_ratelimited(per_sec, ...)                    \
+    micro_log_write_ratelimited(MICRO_LOG_LEVEL_TRACE, per_sec, __VA_ARGS__)
+#else
+  #define micro_log_trace_ratelimited(per_sec, ...) micro_log_disabled()
+#endif
 
-#ifdef MICRO_LOG_SOCKETS
-typedef enum
-{
-  MICRO_LOG_PROTO_TCP = 0,
-  MICRO_LOG_PROTO_UDP,
-  _MICRO_LOG_PROTO_MAX
-} MicroLogProto;
-#endif // MICRO_LOG_SOCKETS
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_DEBUG
+  #define micro_log_debug_ratelimited(per_sec, ...)                    \
+    micro_log_write_ratelimited(MICRO_LOG_LEVEL_DEBUG, per_sec, __VA_ARGS__)
+#else
+  #define micro_log_debug_ratelimited(per_sec, ...) micro_log_disabled()
+#endif
 
-typedef int micro_log_error;
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_INFO
+  #define micro_log_info_ratelimited(per_sec, ...)                     \
+    micro_log_write_ratelimited(MICRO_LOG_LEVEL_INFO, per_sec, __VA_ARGS__)
+#else
+  #define micro_log_info_ratelimited(per_sec, ...) micro_log_disabled()
+#endif
 
-// The MicroLog logger
-typedef struct {
-  // MICRO_LOG_FLAG bitfield
-  // Adds additionally log information based on the flags
-  long unsigned int flags_bitfield;
-  // MICRO_LOG_OUT bitfield
-  // Default value is MICRO_LOG_OUT_STDOUT
-  long unsigned int out_bitfield;
-  // The current log level of the logger
-  // Only logs that are of an higher or equal priority than this will
-  // be logged.
-  // Default value is MICRO_LOG_LEVEL_TRACE
-  MicroLogLevel log_level;
-  // (optional) Pointer to output file
-  FILE *file;
-  #ifdef MICRO_LOG_SOCKETS
-  // (optional) Socket file descriptor
-  int inet_sock_fd;
-  #if defined(__unix__) || defined(__unix)
-  int unix_sock_fd;
-  #endif // __unix__
-  #endif // MICRO_LOG_SOCKETS
-  #ifdef MICRO_LOG_MULTITHREADED
-  // Mutex to protect all writes
-  pthread_mutex_t write_mutex;
-  #endif // MICRO_LOG_MULTITHREADED
-} MicroLog;
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_WARN
+  #define micro_log_warn_ratelimited(per_sec, ...)                     \
+    micro_log_write_ratelimited(MICRO_LOG_LEVEL_WARN, per_sec, __VA_ARGS__)
+#else
+  #define micro_log_warn_ratelimited(per_sec, ...) micro_log_disabled()
+#endif
 
-//
-// Global logger functions
-//
-//
-// The Global logger
-//
-// This is a global logger that can be used with the function below.
-// You can also create other loggers, check out the other functions
-// in the `Local logger functions` group.
-extern MicroLog micro_log_global;
-  
-// Initialize the global logger
-//
-// Notes: remember to close it when you are done
-MICRO_LOG_DEF micro_log_error micro_log_init(void);
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_ERROR
+  #define micro_log_error_ratelimited(per_sec, ...)                    \
+    micro_log_write_ratelimited(MICRO_LOG_LEVEL_ERROR, per_sec, __VA_ARGS__)
+#else
+  #define micro_log_error_ratelimited(per_sec, ...) micro_log_disabled()
+#endif
 
-// Read settings from file
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_FATAL
+  #define micro_log_fatal_ratelimited(per_sec, ...)                    \
+    micro_log_write_ratelimited(MICRO_LOG_LEVEL_FATAL, per_sec, __VA_ARGS__)
+#else
+  #define micro_log_fatal_ratelimited(per_sec, ...) micro_log_disabled()
+#endif
+
+// Functions
+// micro_log_{write|trace|debug|info|warn|error|fatal}_sampled
 //
-// Check out the file named `settings` for additional information
-// Notes: this expects the global logger to be already initialzied
-MICRO_LOG_DEF micro_log_error micro_log_from_file(char *filename);
+// Log only 1 in [sample_rate] records of this call site, chosen at
+// random. The choice is made before the arguments are evaluated, and
+// the json output has a "sample_rate" field so that the counts can be
+// scaled back up.
 
-// Close the global logger
-MICRO_LOG_DEF micro_log_error micro_log_close(void);
+#define micro_log_write_sampled(log_level, sample_rate, ...)           \
+  micro_log_write_sampled2(&micro_log_global, log_level, sample_rate,  \
+                           __VA_ARGS__)
 
-// Flush all current output streams in the global logger
-MICRO_LOG_DEF micro_log_error micro_log_flush(void);
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_TRACE
+  #define micro_log_trace_sampled(sample_rate, ...)                    \
+    micro_log_write_sampled(MICRO_LOG_LEVEL_TRACE, sample_rate, __VA_ARGS__)
+#else
+  #define micro_log_trace_sampled(sample_rate, ...) micro_log_disabled()
+#endif
 
-// Set output flags to global logger
-//
-// These are additional information to the log output, such as the
-// date, line, file position etc. You can also set the output to be
-// colored or to be serialized in some format like json.
-//
-// Check out the MICRO_LOG_FLAG_ values to see all the flags available
-MICRO_LOG_DEF micro_log_error
-micro_log_set_flags(long unsigned int flags_bitfield);
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_DEBUG
+  #define micro_log_debug_sampled(sample_rate, ...)                    \
+    micro_log_write_sampled(MICRO_LOG_LEVEL_DEBUG, sample_rate, __VA_ARGS__)
+#else
+  #define micro_log_debug_sampled(sample_rate, ...) micro_log_disabled()
+#endif
 
-// Set the log level to global logger
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_INFO
+  #define micro_log_info_sampled(sample_rate, ...)                     \
+    micro_log_write_sampled(MICRO_LOG_LEVEL_INFO, sample_rate, __VA_ARGS__)
+#else
+  #define micro_log_info_sampled(sample_rate, ...) micro_log_disabled()
+#endif
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_WARN
+  #define micro_log_warn_sampled(sample_rate, ...)                     \
+    micro_log_write_sampled(MICRO_LOG_LEVEL_WARN, sample_rate, __VA_ARGS__)
+#else
+  #define micro_log_warn_sampled(sample_rate, ...) micro_log_disabled()
+#endif
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_ERROR
+  #define micro_log_error_sampled(sample_rate, ...)                    \
+    micro_log_write_sampled(MICRO_LOG_LEVEL_ERROR, sample_rate, __VA_ARGS__)
+#else
+  #define micro_log_error_sampled(sample_rate, ...) micro_log_disabled()
+#endif
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_FATAL
+  #define micro_log_fatal_sampled(sample_rate, ...)                    \
+    micro_log_write_sampled(MICRO_LOG_LEVEL_FATAL, sample_rate, __VA_ARGS__)
+#else
+  #define micro_log_fatal_sampled(sample_rate, ...) micro_log_disabled()
+#endif
+
+// Functions
+// micro_log_{write|trace|debug|info|warn|error|fatal}_kv
 //
-// Only the logs with an higher level of the current log level will be
-// printed.
+// Log [msg] with a list of typed fields, like:
 //
-// Check out the MicroLogLevel for a list of the supported levels.
-MICRO_LOG_DEF micro_log_error micro_log_set_level(MicroLogLevel level);
-
-// Set the output streams to the global logger
+//     micro_log_info_kv("Request served", MICRO_LOG_INT("status", 200),
+//                       MICRO_LOG_STR("path", path));
 //
-// You can toggle some output streams. Check out the MICRO_LOG_OUT_
-// values. Remember that if you manually enable the
-// MICRO_LOG_OUT_FILE, the logger will try to write to a file so you
-// should have already opened it with `miro_log_set_file`. Likewise
-// for the other options. By default, when you add a new output
-// stream, this will be automatically registered.
-MICRO_LOG_DEF micro_log_error micro_log_set_out(int out_flags);
+// In json each field is a member of the record with its native
+// type, in text they are written as key=value before the message.
+// [msg] is not a format string, and at least one field is needed.
+// The binary output keeps only the message.
 
-// Set output file of the global logger
-//
-// The logger will write logs to [filename]. The logger will create
-// the file if it does not exist.
-MICRO_LOG_DEF micro_log_error micro_log_set_file(char* filename);
+#define micro_log_write_kv(log_level, msg, ...)                        \
+  micro_log_write_kv2(&micro_log_global, log_level, msg, __VA_ARGS__)
 
-#ifdef MICRO_LOG_SOCKETS
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_TRACE
+  #define micro_log_trace_kv(msg, ...)                                 \
+    micro_log_write_kv(MICRO_LOG_LEVEL_TRACE, msg, __VA_ARGS__)
+#else
+  #define micro_log_trace_kv(msg, ...) micro_log_disabled()
+#endif
 
-// Set output internet socket of the global logger
-//
-// Note: You need to have defined MICRO_LOG_SOCKETS before including
-// this header in torder to use this function
-MICRO_LOG_DEF micro_log_error
-micro_log_set_socket_inet(char* addr,
-                          int port,
-                          MicroLogProto protocol);
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_DEBUG
+  #define micro_log_debug_kv(msg, ...)                                 \
+    micro_log_write_kv(MICRO_LOG_LEVEL_DEBUG, msg, __VA_ARGS__)
+#else
+  #define micro_log_debug_kv(msg, ...) micro_log_disabled()
+#endif
 
-#if defined(__unix__) || defined(__unix)
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_INFO
+  #define micro_log_info_kv(msg, ...)                                  \
+    micro_log_write_kv(MICRO_LOG_LEVEL_INFO, msg, __VA_ARGS__)
+#else
+  #define micro_log_info_kv(msg, ...) micro_log_disabled()
+#endif
 
-// Set output unix socket of the global logger
-//
-// Note: You need to have defined MICRO_LOG_SOCKETS before including
-// this header, and be in an unix system to use this function.
-MICRO_LOG_DEF micro_log_error micro_log_set_socket_unix(char* path);
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_WARN
+  #define micro_log_warn_kv(msg, ...)                                  \
+    micro_log_write_kv(MICRO_LOG_LEVEL_WARN, msg, __VA_ARGS__)
+#else
+  #define micro_log_warn_kv(msg, ...) micro_log_disabled()
+#endif
 
-#endif // __unix__
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_ERROR
+  #define micro_log_error_kv(msg, ...)                                 \
+    micro_log_write_kv(MICRO_LOG_LEVEL_ERROR, msg, __VA_ARGS__)
+#else
+  #define micro_log_error_kv(msg, ...) micro_log_disabled()
+#endif
 
-#endif // MICRO_LOG_SOCKETS
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_FATAL
+  #define micro_log_fatal_kv(msg, ...)                                 \
+    micro_log_write_kv(MICRO_LOG_LEVEL_FATAL, msg, __VA_ARGS__)
+#else
+  #define micro_log_fatal_kv(msg, ...) micro_log_disabled()
+#endif
 
+// Functions
+// micro_log_write_{raw|hex}
 //
-// Local logger functions
+// Log the [len] bytes of [data] as the message, without a format
+// string, like:
 //
-// These are equivalent to the global ones but they take an additional
-// MicroLog first argument, which is the logger what will be modified.
+//     micro_log_write_raw(MICRO_LOG_LEVEL_INFO, line, line_len);
+//     micro_log_write_hex(MICRO_LOG_LEVEL_DEBUG, packet, packet_len);
+//
+// The bytes are copied once in the rendered record, which all the
+// outputs share, escaped only in json. The hex version writes each
+// byte as two hex digits separated by spaces, so that binary data
+// keeps the record on one line.
 
-MICRO_LOG_DEF micro_log_error micro_log_init2(MicroLog *micro_log);
+#define micro_log_write_raw(log_level, data, len)                      \
+  micro_log_write_raw2(&micro_log_global, log_level, data, len)
 
-// micro_log_from_file2 expects [micro_log] to be already initialzied
-MICRO_LOG_DEF micro_log_error
-micro_log_from_file2(MicroLog *micro_log, char *filename);
-  
-MICRO_LOG_DEF micro_log_error micro_log_close2(MicroLog *micro_log);
-  
-MICRO_LOG_DEF micro_log_error micro_log_flush2(MicroLog *micro_log);
-  
-MICRO_LOG_DEF micro_log_error
-micro_log_set_flags2(MicroLog *micro_log,
-                     long unsigned int flags_bitfield);
-  
-MICRO_LOG_DEF micro_log_error
-micro_log_set_level2(MicroLog *micro_log,
-                     MicroLogLevel level);
-  
-MICRO_LOG_DEF micro_log_error
-micro_log_set_out2(MicroLog *micro_log, int out_flags);
-  
-MICRO_LOG_DEF micro_log_error
-micro_log_set_file2(MicroLog *micro_log,
-                    char* filename);
-  
-#ifdef MICRO_LOG_SOCKETS
+#define micro_log_write_hex(log_level, data, len)                      \
+  micro_log_write_hex2(&micro_log_global, log_level, data, len)
 
-MICRO_LOG_DEF micro_log_error
-micro_log_set_socket_inet2(MicroLog *micro_log,
-                           char* addr,
-                           int port,
-                           MicroLogProto protocol);
+// Local logger
 
-#if defined(__unix__) || defined(__unix)
+// Functions
+// micro_log_{write2|trace2|debug2|info2|warn2|error2|fatal2}
 
-MICRO_LOG_DEF micro_log_error
-micro_log_set_socket_unix2(MicroLog *micro_log,
-                           char* path);
+//
+// Note: [micro_log] is evaluated twice, and the other arguments are
+// not evaluated at all if the level is below the one of the logger.
 
-#endif // __unix__
+#define micro_log_write2(micro_log, log_level, ...)                     \
+  (_micro_log_level_enabled(micro_log, log_level)                       \
+   ? _micro_log_write_impl(micro_log, log_level,                        \
+                           __FILE__, __LINE__, __VA_ARGS__)             \
+   : MICRO_LOG_OK)
 
-#endif // MICRO_LOG_SOCKETS
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_TRACE
+  #define micro_log_trace2(micro_log, ...)                          \
+    micro_log_write2(micro_log, MICRO_LOG_LEVEL_TRACE, __VA_ARGS__)
+#else
+  #define micro_log_trace2(micro_log, ...) micro_log_disabled()
+#endif
 
-// Misc
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_DEBUG
+  #define micro_log_debug2(micro_log, ...)                          \
+    micro_log_write2(micro_log, MICRO_LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+  #define micro_log_debug2(micro_log, ...) micro_log_disabled()
+#endif
 
-// Inline function that just returns MICRO_LOG_OK
-// This is needed when log level is disabled at compile time, and
-// it needs a definition in every translation unit to be inlined
-static inline int micro_log_disabled(void)
-{
-    return MICRO_LOG_OK;
-}
-  
-// Get a string of a certain log level, with an optional color
-MICRO_LOG_DEF const char*
-micro_log_level_string(MicroLogLevel level, bool color);
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_INFO
+  #define micro_log_info2(micro_log, ...)                           \
+    micro_log_write2(micro_log, MICRO_LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+  #define micro_log_info2(micro_log, ...) micro_log_disabled()
+#endif
 
-// The central log function
-//
-// All other functions call this one for printing. It handles all the
-// flags and calls `_micro_log_print_outputs`.
-MICRO_LOG_DEF micro_log_error
-_micro_log_write_impl(MicroLog *micro_log,
-                      MicroLogLevel level,
-                      const char* file,
-                      int line,
-                      const char *fmt, ...);
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_WARN
+  #define micro_log_warn2(micro_log, ...)                           \
+    micro_log_write2(micro_log, MICRO_LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+  #define micro_log_warn2(micro_log, ...) micro_log_disabled()
+#endif
 
-// Wraps `_micro_log_print_outputs_args`
-MICRO_LOG_DEF micro_log_error
-_micro_log_print_outputs(MicroLog *micro_log,
-                         const char* fmt, ...);
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_ERROR
+  #define micro_log_error2(micro_log, ...)                          \
+    micro_log_write2(micro_log, MICRO_LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+  #define micro_log_error2(micro_log, ...) micro_log_disabled()
+#endif
 
-// Print formatted string in multiple outputs.
-MICRO_LOG_DEF micro_log_error
-_micro_log_print_outputs_args(MicroLog *micro_log,
-                              const char* fmt,
-                              va_list args);
-//
-// Implementation
-//
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_FATAL
+  #define micro_log_fatal2(micro_log, ...)                          \
+    micro_log_write2(micro_log, MICRO_LOG_LEVEL_FATAL, __VA_ARGS__)
+#else
+  #define micro_log_fatal2(micro_log, ...) micro_log_disabled()
+#endif
 
-#ifdef MICRO_LOG_IMPLEMENTATION
+// Functions
+// micro_log_{write|trace|debug|info|warn|error|fatal}_c2
 
-#define _GNU_SOURCE
-#include <unistd.h>
-#include <time.h>
-#include <pthread.h>
-#include <assert.h>
-#include <string.h>
-#include <stdlib.h>
+#define micro_log_write_c2(micro_log, category, log_level, ...)          \
+  (_micro_log_category_enabled(micro_log, &micro_log_category_##category, \
+                               log_level)                               \
+   ? _micro_log_write_category_impl(micro_log,                          \
+                                    &micro_log_category_##category,     \
+                                    log_level, __FILE__, __LINE__,      \
+                                    __VA_ARGS__)                        \
+   : MICRO_LOG_OK)
 
-#ifdef MICRO_LOG_SOCKETS
-  #ifdef _WIN32
-    // Windows
-    #include <winsock2.h>
-    #include <ws2tcpip.h>
-    #define close_socket(s) closesocket(s)
-    #pragma comment(lib, "ws2_32.lib")  // link against Winsock library
-    #define dprintf(...) assert(false); // TODO
-    #define vdprintf(...) assert(false); // TODO
-    #error "TODO Support for windows internet sockets"
-  #else
-    // POSIX (Linux, macOS, BSD, etc.)
-    #include <sys/types.h>
-    #include <sys/socket.h>
-    #include <netinet/in.h>
-    #include <arpa/inet.h>
-    #include <unistd.h>
-    #include <sys/un.h>
-    #define close_socket(s) close(s)
-  #endif // _WIN32
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_TRACE
+  #define micro_log_trace_c2(micro_log, category, ...)      \
+    micro_log_write_c2(micro_log, category, MICRO_LOG_LEVEL_TRACE, __VA_ARGS__)
+#else
+  #define micro_log_trace_c2(micro_log, category, ...) micro_log_disabled()
+#endif
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_DEBUG
+  #define micro_log_debug_c2(micro_log, category, ...)      \
+    micro_log_write_c2(micro_log, category, MICRO_LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+  #define micro_log_debug_c2(micro_log, category, ...) micro_log_disabled()
+#endif
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_INFO
+  #define micro_log_info_c2(micro_log, category, ...)       \
+    micro_log_write_c2(micro_log, category, MICRO_LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+  #define micro_log_info_c2(micro_log, category, ...) micro_log_disabled()
+#endif
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_WARN
+  #define micro_log_warn_c2(micro_log, category, ...)       \
+    micro_log_write_c2(micro_log, category, MICRO_LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+  #define micro_log_warn_c2(micro_log, category, ...) micro_log_disabled()
+#endif
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_ERROR
+  #define micro_log_error_c2(micro_log, category, ...)      \
+    micro_log_write_c2(micro_log, category, MICRO_LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+  #define micro_log_error_c2(micro_log, category, ...) micro_log_disabled()
+#endif
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_FATAL
+  #define micro_log_fatal_c2(micro_log, category, ...)      \
+    micro_log_write_c2(micro_log, category, MICRO_LOG_LEVEL_FATAL, __VA_ARGS__)
+#else
+  #define micro_log_fatal_c2(micro_log, category, ...) micro_log_disabled()
+#endif
+  
+// Functions
+// micro_log_{write|trace|debug|info|warn|error|fatal}_ratelimited2
+
+#define micro_log_write_ratelimited2(micro_log, log_level, per_sec, ...) \
+  do {                                                                 \
+    static MicroLogRateLimit _micro_log_rate_limit;                    \
+    if (_micro_log_level_enabled(micro_log, log_level)                 \
+        && _micro_log_rate_limit_pass(micro_log, &_micro_log_rate_limit, \
+                                      log_level, per_sec,              \
+                                      __FILE__, __LINE__))             \
+      (void) _micro_log_write_impl(micro_log, log_level,               \
+                                   __FILE__, __LINE__, __VA_ARGS__);   \
+  } while (0)
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_TRACE
+  #define micro_log_trace_ratelimited2(micro_log, per_sec, ...)        \
+    micro_log_write_ratelimited2(micro_log, MICRO_LOG_LEVEL_TRACE,     \
+                                 per_sec, __VA_ARGS__)
+#else
+  #define micro_log_trace_ratelimited2(micro_log, per_sec, ...)        \
+    micro_log_disabled()
+#endif
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_DEBUG
+  #define micro_log_debug_ratelimited2(micro_log, per_sec, ...)        \
+    micro_log_write_ratelimited2(micro_log, MICRO_LOG_LEVEL_DEBUG,     \
+                                 per_sec, __VA_ARGS__)
+#else
+  #define micro_log_debug_ratelimited2(micro_log, per_sec, ...)        \
+    micro_log_disabled()
+#endif
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_INFO
+  #define micro_log_info_ratelimited2(micro_log, per_sec, ...)         \
+    micro_log_write_ratelimited2(micro_log, MICRO_LOG_LEVEL_INFO,      \
+                                 per_sec, __VA_ARGS__)
+#else
+  #define micro_log_info_ratelimited2(micro_log, per_sec, ...)         \
+    micro_log_disabled()
+#endif
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_WARN
+  #define micro_log_warn_ratelimited2(micro_log, per_sec, ...)         \
+    micro_log_write_ratelimited2(micro_log, MICRO_LOG_LEVEL_WARN,      \
+                                 per_sec, __VA_ARGS__)
+#else
+  #define micro_log_warn_ratelimited2(micro_log, per_sec, ...)         \
+    micro_log_disabled()
+#endif
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_ERROR
+  #define micro_log_error_ratelimited2(micro_log, per_sec, ...)        \
+    micro_log_write_ratelimited2(micro_log, MICRO_LOG_LEVEL_ERROR,     \
+                                 per_sec, __VA_ARGS__)
+#else
+  #define micro_log_error_ratelimited2(micro_log, per_sec, ...)        \
+    micro_log_disabled()
+#endif
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_FATAL
+  #define micro_log_fatal_ratelimited2(micro_log, per_sec, ...)        \
+    micro_log_write_ratelimited2(micro_log, MICRO_LOG_LEVEL_FATAL,     \
+                                 per_sec, __VA_ARGS__)
+#else
+  #define micro_log_fatal_ratelimited2(micro_log, per_sec, ...)        \
+    micro_log_disabled()
+#endif
+  
+// Functions
+// micro_log_{write|trace|debug|info|warn|error|fatal}_sampled2
+
+#define micro_log_write_sampled2(micro_log, log_level, sample_rate, ...) \
+  (_micro_log_level_enabled(micro_log, log_level)                      \
+   && _micro_log_sample(sample_rate)                                   \
+   ? _micro_log_write_sampled_impl(micro_log, log_level, sample_rate,  \
+                                   __FILE__, __LINE__, __VA_ARGS__)    \
+   : MICRO_LOG_OK)
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_TRACE
+  #define micro_log_trace_sampled2(micro_log, sample_rate, ...)        \
+    micro_log_write_sampled2(micro_log, MICRO_LOG_LEVEL_TRACE,         \
+                             sample_rate, __VA_ARGS__)
+#else
+  #define micro_log_trace_sampled2(micro_log, sample_rate, ...)        \
+    micro_log_disabled()
+#endif
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_DEBUG
+  #define micro_log_debug_sampled2(micro_log, sample_rate, ...)        \
+    micro_log_write_sampled2(micro_log, MICRO_LOG_LEVEL_DEBUG,         \
+                             sample_rate, __VA_ARGS__)
+#else
+  #define micro_log_debug_sampled2(micro_log, sample_rate, ...)        \
+    micro_log_disabled()
+#endif
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_INFO
+  #define micro_log_info_sampled2(micro_log, sample_rate, ...)         \
+    micro_log_write_sampled2(micro_log, MICRO_LOG_LEVEL_INFO,          \
+                             sample_rate, __VA_ARGS__)
+#else
+  #define micro_log_info_sampled2(micro_log, sample_rate, ...)         \
+    micro_log_disabled()
+#endif
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_WARN
+  #define micro_log_warn_sampled2(micro_log, sample_rate, ...)         \
+    micro_log_write_sampled2(micro_log, MICRO_LOG_LEVEL_WARN,          \
+                             sample_rate, __VA_ARGS__)
+#else
+  #define micro_log_warn_sampled2(micro_log, sample_rate, ...)         \
+    micro_log_disabled()
+#endif
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_ERROR
+  #define micro_log_error_sampled2(micro_log, sample_rate, ...)        \
+    micro_log_write_sampled2(micro_log, MICRO_LOG_LEVEL_ERROR,         \
+                             sample_rate, __VA_ARGS__)
+#else
+  #define micro_log_error_sampled2(micro_log, sample_rate, ...)        \
+    micro_log_disabled()
+#endif
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_FATAL
+  #define micro_log_fatal_sampled2(micro_log, sample_rate, ...)        \
+    micro_log_write_sampled2(micro_log, MICRO_LOG_LEVEL_FATAL,         \
+                             sample_rate, __VA_ARGS__)
+#else
+  #define micro_log_fatal_sampled2(micro_log, sample_rate, ...)        \
+    micro_log_disabled()
+#endif
+
+// Functions
+// micro_log_{write|trace|debug|info|warn|error|fatal}_kv2
+
+#define micro_log_write_kv2(micro_log, log_level, msg, ...)            \
+  (_micro_log_level_enabled(micro_log, log_level)                      \
+   ? _micro_log_write_kv_impl(micro_log, log_level, __FILE__, __LINE__, \
+                              msg,                                     \
+                              (const MicroLogField[]) { __VA_ARGS__ }, \
+                              sizeof((MicroLogField[]) { __VA_ARGS__ }) \
+                              / sizeof(MicroLogField))                 \
+   : MICRO_LOG_OK)
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_TRACE
+  #define micro_log_trace_kv2(micro_log, msg, ...)                     \
+    micro_log_write_kv2(micro_log, MICRO_LOG_LEVEL_TRACE, msg,         \
+                        __VA_ARGS__)
+#else
+  #define micro_log_trace_kv2(micro_log, msg, ...) micro_log_disabled()
+#endif
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_DEBUG
+  #define micro_log_debug_kv2(micro_log, msg, ...)                     \
+    micro_log_write_kv2(micro_log, MICRO_LOG_LEVEL_DEBUG, msg,         \
+                        __VA_ARGS__)
+#else
+  #define micro_log_debug_kv2(micro_log, msg, ...) micro_log_disabled()
+#endif
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_INFO
+  #define micro_log_info_kv2(micro_log, msg, ...)                      \
+    micro_log_write_kv2(micro_log, MICRO_LOG_LEVEL_INFO, msg,          \
+                        __VA_ARGS__)
+#else
+  #define micro_log_info_kv2(micro_log, msg, ...) micro_log_disabled()
+#endif
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_WARN
+  #define micro_log_warn_kv2(micro_log, msg, ...)                      \
+    micro_log_write_kv2(micro_log, MICRO_LOG_LEVEL_WARN, msg,          \
+                        __VA_ARGS__)
+#else
+  #define micro_log_warn_kv2(micro_log, msg, ...) micro_log_disabled()
+#endif
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_ERROR
+  #define micro_log_error_kv2(micro_log, msg, ...)                     \
+    micro_log_write_kv2(micro_log, MICRO_LOG_LEVEL_ERROR, msg,         \
+                        __VA_ARGS__)
+#else
+  #define micro_log_error_kv2(micro_log, msg, ...) micro_log_disabled()
+#endif
+
+#if MICRO_LOG_LEVEL_DEF <= MICRO_LOG_LEVEL_FATAL
+  #define micro_log_fatal_kv2(micro_log, msg, ...)                     \
+    micro_log_write_kv2(micro_log, MICRO_LOG_LEVEL_FATAL, msg,         \
+                        __VA_ARGS__)
+#else
+  #define micro_log_fatal_kv2(micro_log, msg, ...) micro_log_disabled()
+#endif
+
+// Functions
+// micro_log_write_{raw|hex}2
+
+#define micro_log_write_raw2(micro_log, log_level, data, len)          \
+  (_micro_log_level_enabled(micro_log, log_level)                      \
+   ? _micro_log_write_raw_impl(micro_log, log_level, __FILE__, __LINE__, \
+                               (const char*) (data), len, false)       \
+   : MICRO_LOG_OK)
+
+#define micro_log_write_hex2(micro_log, log_level, data, len)          \
+  (_micro_log_level_enabled(micro_log, log_level)                      \
+   ? _micro_log_write_raw_impl(micro_log, log_level, __FILE__, __LINE__, \
+                               (const char*) (data), len, true)        \
+   : MICRO_LOG_OK)
+
+//
+// Types and functions
+//
+
+// A log category, with its own runtime level in each logger
+//
+// Define one with `MICRO_LOG_CATEGORY` and log to it with the
+// `micro_log_{level}_c` macros.
+typedef struct {
+  const char *name;
+  // Index of the category in the levels of a logger, -1 until the
+  // first record is logged to it
+  int slot;
+} MicroLogCategory;
+
+// Define the category [name], in a single translation unit
+#define MICRO_LOG_CATEGORY(name)                                \
+  MicroLogCategory micro_log_category_##name = { #name, -1 }
+
+// Declare the category [name], defined in another translation unit
+#define MICRO_LOG_CATEGORY_EXTERN(name)                 \
+  extern MicroLogCategory micro_log_category_##name
+
+typedef enum
+{
+  MICRO_LOG_FIELD_INT = 0,
+  MICRO_LOG_FIELD_UINT,
+  MICRO_LOG_FIELD_DOUBLE,
+  MICRO_LOG_FIELD_BOOL,
+  MICRO_LOG_FIELD_STR,
+  _MICRO_LOG_FIELD_MAX,
+} MicroLogFieldType;
+
+// A typed field of a record, see `micro_log_info_kv`
+typedef struct {
+  const char *key;
+  MicroLogFieldType type;
+  union {
+    int64_t i;
+    uint64_t u;
+    double d;
+    bool b;
+    // NULL is rendered as null
+    const char *s;
+  } value;
+} MicroLogField;
+
+#define MICRO_LOG_INT(key, v)                                          \
+  ((MicroLogField) { (key), MICRO_LOG_FIELD_INT, { .i = (int64_t) (v) } })
+#define MICRO_LOG_UINT(key, v)                                         \
+  ((MicroLogField) { (key), MICRO_LOG_FIELD_UINT, { .u = (uint64_t) (v) } })
+#define MICRO_LOG_DOUBLE(key, v)                                       \
+  ((MicroLogField) { (key), MICRO_LOG_FIELD_DOUBLE, { .d = (double) (v) } })
+#define MICRO_LOG_BOOL(key, v)                                         \
+  ((MicroLogField) { (key), MICRO_LOG_FIELD_BOOL, { .b = (v) ? true : false } })
+#define MICRO_LOG_STR(key, v)                                          \
+  ((MicroLogField) { (key), MICRO_LOG_FIELD_STR, { .s = (v) } })
+
+// How the records are encoded for an output, see
+// `micro_log_set_encoding`
+typedef enum
+{
+  // Rendered with the flags of the logger (default)
+  MICRO_LOG_ENCODING_TEXT = 0,
+  // key=value pairs, like level=info msg="Hello"
+  MICRO_LOG_ENCODING_LOGFMT,
+  // Graylog Extended Log Format 1.1, a json object per record
+  MICRO_LOG_ENCODING_GELF,
+  // The native protocol of systemd-journald, a KEY=value line per
+  // field, see `micro_log_add_journald`
+  MICRO_LOG_ENCODING_JOURNALD,
+  // Syslog messages of RFC 5424, with the metadata as structured
+  // data, see `micro_log_add_syslog`
+  MICRO_LOG_ENCODING_SYSLOG,
+  _MICRO_LOG_ENCODING_MAX,
+} MicroLogEncoding;
+
+// How the records are delimited in an output, see
+// `micro_log_set_framing`
+typedef enum
+{
+  // Each record ends with a newline (default), or with a null byte
+  // for GELF on a stream socket, or is a datagram of its own for
+  // GELF on a datagram socket
+  MICRO_LOG_FRAMING_NONE = 0,
+  // Each record is prefixed by its length in decimal and a space,
+  // like syslog over TCP (RFC 5425 and RFC 6587)
+  MICRO_LOG_FRAMING_OCTET_COUNTED,
+  _MICRO_LOG_FRAMING_MAX,
+} MicroLogFraming;
+
+
+#ifdef MICRO_LOG_SOCKETS
+typedef enum
+{
+  MICRO_LOG_PROTO_TCP = 0,
+  MICRO_LOG_PROTO_UDP,
+  _MICRO_LOG_PROTO_MAX
+} MicroLogProto;
+
+// State of a socket output, see `micro_log_get_socket_state`
+typedef struct {
+  bool connected;
+  // Bytes waiting to be sent
+  size_t bytes_queued;
+  // Bytes dropped because the queue was full, or because the
+  // connection was lost in the middle of a record
+  size_t bytes_dropped;
+  // Number of times the connection was established again after it
+  // was lost
+  size_t reconnects;
+} MicroLogSocketState;
+
+// A non-blocking socket output
+typedef struct {
+  // -1 if the socket is closed
+  int fd;
+  // Disconnected, connecting or connected
+  int state;
+  // SOCK_STREAM or SOCK_DGRAM
+  int type;
+  struct sockaddr_storage addr;
+  // 0 if there is no address to connect to
+  socklen_t addr_len;
+  // Queued records, each prefixed by its length as an uint32_t
+  char *pending;
+  size_t pending_len;
+  // Bytes of the first queued record already sent
+  size_t pending_sent;
+  size_t queued;
+  size_t dropped;
+  size_t reconnects;
+  // Whether the connection was lost since the last connect
+  bool lost;
+  // Time to wait before the next attempt to connect, and when it
+  // is due, in milliseconds of CLOCK_MONOTONIC
+  long backoff_ms;
+  int64_t retry_at;
+} MicroLogSocket;
+#endif // MICRO_LOG_SOCKETS
+
+typedef int micro_log_error;
+
+// A custom output, see `micro_log_add_sink`
+//
+// The callbacks are called with the write mutex held, from the
+// thread that logs or from the async writer, so they do not need to
+// be thread safe. [write] and [flush] return MICRO_LOG_OK or an
+// error, they are declared as returning int because
+// `micro_log_error` is also the name of a log macro.
+typedef struct {
+  // Write a record, the [len] bytes of [buf]
+  int (*write)(void *user, const char *buf, size_t len);
+  // (optional) Write what the sink buffered, on `micro_log_flush`
+  int (*flush)(void *user);
+  // (optional) Release the sink, on `micro_log_close`
+  void (*close)(void *user);
+  // Passed to the callbacks
+  void *user;
+  // Only records of an higher or equal priority than this are
+  // written to the sink, MICRO_LOG_LEVEL_TRACE to get all of them
+  MicroLogLevel level;
+  // How the records are encoded for the sink
+  MicroLogEncoding encoding;
+  MicroLogFraming framing;
+} MicroLogSink;
+
+// Metadata of a record, captured when the record is logged
+typedef struct {
+  MicroLogLevel level;
+  // MICRO_LOG_FLAG bitfield the record is rendered with
+  long unsigned int flags;
+  // Source location of the log call
+  const char *file;
+  int line;
+  // When the record was logged
+  time_t time;
+  long nsec;
+  // Nanoseconds since the logger was initialized
+  int64_t mono;
+  long pid;
+  long tid;
+  // Only 1 in [sample_rate] records of the call site was logged, 0
+  // if the record was not sampled
+  unsigned int sample_rate;
+} MicroLogRecord;
+
+// A call site described in a binary output, see
+// `micro_log_set_binary_file2`
+typedef struct {
+  const char *fmt;
+  const char *file;
+  int line;
+  uint32_t id;
+} MicroLogBinaryFormat;
+
+#ifdef MICRO_LOG_ASYNC
+
+// What to do with a record when the async ring buffer is full
+typedef enum
+{
+  // Wait for the writer to make space (default)
+  MICRO_LOG_OVERFLOW_BLOCK = 0,
+  // Discard the record being logged
+  MICRO_LOG_OVERFLOW_DROP_NEWEST,
+  // Discard the oldest record in the ring to make space
+  MICRO_LOG_OVERFLOW_DROP_OLDEST,
+  // Discard the record being logged if its level is lower than the
+  // overflow level, wait otherwise
+  MICRO_LOG_OVERFLOW_DROP_BELOW,
+  _MICRO_LOG_OVERFLOW_MAX
+} MicroLogOverflow;
+
+// A slot in the async ring buffer, holding one rendered record
+typedef struct {
+  // Sequence number of the slot, tells producers and the writer
+  // thread whose turn it is to use it
+  size_t seq;
+  // Length of [data], 0 if rendering failed
+  size_t len;
+  MicroLogRecord record;
+  // If not NULL, the record was deferred: [data] holds the packed
+  // arguments of [fmt] instead of the rendered text
+  const char *fmt;
+  // Position of the message in the rendered text
+  size_t msg_begin;
+  size_t msg_len;
+  char data[MICRO_LOG_ASYNC_SLOT_SIZE];
+} MicroLogSlot;
+
+#ifdef MICRO_LOG_SOCKETS
+// Records for a socket, written together at the end of a batch of
+// the async writer: their text one after the other, and where each
+// one ends
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+  size_t ends[MICRO_LOG_ASYNC_BATCH];
+  size_t count;
+} MicroLogSocketBatch;
 #endif // MICRO_LOG_SOCKETS
 
+#ifdef MICRO_LOG_IO_URING
+// Outputs the async writer writes with io_uring
+#define _MICRO_LOG_IO_URING_STDOUT 0
+#define _MICRO_LOG_IO_URING_FILE   1
+#define _MICRO_LOG_IO_URING_COUNT  2
+
+// Ring of the async writer, see MICRO_LOG_IO_URING
+//
+// The queues are shared with the kernel, their entries are kept
+// opaque here so that the kernel headers are only needed by the
+// implementation.
+typedef struct {
+  // -1 when the writer uses stdio
+  int fd;
+  void *sq_ring;
+  size_t sq_ring_size;
+  // The same mapping as [sq_ring] on kernels since 5.4
+  void *cq_ring;
+  size_t cq_ring_size;
+  void *sqes;
+  size_t sqes_size;
+  unsigned int *sq_tail;
+  unsigned int *sq_head;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  void *cqes;
+  // Whether [bufs] are registered with the kernel
+  bool fixed;
+  // Set if the ring failed with writes still in flight, the writer
+  // then uses stdio and [bufs] are never freed
+  bool broken;
+  // Set while the writer drains a batch, the records for stdout and
+  // the file are then copied in [bufs]
+  bool batching;
+  // Records of the batch for each output, and the fd they go to
+  char *bufs[_MICRO_LOG_IO_URING_COUNT];
+  size_t lens[_MICRO_LOG_IO_URING_COUNT];
+  int fds[_MICRO_LOG_IO_URING_COUNT];
+} MicroLogIoUring;
+#endif // MICRO_LOG_IO_URING
+
+// State of the asynchronous backend
+//
+// The ring is a bounded multi-producer queue: producers claim a slot
+// by advancing [enqueue_pos], render into it and publish it by
+// updating its sequence number. The writer thread consumes slots in
+// order and writes them to the outputs.
+typedef struct {
+  // NULL when the asynchronous backend is not running
+  MicroLogSlot *slots;
+  // Number of slots minus one, the capacity is a power of two
+  size_t mask;
+  // Producers and the writer update these concurrently, so they are
+  // kept on separate cache lines
+  char _pad0[64];
+  size_t enqueue_pos;
+  char _pad1[64 - sizeof(size_t)];
+  size_t dequeue_pos;
+  char _pad2[64 - sizeof(size_t)];
+  // Number of records the writer has finished with
+  size_t done_pos;
+  char _pad3[64 - sizeof(size_t)];
+  // Set by the writer when it is about to wait for new records
+  int sleeping;
+  // Set by `micro_log_close2` to stop the writer
+  int stop;
+  // Number of threads waiting in `micro_log_flush2`
+  int waiters;
+  // Records discarded because the ring was full, for each level
+  size_t dropped[MICRO_LOG_LEVEL_MAX];
+  // Total dropped records already reported by the writer
+  size_t dropped_reported;
+  // When the writer last reported dropped records, in seconds of
+  // CLOCK_MONOTONIC
+  time_t dropped_report_time;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  // Wakes up the writer
+  pthread_cond_t cond;
+  // Wakes up the threads waiting for the writer to drain the ring
+  pthread_cond_t flush_cond;
+  #ifdef MICRO_LOG_SOCKETS
+  // Records for the inet and the unix socket, written together at
+  // the end of each batch
+  MicroLogSocketBatch inet_batch;
+  MicroLogSocketBatch unix_batch;
+  #endif // MICRO_LOG_SOCKETS
+  #ifdef MICRO_LOG_IO_URING
+  MicroLogIoUring uring;
+  #endif // MICRO_LOG_IO_URING
+} MicroLogAsync;
+
+#endif // MICRO_LOG_ASYNC
+
+#ifdef MICRO_LOG_FLIGHT_RECORDER
+
+// A record kept by the flight recorder
+typedef struct {
+  MicroLogRecord record;
+  // If not NULL, [data] holds the packed arguments of [fmt] instead
+  // of the rendered record
+  const char *fmt;
+  // Length of [data], 0 if rendering failed
+  size_t len;
+  // Position of the message in the rendered record
+  size_t msg_begin;
+  size_t msg_len;
+  char data[MICRO_LOG_FLIGHT_SLOT_SIZE];
+} MicroLogFlightSlot;
+
+// The flight recorder, see `micro_log_set_flight_recorder2`
+//
+// A ring of the last records below the level of the logger, the
+// oldest one is overwritten when it is full.
+typedef struct {
+  // NULL when the flight recorder is off
+  MicroLogFlightSlot *slots;
+  size_t capacity;
+  // Index of the oldest record
+  size_t head;
+  // Number of records in the ring
+  size_t count;
+  // Records with a lower level than this are not kept
+  // Default value is MICRO_LOG_LEVEL_DISABLED
+  MicroLogLevel level;
+  // Records with an higher or equal level than this write the ring
+  // before them
+  MicroLogLevel trigger;
+  #ifdef MICRO_LOG_MULTITHREADED
+  pthread_mutex_t mutex;
+  #endif // MICRO_LOG_MULTITHREADED
+} MicroLogFlight;
+
+#endif // MICRO_LOG_FLIGHT_RECORDER
+
+#ifdef MICRO_LOG_THREAD_BUFFER
+// Records staged by a thread, see MICRO_LOG_THREAD_BUFFER
+typedef struct MicroLogThreadBuffer MicroLogThreadBuffer;
+// Background thread that writes the staged records on time, see
+// MICRO_LOG_THREAD_BUFFER_MS
+typedef struct MicroLogThreadFlusher MicroLogThreadFlusher;
+#endif // MICRO_LOG_THREAD_BUFFER
+
+#ifdef MICRO_LOG_MULTITHREADED
+// A watched settings file, see `micro_log_watch_file2`
+typedef struct MicroLogWatch MicroLogWatch;
+// Background thread that finishes the rotations of the output file
+typedef struct MicroLogRotator MicroLogRotator;
+#endif // MICRO_LOG_MULTITHREADED
+
+#ifdef MICRO_LOG_MMAP
+// A memory mapped output file, see `micro_log_set_mmap_file2`
+typedef struct MicroLogMmap MicroLogMmap;
+#endif // MICRO_LOG_MMAP
+
+// How the rotated output files are compressed
+typedef enum
+{
+  MICRO_LOG_COMPRESS_NONE = 0,
+  // With the gzip program, the files end with ".gz"
+  MICRO_LOG_COMPRESS_GZIP,
+  // With the zstd program, the files end with ".zst"
+  MICRO_LOG_COMPRESS_ZSTD,
+  _MICRO_LOG_COMPRESS_MAX
+} MicroLogCompress;
+
+// When the output file is rotated, see `micro_log_set_file_rotation`
+//
+// The file is rotated as soon as one of the conditions is met. A
+// zeroed MicroLogRotation never rotates the file.
+typedef struct {
+  // Rotate before the file grows past this size in bytes, 0 to not
+  // rotate on size
+  size_t max_bytes;
+  // Rotate every [minutes] minutes, 0 to not rotate on time
+  int minutes;
+  // Rotate at midnight, local time
+  bool daily;
+  // Number of rotated files to keep, 0 to keep all of them
+  int keep;
+  // Compress the rotated files
+  MicroLogCompress compress;
+} MicroLogRotation;
+
+// State of a rate limited call site, see the
+// `micro_log_{level}_ratelimited` macros
+//
+// The limit is a token bucket, kept as the time at which the bucket
+// is full again so that it can be updated with a single atomic.
+typedef struct {
+  // When the next record would fill the bucket, in nanoseconds of
+  // CLOCK_MONOTONIC
+  int64_t full_at;
+  // Records held back since the last report
+  size_t suppressed;
+  // When the held back records were last reported, in milliseconds
+  // of CLOCK_MONOTONIC
+  int64_t reported_at;
+} MicroLogRateLimit;
+
+// The last record written by a logger, to collapse the ones that
+// repeat it, see `micro_log_set_collapse2`
+typedef struct {
+  bool enabled;
+  // The last record, not set if [fmt] is NULL
+  MicroLogLevel level;
+  const char *fmt;
+  const char *file;
+  int line;
+  // The packed arguments of [fmt]
+  char args[MICRO_LOG_COLLAPSE_SIZE];
+  size_t args_len;
+  // Records that repeated it since the last report
+  size_t repeated;
+  // When the first of them was held back, in milliseconds of
+  // CLOCK_MONOTONIC
+  int64_t repeated_since;
+  #ifdef MICRO_LOG_MULTITHREADED
+  pthread_mutex_t mutex;
+  #endif // MICRO_LOG_MULTITHREADED
+} MicroLogCollapse;
+
+#ifdef MICRO_LOG_STATS
+// Counters of a logger, see `micro_log_get_stats`
+//
+// The counters only grow, from the initialization of the logger.
+typedef struct {
+  // Records written to at least one output, for each level
+  size_t emitted[MICRO_LOG_LEVEL_MAX];
+  // Records that got past the level check of the log macros but were
+  // not written: below the level of all the outputs, held back by a
+  // rate limit, collapsed as repeated, or only kept by the flight
+  // recorder, which are counted as emitted again if it writes them.
+  // Records below the level of the logger or not chosen by sampling
+  // are rejected by the macros and not counted, which would cost an
+  // atomic operation on every disabled log call.
+  size_t filtered[MICRO_LOG_LEVEL_MAX];
+  // Records dropped because the async ring was full
+  size_t dropped[MICRO_LOG_LEVEL_MAX];
+  // For each output, indexed by the position of its bit in
+  // MICRO_LOG_OUT: the bytes written, the failed writes, and the
+  // nanoseconds spent writing. The bytes of the socket outputs are
+  // the ones handed to the socket, see `micro_log_get_socket_state`
+  // for the ones it dropped.
+  size_t bytes[_MICRO_LOG_OUT_COUNT];
+  size_t errors[_MICRO_LOG_OUT_COUNT];
+  uint64_t io_ns[_MICRO_LOG_OUT_COUNT];
+  // Nanoseconds the write mutex was held, and how many times it was
+  // already locked by another thread
+  uint64_t lock_ns;
+  size_t lock_contended;
+  // Most records waiting in the async ring at once, and its number
+  // of slots
+  size_t queue_high_water;
+  size_t queue_capacity;
+} MicroLogStats;
+#endif // MICRO_LOG_STATS
+
+// The MicroLog logger
+typedef struct {
+  // MICRO_LOG_FLAG bitfield
+  // Adds additionally log information based on the flags
+  long unsigned int flags_bitfield;
+  // MICRO_LOG_OUT bitfield
+  // Default value is MICRO_LOG_OUT_STDOUT
+  long unsigned int out_bitfield;
+  // Encoding and framing of each output, indexed by the position of
+  // its bit in MICRO_LOG_OUT
+  // Default value is MICRO_LOG_ENCODING_TEXT and MICRO_LOG_FRAMING_NONE
+  MicroLogEncoding encodings[_MICRO_LOG_OUT_COUNT];
+  MicroLogFraming framings[_MICRO_LOG_OUT_COUNT];
+  // Lowest level of the records written to each output, indexed like
+  // [encodings]
+  // Default value is MICRO_LOG_LEVEL_TRACE
+  MicroLogLevel out_levels[_MICRO_LOG_OUT_COUNT];
+  // The custom outputs, written when MICRO_LOG_OUT_SINKS is set
+  MicroLogSink sinks[MICRO_LOG_SINKS_MAX];
+  size_t sinks_count;
+  // The current log level of the logger
+  // Only logs that are of an higher or equal priority than this will
+  // be logged.
+  // Default value is MICRO_LOG_LEVEL_TRACE
+  MicroLogLevel log_level;
+  // The level of each category, indexed by its slot
+  // Default value is MICRO_LOG_LEVEL_INHERIT. The last one is for the
+  // categories that did not fit in MICRO_LOG_CATEGORY_MAX.
+  MicroLogLevel category_levels[MICRO_LOG_CATEGORY_MAX + 1];
+  // CLOCK_MONOTONIC time of `micro_log_init2`, for MICRO_LOG_FLAG_MONO
+  struct timespec mono_base;
+  // (optional) Pointer to output file
+  FILE *file;
+  // The name of [file], NULL if not set
+  char *file_path;
+  // Bytes written to [file], counted for the rotation
+  size_t file_size;
+  // When [file] is rotated, default value is no rotation
+  MicroLogRotation rotation;
+  // When [file] is rotated next, in seconds since the epoch, 0 if it
+  // is not rotated over time
+  time_t rotate_at;
+  // Used to give a different name to each file being rotated
+  unsigned int rotate_seq;
+  // (optional) Pointer to binary output file
+  FILE *binary_file;
+  #ifdef MICRO_LOG_MMAP
+  // (optional) Memory mapped output file
+  MicroLogMmap *mmap;
+  // The memory mapped files replaced by [mmap], freed on close
+  MicroLogMmap *mmap_retired;
+  #endif // MICRO_LOG_MMAP
+  // Hash table of the call sites already described in [binary_file]
+  MicroLogBinaryFormat *binary_formats;
+  size_t binary_formats_cap;
+  uint32_t binary_formats_count;
+  #ifdef MICRO_LOG_SOCKETS
+  // (optional) Socket outputs
+  MicroLogSocket inet_sock;
+  MicroLogProto inet_proto;
+  #if defined(__unix__) || defined(__unix)
+  MicroLogSocket unix_sock;
+  #endif // __unix__
+  #endif // MICRO_LOG_SOCKETS
+  #ifdef MICRO_LOG_MULTITHREADED
+  // Mutex to protect all writes
+  pthread_mutex_t write_mutex;
+  // (optional) Settings file to apply again when it changes
+  MicroLogWatch *watch;
+  // Started with the rotation of [file]
+  MicroLogRotator *rotator;
+  #endif // MICRO_LOG_MULTITHREADED
+  #ifdef MICRO_LOG_ASYNC
+  // Asynchronous backend, see `micro_log_init_async2`
+  MicroLogAsync async;
+  // What to do when the async ring buffer is full
+  // Default value is MICRO_LOG_OVERFLOW_BLOCK
+  MicroLogOverflow overflow;
+  // Records with a lower level than this are dropped on overflow
+  // when using MICRO_LOG_OVERFLOW_DROP_BELOW
+  MicroLogLevel overflow_level;
+  #endif // MICRO_LOG_ASYNC
+  #ifdef MICRO_LOG_FLIGHT_RECORDER
+  // Recent records below [log_level], see
+  // `micro_log_set_flight_recorder2`
+  MicroLogFlight flight;
+  #endif // MICRO_LOG_FLIGHT_RECORDER
+  // Repeated records, see `micro_log_set_collapse2`
+  MicroLogCollapse collapse;
+  // Records held back by rate limits or collapsed as repeated
+  size_t suppressed;
+  #ifdef MICRO_LOG_STATS
+  // See `micro_log_get_stats2`
+  MicroLogStats stats;
+  // When the write mutex was locked, in nanoseconds of
+  // CLOCK_MONOTONIC
+  int64_t locked_at;
+  // Milliseconds between two stats records, 0 for none
+  int64_t stats_interval_ms;
+  // When the next stats record is due, in milliseconds of
+  // CLOCK_MONOTONIC
+  int64_t stats_report_at;
+  #endif // MICRO_LOG_STATS
+  #ifdef MICRO_LOG_THREAD_BUFFER
+  // Buffers of the threads that write to [file]
+  MicroLogThreadBuffer *thread_buffers;
+  pthread_mutex_t thread_buffers_mutex;
+  // Started with the first buffer
+  MicroLogThreadFlusher *thread_flusher;
+  #endif // MICRO_LOG_THREAD_BUFFER
+} MicroLog;
+
+//
+// Global logger functions
+//
+//
+// The Global logger
+//
+// This is a global logger that can be used with the function below.
+// You can also create other loggers, check out the other functions
+// in the `Local logger functions` group.
+extern MicroLog micro_log_global;
   
+// Initialize the global logger
+//
+// Notes: remember to close it when you are done
+MICRO_LOG_DEF micro_log_error micro_log_init(void);
+
+#ifdef MICRO_LOG_ASYNC
+
+// Initialize the global logger with the asynchronous backend
+//
+// Records are rendered by the calling thread into a ring buffer of
+// [capacity] slots (rounded up to a power of two, or
+// MICRO_LOG_ASYNC_CAPACITY if 0) and written to the outputs by a
+// background thread. `micro_log_flush` waits for the ring to be
+// drained, and `micro_log_close` drains it before stopping the
+// thread.
+//
+// Note: You need to have defined MICRO_LOG_ASYNC before including
+// this header in order to use this function
+MICRO_LOG_DEF micro_log_error micro_log_init_async(size_t capacity);
+
+// Set what the global logger does when the async ring buffer is full
+//
+// [level] is only used by MICRO_LOG_OVERFLOW_DROP_BELOW: records
+// with a lower level are dropped, the others wait for space. This is
+// useful to never lose warnings and errors while shedding trace
+// logs under pressure.
+MICRO_LOG_DEF micro_log_error
+micro_log_set_overflow(MicroLogOverflow policy, MicroLogLevel level);
+
+// Get the number of records dropped by the global logger
+//
+// [dropped] must have space for MICRO_LOG_LEVEL_MAX values, it will
+// contain the number of records dropped for each level.
+MICRO_LOG_DEF micro_log_error micro_log_get_dropped(size_t *dropped);
+
+#endif // MICRO_LOG_ASYNC
+
+// Read settings from file
+//
+// Check out the file named `settings` for additional information
+// Notes: this expects the global logger to be already initialzied
+MICRO_LOG_DEF micro_log_error micro_log_from_file(char *filename);
+
 #ifdef MICRO_LOG_MULTITHREADED
+// Read settings from file, and read them again whenever the file
+// changes
+//
+// A background thread checks the file every MICRO_LOG_WATCH_MS
+// milliseconds. On a change the level, the flags and the levels of
+// the categories are updated, and only the outputs that changed are
+// opened again. The records logged before the change are written to
+// the previous outputs. A settings file with an error is reported
+// and ignored. A setting removed from the file keeps its value,
+// except for the levels of the categories.
+//
+// The watch stops when the logger is closed.
+//
+// Note: Requires MICRO_LOG_MULTITHREADED
+MICRO_LOG_DEF micro_log_error micro_log_watch_file(const char *filename);
+#endif // MICRO_LOG_MULTITHREADED
 
-#define __MICRO_LOG_LOCK(__micro_log_ptr)                   \
+#ifndef _WIN32
+// Write the records of the global logger that are still in memory if
+// the program crashes or exits without closing the logger
+//
+// On SIGSEGV, SIGABRT, SIGBUS, SIGFPE and SIGILL, the stdio buffers,
+// the thread buffers and the async ring are written to the outputs
+// with write(2), followed by a last FATAL record with the number of
+// the signal. Then the previous handler of the signal, or its
+// default action, ends the program. On exit, the logger is flushed.
+// The records of the async ring with their arguments packed, see
+// MICRO_LOG_DEFERRED, are formatted with a reduced formatter that is
+// safe in a signal handler: they only get their level, and their
+// floating point arguments are written with 6 decimals and no
+// exponent. The binary output only gets its stdio buffer.
+//
+// The handler runs on an alternate stack in the calling thread, so
+// that it also works after a stack overflow in that thread. The other
+// threads need to call `micro_log_install_crash_stack` for that.
+// Only one logger is drained, the last one the handler was installed
+// for.
+MICRO_LOG_DEF micro_log_error micro_log_install_crash_handler(void);
+
+// Give the calling thread its own alternate stack for the crash
+// handler, so that a stack overflow in this thread is also reported
+//
+// Does nothing if the thread already has an alternate stack. With
+// MICRO_LOG_MULTITHREADED, the stack is freed when the thread exits.
+MICRO_LOG_DEF micro_log_error micro_log_install_crash_stack(void);
+#endif // _WIN32
+
+// Close the global logger
+MICRO_LOG_DEF micro_log_error micro_log_close(void);
+
+// Flush all current output streams in the global logger
+MICRO_LOG_DEF micro_log_error micro_log_flush(void);
+
+// Set output flags to global logger
+//
+// These are additional information to the log output, such as the
+// date, line, file position etc. You can also set the output to be
+// colored or to be serialized in some format like json.
+//
+// Check out the MICRO_LOG_FLAG_ values to see all the flags available
+MICRO_LOG_DEF micro_log_error
+micro_log_set_flags(long unsigned int flags_bitfield);
+
+// Set the log level to global logger
+//
+// Only the logs with an higher level of the current log level will be
+// printed.
+//
+// Check out the MicroLogLevel for a list of the supported levels.
+MICRO_LOG_DEF micro_log_error micro_log_set_level(MicroLogLevel level);
+
+// Set the log level of the category [name] of the global logger
+//
+// Records logged to the category with the `micro_log_{level}_c`
+// macros use this level instead of the one of the logger. Use
+// MICRO_LOG_LEVEL_INHERIT to follow the level of the logger again.
+// The category does not need to be defined yet.
+MICRO_LOG_DEF micro_log_error
+micro_log_set_category_level(const char *name, MicroLogLevel level);
+
+// Set the output streams to the global logger
+//
+// You can toggle some output streams. Check out the MICRO_LOG_OUT_
+// values. Remember that if you manually enable the
+// MICRO_LOG_OUT_FILE, the logger will try to write to a file so you
+// should have already opened it with `miro_log_set_file`. Likewise
+// for the other options. By default, when you add a new output
+// stream, this will be automatically registered.
+MICRO_LOG_DEF micro_log_error micro_log_set_out(int out_flags);
+
+// Set how the records are encoded for the outputs in the MICRO_LOG_OUT
+// bitfield [out_flags] of the global logger
+//
+// The message of a record is formatted once, and each output gets it
+// with the metadata in its own encoding: for example text on stdout
+// and GELF on MICRO_LOG_OUT_SOCK_INET. The flags of the logger still
+// choose the metadata, but the level and the message are always
+// there. GELF records over UDP are sent one per datagram, in chunks
+// if they are larger than MICRO_LOG_GELF_CHUNK_SIZE. The async
+// writer only keeps the message of the records, so the fields of the
+// `_kv` records are not in the logfmt and GELF outputs.
+//
+// Returns MICRO_LOG_ERROR_ENCODING for MICRO_LOG_OUT_BINARY, which
+// has its own format, and for MICRO_LOG_OUT_SINKS, whose sinks have
+// their own encoding.
+MICRO_LOG_DEF micro_log_error
+micro_log_set_encoding(int out_flags, MicroLogEncoding encoding);
+
+// Set how the records are delimited in the outputs in the
+// MICRO_LOG_OUT bitfield [out_flags] of the global logger
+//
+// With MICRO_LOG_FRAMING_OCTET_COUNTED a reader of a stream socket
+// can split the records without looking for the newlines.
+//
+// Returns MICRO_LOG_ERROR_ENCODING for MICRO_LOG_OUT_BINARY and
+// MICRO_LOG_OUT_SINKS.
+MICRO_LOG_DEF micro_log_error
+micro_log_set_framing(int out_flags, MicroLogFraming framing);
+
+// Set the lowest level of the records written to the outputs in the
+// MICRO_LOG_OUT bitfield [out_flags] of the global logger
+//
+// The level of the logger still applies first, this only holds back
+// more records from some outputs: for example only the warnings and
+// the errors on a network socket, and everything on stdout.
+MICRO_LOG_DEF micro_log_error
+micro_log_set_out_level(int out_flags, MicroLogLevel level);
+
+// Add a custom output to the global logger
+//
+// [sink] is copied, its [write] callback gets each record of at
+// least [sink->level] in its encoding, and its [close] callback is
+// called when the logger is closed. This also adds
+// MICRO_LOG_OUT_SINKS to the outputs.
+//
+// Returns MICRO_LOG_ERROR_SINKS_FULL if the logger has already
+// MICRO_LOG_SINKS_MAX sinks. The sinks are not written by the crash
+// handler, which can only call functions that are safe in a signal
+// handler.
+MICRO_LOG_DEF micro_log_error micro_log_add_sink(const MicroLogSink *sink);
+
+// Set output file of the global logger
+//
+// The logger will write logs to [filename]. The logger will create
+// the file if it does not exist.
+MICRO_LOG_DEF micro_log_error micro_log_set_file(char* filename);
+
+// Set when the output file of the global logger is rotated
+//
+// When [rotation] says so, the output file is renamed to the name of
+// the file followed by ".1" and a new one is opened in its place.
+// The files rotated before are renamed to ".2", ".3" and so on, and
+// the ones after [rotation->keep] are removed. The renaming is done
+// by a background thread when MICRO_LOG_MULTITHREADED is defined, so
+// a rotation does not stop the threads that log.
+//
+// The rotated files can be compressed with an external program,
+// which runs with the lowest priority.
+//
+// Note: compressing requires MICRO_LOG_MULTITHREADED
+MICRO_LOG_DEF micro_log_error
+micro_log_set_file_rotation(const MicroLogRotation *rotation);
+
+// Rotate the output file of the global logger now
+MICRO_LOG_DEF micro_log_error micro_log_rotate_file(void);
+
+// Set binary output file of the global logger
+//
+// The logger will write compact binary records to [filename]: a call
+// site is described once, then each record only contains a reference
+// to it, its metadata and the raw arguments of the format string.
+// Use the `micro-log-decode` program to turn the file back into text
+// or json. This enables MICRO_LOG_OUT_BINARY.
+//
+// Note: The file can only be decoded on a machine with the same
+// architecture as the one that wrote it.
+MICRO_LOG_DEF micro_log_error micro_log_set_binary_file(char* filename);
+
+#ifdef MICRO_LOG_MMAP
+// Set memory mapped output file of the global logger
+//
+// The logger will write logs to [filename] like `micro_log_set_file`,
+// but through memory mapped segments of MICRO_LOG_MMAP_SEGMENT bytes
+// instead of stdio: the threads that log copy their records in the
+// mapped memory without taking the write mutex or calling the
+// kernel. A background thread maps the segments ahead of time and
+// writes them to the disk every MICRO_LOG_MMAP_SYNC_MS milliseconds.
+// The records already written survive a crash of the program, since
+// they are in the page cache, and the file ends with the space
+// allocated for its last segment until the logger is closed. This
+// enables MICRO_LOG_OUT_MMAP.
+//
+// Note: You need to have defined MICRO_LOG_MMAP before including
+// this header in order to use this function
+MICRO_LOG_DEF micro_log_error micro_log_set_mmap_file(char* filename);
+#endif // MICRO_LOG_MMAP
+
+#ifdef MICRO_LOG_FLIGHT_RECORDER
+// Keep the recent records below the log level of the global logger
+// in memory, and write them when something goes wrong
+//
+// The last [capacity] records with a level of at least [level], that
+// would not be written because of the log level, are kept in a ring
+// instead: their arguments are packed like with MICRO_LOG_DEFERRED
+// and they are not formatted. When a record with a level of at least
+// [trigger] is logged, usually MICRO_LOG_LEVEL_ERROR, the records in
+// the ring are written to the outputs before it, oldest first, and
+// the ring is emptied. A [capacity] of 0 turns the flight recorder
+// off.
+//
+// Note: You need to have defined MICRO_LOG_FLIGHT_RECORDER before
+// including this header in order to use this function. The records
+// are written by the thread that logs the trigger, so with the
+// asynchronous backend they may come before records that are still
+// in its queue.
+MICRO_LOG_DEF micro_log_error
+micro_log_set_flight_recorder(MicroLogLevel level,
+                              MicroLogLevel trigger,
+                              size_t capacity);
+#endif // MICRO_LOG_FLIGHT_RECORDER
+
+// Collapse the records of the global logger that repeat the previous
+// one
+//
+// When [enabled], a record with the same call site, level and
+// arguments as the previous one is not written but counted. The count
+// is reported with a "Last record repeated N times" record once a
+// different record is logged, on `micro_log_flush`, or at most every
+// MICRO_LOG_SUPPRESSED_REPORT_MS milliseconds while it keeps
+// repeating, like syslog does.
+//
+// Note: records whose arguments can not be packed like with
+// MICRO_LOG_DEFERRED, or are larger than MICRO_LOG_COLLAPSE_SIZE,
+// are never collapsed.
+MICRO_LOG_DEF micro_log_error micro_log_set_collapse(bool enabled);
+
+// Get the number of records of the global logger held back by the
+// `micro_log_{level}_ratelimited` macros or collapsed as repeated
+MICRO_LOG_DEF micro_log_error micro_log_get_suppressed(size_t *suppressed);
+
+#ifdef MICRO_LOG_STATS
+
+// Get the counters of the global logger, see MicroLogStats
+//
+// The counters are read one by one without stopping the writers, so
+// they are not a consistent snapshot.
+MICRO_LOG_DEF micro_log_error micro_log_get_stats(MicroLogStats *stats);
+
+// Log the counters of the global logger every [seconds] as an info
+// record, 0 to stop
+//
+// The record is written by the async writer if it is running, or by
+// the first record logged after the interval otherwise.
+MICRO_LOG_DEF micro_log_error micro_log_set_stats_interval(int seconds);
+
+#endif // MICRO_LOG_STATS
+
+#ifdef MICRO_LOG_SOCKETS
+
+// Set output internet socket of the global logger
+//
+// Note: You need to have defined MICRO_LOG_SOCKETS before including
+// this header in torder to use this function
+MICRO_LOG_DEF micro_log_error
+micro_log_set_socket_inet(char* addr,
+                          int port,
+                          MicroLogProto protocol);
+
+#if defined(__unix__) || defined(__unix)
+
+// Set output unix socket of the global logger
+//
+// Note: You need to have defined MICRO_LOG_SOCKETS before including
+// this header, and be in an unix system to use this function.
+MICRO_LOG_DEF micro_log_error micro_log_set_socket_unix(char* path);
+
+// Add a sink that sends the records of at least [level] to syslog
+// at the unix datagram socket [path], "/dev/log" if NULL
+//
+// Each record is a datagram encoded with MICRO_LOG_ENCODING_SYSLOG:
+// the level is the severity, and the file, the line, the thread id
+// and the fields of the record are structured data.
+MICRO_LOG_DEF micro_log_error
+micro_log_add_syslog(char* path, MicroLogLevel level);
+
+#ifdef __linux__
+
+// Add a sink that sends the records of at least [level] to
+// systemd-journald, in its native protocol
+//
+// Each record is a datagram encoded with MICRO_LOG_ENCODING_JOURNALD:
+// the level is the PRIORITY, the file and the line are CODE_FILE and
+// CODE_LINE, and the fields of the record are journal fields with
+// their key upper cased. Records larger than
+// MICRO_LOG_JOURNALD_DATAGRAM_SIZE are passed in a sealed memfd.
+MICRO_LOG_DEF micro_log_error micro_log_add_journald(MicroLogLevel level);
+
+#endif // __linux__
+
+#endif // __unix__
+
+// Get the state of the socket output [out] of the global logger,
+// either MICRO_LOG_OUT_SOCK_INET or MICRO_LOG_OUT_SOCK_UNIX
+//
+// Socket outputs never block the logging thread: records are queued
+// while the socket is busy or reconnecting, and dropped when the
+// queue is full, see MICRO_LOG_SOCKET_QUEUE.
+MICRO_LOG_DEF micro_log_error
+micro_log_get_socket_state(int out, MicroLogSocketState *state);
+
+#endif // MICRO_LOG_SOCKETS
+
+//
+// Local logger functions
+//
+// These are equivalent to the global ones but they take an additional
+// MicroLog first argument, which is the logger what will be modified.
+
+MICRO_LOG_DEF micro_log_error micro_log_init2(MicroLog *micro_log);
+
+#ifdef MICRO_LOG_ASYNC
+MICRO_LOG_DEF micro_log_error
+micro_log_init_async2(MicroLog *micro_log, size_t capacity);
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_overflow2(MicroLog *micro_log,
+                        MicroLogOverflow policy,
+                        MicroLogLevel level);
+
+MICRO_LOG_DEF micro_log_error
+micro_log_get_dropped2(MicroLog *micro_log, size_t *dropped);
+#endif // MICRO_LOG_ASYNC
+
+// micro_log_from_file2 expects [micro_log] to be already initialzied
+MICRO_LOG_DEF micro_log_error
+micro_log_from_file2(MicroLog *micro_log, char *filename);
+
+#ifdef MICRO_LOG_MULTITHREADED
+MICRO_LOG_DEF micro_log_error
+micro_log_watch_file2(MicroLog *micro_log, const char *filename);
+#endif // MICRO_LOG_MULTITHREADED
+  
+#ifndef _WIN32
+MICRO_LOG_DEF micro_log_error
+micro_log_install_crash_handler2(MicroLog *micro_log);
+#endif // _WIN32
+
+MICRO_LOG_DEF micro_log_error micro_log_close2(MicroLog *micro_log);
+  
+MICRO_LOG_DEF micro_log_error micro_log_flush2(MicroLog *micro_log);
+  
+MICRO_LOG_DEF micro_log_error
+micro_log_set_flags2(MicroLog *micro_log,
+                     long unsigned int flags_bitfield);
+  
+MICRO_LOG_DEF micro_log_error
+micro_log_set_level2(MicroLog *micro_log,
+                     MicroLogLevel level);
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_category_level2(MicroLog *micro_log,
+                              const char *name,
+                              MicroLogLevel level);
+  
+MICRO_LOG_DEF micro_log_error
+micro_log_set_out2(MicroLog *micro_log, int out_flags);
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_encoding2(MicroLog *micro_log,
+                        int out_flags,
+                        MicroLogEncoding encoding);
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_framing2(MicroLog *micro_log,
+                       int out_flags,
+                       MicroLogFraming framing);
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_out_level2(MicroLog *micro_log,
+                         int out_flags,
+                         MicroLogLevel level);
+
+MICRO_LOG_DEF micro_log_error
+micro_log_add_sink2(MicroLog *micro_log, const MicroLogSink *sink);
+  
+MICRO_LOG_DEF micro_log_error
+micro_log_set_file2(MicroLog *micro_log,
+                    char* filename);
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_file_rotation2(MicroLog *micro_log,
+                             const MicroLogRotation *rotation);
+
+MICRO_LOG_DEF micro_log_error micro_log_rotate_file2(MicroLog *micro_log);
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_binary_file2(MicroLog *micro_log,
+                           char* filename);
+
+#ifdef MICRO_LOG_MMAP
+MICRO_LOG_DEF micro_log_error
+micro_log_set_mmap_file2(MicroLog *micro_log,
+                         char* filename);
+#endif // MICRO_LOG_MMAP
+
+#ifdef MICRO_LOG_FLIGHT_RECORDER
+MICRO_LOG_DEF micro_log_error
+micro_log_set_flight_recorder2(MicroLog *micro_log,
+                               MicroLogLevel level,
+                               MicroLogLevel trigger,
+                               size_t capacity);
+#endif // MICRO_LOG_FLIGHT_RECORDER
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_collapse2(MicroLog *micro_log, bool enabled);
+
+MICRO_LOG_DEF micro_log_error
+micro_log_get_suppressed2(MicroLog *micro_log, size_t *suppressed);
+
+#ifdef MICRO_LOG_STATS
+
+MICRO_LOG_DEF micro_log_error
+micro_log_get_stats2(MicroLog *micro_log, MicroLogStats *stats);
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_stats_interval2(MicroLog *micro_log, int seconds);
+
+#endif // MICRO_LOG_STATS
+
+#ifdef MICRO_LOG_SOCKETS
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_socket_inet2(MicroLog *micro_log,
+                           char* addr,
+                           int port,
+                           MicroLogProto protocol);
+
+#if defined(__unix__) || defined(__unix)
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_socket_unix2(MicroLog *micro_log,
+                           char* path);
+
+MICRO_LOG_DEF micro_log_error
+micro_log_add_syslog2(MicroLog *micro_log,
+                      char* path,
+                      MicroLogLevel level);
+
+#ifdef __linux__
+
+MICRO_LOG_DEF micro_log_error
+micro_log_add_journald2(MicroLog *micro_log, MicroLogLevel level);
+
+#endif // __linux__
+
+#endif // __unix__
+
+MICRO_LOG_DEF micro_log_error
+micro_log_get_socket_state2(MicroLog *micro_log,
+                            int out,
+                            MicroLogSocketState *state);
+
+#endif // MICRO_LOG_SOCKETS
+
+// Misc
+
+#ifdef MICRO_LOG_MULTITHREADED
+  #define _MICRO_LOG_THREAD_LOCAL __thread
+#else
+  #define _MICRO_LOG_THREAD_LOCAL
+#endif
+
+// The flags to render with, a constant with MICRO_LOG_FIXED_FLAGS
+#ifdef MICRO_LOG_FIXED_FLAGS
+  #define _MICRO_LOG_FLAGS(flags) ((long unsigned int) (MICRO_LOG_FIXED_FLAGS))
+#else
+  #define _MICRO_LOG_FLAGS(flags) (flags)
+#endif
+
+// Inline function that just returns MICRO_LOG_OK
+// This is needed when log level is disabled at compile time, and
+// it needs a definition in every translation unit to be inlined
+static inline int micro_log_disabled(void)
+{
+    return MICRO_LOG_OK;
+}
+
+// The level, flags and outputs of a logger are read by the logging
+// threads without taking the write mutex, so they are accessed with
+// relaxed atomic loads and stores
+#if defined(__GNUC__) || defined(__clang__)
+  #define _MICRO_LOG_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+  #define _MICRO_LOG_STORE(field, value)                        \
+    __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#else
+  #define _MICRO_LOG_LOAD(field) (field)
+  #define _MICRO_LOG_STORE(field, value) ((field) = (value))
+#endif
+
+// The lowest level of the records that [micro_log] handles, when
+// records of at least [min] are written to the outputs
+//
+// This is [min], unless the flight recorder keeps lower records.
+static inline MicroLogLevel
+_micro_log_level_min(MicroLog *micro_log, MicroLogLevel min)
+{
+  #ifdef MICRO_LOG_FLIGHT_RECORDER
+  MicroLogLevel flight = _MICRO_LOG_LOAD(micro_log->flight.level);
+  if (flight < min)
+    return flight;
+  #else
+  (void) micro_log;
+  #endif // MICRO_LOG_FLIGHT_RECORDER
+  return min;
+}
+
+// Whether a record of [level] passes the runtime level of
+// [micro_log]
+//
+// The log macros check this inline before calling the logger, so a
+// record below the level costs a load and a branch, and its
+// arguments are not evaluated. A NULL logger passes, so that the
+// call reports the error.
+static inline bool
+_micro_log_level_enabled(MicroLog *micro_log, MicroLogLevel level)
+{
+  return micro_log == NULL
+    || (level >= _micro_log_level_min(micro_log,
+                                      _MICRO_LOG_LOAD(micro_log->log_level))
+        && level < MICRO_LOG_LEVEL_DISABLED);
+}
+
+// Whether a record sampled 1 in [sample_rate] is chosen
+//
+// The log macros check this inline, after the level and before
+// evaluating the arguments, with a xorshift generator of the calling
+// thread: a record that is not chosen costs a few instructions.
+static inline bool _micro_log_sample(unsigned int sample_rate)
+{
+  static _MICRO_LOG_THREAD_LOCAL uint64_t state = 0;
+  if (sample_rate <= 1)
+    return true;
+  // Each thread starts from a different state, without a syscall
+  if (state == 0)
+    state = (uint64_t) (uintptr_t) &state * 0x9E3779B97F4A7C15ull | 1;
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  // 1 in [sample_rate] of the high bits, without a division
+  return (((state >> 32) * sample_rate) >> 32) == 0;
+}
+
+// Find the slot of [category] and remember it in the category
+MICRO_LOG_DEF int _micro_log_category_resolve(MicroLogCategory *category);
+
+// The runtime level of [category] in [micro_log], or the one of the
+// logger if the category inherits it
+static inline MicroLogLevel
+_micro_log_category_level(MicroLog *micro_log, MicroLogCategory *category)
+{
+  int slot = _MICRO_LOG_LOAD(category->slot);
+  if (slot < 0)
+    slot = _micro_log_category_resolve(category);
+  MicroLogLevel min = _MICRO_LOG_LOAD(micro_log->category_levels[slot]);
+  if (min == MICRO_LOG_LEVEL_INHERIT)
+    min = _MICRO_LOG_LOAD(micro_log->log_level);
+  return min;
+}
+
+// Whether a record of [level] in [category] passes the runtime level
+// of the category in [micro_log], or the one of the logger if the
+// category inherits it
+//
+// The slot of the category is looked up by name only once, then this
+// is a few loads and a branch like `_micro_log_level_enabled`.
+static inline bool
+_micro_log_category_enabled(MicroLog *micro_log,
+                            MicroLogCategory *category,
+                            MicroLogLevel level)
+{
+  if (micro_log == NULL)
+    return true;
+  return level >= _micro_log_level_min(micro_log,
+                                       _micro_log_category_level(micro_log,
+                                                                 category))
+    && level < MICRO_LOG_LEVEL_DISABLED;
+}
+  
+// Get a string of a certain log level, with an optional color
+MICRO_LOG_DEF const char*
+micro_log_level_string(MicroLogLevel level, bool color);
+
+// The central log function
+//
+// All other functions call this one for printing. It renders the
+// record once with `_micro_log_render` and hands the result to
+// `_micro_log_write_outputs`.
+MICRO_LOG_DEF micro_log_error
+_micro_log_write_impl(MicroLog *micro_log,
+                      MicroLogLevel level,
+                      const char* file,
+                      int line,
+                      const char *fmt, ...);
+
+// Like `_micro_log_write_impl`, for a record of a call site sampled
+// 1 in [sample_rate]
+MICRO_LOG_DEF micro_log_error
+_micro_log_write_sampled_impl(MicroLog *micro_log,
+                              MicroLogLevel level,
+                              unsigned int sample_rate,
+                              const char* file,
+                              int line,
+                              const char *fmt, ...);
+
+// Whether a record of the call site limited by [rate_limit] to
+// [per_sec] records per second can be logged now
+//
+// Counts the records held back, and reports them with a record of
+// [level] from [file] and [line].
+MICRO_LOG_DEF bool
+_micro_log_rate_limit_pass(MicroLog *micro_log,
+                           MicroLogRateLimit *rate_limit,
+                           MicroLogLevel level,
+                           double per_sec,
+                           const char *file,
+                           int line);
+
+// Like `_micro_log_write_impl`, for the message [msg] with the
+// [count] typed [fields]
+//
+// These records are rendered by the calling thread, the flight
+// recorder keeps them as text. They are collapsed if their message
+// and fields repeat the previous record.
+MICRO_LOG_DEF micro_log_error
+_micro_log_write_kv_impl(MicroLog *micro_log,
+                         MicroLogLevel level,
+                         const char* file,
+                         int line,
+                         const char *msg,
+                         const MicroLogField *fields,
+                         size_t count);
+
+// Like `_micro_log_write_impl`, for the [len] bytes of [data] as the
+// message, written as they are or in [hex]
+//
+// These records are rendered by the calling thread, the flight
+// recorder keeps them as text. They are collapsed if their bytes
+// repeat the previous record.
+MICRO_LOG_DEF micro_log_error
+_micro_log_write_raw_impl(MicroLog *micro_log,
+                          MicroLogLevel level,
+                          const char* file,
+                          int line,
+                          const char *data,
+                          size_t len,
+                          bool hex);
+
+// Like `_micro_log_write_impl`, for a record in [category]
+MICRO_LOG_DEF micro_log_error
+_micro_log_write_category_impl(MicroLog *micro_log,
+                               MicroLogCategory *category,
+                               MicroLogLevel level,
+                               const char* file,
+                               int line,
+                               const char *fmt, ...);
+
+// Write an already rendered record to the outputs in the
+// MICRO_LOG_OUT bitfield [out]
+//
+// Each output receives the whole record with a single write. This
+// expects the caller to hold the write mutex.
+MICRO_LOG_DEF micro_log_error
+_micro_log_write_outputs(MicroLog *micro_log,
+                         long unsigned int out,
+                         const char* buf,
+                         size_t len);
+//
+// Implementation
+//
+
+#ifdef MICRO_LOG_IMPLEMENTATION
+
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <spawn.h>
+#ifndef _WIN32
+  #include <signal.h>
+#endif
+#if defined(MICRO_LOG_ASYNC) || defined(MICRO_LOG_MMAP)
+  #include <sched.h>
+#endif
+#if defined(MICRO_LOG_MMAP) || defined(MICRO_LOG_IO_URING)   \
+  || (defined(MICRO_LOG_SOCKETS) && defined(__linux__))
+  #include <sys/mman.h>
+#endif
+#if defined(MICRO_LOG_KERNEL_TID) || defined(MICRO_LOG_IO_URING)
+  #include <sys/syscall.h>
+#endif
+#ifdef MICRO_LOG_IO_URING
+  #include <linux/io_uring.h>
+#endif
+
+#ifdef MICRO_LOG_SOCKETS
+  #ifdef _WIN32
+    // Windows
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+    #define close_socket(s) closesocket(s)
+    #pragma comment(lib, "ws2_32.lib")  // link against Winsock library
+    #define dprintf(...) assert(false); // TODO
+    #define vdprintf(...) assert(false); // TODO
+    #error "TODO Support for windows internet sockets"
+  #else
+    // POSIX (Linux, macOS, BSD, etc.)
+    #include <sys/types.h>
+    #include <sys/socket.h>
+    #include <netinet/in.h>
+    #include <arpa/inet.h>
+    #include <unistd.h>
+    #include <sys/un.h>
+    #include <fcntl.h>
+    #include <poll.h>
+    #define close_socket(s) close(s)
+  #endif // _WIN32
+#endif // MICRO_LOG_SOCKETS
+
+  
+#ifdef MICRO_LOG_STATS
+
+// Nanoseconds of CLOCK_MONOTONIC, for the durations in MicroLogStats
+static inline int64_t _micro_log_stats_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Count a write of [len] bytes to the output [out] that started at
+// [start], in nanoseconds of `_micro_log_stats_now`
+static inline void
+_micro_log_stats_write(MicroLog *micro_log,
+                       long unsigned int out,
+                       size_t len,
+                       int64_t start,
+                       micro_log_error error)
+{
+  int index = __builtin_ctzl(out);
+  if (error == MICRO_LOG_OK)
+    __atomic_add_fetch(&micro_log->stats.bytes[index], len,
+                       __ATOMIC_RELAXED);
+  else
+    __atomic_add_fetch(&micro_log->stats.errors[index], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&micro_log->stats.io_ns[index],
+                     (uint64_t) (_micro_log_stats_now() - start),
+                     __ATOMIC_RELAXED);
+}
+
+#define _MICRO_LOG_STATS_ADD(micro_log, counter, n)                     \
+  (void) __atomic_add_fetch(&(micro_log)->stats.counter, (n),           \
+                            __ATOMIC_RELAXED)
+// Declares [start], the time a write begins
+#define _MICRO_LOG_STATS_START(start)                                   \
+  int64_t start = _micro_log_stats_now()
+#define _MICRO_LOG_STATS_WRITE(micro_log, out, len, start, error)       \
+  _micro_log_stats_write(micro_log, out, len, start, error)
+
+#else
+
+#define _MICRO_LOG_STATS_ADD(micro_log, counter, n) ((void) 0)
+#define _MICRO_LOG_STATS_START(start) ((void) 0)
+#define _MICRO_LOG_STATS_WRITE(micro_log, out, len, start, error) ((void) 0)
+
+#endif // MICRO_LOG_STATS
+
+#ifdef MICRO_LOG_MULTITHREADED
+
+#ifdef MICRO_LOG_STATS
+
+// Lock the write mutex of [micro_log], counting how many times it is
+// busy and for how long it is held
+static inline int _micro_log_write_lock(MicroLog *micro_log)
+{
+  if (pthread_mutex_trylock(&micro_log->write_mutex) != 0)
+  {
+    __atomic_add_fetch(&micro_log->stats.lock_contended, 1,
+                       __ATOMIC_RELAXED);
+    int ret = pthread_mutex_lock(&micro_log->write_mutex);
+    if (ret != 0)
+      return ret;
+  }
+  micro_log->locked_at = _micro_log_stats_now();
+  return 0;
+}
+
+static inline int _micro_log_write_unlock(MicroLog *micro_log)
+{
+  __atomic_add_fetch(&micro_log->stats.lock_ns,
+                     (uint64_t) (_micro_log_stats_now() - micro_log->locked_at),
+                     __ATOMIC_RELAXED);
+  return pthread_mutex_unlock(&micro_log->write_mutex);
+}
+
+#else
+
+#define _micro_log_write_lock(micro_log)                \
+  pthread_mutex_lock(&(micro_log)->write_mutex)
+#define _micro_log_write_unlock(micro_log)              \
+  pthread_mutex_unlock(&(micro_log)->write_mutex)
+
+#endif // MICRO_LOG_STATS
+
+#define __MICRO_LOG_LOCK(__micro_log_ptr)                   \
   do {                                                      \
-    if (pthread_mutex_lock(&__micro_log_ptr->write_mutex) != 0) \
+    if (_micro_log_write_lock(__micro_log_ptr) != 0)        \
     {                                                       \
       error = MICRO_LOG_ERROR_MUTEX_LOCK;                   \
       goto done;                                            \
     }                                                       \
   } while (0)
-#define __MICRO_LOG_UNLOCK(__micro_log_ptr)                   \
+#define __MICRO_LOG_UNLOCK(__micro_log_ptr)                   \
+  do {                                                        \
+    if (_micro_log_write_unlock(__micro_log_ptr) != 0)        \
+    {                                                         \
+      error = MICRO_LOG_ERROR_MUTEX_UNLOCK;                   \
+      goto done;                                              \
+    }                                                         \
+  } while(0)
+
+#else
+  
+#define __MICRO_LOG_LOCK(__micro_log_ptr) ;
+#define __MICRO_LOG_UNLOCK(__micro_log_ptr) ;
+
+#endif // MICRO_LOG_MULTITHREADED
+
+//
+// Number formatting
+//
+// The numbers in the metadata of a record are written by hand
+// instead of going through printf, two digits at a time. These do
+// not allocate nor lock, so they can be used in a signal handler.
+//
+
+// The decimal digits of the numbers from 0 to 99
+static const char _micro_log_digits[200] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+// Write the two digits of [value], less than 100, in [out]
+MICRO_LOG_DEF void _micro_log_format_2digits(char *out, unsigned int value)
+{
+  memcpy(out, &_micro_log_digits[2 * value], 2);
+}
+
+// Write [value] in decimal in [out], padded with zeros to [width]
+// digits, and return the number of digits
+//
+// [out] must have room for at least 20 characters and [width].
+MICRO_LOG_DEF int _micro_log_format_uint(char *out, uint64_t value, int width)
+{
+  int digits = 1;
+  for (uint64_t rest = value; rest >= 10; rest /= 10)
+    digits++;
+  int len = digits > width ? digits : width;
+  memset(out, '0', (size_t) (len - digits));
+
+  // Written from the last digit
+  char *end = out + len;
+  while (value >= 100)
+  {
+    end -= 2;
+    _micro_log_format_2digits(end, (unsigned int) (value % 100));
+    value /= 100;
+  }
+  if (value >= 10)
+    _micro_log_format_2digits(end - 2, (unsigned int) value);
+  else
+    end[-1] = (char) ('0' + value);
+  return len;
+}
+
+// Write [value] in decimal in [out], with its sign, and return the
+// number of characters
+MICRO_LOG_DEF int _micro_log_format_int(char *out, int64_t value)
+{
+  if (value < 0)
+  {
+    out[0] = '-';
+    return 1 + _micro_log_format_uint(out + 1, 0 - (uint64_t) value, 0);
+  }
+  return _micro_log_format_uint(out, (uint64_t) value, 0);
+}
+
+// Write [year]-[month]-[day] in [out] and return the number of
+// characters
+MICRO_LOG_DEF int _micro_log_format_date(char *out, const struct tm *tm)
+{
+  int len = _micro_log_format_int(out, (int64_t) tm->tm_year + 1900);
+  out[len] = '-';
+  _micro_log_format_2digits(out + len + 1, (unsigned int) tm->tm_mon + 1);
+  out[len + 3] = '-';
+  _micro_log_format_2digits(out + len + 4, (unsigned int) tm->tm_mday);
+  return len + 6;
+}
+
+// Write [hours]:[minutes]:[seconds] in [out], always 8 characters
+MICRO_LOG_DEF int _micro_log_format_time(char *out, const struct tm *tm)
+{
+  _micro_log_format_2digits(out, (unsigned int) tm->tm_hour);
+  out[2] = ':';
+  _micro_log_format_2digits(out + 3, (unsigned int) tm->tm_min);
+  out[5] = ':';
+  // tm_sec is 60 on a leap second
+  _micro_log_format_2digits(out + 6, (unsigned int) tm->tm_sec);
+  return 8;
+}
+
+// A process or thread id, with its rendered string
+typedef struct {
+  long id;
+  char str[24];
+  int len;
+  // Number of forks when [id] was read
+  unsigned long forks;
+} _MicroLogId;
+
+// Process id, refreshed in the child after a fork
+static _MicroLogId _micro_log_pid_cache;
+// Number of times the process forked since the first logger was
+// initialized
+static unsigned long _micro_log_forks;
+static pthread_once_t _micro_log_fork_once = PTHREAD_ONCE_INIT;
+
+MICRO_LOG_DEF void _micro_log_id_set(_MicroLogId *id, long value)
+{
+  id->id = value;
+  id->len = _micro_log_format_int(id->str, (int64_t) value);
+}
+
+MICRO_LOG_DEF void _micro_log_fork_child(void)
+{
+  // Only the forking thread exists in the child
+  _micro_log_forks++;
+  _micro_log_id_set(&_micro_log_pid_cache, (long) getpid());
+}
+
+MICRO_LOG_DEF void _micro_log_fork_register(void)
+{
+  _micro_log_id_set(&_micro_log_pid_cache, (long) getpid());
+  pthread_atfork(NULL, NULL, _micro_log_fork_child);
+}
+
+// Get the cached process id
+MICRO_LOG_DEF const _MicroLogId *_micro_log_pid(void)
+{
+  pthread_once(&_micro_log_fork_once, _micro_log_fork_register);
+  return &_micro_log_pid_cache;
+}
+
+// Get the cached id of the calling thread
+MICRO_LOG_DEF const _MicroLogId *_micro_log_tid(void)
+{
+  static _MICRO_LOG_THREAD_LOCAL _MicroLogId tid;
+  static _MICRO_LOG_THREAD_LOCAL bool tid_valid = false;
+
+  // The kernel gives a new id to the thread that forked
+  if (!tid_valid || tid.forks != _micro_log_forks)
+  {
+    #ifdef MICRO_LOG_KERNEL_TID
+    _micro_log_id_set(&tid, (long) syscall(SYS_gettid));
+    #else
+    _micro_log_id_set(&tid, (long) pthread_self());
+    #endif
+    tid.forks = _micro_log_forks;
+    tid_valid = true;
+  }
+  return &tid;
+}
+
+// Milliseconds of CLOCK_MONOTONIC, as cheap as possible
+MICRO_LOG_DEF int64_t _micro_log_monotonic_ms(void)
+{
+  struct timespec now;
+  #ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  #else
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  #endif
+  return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+#ifdef MICRO_LOG_ASYNC
+MICRO_LOG_DEF micro_log_error
+_micro_log_async_push(MicroLog *micro_log,
+                      const MicroLogRecord *record,
+                      const char *fmt,
+                      va_list args);
+MICRO_LOG_DEF void
+_micro_log_async_push_text(MicroLog *micro_log,
+                           const MicroLogRecord *record,
+                           const char *text,
+                           size_t len,
+                           size_t msg_begin,
+                           size_t msg_len);
+MICRO_LOG_DEF void _micro_log_async_wait(MicroLog *micro_log);
+MICRO_LOG_DEF micro_log_error _micro_log_async_stop(MicroLog *micro_log);
+#endif // MICRO_LOG_ASYNC
+
+#ifdef MICRO_LOG_IO_URING
+MICRO_LOG_DEF micro_log_error
+_micro_log_io_uring_append(MicroLog *micro_log,
+                           int index,
+                           int fd,
+                           const char *buf,
+                           size_t len);
+MICRO_LOG_DEF micro_log_error _micro_log_io_uring_submit(MicroLog *micro_log);
+#endif // MICRO_LOG_IO_URING
+
+#ifdef MICRO_LOG_THREAD_BUFFER
+MICRO_LOG_DEF micro_log_error
+_micro_log_thread_buffer_flush_all(MicroLog *micro_log, bool detach);
+MICRO_LOG_DEF micro_log_error
+_micro_log_thread_flusher_stop(MicroLog *micro_log);
+#endif // MICRO_LOG_THREAD_BUFFER
+
+#ifdef MICRO_LOG_SOCKETS
+MICRO_LOG_DEF void _micro_log_socket_init(MicroLogSocket *sock);
+MICRO_LOG_DEF int _micro_log_socket_close(MicroLogSocket *sock);
+MICRO_LOG_DEF int
+_micro_log_socket_open(MicroLogSocket *sock,
+                       int type,
+                       const struct sockaddr *addr,
+                       socklen_t addr_len);
+MICRO_LOG_DEF void
+_micro_log_socket_state(const MicroLogSocket *sock,
+                        MicroLogSocketState *state);
+MICRO_LOG_DEF void _micro_log_socket_resume(MicroLogSocket *sock);
+#endif // MICRO_LOG_SOCKETS
+
+MICRO_LOG_DEF micro_log_error
+_micro_log_write_sync(MicroLog *micro_log,
+                      const MicroLogRecord *record,
+                      const char *fmt,
+                      va_list args);
+
+MICRO_LOG_DEF void
+_micro_log_report(MicroLog *micro_log,
+                  MicroLogLevel level,
+                  const char *fmt, ...);
+
+#ifdef MICRO_LOG_STATS
+MICRO_LOG_DEF void _micro_log_stats_report(MicroLog *micro_log);
+#endif
+
+MICRO_LOG_DEF micro_log_error
+_micro_log_write_record(MicroLog *micro_log,
+                        MicroLogLevel level,
+                        MicroLogLevel min,
+                        unsigned int sample_rate,
+                        const char* file,
+                        int line,
+                        const char *fmt,
+                        va_list args);
+
+MICRO_LOG_DEF bool
+_micro_log_collapse(MicroLog *micro_log,
+                    const MicroLogRecord *record,
+                    const char *fmt,
+                    va_list args);
+
+MICRO_LOG_DEF bool
+_micro_log_collapse_packed(MicroLog *micro_log,
+                           const MicroLogRecord *record,
+                           const char *fmt,
+                           bool packed,
+                           const char *args_data,
+                           size_t args_len);
+
+MICRO_LOG_DEF micro_log_error _micro_log_collapse_flush(MicroLog *micro_log);
+
+#ifdef MICRO_LOG_FLIGHT_RECORDER
+MICRO_LOG_DEF micro_log_error
+_micro_log_flight_push(MicroLog *micro_log,
+                       const MicroLogRecord *record,
+                       const char *fmt,
+                       va_list args);
+
+MICRO_LOG_DEF void
+_micro_log_flight_push_text(MicroLog *micro_log,
+                            const MicroLogRecord *record,
+                            const char *text,
+                            size_t len,
+                            size_t msg_begin,
+                            size_t msg_len);
+
+MICRO_LOG_DEF micro_log_error _micro_log_flight_dump(MicroLog *micro_log);
+
+MICRO_LOG_DEF void _micro_log_flight_free(MicroLog *micro_log);
+#endif // MICRO_LOG_FLIGHT_RECORDER
+
+MICRO_LOG_DEF micro_log_error
+_micro_log_set_file_mode(MicroLog *micro_log,
+                         char *filename,
+                         const char *mode);
+
+MICRO_LOG_DEF micro_log_error
+_micro_log_file_write(MicroLog *micro_log, const char *buf, size_t len);
+
+#ifdef MICRO_LOG_MULTITHREADED
+MICRO_LOG_DEF micro_log_error _micro_log_watch_stop(MicroLog *micro_log);
+MICRO_LOG_DEF micro_log_error _micro_log_rotator_stop(MicroLog *micro_log);
+#endif // MICRO_LOG_MULTITHREADED
+
+#ifndef _WIN32
+MICRO_LOG_DEF void _micro_log_crash_forget(MicroLog *micro_log);
+#endif // _WIN32
+
+#ifdef MICRO_LOG_MMAP
+MICRO_LOG_DEF void _micro_log_mmap_sync(MicroLog *micro_log);
+MICRO_LOG_DEF micro_log_error _micro_log_mmap_stop(MicroLog *micro_log);
+#endif // MICRO_LOG_MMAP
+
+MicroLog micro_log_global;
+
+//
+// Categories
+//
+// The names of the categories are shared by all the loggers, each
+// name gets a slot the first time it is used, either by a record or
+// by `micro_log_set_category_level2`. Each logger keeps the level of
+// every slot.
+//
+
+char _micro_log_category_names[MICRO_LOG_CATEGORY_MAX]
+                              [MICRO_LOG_CATEGORY_NAME_SIZE];
+int _micro_log_category_count;
+#ifdef MICRO_LOG_MULTITHREADED
+pthread_mutex_t _micro_log_category_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// Find the slot of the category [name] of length [len], or give it
+// a new one
+//
+// Returns MICRO_LOG_CATEGORY_MAX if there is no slot left or if the
+// name is too long.
+MICRO_LOG_DEF int _micro_log_category_slot(const char *name, size_t len)
+{
+  if (len == 0 || len >= MICRO_LOG_CATEGORY_NAME_SIZE)
+    return MICRO_LOG_CATEGORY_MAX;
+
+  #ifdef MICRO_LOG_MULTITHREADED
+  pthread_mutex_lock(&_micro_log_category_mutex);
+  #endif
+
+  int slot;
+  for (slot = 0; slot < _micro_log_category_count; ++slot)
+  {
+    if (strncmp(_micro_log_category_names[slot], name, len) == 0
+        && _micro_log_category_names[slot][len] == '\0')
+      break;
+  }
+  if (slot == _micro_log_category_count && slot < MICRO_LOG_CATEGORY_MAX)
+  {
+    memcpy(_micro_log_category_names[slot], name, len);
+    _micro_log_category_names[slot][len] = '\0';
+    _micro_log_category_count++;
+  }
+
+  #ifdef MICRO_LOG_MULTITHREADED
+  pthread_mutex_unlock(&_micro_log_category_mutex);
+  #endif
+  return slot;
+}
+
+MICRO_LOG_DEF int _micro_log_category_resolve(MicroLogCategory *category)
+{
+  int slot = _micro_log_category_slot(category->name,
+                                      strlen(category->name));
+  _MICRO_LOG_STORE(category->slot, slot);
+  return slot;
+}
+
+MICRO_LOG_DEF micro_log_error micro_log_init(void)
+{
+  return micro_log_init2(&micro_log_global);
+}
+
+#ifdef MICRO_LOG_ASYNC
+MICRO_LOG_DEF micro_log_error micro_log_init_async(size_t capacity)
+{
+  return micro_log_init_async2(&micro_log_global, capacity);
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_overflow(MicroLogOverflow policy, MicroLogLevel level)
+{
+  return micro_log_set_overflow2(&micro_log_global, policy, level);
+}
+
+MICRO_LOG_DEF micro_log_error micro_log_get_dropped(size_t *dropped)
+{
+  return micro_log_get_dropped2(&micro_log_global, dropped);
+}
+#endif // MICRO_LOG_ASYNC
+
+MICRO_LOG_DEF micro_log_error micro_log_from_file(char *filename)
+{
+  return micro_log_from_file2(&micro_log_global, filename);
+}
+
+#ifdef MICRO_LOG_MULTITHREADED
+MICRO_LOG_DEF micro_log_error micro_log_watch_file(const char *filename)
+{
+  return micro_log_watch_file2(&micro_log_global, filename);
+}
+#endif // MICRO_LOG_MULTITHREADED
+
+#ifndef _WIN32
+MICRO_LOG_DEF micro_log_error micro_log_install_crash_handler(void)
+{
+  return micro_log_install_crash_handler2(&micro_log_global);
+}
+#endif // _WIN32
+
+MICRO_LOG_DEF micro_log_error micro_log_close(void)
+{
+  return micro_log_close2(&micro_log_global);
+}
+
+MICRO_LOG_DEF micro_log_error micro_log_flush(void)
+{
+  return micro_log_flush2(&micro_log_global);
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_flags(long unsigned int flags_bitfield)
+{
+  return micro_log_set_flags2(&micro_log_global, flags_bitfield);
+}
+
+MICRO_LOG_DEF micro_log_error micro_log_set_level(MicroLogLevel level)
+{
+  return micro_log_set_level2(&micro_log_global, level);
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_category_level(const char *name, MicroLogLevel level)
+{
+  return micro_log_set_category_level2(&micro_log_global, name, level);
+}
+
+MICRO_LOG_DEF micro_log_error micro_log_set_out(int out_flags)
+{
+  return micro_log_set_out2(&micro_log_global, out_flags);
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_encoding(int out_flags, MicroLogEncoding encoding)
+{
+  return micro_log_set_encoding2(&micro_log_global, out_flags, encoding);
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_framing(int out_flags, MicroLogFraming framing)
+{
+  return micro_log_set_framing2(&micro_log_global, out_flags, framing);
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_out_level(int out_flags, MicroLogLevel level)
+{
+  return micro_log_set_out_level2(&micro_log_global, out_flags, level);
+}
+
+MICRO_LOG_DEF micro_log_error micro_log_add_sink(const MicroLogSink *sink)
+{
+  return micro_log_add_sink2(&micro_log_global, sink);
+}
+
+MICRO_LOG_DEF micro_log_error micro_log_set_file(char* filename)
+{
+  return micro_log_set_file2(&micro_log_global, filename);
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_file_rotation(const MicroLogRotation *rotation)
+{
+  return micro_log_set_file_rotation2(&micro_log_global, rotation);
+}
+
+MICRO_LOG_DEF micro_log_error micro_log_rotate_file(void)
+{
+  return micro_log_rotate_file2(&micro_log_global);
+}
+
+MICRO_LOG_DEF micro_log_error micro_log_set_binary_file(char* filename)
+{
+  return micro_log_set_binary_file2(&micro_log_global, filename);
+}
+
+#ifdef MICRO_LOG_MMAP
+MICRO_LOG_DEF micro_log_error micro_log_set_mmap_file(char* filename)
+{
+  return micro_log_set_mmap_file2(&micro_log_global, filename);
+}
+#endif // MICRO_LOG_MMAP
+
+#ifdef MICRO_LOG_FLIGHT_RECORDER
+MICRO_LOG_DEF micro_log_error
+micro_log_set_flight_recorder(MicroLogLevel level,
+                              MicroLogLevel trigger,
+                              size_t capacity)
+{
+  return micro_log_set_flight_recorder2(&micro_log_global, level,
+                                        trigger, capacity);
+}
+#endif // MICRO_LOG_FLIGHT_RECORDER
+
+MICRO_LOG_DEF micro_log_error micro_log_set_collapse(bool enabled)
+{
+  return micro_log_set_collapse2(&micro_log_global, enabled);
+}
+
+MICRO_LOG_DEF micro_log_error micro_log_get_suppressed(size_t *suppressed)
+{
+  return micro_log_get_suppressed2(&micro_log_global, suppressed);
+}
+
+#ifdef MICRO_LOG_STATS
+
+MICRO_LOG_DEF micro_log_error micro_log_get_stats(MicroLogStats *stats)
+{
+  return micro_log_get_stats2(&micro_log_global, stats);
+}
+
+MICRO_LOG_DEF micro_log_error micro_log_set_stats_interval(int seconds)
+{
+  return micro_log_set_stats_interval2(&micro_log_global, seconds);
+}
+
+#endif // MICRO_LOG_STATS
+
+#ifdef MICRO_LOG_SOCKETS
+MICRO_LOG_DEF micro_log_error
+micro_log_set_socket_inet(char* addr,
+                          int port,
+                          MicroLogProto protocol)
+{
+  return micro_log_set_socket_inet2(&micro_log_global, addr, port, protocol);
+}
+
+#if defined(__unix__) || defined(__unix)
+
+MICRO_LOG_DEF micro_log_error micro_log_set_socket_unix(char* path)
+{
+  return micro_log_set_socket_unix2(&micro_log_global, path);
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_add_syslog(char* path, MicroLogLevel level)
+{
+  return micro_log_add_syslog2(&micro_log_global, path, level);
+}
+
+#ifdef __linux__
+
+MICRO_LOG_DEF micro_log_error micro_log_add_journald(MicroLogLevel level)
+{
+  return micro_log_add_journald2(&micro_log_global, level);
+}
+
+#endif // __linux__
+
+#endif // __unix__
+
+MICRO_LOG_DEF micro_log_error
+micro_log_get_socket_state(int out, MicroLogSocketState *state)
+{
+  return micro_log_get_socket_state2(&micro_log_global, out, state);
+}
+
+#endif // MICRO_LOG_SOCKETS
+
+MICRO_LOG_DEF micro_log_error micro_log_init2(MicroLog *micro_log)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+
+  *micro_log = (MicroLog){
+    .log_level = MICRO_LOG_LEVEL_TRACE,
+    .flags_bitfield = _MICRO_LOG_FLAGS(0),
+    .out_bitfield = MICRO_LOG_OUT_STDOUT,
+    .file = NULL,
+  };
+
+  for (int i = 0; i <= MICRO_LOG_CATEGORY_MAX; ++i)
+    micro_log->category_levels[i] = MICRO_LOG_LEVEL_INHERIT;
+
+  #ifdef MICRO_LOG_SOCKETS
+  _micro_log_socket_init(&micro_log->inet_sock);
+  #if defined(__unix__) || defined(__unix)
+  _micro_log_socket_init(&micro_log->unix_sock);
+  #endif // __unix__
+  #endif // MICRO_LOG_SOCKETS
+
+  #ifdef MICRO_LOG_MULTITHREADED
+  pthread_mutex_init(&micro_log->write_mutex, NULL);
+  #endif
+  #ifdef MICRO_LOG_THREAD_BUFFER
+  pthread_mutex_init(&micro_log->thread_buffers_mutex, NULL);
+  #endif
+  #ifdef MICRO_LOG_MULTITHREADED
+  pthread_mutex_init(&micro_log->collapse.mutex, NULL);
+  #endif
+  #ifdef MICRO_LOG_FLIGHT_RECORDER
+  micro_log->flight.level = MICRO_LOG_LEVEL_DISABLED;
+  micro_log->flight.trigger = MICRO_LOG_LEVEL_DISABLED;
+  #ifdef MICRO_LOG_MULTITHREADED
+  pthread_mutex_init(&micro_log->flight.mutex, NULL);
+  #endif
+  #endif // MICRO_LOG_FLIGHT_RECORDER
+
+  clock_gettime(CLOCK_MONOTONIC, &micro_log->mono_base);
+  (void) _micro_log_pid();
+
+  micro_log_info2(micro_log, "Logger initialized");
+  return MICRO_LOG_OK;
+}
+
+MICRO_LOG_DEF int _micro_log_get_spaces(char* str, int max)
+{
+  int spaces = 0;
+  while((*(str + spaces) == ' ' || *(str + spaces) == '\t') && spaces < max)
+    spaces++;
+  return spaces;
+}
+
+MICRO_LOG_DEF int _micro_log_get_word_len(char* str, int max)
+{
+  int letters = 0;
+  while(*(str+letters) != ' '
+        && *(str+letters) != '\n'
+        && *(str+letters) != '\t'
+        && letters < max)
+    letters++;
+  return letters;
+}
+
+// Parse a level name like "debug" at the start of [str]
+//
+// Returns the length of the name, or 0 if it is not a level.
+MICRO_LOG_DEF int _micro_log_parse_level(char* str, MicroLogLevel *level)
+{
+  static const struct {
+    const char *name;
+    MicroLogLevel level;
+  } levels[] = {
+    { "trace",    MICRO_LOG_LEVEL_TRACE    },
+    { "debug",    MICRO_LOG_LEVEL_DEBUG    },
+    { "info",     MICRO_LOG_LEVEL_INFO     },
+    { "warn",     MICRO_LOG_LEVEL_WARN     },
+    { "error",    MICRO_LOG_LEVEL_ERROR    },
+    { "fatal",    MICRO_LOG_LEVEL_FATAL    },
+    { "disabled", MICRO_LOG_LEVEL_DISABLED },
+  };
+
+  for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); ++i)
+  {
+    int name_len = (int) strlen(levels[i].name);
+    if (strncmp(str, levels[i].name, name_len) == 0)
+    {
+      *level = levels[i].level;
+      return name_len;
+    }
+  }
+  return 0;
+}
+
+// Parse a list of flag names separated by spaces, like
+// "level date time", until the end of the line
+MICRO_LOG_DEF micro_log_error
+_micro_log_parse_flags(char* str, long unsigned int *flags)
+{
+  static const struct {
+    const char *name;
+    long unsigned int flag;
+  } names[] = {
+    { "level", MICRO_LOG_FLAG_LEVEL },
+    { "date",  MICRO_LOG_FLAG_DATE  },
+    { "time",  MICRO_LOG_FLAG_TIME  },
+    { "pid",   MICRO_LOG_FLAG_PID   },
+    { "tid",   MICRO_LOG_FLAG_TID   },
+    { "json",  MICRO_LOG_FLAG_JSON  },
+    { "color", MICRO_LOG_FLAG_COLOR },
+    { "file",  MICRO_LOG_FLAG_FILE  },
+    { "line",  MICRO_LOG_FLAG_LINE  },
+    { "usec",  MICRO_LOG_FLAG_USEC  },
+    { "nsec",  MICRO_LOG_FLAG_NSEC  },
+    { "mono",  MICRO_LOG_FLAG_MONO  },
+  };
+  const size_t names_count = sizeof(names) / sizeof(names[0]);
+
+  int len = (int) strlen(str);
+  int pos = _micro_log_get_spaces(str, len);
+  *flags = MICRO_LOG_FLAG_NONE;
+  while (pos < len && str[pos] != '\n')
+  {
+    size_t i;
+    for (i = 0; i < names_count; ++i)
+    {
+      int name_len = (int) strlen(names[i].name);
+      if (strncmp(str + pos, names[i].name, name_len) == 0)
+      {
+        *flags |= names[i].flag;
+        pos += name_len;
+        break;
+      }
+    }
+    if (i == names_count)
+      return MICRO_LOG_ERROR_UNKNOWN_FLAG;
+
+    pos += _micro_log_get_spaces(str + pos, len - pos);
+  }
+  return MICRO_LOG_OK;
+}
+
+//
+// Settings file
+//
+// A settings file is first read in a _MicroLogSettings and then
+// applied to the logger, so a file with an error changes nothing.
+// When the file is watched with `micro_log_watch_file2`, only the
+// outputs that changed since the previous settings are opened again.
+//
+
+typedef struct {
+  char name[MICRO_LOG_CATEGORY_NAME_SIZE];
+  MicroLogLevel level;
+} _MicroLogSettingsCategory;
+
+typedef struct {
+  bool has_level;
+  MicroLogLevel level;
+  bool has_flags;
+  long unsigned int flags;
+  _MicroLogSettingsCategory categories[MICRO_LOG_CATEGORY_MAX];
+  int categories_count;
+  // Output files, NULL if not set
+  char *file;
+  MicroLogRotation rotation;
+  char *binary;
+  #ifdef MICRO_LOG_ASYNC
+  bool has_overflow;
+  MicroLogOverflow overflow;
+  MicroLogLevel overflow_level;
+  #endif // MICRO_LOG_ASYNC
+  #ifdef MICRO_LOG_SOCKETS
+  // Inet socket, not set if [inet_addr] is NULL
+  char *inet_addr;
+  int inet_port;
+  MicroLogProto inet_proto;
+  // Unix socket, NULL if not set
+  char *unix_path;
+  #endif // MICRO_LOG_SOCKETS
+} _MicroLogSettings;
+
+// Parse the options of the rotation after the name of the output
+// file, like "rotate=256M rotate=daily keep=10 compress=gzip"
+MICRO_LOG_DEF micro_log_error
+_micro_log_settings_rotation(MicroLogRotation *rotation,
+                             char *line,
+                             int len,
+                             int pos)
+{
+  *rotation = (MicroLogRotation){0};
+  for (;;)
+  {
+    pos += _micro_log_get_spaces(line + pos, len - pos);
+    if (pos >= len)
+      return MICRO_LOG_OK;
+    char *option = line + pos;
+    int option_len = _micro_log_get_word_len(option, len - pos);
+    pos += option_len;
+
+    char *end;
+    if (option_len == 12 && strncmp(option, "rotate=daily", 12) == 0)
+    {
+      rotation->daily = true;
+    }
+    else if (strncmp(option, "rotate=", 7) == 0)
+    {
+      long value = strtol(option + 7, &end, 10);
+      int suffix_len = option_len - (int) (end - option);
+      if (value <= 0 || end == option + 7)
+        return MICRO_LOG_ERROR_INVALID_ROTATION;
+      if (suffix_len == 3 && strncmp(end, "min", 3) == 0)
+        rotation->minutes = (int) value;
+      else if (suffix_len == 0)
+        rotation->max_bytes = (size_t) value;
+      else if (suffix_len == 1 && (*end == 'K' || *end == 'k'))
+        rotation->max_bytes = (size_t) value << 10;
+      else if (suffix_len == 1 && (*end == 'M' || *end == 'm'))
+        rotation->max_bytes = (size_t) value << 20;
+      else if (suffix_len == 1 && (*end == 'G' || *end == 'g'))
+        rotation->max_bytes = (size_t) value << 30;
+      else
+        return MICRO_LOG_ERROR_INVALID_ROTATION;
+    }
+    else if (strncmp(option, "keep=", 5) == 0)
+    {
+      rotation->keep = (int) strtol(option + 5, &end, 10);
+      if (end != option + option_len || end == option + 5
+          || rotation->keep < 0)
+        return MICRO_LOG_ERROR_INVALID_ROTATION;
+    }
+    else if (option_len == 13 && strncmp(option, "compress=gzip", 13) == 0)
+    {
+      rotation->compress = MICRO_LOG_COMPRESS_GZIP;
+    }
+    else if (option_len == 13 && strncmp(option, "compress=zstd", 13) == 0)
+    {
+      rotation->compress = MICRO_LOG_COMPRESS_ZSTD;
+    }
+    else {
+      return MICRO_LOG_ERROR_INVALID_ROTATION;
+    }
+  }
+}
+
+MICRO_LOG_DEF void _micro_log_settings_free(_MicroLogSettings *settings)
+{
+  free(settings->file);
+  free(settings->binary);
+  #ifdef MICRO_LOG_SOCKETS
+  free(settings->inet_addr);
+  free(settings->unix_path);
+  #endif // MICRO_LOG_SOCKETS
+  *settings = (_MicroLogSettings){0};
+}
+
+// Replace [*dst] with a copy of the word at [pos] in [line]
+MICRO_LOG_DEF micro_log_error
+_micro_log_settings_word(char **dst, char *line, int len, int *pos)
+{
+  *pos += _micro_log_get_spaces(line + *pos, len - *pos);
+  int word_len = _micro_log_get_word_len(line + *pos, len - *pos);
+  char *word = malloc(word_len + 1);
+  if (word == NULL)
+    return MICRO_LOG_ERROR_ALLOC;
+  memcpy(word, line + *pos, word_len);
+  word[word_len] = '\0';
+  *pos += word_len;
+
+  free(*dst);
+  *dst = word;
+  return MICRO_LOG_OK;
+}
+
+#ifdef MICRO_LOG_ASYNC
+_Static_assert(_MICRO_LOG_OVERFLOW_MAX == 4,
+               "Updated MicroLogOverflow, should also update _micro_log_settings_line");
+#endif // MICRO_LOG_ASYNC
+// Read a [line] of [len] characters of a settings file, without its
+// end of line
+//
+// Example file:
+//
+// level: debug
+// level.net: trace
+// flags: level date time tid pid
+// file: output.txt rotate=256M keep=10
+// inet: 127.0.0.1 5000 tcp
+// unix: /tmp/a-socket
+// # A comment
+//
+MICRO_LOG_DEF micro_log_error
+_micro_log_settings_line(_MicroLogSettings *settings, char *line, int len)
+{
+  micro_log_error error = MICRO_LOG_OK;
+  int pos;
+
+  if (len == 0 || line[0] == '#')
+  {
+    return MICRO_LOG_OK;
+  }
+  if (strncmp(line, "level:", 6) == 0)
+  {
+    pos = 6;
+    pos += _micro_log_get_spaces(line + pos, len - pos);
+    if (_micro_log_parse_level(line + pos, &settings->level) == 0)
+      return MICRO_LOG_ERROR_UNKNOWN_LEVEL;
+    settings->has_level = true;
+  }
+  else if (strncmp(line, "level.", 6) == 0)
+  {
+    pos = 6;
+    while (pos < len && line[pos] != ':' && line[pos] != ' ')
+      pos++;
+    int name_len = pos - 6;
+    if (line[pos] != ':' || name_len == 0
+        || name_len >= MICRO_LOG_CATEGORY_NAME_SIZE
+        || settings->categories_count == MICRO_LOG_CATEGORY_MAX)
+      return MICRO_LOG_ERROR_INVALID_CATEGORY;
+
+    _MicroLogSettingsCategory *category =
+      &settings->categories[settings->categories_count];
+    pos++;
+    pos += _micro_log_get_spaces(line + pos, len - pos);
+    if (_micro_log_parse_level(line + pos, &category->level) == 0)
+      return MICRO_LOG_ERROR_UNKNOWN_LEVEL;
+    memcpy(category->name, line + 6, name_len);
+    category->name[name_len] = '\0';
+    settings->categories_count++;
+  }
+  else if (strncmp(line, "flags:", 6) == 0)
+  {
+    error = _micro_log_parse_flags(line + 6, &settings->flags);
+    if (error != MICRO_LOG_OK)
+      return error;
+    settings->has_flags = true;
+  }
+  else if (strncmp(line, "file:", 5) == 0)
+  {
+    pos = 5;
+    error = _micro_log_settings_word(&settings->file, line, len, &pos);
+    if (error == MICRO_LOG_OK)
+      error = _micro_log_settings_rotation(&settings->rotation,
+                                           line, len, pos);
+  }
+  else if (strncmp(line, "binary:", 7) == 0)
+  {
+    pos = 7;
+    error = _micro_log_settings_word(&settings->binary, line, len, &pos);
+  }
+  #ifdef MICRO_LOG_ASYNC
+  else if (strncmp(line, "overflow:", 9) == 0)
+  {
+    pos = 9;
+    settings->overflow_level = MICRO_LOG_LEVEL_TRACE;
+    pos += _micro_log_get_spaces(line + pos, len - pos);
+
+    if (strncmp(line + pos, "block", 5) == 0)
+    {
+      settings->overflow = MICRO_LOG_OVERFLOW_BLOCK;
+    }
+    else if (strncmp(line + pos, "drop-newest", 11) == 0)
+    {
+      settings->overflow = MICRO_LOG_OVERFLOW_DROP_NEWEST;
+    }
+    else if (strncmp(line + pos, "drop-oldest", 11) == 0)
+    {
+      settings->overflow = MICRO_LOG_OVERFLOW_DROP_OLDEST;
+    }
+    else if (strncmp(line + pos, "drop-below", 10) == 0)
+    {
+      settings->overflow = MICRO_LOG_OVERFLOW_DROP_BELOW;
+      pos += 10;
+      pos += _micro_log_get_spaces(line + pos, len - pos);
+      if (_micro_log_parse_level(line + pos, &settings->overflow_level) == 0)
+        return MICRO_LOG_ERROR_UNKNOWN_LEVEL;
+    }
+    else {
+      return MICRO_LOG_ERROR_UNKNOWN_OVERFLOW;
+    }
+    settings->has_overflow = true;
+  }
+  #endif // MICRO_LOG_ASYNC
+  #ifdef MICRO_LOG_SOCKETS
+  else if (strncmp(line, "inet:", 5) == 0)
+  {
+    char *port = NULL;
+    char *proto = NULL;
+    pos = 5;
+    error = _micro_log_settings_word(&settings->inet_addr, line, len, &pos);
+    if (error == MICRO_LOG_OK)
+      error = _micro_log_settings_word(&port, line, len, &pos);
+    if (error == MICRO_LOG_OK)
+      error = _micro_log_settings_word(&proto, line, len, &pos);
+
+    if (error == MICRO_LOG_OK && settings->inet_addr[0] == '\0')
+      error = MICRO_LOG_ERROR_INVALID_INET_ADDR;
+    if (error == MICRO_LOG_OK)
+    {
+      settings->inet_port = atoi(port);
+      if (settings->inet_port <= 0 || settings->inet_port > 65535)
+        error = MICRO_LOG_ERROR_INVALID_PORT;
+    }
+    if (error == MICRO_LOG_OK)
+    {
+      if (strcmp(proto, "tcp") == 0)
+        settings->inet_proto = MICRO_LOG_PROTO_TCP;
+      else if (strcmp(proto, "udp") == 0)
+        settings->inet_proto = MICRO_LOG_PROTO_UDP;
+      else
+        error = MICRO_LOG_ERROR_INVALID_PROTOCOL;
+    }
+    free(port);
+    free(proto);
+  }
+  #if defined(__unix__) || defined(__unix)
+  else if (strncmp(line, "unix:", 5) == 0)
+  {
+    pos = 5;
+    error = _micro_log_settings_word(&settings->unix_path, line, len, &pos);
+  }
+  #endif // __unix__
+  #endif // MICRO_LOG_SOCKETS
+  else {
+    return MICRO_LOG_ERROR_INVALID_FILE_SETTING;
+  }
+
+  return error;
+}
+
+MICRO_LOG_DEF micro_log_error
+_micro_log_settings_read(_MicroLogSettings *settings, const char *filename)
+{
+  *settings = (_MicroLogSettings){0};
+
+  FILE* file = fopen(filename, "r");
+  if (file == NULL)
+  {
+    perror("Error opening file");
+    return MICRO_LOG_ERROR_OPEN_FILE;
+  }
+
+  micro_log_error error = MICRO_LOG_OK;
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  while (error == MICRO_LOG_OK && (len = getline(&line, &cap, file)) >= 0)
+  {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+    error = _micro_log_settings_line(settings, line, (int) len);
+  }
+  free(line);
+
+  if (fclose(file) != 0 && error == MICRO_LOG_OK)
+    error = MICRO_LOG_ERROR_CLOSE_FILE;
+  if (error != MICRO_LOG_OK)
+    _micro_log_settings_free(settings);
+  return error;
+}
+
+// Whether the strings [a] and [b] are both NULL or equal
+MICRO_LOG_DEF bool _micro_log_settings_same(const char *a, const char *b)
+{
+  return (a == NULL || b == NULL) ? a == b : strcmp(a, b) == 0;
+}
+
+MICRO_LOG_DEF bool _micro_log_rotation_same(const MicroLogRotation *a,
+                                            const MicroLogRotation *b)
+{
+  return a->max_bytes == b->max_bytes && a->minutes == b->minutes
+    && a->daily == b->daily && a->keep == b->keep
+    && a->compress == b->compress;
+}
+
+// Apply [settings] to [micro_log], [old] are the settings applied
+// before from the same file or NULL
+//
+// The outputs that are the same as in [old] are left untouched,
+// and the records already logged are written to the old outputs
+// before the new ones are swapped in. The output file is opened in
+// append mode, so reading the settings again does not truncate it.
+MICRO_LOG_DEF micro_log_error
+_micro_log_settings_apply(MicroLog *micro_log,
+                          const _MicroLogSettings *settings,
+                          const _MicroLogSettings *old)
+{
+  micro_log_error error = micro_log_flush2(micro_log);
+  if (error != MICRO_LOG_OK)
+    return error;
+
+  if (settings->file != NULL
+      && (old == NULL || !_micro_log_settings_same(settings->file, old->file)))
+  {
+    error = _micro_log_set_file_mode(micro_log, settings->file, "a");
+    if (error != MICRO_LOG_OK)
+      return error;
+  }
+  if (settings->file != NULL
+      && (old == NULL
+          || !_micro_log_rotation_same(&settings->rotation,
+                                       &old->rotation)))
+  {
+    error = micro_log_set_file_rotation2(micro_log, &settings->rotation);
+    if (error != MICRO_LOG_OK)
+      return error;
+  }
+  if (settings->binary != NULL
+      && (old == NULL
+          || !_micro_log_settings_same(settings->binary, old->binary)))
+  {
+    error = micro_log_set_binary_file2(micro_log, settings->binary);
+    if (error != MICRO_LOG_OK)
+      return error;
+  }
+  #ifdef MICRO_LOG_SOCKETS
+  if (settings->inet_addr != NULL
+      && (old == NULL
+          || !_micro_log_settings_same(settings->inet_addr, old->inet_addr)
+          || settings->inet_port != old->inet_port
+          || settings->inet_proto != old->inet_proto))
+  {
+    error = micro_log_set_socket_inet2(micro_log, settings->inet_addr,
+                                       settings->inet_port,
+                                       settings->inet_proto);
+    if (error != MICRO_LOG_OK)
+      return error;
+  }
+  #if defined(__unix__) || defined(__unix)
+  if (settings->unix_path != NULL
+      && (old == NULL
+          || !_micro_log_settings_same(settings->unix_path, old->unix_path)))
+  {
+    error = micro_log_set_socket_unix2(micro_log, settings->unix_path);
+    if (error != MICRO_LOG_OK)
+      return error;
+  }
+  #endif // __unix__
+  #endif // MICRO_LOG_SOCKETS
+  #ifdef MICRO_LOG_ASYNC
+  if (settings->has_overflow)
+  {
+    error = micro_log_set_overflow2(micro_log, settings->overflow,
+                                    settings->overflow_level);
+    if (error != MICRO_LOG_OK)
+      return error;
+  }
+  #endif // MICRO_LOG_ASYNC
+
+  // The categories removed from the file follow the logger again
+  for (int i = 0; old != NULL && i < old->categories_count; ++i)
+  {
+    int j;
+    for (j = 0; j < settings->categories_count; ++j)
+      if (strcmp(old->categories[i].name, settings->categories[j].name) == 0)
+        break;
+    if (j < settings->categories_count)
+      continue;
+    error = micro_log_set_category_level2(micro_log, old->categories[i].name,
+                                          MICRO_LOG_LEVEL_INHERIT);
+    if (error != MICRO_LOG_OK)
+      return error;
+  }
+  for (int i = 0; i < settings->categories_count; ++i)
+  {
+    error = micro_log_set_category_level2(micro_log,
+                                          settings->categories[i].name,
+                                          settings->categories[i].level);
+    if (error != MICRO_LOG_OK)
+      return error;
+  }
+
+  if (settings->has_flags)
+  {
+    error = micro_log_set_flags2(micro_log, settings->flags);
+    if (error != MICRO_LOG_OK)
+      return error;
+  }
+  if (settings->has_level)
+    error = micro_log_set_level2(micro_log, settings->level);
+  return error;
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_from_file2(MicroLog *micro_log, char *filename)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+  if (filename == NULL)
+    return MICRO_LOG_ERROR_FROM_FILE_NULL;
+
+  _MicroLogSettings settings;
+  micro_log_error error = _micro_log_settings_read(&settings, filename);
+  if (error != MICRO_LOG_OK)
+    return error;
+  error = _micro_log_settings_apply(micro_log, &settings, NULL);
+  _micro_log_settings_free(&settings);
+
+  if (error == MICRO_LOG_OK)
+    micro_log_trace2(micro_log, "Initialized logger from file \"%s\"",
+                     filename);
+  return error;
+}
+
+#ifdef MICRO_LOG_MULTITHREADED
+
+//
+// Settings file watch
+//
+// A thread checks the settings file every MICRO_LOG_WATCH_MS
+// milliseconds, and reads it again when its size, modification time
+// or inode changed.
+//
+
+struct MicroLogWatch {
+  MicroLog *micro_log;
+  char *filename;
+  pthread_t thread;
+  // Protects [stop]
+  pthread_mutex_t mutex;
+  // Wakes up the thread to stop it
+  pthread_cond_t cond;
+  bool stop;
+  // The file when it was last read
+  struct stat stat;
+  // The settings applied from the file
+  _MicroLogSettings settings;
+};
+
+MICRO_LOG_DEF bool
+_micro_log_watch_same(const struct stat *a, const struct stat *b)
+{
+  return a->st_ino == b->st_ino && a->st_dev == b->st_dev
+    && a->st_size == b->st_size
+    && a->st_mtim.tv_sec == b->st_mtim.tv_sec
+    && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// Read the settings file again if it changed
+MICRO_LOG_DEF void _micro_log_watch_check(MicroLogWatch *watch)
+{
+  struct stat stat_now;
+  // The file may be missing while an editor replaces it
+  if (stat(watch->filename, &stat_now) != 0
+      || _micro_log_watch_same(&stat_now, &watch->stat))
+    return;
+  watch->stat = stat_now;
+
+  _MicroLogSettings settings;
+  micro_log_error error = _micro_log_settings_read(&settings,
+                                                   watch->filename);
+  if (error == MICRO_LOG_OK)
+    error = _micro_log_settings_apply(watch->micro_log, &settings,
+                                      &watch->settings);
+  if (error != MICRO_LOG_OK)
+  {
+    _micro_log_settings_free(&settings);
+    micro_log_error2(watch->micro_log,
+                     "Error %d reloading settings from \"%s\"",
+                     error, watch->filename);
+    return;
+  }
+
+  _micro_log_settings_free(&watch->settings);
+  watch->settings = settings;
+  micro_log_info2(watch->micro_log, "Reloaded settings from \"%s\"",
+                  watch->filename);
+}
+
+MICRO_LOG_DEF void *_micro_log_watch_thread(void *arg)
+{
+  MicroLogWatch *watch = arg;
+
+  pthread_mutex_lock(&watch->mutex);
+  while (!watch->stop)
+  {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec  += MICRO_LOG_WATCH_MS / 1000;
+    deadline.tv_nsec += (long) (MICRO_LOG_WATCH_MS % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    while (!watch->stop
+           && pthread_cond_timedwait(&watch->cond, &watch->mutex,
+                                     &deadline) != ETIMEDOUT)
+      ;
+    if (watch->stop)
+      break;
+
+    pthread_mutex_unlock(&watch->mutex);
+    _micro_log_watch_check(watch);
+    pthread_mutex_lock(&watch->mutex);
+  }
+  pthread_mutex_unlock(&watch->mutex);
+  return NULL;
+}
+
+MICRO_LOG_DEF void _micro_log_watch_free(MicroLogWatch *watch)
+{
+  _micro_log_settings_free(&watch->settings);
+  free(watch->filename);
+  free(watch);
+}
+
+// Stop watching the settings file of [micro_log], if any
+MICRO_LOG_DEF micro_log_error _micro_log_watch_stop(MicroLog *micro_log)
+{
+  MicroLogWatch *watch = micro_log->watch;
+  if (watch == NULL)
+    return MICRO_LOG_OK;
+
+  pthread_mutex_lock(&watch->mutex);
+  watch->stop = true;
+  pthread_cond_signal(&watch->cond);
+  pthread_mutex_unlock(&watch->mutex);
+  if (pthread_join(watch->thread, NULL) != 0)
+    return MICRO_LOG_ERROR_THREAD_JOIN;
+
+  pthread_cond_destroy(&watch->cond);
+  pthread_mutex_destroy(&watch->mutex);
+  _micro_log_watch_free(watch);
+  micro_log->watch = NULL;
+  return MICRO_LOG_OK;
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_watch_file2(MicroLog *micro_log, const char *filename)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+  if (filename == NULL)
+    return MICRO_LOG_ERROR_FROM_FILE_NULL;
+
+  micro_log_error error = _micro_log_watch_stop(micro_log);
+  if (error != MICRO_LOG_OK)
+    return error;
+
+  MicroLogWatch *watch = calloc(1, sizeof(*watch));
+  if (watch == NULL)
+    return MICRO_LOG_ERROR_ALLOC;
+  watch->micro_log = micro_log;
+  watch->filename = malloc(strlen(filename) + 1);
+  if (watch->filename == NULL)
+  {
+    error = MICRO_LOG_ERROR_ALLOC;
+    goto fail;
+  }
+  strcpy(watch->filename, filename);
+
+  if (stat(filename, &watch->stat) != 0)
+  {
+    perror("Error opening file");
+    error = MICRO_LOG_ERROR_OPEN_FILE;
+    goto fail;
+  }
+  error = _micro_log_settings_read(&watch->settings, filename);
+  if (error != MICRO_LOG_OK)
+    goto fail;
+  error = _micro_log_settings_apply(micro_log, &watch->settings, NULL);
+  if (error != MICRO_LOG_OK)
+    goto fail;
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&watch->cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+  pthread_mutex_init(&watch->mutex, NULL);
+  if (pthread_create(&watch->thread, NULL, _micro_log_watch_thread,
+                     watch) != 0)
+  {
+    pthread_cond_destroy(&watch->cond);
+    pthread_mutex_destroy(&watch->mutex);
+    error = MICRO_LOG_ERROR_THREAD_CREATE;
+    goto fail;
+  }
+  micro_log->watch = watch;
+
+  micro_log_trace2(micro_log, "Watching settings file \"%s\"", filename);
+  return MICRO_LOG_OK;
+
+ fail:
+  _micro_log_watch_free(watch);
+  return error;
+}
+
+#endif // MICRO_LOG_MULTITHREADED
+
+MICRO_LOG_DEF micro_log_error micro_log_close2(MicroLog *micro_log)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+
+  micro_log_error error = MICRO_LOG_OK;
+
+  #ifndef _WIN32
+  _micro_log_crash_forget(micro_log);
+  #endif // _WIN32
+
+  #ifdef MICRO_LOG_MULTITHREADED
+  error = _micro_log_watch_stop(micro_log);
+  if (error != MICRO_LOG_OK)
+    return error;
+  #endif // MICRO_LOG_MULTITHREADED
+
+  micro_log_info2(micro_log, "Closing logger");
+
+  #ifdef MICRO_LOG_ASYNC
+  error = _micro_log_async_stop(micro_log);
+  if (error != MICRO_LOG_OK)
+    return error;
+  #endif // MICRO_LOG_ASYNC
+
+  #ifdef MICRO_LOG_THREAD_BUFFER
+  error = _micro_log_thread_flusher_stop(micro_log);
+  if (error != MICRO_LOG_OK)
+    return error;
+  error = _micro_log_thread_buffer_flush_all(micro_log, true);
+  if (error != MICRO_LOG_OK)
+    return error;
+  #endif // MICRO_LOG_THREAD_BUFFER
+
+  #ifdef MICRO_LOG_MULTITHREADED
+  // Give their final name to the files already rotated
+  error = _micro_log_rotator_stop(micro_log);
+  if (error != MICRO_LOG_OK)
+    return error;
+  #endif // MICRO_LOG_MULTITHREADED
+
+  #ifdef MICRO_LOG_MMAP
+  error = _micro_log_mmap_stop(micro_log);
+  if (error != MICRO_LOG_OK)
+    return error;
+  #endif // MICRO_LOG_MMAP
+  
+  __MICRO_LOG_LOCK(micro_log);
+  
+  if (micro_log->file != NULL)
+  {
+    if (fclose(micro_log->file) != 0)
+    {
+      perror("Error closing file");
+      error = MICRO_LOG_ERROR_CLOSE_FILE;
+      goto done;
+    }
+    micro_log->file = NULL;
+  }
+  free(micro_log->file_path);
+  micro_log->file_path = NULL;
+
+  if (micro_log->binary_file != NULL)
+  {
+    if (fclose(micro_log->binary_file) != 0)
+    {
+      perror("Error closing binary file");
+      error = MICRO_LOG_ERROR_CLOSE_FILE;
+      goto done;
+    }
+    micro_log->binary_file = NULL;
+  }
+  free(micro_log->binary_formats);
+  micro_log->binary_formats = NULL;
+
+  #ifdef MICRO_LOG_SOCKETS
+  if (_micro_log_socket_close(&micro_log->inet_sock) < 0)
+  {
+    perror("Error closeing socket");
+    error = MICRO_LOG_ERROR_CLOSE_INET_SOCK;
+    goto done;
+  }
+  #if defined(__unix__) || defined(__unix)
+  if (_micro_log_socket_close(&micro_log->unix_sock) < 0)
+  {
+    error = MICRO_LOG_ERROR_CLOSE_UNIX_SOCK;
+    goto done;
+  }
+  #endif // __unix__
+  #endif // MICRO_LOG_SOCKETS
+
+  for (size_t i = 0; i < micro_log->sinks_count; ++i)
+    if (micro_log->sinks[i].close != NULL)
+      micro_log->sinks[i].close(micro_log->sinks[i].user);
+  micro_log->sinks_count = 0;
+
+ done:
+  __MICRO_LOG_UNLOCK(micro_log);
+  
+  #ifdef MICRO_LOG_MULTITHREADED
+  pthread_mutex_destroy(&micro_log->write_mutex);
+  #endif
+  #ifdef MICRO_LOG_THREAD_BUFFER
+  pthread_mutex_destroy(&micro_log->thread_buffers_mutex);
+  #endif
+  #ifdef MICRO_LOG_MULTITHREADED
+  pthread_mutex_destroy(&micro_log->collapse.mutex);
+  #endif
+  #ifdef MICRO_LOG_FLIGHT_RECORDER
+  _micro_log_flight_free(micro_log);
+  #endif
+  
+  return error;
+}
+
+_Static_assert(_MICRO_LOG_OUT_MAX == (1 << 7),
+               "Updated MICRO_LOG_OUT_MAX, maybe should also update micro_log_flush2");
+MICRO_LOG_DEF micro_log_error micro_log_flush2(MicroLog *micro_log)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+
+  micro_log_error error = _micro_log_collapse_flush(micro_log);
+  if (error != MICRO_LOG_OK)
+    return error;
+
+  #ifdef MICRO_LOG_ASYNC
+  _micro_log_async_wait(micro_log);
+  #endif // MICRO_LOG_ASYNC
+
+  #ifdef MICRO_LOG_THREAD_BUFFER
+  error = _micro_log_thread_buffer_flush_all(micro_log, false);
+  if (error != MICRO_LOG_OK)
+    return error;
+  #endif // MICRO_LOG_THREAD_BUFFER
+
+  // The outputs may be swapped by another thread, for example when
+  // a watched settings file changes
+  __MICRO_LOG_LOCK(micro_log);
+
+  int out = _MICRO_LOG_LOAD(micro_log->out_bitfield);
+  if ((out & MICRO_LOG_OUT_STDOUT) && fflush(stdout) != 0)
+  {
+    perror("Error flushing stdout");
+    error = MICRO_LOG_ERROR_FLUSH_STDOUT;
+  }
+  if ((out & MICRO_LOG_OUT_FILE) && fflush(micro_log->file) != 0)
+  {
+    perror("Error flushing file");
+    error = MICRO_LOG_ERROR_FLUSH_FILE;
+  }
+  if ((out & MICRO_LOG_OUT_BINARY) && fflush(micro_log->binary_file) != 0)
+  {
+    perror("Error flushing binary file");
+    error = MICRO_LOG_ERROR_FLUSH_FILE;
+  }
+
+  #ifdef MICRO_LOG_SOCKETS
+  // Send what the sockets take without blocking
+  _micro_log_socket_resume(&micro_log->inet_sock);
+  #if defined(__unix__) || defined(__unix)
+  _micro_log_socket_resume(&micro_log->unix_sock);
+  #endif // __unix__
+  #endif // MICRO_LOG_SOCKETS
+
+  #ifdef MICRO_LOG_MMAP
+  _micro_log_mmap_sync(micro_log);
+  #endif // MICRO_LOG_MMAP
+
+  if (out & MICRO_LOG_OUT_SINKS)
+  {
+    for (size_t i = 0; i < micro_log->sinks_count; ++i)
+    {
+      const MicroLogSink *sink = &micro_log->sinks[i];
+      if (sink->flush == NULL)
+        continue;
+      micro_log_error sink_error = sink->flush(sink->user);
+      if (error == MICRO_LOG_OK)
+        error = sink_error;
+    }
+  }
+
+  goto done;
+ done:
+  __MICRO_LOG_UNLOCK(micro_log);
+  return error;
+}
+  
+MICRO_LOG_DEF micro_log_error
+micro_log_set_flags2(MicroLog *micro_log,
+                     long unsigned int flags_bitfield)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+  
+  #ifdef MICRO_LOG_FIXED_FLAGS
+  if (flags_bitfield != MICRO_LOG_FIXED_FLAGS)
+    return MICRO_LOG_ERROR_FIXED_FLAGS;
+  #endif // MICRO_LOG_FIXED_FLAGS
+
+  micro_log_error error = MICRO_LOG_OK;
+  
+  __MICRO_LOG_LOCK(micro_log);
+  
+  _MICRO_LOG_STORE(micro_log->flags_bitfield, flags_bitfield);
+
+  goto done;
+ done:
+  __MICRO_LOG_UNLOCK(micro_log);
+  return error;
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_level2(MicroLog *micro_log,
+                     MicroLogLevel level)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+
+  if (level > MICRO_LOG_LEVEL_MAX)
+    return MICRO_LOG_ERROR_UNKNOWN_LEVEL;
+  
+  micro_log_error error = MICRO_LOG_OK;
+
+  __MICRO_LOG_LOCK(micro_log);
+  
+  _MICRO_LOG_STORE(micro_log->log_level, level);
+
+  goto done;
+ done:
+  __MICRO_LOG_UNLOCK(micro_log);
+
+  if (error == MICRO_LOG_OK)
+    micro_log_trace2(micro_log, "Set log level to %s",
+                     micro_log_level_string(level, false));
+  return error;
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_category_level2(MicroLog *micro_log,
+                              const char *name,
+                              MicroLogLevel level)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+  if (name == NULL)
+    return MICRO_LOG_ERROR_INVALID_CATEGORY;
+  if (level >= MICRO_LOG_LEVEL_MAX && level != MICRO_LOG_LEVEL_INHERIT)
+    return MICRO_LOG_ERROR_UNKNOWN_LEVEL;
+
+  int slot = _micro_log_category_slot(name, strlen(name));
+  if (slot == MICRO_LOG_CATEGORY_MAX)
+    return MICRO_LOG_ERROR_INVALID_CATEGORY;
+
+  micro_log_error error = MICRO_LOG_OK;
+
+  __MICRO_LOG_LOCK(micro_log);
+
+  _MICRO_LOG_STORE(micro_log->category_levels[slot], level);
+
+  goto done;
+ done:
+  __MICRO_LOG_UNLOCK(micro_log);
+
+  if (error == MICRO_LOG_OK)
+    micro_log_trace2(micro_log, "Set log level of category %s to %s", name,
+                     (level == MICRO_LOG_LEVEL_INHERIT)
+                     ? "inherit" : micro_log_level_string(level, false));
+  return error;
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_out2(MicroLog *micro_log, int out_flags)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+
+  micro_log_error error = MICRO_LOG_OK;
+
+  __MICRO_LOG_LOCK(micro_log);
+  
+  _MICRO_LOG_STORE(micro_log->out_bitfield, out_flags);
+
+  goto done;
+ done:
+  __MICRO_LOG_UNLOCK(micro_log);
+  return error;
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_encoding2(MicroLog *micro_log,
+                        int out_flags,
+                        MicroLogEncoding encoding)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+  if ((out_flags & (MICRO_LOG_OUT_BINARY | MICRO_LOG_OUT_SINKS))
+      || (unsigned int) encoding >= _MICRO_LOG_ENCODING_MAX)
+    return MICRO_LOG_ERROR_ENCODING;
+
+  micro_log_error error = MICRO_LOG_OK;
+
+  __MICRO_LOG_LOCK(micro_log);
+
+  for (int i = 0; i < _MICRO_LOG_OUT_COUNT; ++i)
+    if (out_flags & (1 << i))
+      _MICRO_LOG_STORE(micro_log->encodings[i], encoding);
+
+  goto done;
+ done:
+  __MICRO_LOG_UNLOCK(micro_log);
+  return error;
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_framing2(MicroLog *micro_log,
+                       int out_flags,
+                       MicroLogFraming framing)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+  if ((out_flags & (MICRO_LOG_OUT_BINARY | MICRO_LOG_OUT_SINKS))
+      || (unsigned int) framing >= _MICRO_LOG_FRAMING_MAX)
+    return MICRO_LOG_ERROR_ENCODING;
+
+  micro_log_error error = MICRO_LOG_OK;
+
+  __MICRO_LOG_LOCK(micro_log);
+
+  for (int i = 0; i < _MICRO_LOG_OUT_COUNT; ++i)
+    if (out_flags & (1 << i))
+      _MICRO_LOG_STORE(micro_log->framings[i], framing);
+
+  goto done;
+ done:
+  __MICRO_LOG_UNLOCK(micro_log);
+  return error;
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_out_level2(MicroLog *micro_log,
+                         int out_flags,
+                         MicroLogLevel level)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+  if (level >= MICRO_LOG_LEVEL_MAX)
+    return MICRO_LOG_ERROR_UNKNOWN_LEVEL;
+
+  micro_log_error error = MICRO_LOG_OK;
+
+  __MICRO_LOG_LOCK(micro_log);
+
+  for (int i = 0; i < _MICRO_LOG_OUT_COUNT; ++i)
+    if (out_flags & (1 << i))
+      _MICRO_LOG_STORE(micro_log->out_levels[i], level);
+
+  goto done;
+ done:
+  __MICRO_LOG_UNLOCK(micro_log);
+  return error;
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_add_sink2(MicroLog *micro_log, const MicroLogSink *sink)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+  if (sink == NULL || sink->write == NULL
+      || sink->level >= MICRO_LOG_LEVEL_MAX
+      || (unsigned int) sink->encoding >= _MICRO_LOG_ENCODING_MAX
+      || (unsigned int) sink->framing >= _MICRO_LOG_FRAMING_MAX)
+    return MICRO_LOG_ERROR_INVALID_SINK;
+
+  micro_log_error error = MICRO_LOG_OK;
+
+  __MICRO_LOG_LOCK(micro_log);
+
+  if (micro_log->sinks_count == MICRO_LOG_SINKS_MAX)
+  {
+    error = MICRO_LOG_ERROR_SINKS_FULL;
+    goto done;
+  }
+  micro_log->sinks[micro_log->sinks_count++] = *sink;
+  _MICRO_LOG_STORE(micro_log->out_bitfield,
+                   _MICRO_LOG_LOAD(micro_log->out_bitfield)
+                   | MICRO_LOG_OUT_SINKS);
+
+  goto done;
+ done:
+  __MICRO_LOG_UNLOCK(micro_log);
+  return error;
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_file2(MicroLog *micro_log,
+                    char* filename)
+{
+  return _micro_log_set_file_mode(micro_log, filename, "w+");
+}
+
+// Open [filename] with [mode] and use it as the output file
+//
+// The file is opened before taking the lock, so that the other
+// threads keep logging to the previous file in the meantime.
+MICRO_LOG_DEF micro_log_error
+_micro_log_set_file_mode(MicroLog *micro_log,
+                         char *filename,
+                         const char *mode)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+
+  micro_log_error error = MICRO_LOG_OK;
+
+  size_t path_len = strlen(filename);
+  char *path = malloc(path_len + 1);
+  if (path == NULL)
+    return MICRO_LOG_ERROR_ALLOC;
+  memcpy(path, filename, path_len + 1);
+
+  FILE *file = fopen(filename, mode);
+  if (file == NULL)
+  {
+    perror("Error opening file");
+    free(path);
+    return MICRO_LOG_ERROR_OPEN_FILE;
+  }
+  // The rotation counts the bytes already in the file
+  struct stat file_stat;
+  size_t file_size = (fstat(fileno(file), &file_stat) == 0)
+    ? (size_t) file_stat.st_size : 0;
+
+  FILE *old_file = NULL;
+  __MICRO_LOG_LOCK(micro_log);
+
+  old_file = micro_log->file;
+  micro_log->file = file;
+  file = NULL;
+  char *old_path = micro_log->file_path;
+  micro_log->file_path = path;
+  path = old_path;
+  micro_log->file_size = file_size;
+  _MICRO_LOG_STORE(micro_log->out_bitfield,
+                   _MICRO_LOG_LOAD(micro_log->out_bitfield)
+                   | MICRO_LOG_OUT_FILE);
+
+  goto done;
+ done:
+  __MICRO_LOG_UNLOCK(micro_log);
+
+  if (file != NULL)
+    fclose(file);
+  free(path);
+  if (old_file != NULL && fclose(old_file) != 0)
+  {
+    perror("Error closing file");
+    error = MICRO_LOG_ERROR_CLOSE_FILE;
+  }
+
+  if (error == MICRO_LOG_OK)
+    micro_log_trace2(micro_log, "Set output file to \"%s\"", filename);
+  return error;
+}
+
+#ifdef MICRO_LOG_SOCKETS
+
+_Static_assert(_MICRO_LOG_PROTO_MAX == 2,
+               "Updated MicroLogProto, should also update micro_log_set_socket_inet2");
+MICRO_LOG_DEF micro_log_error
+micro_log_set_socket_inet2(MicroLog *micro_log,
+                           char* addr,
+                           int port,
+                           MicroLogProto protocol)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+  if (addr == NULL)
+    return MICRO_LOG_ERROR_INET_ADDR_NULL;
+
+  micro_log_error error = MICRO_LOG_OK;
+
+  struct sockaddr_in sockaddr_in;
+  memset(&sockaddr_in, 0, sizeof(sockaddr_in));
+  sockaddr_in.sin_family = AF_INET;
+  sockaddr_in.sin_port = htons(port);
+
+  if(inet_pton(AF_INET, addr, &sockaddr_in.sin_addr) <= 0)
+  {
+    perror("Error setting inet socket addr");
+    return MICRO_LOG_ERROR_INET_ADDR;
+  }
+
+  int type;
+  switch (protocol)
+  {
+  case MICRO_LOG_PROTO_TCP:
+    type = SOCK_STREAM;
+    break;
+  case MICRO_LOG_PROTO_UDP:
+    type = SOCK_DGRAM;
+    break;
+  default:
+    fprintf(stderr, "Inet Protocol unrecognized");
+    return MICRO_LOG_ERROR_INVALID_PROTOCOL;
+  }
+
+  // The connection completes in the background if it can not be
+  // established right away
+  MicroLogSocket sock;
+  _micro_log_socket_init(&sock);
+  int ret = _micro_log_socket_open(&sock, type,
+                                   (struct sockaddr *) &sockaddr_in,
+                                   sizeof(sockaddr_in));
+  if (ret < 0)
+  {
+    perror("Error connecting to inet socket");
+    _micro_log_socket_close(&sock);
+    return (ret == -1) ? MICRO_LOG_ERROR_OPEN_INET_SOCK
+                       : MICRO_LOG_ERROR_INET_CONNECT;
+  }
+
+  __MICRO_LOG_LOCK(micro_log);
+
+  // Swap the socket, so that what is left in the queue of the old
+  // one can still be sent after unlocking
+  MicroLogSocket old_sock = micro_log->inet_sock;
+  micro_log->inet_sock = sock;
+  _micro_log_socket_init(&sock);
+  micro_log->inet_proto = protocol;
+  _MICRO_LOG_STORE(micro_log->out_bitfield,
+                   _MICRO_LOG_LOAD(micro_log->out_bitfield)
+                   | MICRO_LOG_OUT_SOCK_INET);
+  sock = old_sock;
+
+  goto done;
+ done:
+  __MICRO_LOG_UNLOCK(micro_log);
+
+  _micro_log_socket_resume(&sock);
+  _micro_log_socket_close(&sock);
+
+  if (error == MICRO_LOG_OK)
+    micro_log_trace2(micro_log,
+                     "Set output to inet socket at address \"%s\" port %d",
+                     addr, port);
+  return error;
+}
+
+#if defined(__unix__) || defined(__unix)
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_socket_unix2(MicroLog* micro_log, char* path)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+  if (path == NULL)
+    return MICRO_LOG_ERROR_SOCK_PATH_NULL;
+
+  micro_log_error error = MICRO_LOG_OK;
+
+  struct sockaddr_un sockaddr_un;
+  memset(&sockaddr_un, 0, sizeof(sockaddr_un));
+  sockaddr_un.sun_family = AF_UNIX;
+  strncpy(sockaddr_un.sun_path, path, sizeof(sockaddr_un.sun_path) - 1);
+
+  MicroLogSocket sock;
+  _micro_log_socket_init(&sock);
+  int ret = _micro_log_socket_open(&sock, SOCK_STREAM,
+                                   (struct sockaddr *) &sockaddr_un,
+                                   sizeof(sockaddr_un));
+  if (ret < 0)
+  {
+    perror("Error connecting to unix socket");
+    _micro_log_socket_close(&sock);
+    return (ret == -1) ? MICRO_LOG_ERROR_OPEN_UNIX_SOCK
+                       : MICRO_LOG_ERROR_UNIX_CONNECT;
+  }
+
+  __MICRO_LOG_LOCK(micro_log);
+
+  MicroLogSocket old_sock = micro_log->unix_sock;
+  micro_log->unix_sock = sock;
+  _micro_log_socket_init(&sock);
+  _MICRO_LOG_STORE(micro_log->out_bitfield,
+                   _MICRO_LOG_LOAD(micro_log->out_bitfield)
+                   | MICRO_LOG_OUT_SOCK_UNIX);
+  sock = old_sock;
+
+  goto done;
+ done:
+  __MICRO_LOG_UNLOCK(micro_log);
+
+  _micro_log_socket_resume(&sock);
+  _micro_log_socket_close(&sock);
+
+  if (error == MICRO_LOG_OK)
+    micro_log_trace2(micro_log,
+                     "Set output to unix socket \"%s\"", path);
+  return error;
+}
+
+
+#endif // __unix__
+
+MICRO_LOG_DEF micro_log_error
+micro_log_get_socket_state2(MicroLog *micro_log,
+                            int out,
+                            MicroLogSocketState *state)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+
+  micro_log_error error = MICRO_LOG_OK;
+
+  __MICRO_LOG_LOCK(micro_log);
+
+  switch (out)
+  {
+  case MICRO_LOG_OUT_SOCK_INET:
+    _micro_log_socket_state(&micro_log->inet_sock, state);
+    break;
+  #if defined(__unix__) || defined(__unix)
+  case MICRO_LOG_OUT_SOCK_UNIX:
+    _micro_log_socket_state(&micro_log->unix_sock, state);
+    break;
+  #endif // __unix__
+  default:
+    error = MICRO_LOG_ERROR_UNKNOWN_SOCKET;
+    goto done;
+  }
+
+ done:
+  __MICRO_LOG_UNLOCK(micro_log);
+  return error;
+}
+
+#endif // MICRO_LOG_SOCKETS
+
+_Static_assert(MICRO_LOG_LEVEL_MAX == 7,
+               "Updated MICRO_LOG_LEVEL, should also update micro_log_level_string");
+MICRO_LOG_DEF const char*
+micro_log_level_string(MicroLogLevel level, bool color)
+{
+  switch(level)
+  {
+  case MICRO_LOG_LEVEL_TRACE:
+    return color ? MICRO_LOG_MAG("TRACE") : "TRACE";
+  case MICRO_LOG_LEVEL_DEBUG:
+    return color ? MICRO_LOG_GRN("DEBUG") : "DEBUG";
+  case MICRO_LOG_LEVEL_INFO:
+    return color ? MICRO_LOG_CYN("INFO") : "INFO";
+  case MICRO_LOG_LEVEL_WARN:
+    return color ? MICRO_LOG_YEL("WARN") : "WARN";
+  case MICRO_LOG_LEVEL_ERROR:
+    return color ? MICRO_LOG_RED("ERROR") : "ERROR";
+  case MICRO_LOG_LEVEL_FATAL:
+    return color ? MICRO_LOG_BOLD(MICRO_LOG_RED("FATAL")) : "FATAL";
+  case MICRO_LOG_LEVEL_DISABLED:
+    return "DISABLED";
+  default:
+    break;
+  }
+  return "UNKNOWN";
+}
+
+//
+// Record rendering
+//
+// A record is rendered once into a single buffer, which is then
+// written to every output. The buffer lives on the stack of the
+// caller and moves to the heap only when a record does not fit.
+//
+
+typedef struct {
+  char   *data;
+  size_t  len;
+  size_t  cap;
+  // Whether [data] was allocated with malloc, instead of being
+  // supplied by the caller
+  bool    heap;
+} _MicroLogBuf;
+
+MICRO_LOG_DEF void
+_micro_log_buf_init(_MicroLogBuf *buf, char *stack, size_t cap)
+{
+  *buf = (_MicroLogBuf){
+    .data = stack,
+    .len  = 0,
+    .cap  = cap,
+    .heap = false,
+  };
+}
+
+MICRO_LOG_DEF void _micro_log_buf_free(_MicroLogBuf *buf)
+{
+  if (buf->heap)
+    free(buf->data);
+  buf->data = NULL;
+  buf->len  = 0;
+  buf->cap  = 0;
+  buf->heap = false;
+}
+
+// Make sure there is space for [extra] more bytes in [buf]
+MICRO_LOG_DEF micro_log_error
+_micro_log_buf_reserve(_MicroLogBuf *buf, size_t extra)
+{
+  if (buf->len + extra <= buf->cap)
+    return MICRO_LOG_OK;
+
+  size_t cap = (buf->cap > 0) ? buf->cap : 64;
+  while (cap < buf->len + extra)
+    cap *= 2;
+
+  char *data = buf->heap ? realloc(buf->data, cap) : malloc(cap);
+  if (data == NULL)
+    return MICRO_LOG_ERROR_ALLOC;
+  if (!buf->heap && buf->len > 0)
+    memcpy(data, buf->data, buf->len);
+
+  buf->data = data;
+  buf->cap  = cap;
+  buf->heap = true;
+  return MICRO_LOG_OK;
+}
+
+MICRO_LOG_DEF micro_log_error
+_micro_log_buf_append(_MicroLogBuf *buf, const char *str, size_t len)
+{
+  micro_log_error error = _micro_log_buf_reserve(buf, len);
+  if (error != MICRO_LOG_OK)
+    return error;
+
+  memcpy(buf->data + buf->len, str, len);
+  buf->len += len;
+  return MICRO_LOG_OK;
+}
+
+MICRO_LOG_DEF micro_log_error
+_micro_log_buf_puts(_MicroLogBuf *buf, const char *str)
+{
+  return _micro_log_buf_append(buf, str, strlen(str));
+}
+
+MICRO_LOG_DEF micro_log_error
+_micro_log_buf_vprintf(_MicroLogBuf *buf, const char *fmt, va_list args)
+{
+  va_list copy;
+  va_copy(copy, args);
+  int n = vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, copy);
+  va_end(copy);
+  if (n < 0)
+    return MICRO_LOG_ERROR_FORMAT;
+
+  if ((size_t) n >= buf->cap - buf->len)
+  {
+    // Did not fit, grow and format again
+    micro_log_error error = _micro_log_buf_reserve(buf, (size_t) n + 1);
+    if (error != MICRO_LOG_OK)
+      return error;
+
+    va_copy(copy, args);
+    n = vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, copy);
+    va_end(copy);
+    if (n < 0)
+      return MICRO_LOG_ERROR_FORMAT;
+  }
+
+  buf->len += (size_t) n;
+  return MICRO_LOG_OK;
+}
+
+MICRO_LOG_DEF micro_log_error
+_micro_log_buf_printf(_MicroLogBuf *buf, const char *fmt, ...)
+{
+  micro_log_error error;
+  va_list args;
+
+  va_start(args, fmt);
+  error = _micro_log_buf_vprintf(buf, fmt, args);
+  va_end(args);
+
+  return error;
+}
+
+//
+// Json strings
+//
+// Quotes, backslashes and control characters in the strings of a
+// json record are escaped. Most strings have none, so they are
+// scanned eight bytes at a time and copied as they are.
+//
+
+#define _MICRO_LOG_BYTES_ONES  0x0101010101010101ULL
+#define _MICRO_LOG_BYTES_HIGHS 0x8080808080808080ULL
+
+// Whether none of the eight bytes of [word] must be escaped
+MICRO_LOG_DEF bool _micro_log_json_word_clean(uint64_t word)
+{
+  // A byte is zero after the xor, or below 0x20, if the high bit of
+  // its lane is set after the subtraction while it was clear before
+  uint64_t quote = word ^ (_MICRO_LOG_BYTES_ONES * '"');
+  uint64_t slash = word ^ (_MICRO_LOG_BYTES_ONES * '\\');
+  uint64_t dirty = ((quote - _MICRO_LOG_BYTES_ONES) & ~quote)
+                 | ((slash - _MICRO_LOG_BYTES_ONES) & ~slash)
+                 | ((word - _MICRO_LOG_BYTES_ONES * 0x20) & ~word);
+  return (dirty & _MICRO_LOG_BYTES_HIGHS) == 0;
+}
+
+// Number of bytes added by escaping [c]
+MICRO_LOG_DEF size_t _micro_log_json_char_extra(unsigned char c)
+{
+  if (c == '"' || c == '\\')
+    return 1;
+  if (c >= 0x20)
+    return 0;
+  switch (c)
+  {
+  case '\b': case '\f': case '\n': case '\r': case '\t':
+    return 1;
+  default:
+    return 5;  // \u00XX
+  }
+}
+
+// Number of bytes added by escaping the [len] bytes of [str]
+MICRO_LOG_DEF size_t _micro_log_json_escape_extra(const char *str, size_t len)
+{
+  size_t extra = 0;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8)
+  {
+    uint64_t word;
+    memcpy(&word, str + i, sizeof(word));
+    if (_micro_log_json_word_clean(word))
+      continue;
+    for (size_t j = i; j < i + 8; ++j)
+      extra += _micro_log_json_char_extra((unsigned char) str[j]);
+  }
+  for (; i < len; ++i)
+    extra += _micro_log_json_char_extra((unsigned char) str[i]);
+  return extra;
+}
+
+// Write the [len] bytes of [str] escaped in [out], and return the
+// number of bytes written
+//
+// [out] may overlap with the beginning of [str], since every byte is
+// read before its escaped form is written.
+MICRO_LOG_DEF size_t
+_micro_log_json_escape(char *out, const char *str, size_t len)
+{
+  static const char hex[] = "0123456789abcdef";
+  size_t written = 0;
+  size_t i = 0;
+  while (i < len)
+  {
+    uint64_t word;
+    if (i + 8 <= len)
+    {
+      memcpy(&word, str + i, sizeof(word));
+      if (_micro_log_json_word_clean(word))
+      {
+        memcpy(out + written, &word, sizeof(word));
+        written += 8;
+        i += 8;
+        continue;
+      }
+    }
+
+    unsigned char c = (unsigned char) str[i++];
+    switch (c)
+    {
+    case '"':  out[written++] = '\\'; out[written++] = '"';  break;
+    case '\\': out[written++] = '\\'; out[written++] = '\\'; break;
+    case '\b': out[written++] = '\\'; out[written++] = 'b';  break;
+    case '\f': out[written++] = '\\'; out[written++] = 'f';  break;
+    case '\n': out[written++] = '\\'; out[written++] = 'n';  break;
+    case '\r': out[written++] = '\\'; out[written++] = 'r';  break;
+    case '\t': out[written++] = '\\'; out[written++] = 't';  break;
+    default:
+      if (c < 0x20)
+      {
+        memcpy(out + written, "\\u00", 4);
+        out[written + 4] = hex[c >> 4];
+        out[written + 5] = hex[c & 0xf];
+        written += 6;
+      }
+      else
+      {
+        out[written++] = (char) c;
+      }
+    }
+  }
+  return written;
+}
+
+// Append the [len] bytes of [str] to [buf], escaped for a json string
+MICRO_LOG_DEF micro_log_error
+_micro_log_buf_append_json(_MicroLogBuf *buf, const char *str, size_t len)
+{
+  size_t extra = _micro_log_json_escape_extra(str, len);
+  if (extra == 0)
+    return _micro_log_buf_append(buf, str, len);
+
+  micro_log_error error = _micro_log_buf_reserve(buf, len + extra);
+  if (error != MICRO_LOG_OK)
+    return error;
+  buf->len += _micro_log_json_escape(buf->data + buf->len, str, len);
+  return MICRO_LOG_OK;
+}
+
+// Append the [len] bytes of [data] to [buf] as pairs of hex digits
+// separated by spaces
+MICRO_LOG_DEF micro_log_error
+_micro_log_buf_append_hex(_MicroLogBuf *buf, const char *data, size_t len)
+{
+  static const char hex[] = "0123456789abcdef";
+  if (len == 0)
+    return MICRO_LOG_OK;
+
+  micro_log_error error = _micro_log_buf_reserve(buf, 3 * len - 1);
+  if (error != MICRO_LOG_OK)
+    return error;
+  char *out = buf->data + buf->len;
+  for (size_t i = 0; i < len; ++i)
+  {
+    unsigned char c = (unsigned char) data[i];
+    if (i > 0)
+      *out++ = ' ';
+    *out++ = hex[c >> 4];
+    *out++ = hex[c & 0xf];
+  }
+  buf->len += 3 * len - 1;
+  return MICRO_LOG_OK;
+}
+
+// Append the [len] bytes of the json string [str] to [buf], without
+// the escapes written by `_micro_log_json_escape`
+MICRO_LOG_DEF micro_log_error
+_micro_log_buf_append_unescaped(_MicroLogBuf *buf, const char *str, size_t len)
+{
+  // Unescaping never makes the string longer
+  micro_log_error error = _micro_log_buf_reserve(buf, len);
+  if (error != MICRO_LOG_OK)
+    return error;
+
+  char *out = buf->data + buf->len;
+  size_t written = 0;
+  size_t i = 0;
+  while (i < len)
+  {
+    const char *escape = memchr(str + i, '\\', len - i);
+    size_t plain = (escape != NULL) ? (size_t) (escape - str) - i : len - i;
+    memcpy(out + written, str + i, plain);
+    written += plain;
+    i += plain;
+    if (i + 1 >= len)
+    {
+      // A lone backslash at the end is kept
+      if (i < len)
+        out[written++] = str[i++];
+      break;
+    }
+
+    char c = str[i + 1];
+    i += 2;
+    switch (c)
+    {
+    case 'b': out[written++] = '\b'; break;
+    case 'f': out[written++] = '\f'; break;
+    case 'n': out[written++] = '\n'; break;
+    case 'r': out[written++] = '\r'; break;
+    case 't': out[written++] = '\t'; break;
+    case 'u':
+    {
+      // Only the control characters are written as \u00XX
+      unsigned int value = 0;
+      size_t digits = 0;
+      for (; digits < 4 && i + digits < len; ++digits)
+      {
+        char h = str[i + digits];
+        int v = (h >= '0' && h <= '9') ? h - '0'
+              : (h >= 'a' && h <= 'f') ? h - 'a' + 10
+              : (h >= 'A' && h <= 'F') ? h - 'A' + 10 : -1;
+        if (v < 0) break;
+        value = value * 16 + (unsigned int) v;
+      }
+      if (digits == 4 && value < 0x80)
+      {
+        out[written++] = (char) value;
+        i += 4;
+        break;
+      }
+      out[written++] = c;
+      break;
+    }
+    default:
+      out[written++] = c;
+      break;
+    }
+  }
+
+  buf->len += written;
+  return MICRO_LOG_OK;
+}
+
+// Escape for a json string what was written in [buf] after [begin]
+MICRO_LOG_DEF micro_log_error
+_micro_log_buf_escape_json(_MicroLogBuf *buf, size_t begin)
+{
+  size_t len = buf->len - begin;
+  size_t extra = _micro_log_json_escape_extra(buf->data + begin, len);
+  if (extra == 0)
+    return MICRO_LOG_OK;
+
+  micro_log_error error = _micro_log_buf_reserve(buf, extra);
+  if (error != MICRO_LOG_OK)
+    return error;
+  // Move the string out of the way, and escape it back in place
+  char *str = buf->data + begin;
+  memmove(str + extra, str, len);
+  buf->len = begin + _micro_log_json_escape(str, str + extra, len);
+  return MICRO_LOG_OK;
+}
+
+// The date and time of the last second this thread rendered a
+// record in
+typedef struct {
+  time_t sec;
+  char date[32];
+  int date_len;
+  char time[16];
+  int time_len;
+} _MicroLogTimeCache;
+
+// Get the rendered date and time of [sec]
+//
+// localtime is slow and takes a global lock, so it is only called
+// once per second by each rendering thread.
+MICRO_LOG_DEF const _MicroLogTimeCache *_micro_log_time_cache(time_t sec)
+{
+  static _MICRO_LOG_THREAD_LOCAL _MicroLogTimeCache cache = {
+    .sec = (time_t) -1,
+  };
+
+  if (cache.sec != sec)
+  {
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    cache.date_len = _micro_log_format_date(cache.date, &tm);
+    cache.time_len = _micro_log_format_time(cache.time, &tm);
+    cache.sec = sec;
+  }
+  return &cache;
+}
+
+// Capture the metadata of a record that is being logged
+MICRO_LOG_DEF void
+_micro_log_record_capture(MicroLog *micro_log,
+                          MicroLogRecord *record,
+                          MicroLogLevel level,
+                          const char* file,
+                          int line)
+{
+  long unsigned int flags =
+    _MICRO_LOG_FLAGS(_MICRO_LOG_LOAD(micro_log->flags_bitfield));
+
+  record->level = level;
+  record->flags = flags;
+  record->file  = file;
+  record->line  = line;
+  record->time  = 0;
+  record->nsec  = 0;
+  record->mono  = 0;
+  if (flags & (MICRO_LOG_FLAG_DATE | MICRO_LOG_FLAG_TIME
+               | MICRO_LOG_FLAG_USEC | MICRO_LOG_FLAG_NSEC))
+  {
+    struct timespec now;
+    clock_gettime(MICRO_LOG_CLOCK, &now);
+    record->time = now.tv_sec;
+    record->nsec = now.tv_nsec;
+  }
+  if (flags & MICRO_LOG_FLAG_MONO)
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    record->mono =
+      (int64_t) (now.tv_sec - micro_log->mono_base.tv_sec) * 1000000000
+      + (now.tv_nsec - micro_log->mono_base.tv_nsec);
+  }
+  record->pid   = (flags & MICRO_LOG_FLAG_PID) ? _micro_log_pid()->id : 0;
+  record->tid   = (flags & MICRO_LOG_FLAG_TID) ? _micro_log_tid()->id : 0;
+  record->sample_rate = 0;
+}
+
+// The level of a record in the header, padded like "%-5s" with and
+// without colors
+#define _MICRO_LOG_LEVEL_FIELD(str) { (str), sizeof(str) - 1 }
+static const struct {
+  const char *str;
+  size_t len;
+} _micro_log_level_fields[2][MICRO_LOG_LEVEL_MAX] = {
+  {
+    _MICRO_LOG_LEVEL_FIELD("TRACE"),
+    _MICRO_LOG_LEVEL_FIELD("DEBUG"),
+    _MICRO_LOG_LEVEL_FIELD("INFO "),
+    _MICRO_LOG_LEVEL_FIELD("WARN "),
+    _MICRO_LOG_LEVEL_FIELD("ERROR"),
+    _MICRO_LOG_LEVEL_FIELD("FATAL"),
+    _MICRO_LOG_LEVEL_FIELD("DISABLED"),
+  },
+  {
+    _MICRO_LOG_LEVEL_FIELD(MICRO_LOG_MAG("TRACE")),
+    _MICRO_LOG_LEVEL_FIELD(MICRO_LOG_GRN("DEBUG")),
+    _MICRO_LOG_LEVEL_FIELD(MICRO_LOG_CYN("INFO")),
+    _MICRO_LOG_LEVEL_FIELD(MICRO_LOG_YEL("WARN")),
+    _MICRO_LOG_LEVEL_FIELD(MICRO_LOG_RED("ERROR")),
+    _MICRO_LOG_LEVEL_FIELD(MICRO_LOG_BOLD(MICRO_LOG_RED("FATAL"))),
+    _MICRO_LOG_LEVEL_FIELD("DISABLED"),
+  },
+};
+#undef _MICRO_LOG_LEVEL_FIELD
+
+_Static_assert(MICRO_LOG_LEVEL_MAX == 7,
+               "Updated MICRO_LOG_LEVEL, should also update _micro_log_level_fields");
+
+// Write the value of [field] in the 32 bytes of [out], and return
+// its length, or -1 if it is a string
+//
+// Numbers are written like in json, so the values that are not
+// finite and the NULL strings are null.
+MICRO_LOG_DEF int _micro_log_format_field(char *out, const MicroLogField *field)
+{
+  int n;
+  switch (field->type)
+  {
+  case MICRO_LOG_FIELD_INT:
+    return _micro_log_format_int(out, field->value.i);
+  case MICRO_LOG_FIELD_UINT:
+    return _micro_log_format_uint(out, field->value.u, 0);
+  case MICRO_LOG_FIELD_DOUBLE:
+    if (!isfinite(field->value.d))
+      break;
+    // The shortest that reads back as the same value
+    for (int precision = 15; precision <= 17; ++precision)
+    {
+      n = snprintf(out, 32, "%.*g", precision, field->value.d);
+      if (strtod(out, NULL) == field->value.d)
+        break;
+    }
+    return n;
+  case MICRO_LOG_FIELD_BOOL:
+    n = field->value.b ? 4 : 5;
+    memcpy(out, field->value.b ? "true" : "false", (size_t) n);
+    return n;
+  case MICRO_LOG_FIELD_STR:
+    if (field->value.s != NULL)
+      return -1;
+    break;
+  default:
+    break;
+  }
+  memcpy(out, "null", 4);
+  return 4;
+}
+
+// Render a [field] of a structured record, as a member of a json
+// object or as key=value, with [prefix] before its key
+MICRO_LOG_DEF micro_log_error
+_micro_log_render_field(_MicroLogBuf *buf,
+                        const MicroLogField *field,
+                        bool json,
+                        const char *prefix)
+{
+  micro_log_error error;
+  char digits[32];
+
+#define CHECK_ERROR() if (error != MICRO_LOG_OK) { return error; }
+
+  if (json)
+  {
+    error = _micro_log_buf_puts(buf, "\"");
+    CHECK_ERROR();
+    error = _micro_log_buf_puts(buf, prefix);
+    CHECK_ERROR();
+    error = _micro_log_buf_append_json(buf, field->key, strlen(field->key));
+    CHECK_ERROR();
+    error = _micro_log_buf_puts(buf, "\": ");
+  }
+  else
+  {
+    error = _micro_log_buf_puts(buf, prefix);
+    CHECK_ERROR();
+    error = _micro_log_buf_puts(buf, field->key);
+    CHECK_ERROR();
+    error = _micro_log_buf_puts(buf, "=");
+  }
+  CHECK_ERROR();
+
+  int n = _micro_log_format_field(digits, field);
+  if (n >= 0)
+  {
+    error = _micro_log_buf_append(buf, digits, (size_t) n);
+  }
+  else
+  {
+    error = _micro_log_buf_puts(buf, "\"");
+    CHECK_ERROR();
+    error = _micro_log_buf_append_json(buf, field->value.s,
+                                       strlen(field->value.s));
+    CHECK_ERROR();
+    error = _micro_log_buf_puts(buf, "\"");
+  }
+  CHECK_ERROR();
+
+  return _micro_log_buf_puts(buf, json ? ", " : " ");
+
+#undef CHECK_ERROR
+}
+
+// Render the metadata of [record] that comes before the message,
+// with the [count] typed [fields] of a structured record
+MICRO_LOG_DEF micro_log_error
+_micro_log_render_header_kv(_MicroLogBuf *buf,
+                            const MicroLogRecord *record,
+                            const MicroLogField *fields,
+                            size_t count)
+{
+  micro_log_error error = MICRO_LOG_OK;
+  long unsigned int flags = _MICRO_LOG_FLAGS(record->flags);
+
+#define COLOR(x) color ? MICRO_LOG_LGRAY(x) : x
+#define COLOR2(x) color ? MICRO_LOG_BOLD(x) : x
+#define CHECK_ERROR() if (error != MICRO_LOG_OK) { goto done; }
+#define FIELD_BEGIN(name)                                      \
+  if (json)                                                    \
+  {                                                            \
+    error = _micro_log_buf_puts(buf, "\"" name "\": \"");      \
+    CHECK_ERROR();                                             \
+  }
+#define FIELD_END()                                            \
+  error = _micro_log_buf_puts(buf, json ? "\", " : " ");       \
+  CHECK_ERROR();
+// The escape sequence that begins COLOR
+#define COLOR_BEGIN "\x1B[90m"
+#define FIELD_STR(str, len)                                    \
+  if (color)                                                   \
+  {                                                            \
+    error = _micro_log_buf_puts(buf, COLOR_BEGIN);             \
+    CHECK_ERROR();                                             \
+  }                                                            \
+  error = _micro_log_buf_append(buf, (str), (len));            \
+  CHECK_ERROR();                                               \
+  if (color)                                                   \
+  {                                                            \
+    error = _micro_log_buf_puts(buf, MICRO_LOG_RST);           \
+    CHECK_ERROR();                                             \
+  }
+// A field rendered as a number in json, from its [digits]
+#define FIELD_DIGITS(name, digits, n)                          \
+  if (json)                                                    \
+  {                                                            \
+    error = _micro_log_buf_puts(buf, "\"" name "\": ");        \
+    CHECK_ERROR();                                             \
+    error = _micro_log_buf_append(buf, (digits), (n));         \
+    CHECK_ERROR();                                             \
+    error = _micro_log_buf_puts(buf, ", ");                    \
+    CHECK_ERROR();                                             \
+  }                                                            \
+  else                                                         \
+  {                                                            \
+    FIELD_STR((digits), (n));                                  \
+    FIELD_END();                                               \
+  }
+#define FIELD_NUM(name, value)                                 \
+  {                                                            \
+    char digits[24];                                           \
+    int n = _micro_log_format_uint(digits, (value), 0);        \
+    FIELD_DIGITS(name, digits, n);                             \
+  }
+
+  // Handle flags
+  bool json = false;
+  bool color = false;
+
+  if (flags == MICRO_LOG_FLAG_NONE)
+  {
+    // Skip other flags
+    goto fields;
+  }
+
+  if (flags & MICRO_LOG_FLAG_COLOR)
+  {
+    color = true;
+  }
+
+  if (flags & MICRO_LOG_FLAG_JSON)
+  {
+    json = true;
+    color = false;  // json disables color
+    error = _micro_log_buf_puts(buf, "{ ");
+    CHECK_ERROR();
+  }
+
+  const _MicroLogTimeCache *time_cache = NULL;
+  if (flags & (MICRO_LOG_FLAG_DATE | MICRO_LOG_FLAG_TIME))
+  {
+    time_cache = _micro_log_time_cache(record->time);
+  }
+
+  if (flags & MICRO_LOG_FLAG_DATE)
+  {
+    FIELD_BEGIN("date");
+    FIELD_STR(time_cache->date, time_cache->date_len);
+    FIELD_END();
+  }
+
+  // In text the fraction of the second is appended to the time, in
+  // json it is a field of its own
+  bool usec = (flags & MICRO_LOG_FLAG_USEC)
+              && !(flags & MICRO_LOG_FLAG_NSEC);
+  bool nsec = (flags & MICRO_LOG_FLAG_NSEC);
+  if ((flags & MICRO_LOG_FLAG_TIME) || (!json && (usec || nsec)))
+  {
+    char time[32];
+    int time_len = 0;
+    if (flags & MICRO_LOG_FLAG_TIME)
+    {
+      memcpy(time, time_cache->time, time_cache->time_len);
+      time_len = time_cache->time_len;
+    }
+    if (!json && (usec || nsec))
+    {
+      time[time_len++] = '.';
+      time_len += _micro_log_format_uint(time + time_len,
+                                         usec ? (uint64_t) record->nsec / 1000
+                                              : (uint64_t) record->nsec,
+                                         usec ? 6 : 9);
+    }
+    FIELD_BEGIN("time");
+    FIELD_STR(time, time_len);
+    FIELD_END();
+  }
+
+  if (json && usec)
+  {
+    FIELD_NUM("usec", (uint64_t) record->nsec / 1000);
+  }
+
+  if (json && nsec)
+  {
+    FIELD_NUM("nsec", (uint64_t) record->nsec);
+  }
+
+  if (flags & MICRO_LOG_FLAG_MONO)
+  {
+    FIELD_NUM("mono", (uint64_t) record->mono);
+  }
+
+  if (flags & MICRO_LOG_FLAG_LEVEL)
+  {
+    FIELD_BEGIN("log_level");
+    if (json)
+      // Without the padding
+      error = _micro_log_buf_puts(buf, micro_log_level_string(record->level,
+                                                             false));
+    else if (record->level < MICRO_LOG_LEVEL_MAX)
+      error = _micro_log_buf_append(buf,
+                                    _micro_log_level_fields[color][record->level].str,
+                                    _micro_log_level_fields[color][record->level].len);
+    else
+      // "UNKNOWN", longer than the padding
+      error = _micro_log_buf_puts(buf, micro_log_level_string(record->level,
+                                                             color));
+    CHECK_ERROR();
+    FIELD_END();
+  }
+
+  // The ids are already rendered, unless the record was logged by
+  // another thread
+  if (flags & MICRO_LOG_FLAG_PID)
+  {
+    const _MicroLogId *pid = _micro_log_pid();
+    if (pid->id == record->pid)
+    {
+      FIELD_DIGITS("pid", pid->str, pid->len);
+    }
+    else
+    {
+      char digits[24];
+      int n = _micro_log_format_int(digits, (int64_t) record->pid);
+      FIELD_DIGITS("pid", digits, n);
+    }
+  }
+
+  if (flags & MICRO_LOG_FLAG_TID)
+  {
+    const _MicroLogId *tid = _micro_log_tid();
+    if (tid->id == record->tid)
+    {
+      FIELD_DIGITS("tid", tid->str, tid->len);
+    }
+    else
+    {
+      char digits[24];
+      int n = _micro_log_format_int(digits, (int64_t) record->tid);
+      FIELD_DIGITS("tid", digits, n);
+    }
+  }
+
+  if (flags & MICRO_LOG_FLAG_FILE)
+  {
+    FIELD_BEGIN("file");
+    if (json)
+    {
+      error = _micro_log_buf_append_json(buf, record->file,
+                                         strlen(record->file));
+      CHECK_ERROR();
+    }
+    else
+    {
+      FIELD_STR(record->file, strlen(record->file));
+    }
+    FIELD_END();
+  }
+
+  if (flags & MICRO_LOG_FLAG_LINE)
+  {
+    char digits[24];
+    int n = _micro_log_format_int(digits, (int64_t) record->line);
+    FIELD_DIGITS("line", digits, n);
+  }
+
+  // So that the counts can be scaled back up
+  if (json && record->sample_rate > 1)
+  {
+    FIELD_NUM("sample_rate", (uint64_t) record->sample_rate);
+  }
+
+ fields:
+  for (size_t i = 0; i < count; ++i)
+  {
+    error = _micro_log_render_field(buf, &fields[i], json, "");
+    CHECK_ERROR();
+  }
+
+  if (json)
+  {
+    error = _micro_log_buf_puts(buf, "\"log\": \"");
+    CHECK_ERROR();
+  }
+  else if (flags > 1)
+  {
+    error = _micro_log_buf_puts(buf, COLOR2("| "));
+    CHECK_ERROR();
+  }
+
+ done:
+  return error;
+
+#undef COLOR
+#undef COLOR2
+#undef COLOR_BEGIN
+#undef CHECK_ERROR
+#undef FIELD_BEGIN
+#undef FIELD_END
+#undef FIELD_STR
+#undef FIELD_DIGITS
+#undef FIELD_NUM
+}
+
+// Render the metadata of [record] that comes before the message
+MICRO_LOG_DEF micro_log_error
+_micro_log_render_header(_MicroLogBuf *buf, const MicroLogRecord *record)
+{
+  return _micro_log_render_header_kv(buf, record, NULL, 0);
+}
+
+// Escape the message of [record] written in [buf] after [begin], if
+// the record is rendered as json
+MICRO_LOG_DEF micro_log_error
+_micro_log_render_escape(_MicroLogBuf *buf,
+                         const MicroLogRecord *record,
+                         size_t begin)
+{
+  (void) record;
+  if (_MICRO_LOG_FLAGS(record->flags) & MICRO_LOG_FLAG_JSON)
+    return _micro_log_buf_escape_json(buf, begin);
+  return MICRO_LOG_OK;
+}
+
+// Render what comes after the message of [record]
+MICRO_LOG_DEF micro_log_error
+_micro_log_render_footer(_MicroLogBuf *buf, const MicroLogRecord *record)
+{
+  (void) record;
+  return _micro_log_buf_puts(buf,
+                             (_MICRO_LOG_FLAGS(record->flags)
+                              & MICRO_LOG_FLAG_JSON) ? "\" }\n" : "\n");
+}
+
+// Render a full record (header, message and trailing newline) in [buf]
+//
+// If [msg_begin] and [msg_len] are not NULL, they are set to the
+// position of the message in [buf], or to 0 if rendering failed.
+MICRO_LOG_DEF micro_log_error
+_micro_log_render(_MicroLogBuf *buf,
+                  const MicroLogRecord *record,
+                  const char *fmt,
+                  va_list args,
+                  size_t *msg_begin,
+                  size_t *msg_len)
+{
+  if (msg_begin != NULL) *msg_begin = 0;
+  if (msg_len != NULL)   *msg_len = 0;
+
+  micro_log_error error = _micro_log_render_header(buf, record);
+  if (error != MICRO_LOG_OK)
+    return error;
+
+  size_t begin = buf->len;
+  error = _micro_log_buf_vprintf(buf, fmt, args);
+  if (error != MICRO_LOG_OK)
+    return error;
+  error = _micro_log_render_escape(buf, record, begin);
+  if (error != MICRO_LOG_OK)
+    return error;
+  if (msg_begin != NULL) *msg_begin = begin;
+  if (msg_len != NULL)   *msg_len = buf->len - begin;
+
+  return _micro_log_render_footer(buf, record);
+}
+
+//
+// Deferred formatting
+//
+// Instead of formatting a message right away, the arguments of the
+// format string are copied in a compact binary form so the message
+// can be formatted later, by another thread or by another
+// program. The format string itself is not copied, only its address.
+//
+// The packed arguments are laid out one after the other, in the
+// order in which they are read from the va_list, and copied with
+// memcpy so they need no alignment. Strings are stored as their
+// length (a size_t, SIZE_MAX for NULL) followed by their bytes and a
+// terminating NUL.
+//
+
+// Classes of printf arguments, one per type read from a va_list
+enum {
+  _MICRO_LOG_ARG_INT = 0,
+  _MICRO_LOG_ARG_LONG,
+  _MICRO_LOG_ARG_LLONG,
+  _MICRO_LOG_ARG_INTMAX,
+  _MICRO_LOG_ARG_SIZE,
+  _MICRO_LOG_ARG_PTRDIFF,
+  _MICRO_LOG_ARG_DOUBLE,
+  _MICRO_LOG_ARG_LDOUBLE,
+  _MICRO_LOG_ARG_STRING,
+  _MICRO_LOG_ARG_POINTER,
+  _MICRO_LOG_ARG_INVALID,
+};
+
+// A parsed printf conversion specification
+typedef struct {
+  // Length of the specification, without the leading '%'
+  int len;
+  // Number of '*' for the width and the precision
+  int stars;
+  // Whether the precision is a '*'
+  bool star_precision;
+  // Precision given in the format string, -1 if none
+  int precision;
+  // One of the _MICRO_LOG_ARG_ classes
+  int arg;
+} _MicroLogSpec;
+
+// Parse the conversion specification after a '%' in [fmt]
+//
+// Conversions that can not be deferred, like %n, wide strings or
+// positional arguments, are reported as _MICRO_LOG_ARG_INVALID.
+MICRO_LOG_DEF void _micro_log_parse_spec(const char *fmt, _MicroLogSpec *spec)
+{
+  const char *p = fmt;
+  *spec = (_MicroLogSpec){
+    .len = 0,
+    .stars = 0,
+    .star_precision = false,
+    .precision = -1,
+    .arg = _MICRO_LOG_ARG_INVALID,
+  };
+
+  while (*p != '\0' && strchr("-+ #0'", *p) != NULL)
+    p++;
+
+  if (*p == '*')
+  {
+    spec->stars++;
+    p++;
+  }
+  else
+  {
+    while (*p >= '0' && *p <= '9') p++;
+  }
+
+  if (*p == '.')
+  {
+    p++;
+    if (*p == '*')
+    {
+      spec->stars++;
+      spec->star_precision = true;
+      p++;
+    }
+    else
+    {
+      spec->precision = 0;
+      while (*p >= '0' && *p <= '9')
+        spec->precision = spec->precision * 10 + (*p++ - '0');
+    }
+  }
+
+  int length = 0;
+  if (*p == 'h')
+  {
+    p++;
+    if (*p == 'h') p++;
+  }
+  else if (*p == 'l')
+  {
+    length = _MICRO_LOG_ARG_LONG;
+    p++;
+    if (*p == 'l')
+    {
+      length = _MICRO_LOG_ARG_LLONG;
+      p++;
+    }
+  }
+  else if (*p == 'q') { length = _MICRO_LOG_ARG_LLONG;   p++; }
+  else if (*p == 'j') { length = _MICRO_LOG_ARG_INTMAX;  p++; }
+  else if (*p == 'z') { length = _MICRO_LOG_ARG_SIZE;    p++; }
+  else if (*p == 't') { length = _MICRO_LOG_ARG_PTRDIFF; p++; }
+  else if (*p == 'L') { length = _MICRO_LOG_ARG_LDOUBLE; p++; }
+
+  switch (*p)
+  {
+  case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+    if (length != _MICRO_LOG_ARG_LDOUBLE)
+      spec->arg = (length == 0) ? _MICRO_LOG_ARG_INT : length;
+    break;
+  case 'c':
+    if (length == 0)
+      spec->arg = _MICRO_LOG_ARG_INT;
+    break;
+  case 'e': case 'E': case 'f': case 'F':
+  case 'g': case 'G': case 'a': case 'A':
+    if (length == 0)
+      spec->arg = _MICRO_LOG_ARG_DOUBLE;
+    else if (length == _MICRO_LOG_ARG_LDOUBLE)
+      spec->arg = _MICRO_LOG_ARG_LDOUBLE;
+    break;
+  case 's':
+    if (length == 0)
+      spec->arg = _MICRO_LOG_ARG_STRING;
+    break;
+  case 'p':
+    if (length == 0)
+      spec->arg = _MICRO_LOG_ARG_POINTER;
+    break;
+  default:
+    break;
+  }
+
+  if (*p != '\0')
+    p++;
+  spec->len = (int) (p - fmt);
+}
+
+// Copy the arguments of [fmt] from [args] to [buf]
+//
+// Returns MICRO_LOG_ERROR_FORMAT if [fmt] uses a conversion that
+// can not be deferred, in which case the message should be formatted
+// right away instead.
+MICRO_LOG_DEF micro_log_error
+_micro_log_deferred_pack(_MicroLogBuf *buf, const char *fmt, va_list args)
+{
+  micro_log_error error = MICRO_LOG_OK;
+
+#define PACK(type)                                            \
+  do {                                                        \
+    type value = va_arg(args, type);                          \
+    error = _micro_log_buf_append(buf, (const char*) &value,  \
+                                  sizeof(value));             \
+    if (error != MICRO_LOG_OK) return error;                  \
+  } while (0)
+
+  const char *p = fmt;
+  while (*p != '\0')
+  {
+    if (*p++ != '%')
+      continue;
+    if (*p == '%')
+    {
+      p++;
+      continue;
+    }
+
+    _MicroLogSpec spec;
+    _micro_log_parse_spec(p, &spec);
+    if (spec.arg == _MICRO_LOG_ARG_INVALID)
+      return MICRO_LOG_ERROR_FORMAT;
+    p += spec.len;
+
+    int precision = spec.precision;
+    for (int i = 0; i < spec.stars; ++i)
+    {
+      int star = va_arg(args, int);
+      error = _micro_log_buf_append(buf, (const char*) &star, sizeof(star));
+      if (error != MICRO_LOG_OK) return error;
+      if (spec.star_precision)
+        precision = star;
+    }
+
+    switch (spec.arg)
+    {
+    case _MICRO_LOG_ARG_INT:     PACK(int);         break;
+    case _MICRO_LOG_ARG_LONG:    PACK(long);        break;
+    case _MICRO_LOG_ARG_LLONG:   PACK(long long);   break;
+    case _MICRO_LOG_ARG_INTMAX:  PACK(intmax_t);    break;
+    case _MICRO_LOG_ARG_SIZE:    PACK(size_t);      break;
+    case _MICRO_LOG_ARG_PTRDIFF: PACK(ptrdiff_t);   break;
+    case _MICRO_LOG_ARG_DOUBLE:  PACK(double);      break;
+    case _MICRO_LOG_ARG_LDOUBLE: PACK(long double); break;
+    case _MICRO_LOG_ARG_POINTER: PACK(void*);       break;
+    case _MICRO_LOG_ARG_STRING:
+    {
+      const char *str = va_arg(args, const char*);
+      size_t len = SIZE_MAX;
+      if (str != NULL)
+        len = (precision >= 0) ? strnlen(str, (size_t) precision)
+                               : strlen(str);
+
+      error = _micro_log_buf_append(buf, (const char*) &len, sizeof(len));
+      if (error != MICRO_LOG_OK) return error;
+      if (str != NULL)
+      {
+        error = _micro_log_buf_append(buf, str, len);
+        if (error != MICRO_LOG_OK) return error;
+        error = _micro_log_buf_append(buf, "", 1);
+        if (error != MICRO_LOG_OK) return error;
+      }
+      break;
+    }
+    default:
+      return MICRO_LOG_ERROR_FORMAT;
+    }
+  }
+
+  return error;
+
+#undef PACK
+}
+
+// Format [fmt] in [buf] using the arguments packed by
+// `_micro_log_deferred_pack`
+MICRO_LOG_DEF micro_log_error
+_micro_log_deferred_format(_MicroLogBuf *buf,
+                           const char *fmt,
+                           const char *args,
+                           size_t args_len)
+{
+  micro_log_error error = MICRO_LOG_OK;
+  const char *end = args + args_len;
+
+#define READ(dst)                                             \
+  do {                                                        \
+    if ((size_t) (end - args) < sizeof(dst))                  \
+      return MICRO_LOG_ERROR_FORMAT;                          \
+    memcpy(&(dst), args, sizeof(dst));                        \
+    args += sizeof(dst);                                      \
+  } while (0)
+#define PRINT(value)                                                  \
+  do {                                                                \
+    if (spec.stars == 0)                                              \
+      error = _micro_log_buf_printf(buf, conversion, value);          \
+    else if (spec.stars == 1)                                         \
+      error = _micro_log_buf_printf(buf, conversion, stars[0], value); \
+    else                                                              \
+      error = _micro_log_buf_printf(buf, conversion, stars[0],        \
+                                    stars[1], value);                 \
+  } while (0)
+#define UNPACK(type)                                          \
+  do {                                                        \
+    type value;                                               \
+    READ(value);                                              \
+    PRINT(value);                                             \
+  } while (0)
+
+  const char *literal = fmt;
+  const char *p = fmt;
+  while (*p != '\0')
+  {
+    if (*p != '%')
+    {
+      p++;
+      continue;
+    }
+
+    error = _micro_log_buf_append(buf, literal, (size_t) (p - literal));
+    if (error != MICRO_LOG_OK) return error;
+
+    if (p[1] == '%')
+    {
+      error = _micro_log_buf_append(buf, "%", 1);
+      if (error != MICRO_LOG_OK) return error;
+      p += 2;
+      literal = p;
+      continue;
+    }
+
+    _MicroLogSpec spec;
+    _micro_log_parse_spec(p + 1, &spec);
+    char conversion[32];
+    if (spec.arg == _MICRO_LOG_ARG_INVALID
+        || (size_t) spec.len + 2 > sizeof(conversion))
+      return MICRO_LOG_ERROR_FORMAT;
+    memcpy(conversion, p, (size_t) spec.len + 1);
+    conversion[spec.len + 1] = '\0';
+    p += spec.len + 1;
+    literal = p;
+
+    int stars[2] = { 0, 0 };
+    for (int i = 0; i < spec.stars; ++i)
+      READ(stars[i]);
+
+    switch (spec.arg)
+    {
+    case _MICRO_LOG_ARG_INT:     UNPACK(int);         break;
+    case _MICRO_LOG_ARG_LONG:    UNPACK(long);        break;
+    case _MICRO_LOG_ARG_LLONG:   UNPACK(long long);   break;
+    case _MICRO_LOG_ARG_INTMAX:  UNPACK(intmax_t);    break;
+    case _MICRO_LOG_ARG_SIZE:    UNPACK(size_t);      break;
+    case _MICRO_LOG_ARG_PTRDIFF: UNPACK(ptrdiff_t);   break;
+    case _MICRO_LOG_ARG_DOUBLE:  UNPACK(double);      break;
+    case _MICRO_LOG_ARG_LDOUBLE: UNPACK(long double); break;
+    case _MICRO_LOG_ARG_POINTER: UNPACK(void*);       break;
+    case _MICRO_LOG_ARG_STRING:
+    {
+      size_t len;
+      READ(len);
+      // The arguments may come from a corrupt file, the string must
+      // end with its NUL inside them
+      const char *str = "(null)";
+      if (len != SIZE_MAX)
+      {
+        if (len >= (size_t) (end - args) || args[len] != '\0')
+          return MICRO_LOG_ERROR_FORMAT;
+        str = args;
+        args += len + 1;
+      }
+      PRINT(str);
+      break;
+    }
+    default:
+      return MICRO_LOG_ERROR_FORMAT;
+    }
+    if (error != MICRO_LOG_OK) return error;
+  }
+
+  return _micro_log_buf_append(buf, literal, (size_t) (p - literal));
+
+#undef READ
+#undef PRINT
+#undef UNPACK
+}
+
+// Render [record] in [buf] from the packed arguments of [fmt]
+//
+// [msg_begin] and [msg_len] are set to the position of the message in
+// [buf], or to 0 if rendering failed.
+MICRO_LOG_DEF micro_log_error
+_micro_log_render_packed(_MicroLogBuf *buf,
+                         const MicroLogRecord *record,
+                         const char *fmt,
+                         const char *args,
+                         size_t args_len,
+                         size_t *msg_begin,
+                         size_t *msg_len)
+{
+  *msg_begin = 0;
+  *msg_len = 0;
+
+  micro_log_error error = _micro_log_render_header(buf, record);
+  if (error != MICRO_LOG_OK)
+    return error;
+
+  size_t begin = buf->len;
+  error = _micro_log_deferred_format(buf, fmt, args, args_len);
+  if (error != MICRO_LOG_OK)
+    return error;
+  error = _micro_log_render_escape(buf, record, begin);
+  if (error != MICRO_LOG_OK)
+    return error;
+  *msg_begin = begin;
+  *msg_len = buf->len - begin;
+
+  return _micro_log_render_footer(buf, record);
+}
+
+// Store the packed arguments of [fmt] in the [size] bytes of [data]
+//
+// Returns false if the arguments can not be packed or do not fit,
+// and the record must be rendered instead.
+MICRO_LOG_DEF bool
+_micro_log_pack_truncated(char *data,
+                          size_t size,
+                          const char *fmt,
+                          va_list args,
+                          size_t *len)
+{
+  _MicroLogBuf buf;
+  _micro_log_buf_init(&buf, data, size);
+
+  va_list copy;
+  va_copy(copy, args);
+  micro_log_error error = _micro_log_deferred_pack(&buf, fmt, copy);
+  va_end(copy);
+
+  bool ok = (error == MICRO_LOG_OK && !buf.heap);
+  *len = buf.len;
+  _micro_log_buf_free(&buf);
+  return ok;
+}
+
+// Render [record] in the [size] bytes of [data]
+//
+// A record that does not fit is truncated, and still ends with a
+// newline. [len] is set to the length of the rendered record, or 0
+// if rendering failed.
+MICRO_LOG_DEF micro_log_error
+_micro_log_render_truncated(char *data,
+                            size_t size,
+                            const MicroLogRecord *record,
+                            const char *fmt,
+                            va_list args,
+                            size_t *len,
+                            size_t *msg_begin,
+                            size_t *msg_len)
+{
+  _MicroLogBuf buf;
+  _micro_log_buf_init(&buf, data, size);
+  micro_log_error error = _micro_log_render(&buf, record, fmt, args,
+                                            msg_begin, msg_len);
+  if (error == MICRO_LOG_OK && buf.heap)
+  {
+    // Did not fit, keep what fits and end the line
+    size_t kept = (buf.len < size) ? buf.len : size;
+    memcpy(data, buf.data, kept);
+    data[kept - 1] = '\n';
+    buf.len = kept;
+    if (*msg_begin + *msg_len > kept - 1)
+      *msg_len = (*msg_begin < kept - 1) ? kept - 1 - *msg_begin : 0;
+  }
+  *len = (error == MICRO_LOG_OK) ? buf.len : 0;
+  _micro_log_buf_free(&buf);
+  return error;
+}
+
+//
+// Binary output
+//
+// The binary output is a stream of frames, each made of a one byte
+// type, a four byte length and a payload, after a header that
+// describes the architecture of the writer. A call site (format
+// string, source file and line) is described by a format frame the
+// first time it is used; record frames then refer to it by id and
+// only carry the time, pid, tid, level and flags of the record and
+// its packed arguments. Records whose arguments can not be packed
+// are stored as text frames with the formatted message. All the
+// integers are in native byte order and unaligned.
+//
+
+#define _MICRO_LOG_BINARY_MAGIC   "MICROLOG"
+#define _MICRO_LOG_BINARY_VERSION 2
+
+#define _MICRO_LOG_BINARY_FORMAT  'F'
+#define _MICRO_LOG_BINARY_RECORD  'R'
+#define _MICRO_LOG_BINARY_TEXT    'T'
+
+// First bytes of a binary output
+typedef struct {
+  char     magic[8];
+  uint32_t version;
+  // 0x01020304 in the byte order of the writer
+  uint32_t byte_order;
+  // Sizes of the types the packed arguments are made of
+  uint8_t  sizeof_int;
+  uint8_t  sizeof_long;
+  uint8_t  sizeof_llong;
+  uint8_t  sizeof_intmax;
+  uint8_t  sizeof_size;
+  uint8_t  sizeof_ptrdiff;
+  uint8_t  sizeof_double;
+  uint8_t  sizeof_ldouble;
+  uint8_t  sizeof_pointer;
+  uint8_t  _reserved[7];
+} _MicroLogBinaryHeader;
+
+// Size of the metadata of a record in record and text frames: time
+// (8 bytes), pid (4), tid (4), flags (2), level (1), nanoseconds of
+// the time (4), monotonic time (8) and sample rate (4)
+#define _MICRO_LOG_BINARY_RECORD_SIZE 35
+
+_Static_assert(MICRO_LOG_FLAG_MONO < (1 << 16),
+               "Updated MICRO_LOG_FLAG, flags do not fit in a binary record anymore");
+
+MICRO_LOG_DEF void _micro_log_binary_header(_MicroLogBinaryHeader *header)
+{
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, _MICRO_LOG_BINARY_MAGIC, sizeof(header->magic));
+  header->version        = _MICRO_LOG_BINARY_VERSION;
+  header->byte_order     = 0x01020304;
+  header->sizeof_int     = sizeof(int);
+  header->sizeof_long    = sizeof(long);
+  header->sizeof_llong   = sizeof(long long);
+  header->sizeof_intmax  = sizeof(intmax_t);
+  header->sizeof_size    = sizeof(size_t);
+  header->sizeof_ptrdiff = sizeof(ptrdiff_t);
+  header->sizeof_double  = sizeof(double);
+  header->sizeof_ldouble = sizeof(long double);
+  header->sizeof_pointer = sizeof(void*);
+}
+
+// Encode the metadata of [record] in [out]
+MICRO_LOG_DEF void
+_micro_log_binary_record(char *out, const MicroLogRecord *record)
+{
+  int64_t  time  = (int64_t) record->time;
+  uint32_t pid   = (uint32_t) record->pid;
+  uint32_t tid   = (uint32_t) record->tid;
+  uint16_t flags = (uint16_t) record->flags;
+  uint8_t  level = (uint8_t) record->level;
+  uint32_t nsec  = (uint32_t) record->nsec;
+  int64_t  mono  = record->mono;
+  uint32_t rate  = (uint32_t) record->sample_rate;
+  memcpy(out,      &time,  sizeof(time));
+  memcpy(out + 8,  &pid,   sizeof(pid));
+  memcpy(out + 12, &tid,   sizeof(tid));
+  memcpy(out + 16, &flags, sizeof(flags));
+  memcpy(out + 18, &level, sizeof(level));
+  memcpy(out + 19, &nsec,  sizeof(nsec));
+  memcpy(out + 23, &mono,  sizeof(mono));
+  memcpy(out + 31, &rate,  sizeof(rate));
+}
+
+// Decode the metadata encoded by `_micro_log_binary_record`, the
+// file and line are left untouched
+MICRO_LOG_DEF void
+_micro_log_binary_record_decode(const char *in, MicroLogRecord *record)
+{
+  int64_t  time;
+  uint32_t pid, tid;
+  uint16_t flags;
+  uint8_t  level;
+  uint32_t nsec;
+  int64_t  mono;
+  uint32_t rate;
+  memcpy(&time,  in,      sizeof(time));
+  memcpy(&pid,   in + 8,  sizeof(pid));
+  memcpy(&tid,   in + 12, sizeof(tid));
+  memcpy(&flags, in + 16, sizeof(flags));
+  memcpy(&level, in + 18, sizeof(level));
+  memcpy(&nsec,  in + 19, sizeof(nsec));
+  memcpy(&mono,  in + 23, sizeof(mono));
+  memcpy(&rate,  in + 31, sizeof(rate));
+  record->time  = (time_t) time;
+  record->pid   = (long) pid;
+  record->tid   = (long) tid;
+  record->flags = flags;
+  record->level = (MicroLogLevel) level;
+  record->nsec  = (long) nsec;
+  record->mono  = mono;
+  record->sample_rate = rate;
+}
+
+// Write a frame made of the concatenation of [count] parts
+MICRO_LOG_DEF micro_log_error
+_micro_log_binary_frame(FILE *file, char type, int count,
+                        const void **parts, const size_t *sizes)
+{
+  uint32_t len = 0;
+  for (int i = 0; i < count; ++i)
+    len += (uint32_t) sizes[i];
+
+  if (fwrite(&type, 1, 1, file) != 1
+      || fwrite(&len, sizeof(len), 1, file) != 1)
+    return MICRO_LOG_ERROR_PRINTF_BINARY;
+  for (int i = 0; i < count; ++i)
+  {
+    if (sizes[i] > 0 && fwrite(parts[i], 1, sizes[i], file) != sizes[i])
+      return MICRO_LOG_ERROR_PRINTF_BINARY;
+  }
+  return MICRO_LOG_OK;
+}
+
+#define _MICRO_LOG_BINARY_HASH(fmt, file, line) \
+  (((uintptr_t) (fmt) >> 3) ^ (uintptr_t) (file) ^ ((size_t) (line) * 31))
+
+// Get the id of the call site of [fmt] at [file]:[line], describing
+// it in the binary output if it is the first time it is used
+MICRO_LOG_DEF micro_log_error
+_micro_log_binary_format_id(MicroLog *micro_log,
+                            const char *fmt,
+                            const char *file,
+                            int line,
+                            uint32_t *id)
+{
+  if (2 * (size_t) (micro_log->binary_formats_count + 1)
+      > micro_log->binary_formats_cap)
+  {
+    // Grow the table and move the entries over
+    size_t cap = micro_log->binary_formats_cap
+                 ? 2 * micro_log->binary_formats_cap : 64;
+    MicroLogBinaryFormat *formats = calloc(cap, sizeof(*formats));
+    if (formats == NULL)
+      return MICRO_LOG_ERROR_ALLOC;
+    for (size_t i = 0; i < micro_log->binary_formats_cap; ++i)
+    {
+      MicroLogBinaryFormat *old = &micro_log->binary_formats[i];
+      if (old->fmt == NULL) continue;
+      size_t h = _MICRO_LOG_BINARY_HASH(old->fmt, old->file, old->line)
+                 & (cap - 1);
+      while (formats[h].fmt != NULL) h = (h + 1) & (cap - 1);
+      formats[h] = *old;
+    }
+    free(micro_log->binary_formats);
+    micro_log->binary_formats = formats;
+    micro_log->binary_formats_cap = cap;
+  }
+
+  size_t mask = micro_log->binary_formats_cap - 1;
+  size_t h = _MICRO_LOG_BINARY_HASH(fmt, file, line) & mask;
+  for (;;)
+  {
+    MicroLogBinaryFormat *format = &micro_log->binary_formats[h];
+    if (format->fmt == fmt && format->file == file && format->line == line)
+    {
+      *id = format->id;
+      return MICRO_LOG_OK;
+    }
+    if (format->fmt == NULL)
+      break;
+    h = (h + 1) & mask;
+  }
+
+  *id = micro_log->binary_formats_count;
+  int32_t line32 = line;
+  uint32_t file_len = (uint32_t) strlen(file);
+  const void *parts[] = { id, &line32, &file_len, file, fmt };
+  size_t sizes[] = { sizeof(*id), sizeof(line32), sizeof(file_len),
+                     file_len, strlen(fmt) };
+  micro_log_error error =
+    _micro_log_binary_frame(micro_log->binary_file, _MICRO_LOG_BINARY_FORMAT,
+                            5, parts, sizes);
+  if (error != MICRO_LOG_OK)
+    return error;
+
+  micro_log->binary_formats[h] = (MicroLogBinaryFormat){
+    .fmt  = fmt,
+    .file = file,
+    .line = line,
+    .id   = *id,
+  };
+  micro_log->binary_formats_count++;
+  return MICRO_LOG_OK;
+}
+
+// A record ready to be written to the outputs
+typedef struct {
+  const MicroLogRecord *record;
+  // MICRO_LOG_OUT bitfield of the outputs to write to
+  long unsigned int out;
+  // The rendered record, for the text outputs
+  const char *text;
+  size_t text_len;
+  // The formatted message, inside [text]
+  const char *msg;
+  size_t msg_len;
+  // If not NULL, the format string with its packed arguments
+  const char *fmt;
+  const char *args;
+  size_t args_len;
+  // The typed fields of a structured record, already in [text]
+  const MicroLogField *fields;
+  size_t fields_count;
+} _MicroLogEntry;
+
+//
+// Encodings
+//
+// The text outputs get the record rendered with the flags of the
+// logger, unless another encoding or a framing is set for them. The
+// other encodings are made from the message already formatted for
+// the record and from its metadata, so the format string is only
+// formatted once for all of the outputs.
+//
+
+// Index of the output [sink], a single MICRO_LOG_OUT bit, in the
+// encodings of a logger
+MICRO_LOG_DEF int _micro_log_out_index(long unsigned int sink)
+{
+  return __builtin_ctzl(sink);
+}
+
+// The outputs of the MICRO_LOG_OUT bitfield [out] that take the
+// records of [level], see `micro_log_set_out_level2`
+MICRO_LOG_DEF long unsigned int
+_micro_log_out_for_level(MicroLog *micro_log,
+                         long unsigned int out,
+                         MicroLogLevel level)
+{
+  for (int i = 0; i < _MICRO_LOG_OUT_COUNT; ++i)
+    if (level < _MICRO_LOG_LOAD(micro_log->out_levels[i]))
+      out &= ~(1lu << i);
+  return out;
+}
+
+// Whether [sink] gets the record as rendered, without encoding it
+MICRO_LOG_DEF bool
+_micro_log_out_plain(MicroLog *micro_log, long unsigned int sink)
+{
+  int index = _micro_log_out_index(sink);
+  return _MICRO_LOG_LOAD(micro_log->encodings[index]) == MICRO_LOG_ENCODING_TEXT
+    && _MICRO_LOG_LOAD(micro_log->framings[index]) == MICRO_LOG_FRAMING_NONE;
+}
+
+static char _micro_log_hostname_cache[256];
+static pthread_once_t _micro_log_hostname_once = PTHREAD_ONCE_INIT;
+
+MICRO_LOG_DEF void _micro_log_hostname_read(void)
+{
+  if (gethostname(_micro_log_hostname_cache,
+                  sizeof(_micro_log_hostname_cache) - 1) != 0)
+    strcpy(_micro_log_hostname_cache, "localhost");
+}
+
+// Get the cached name of this machine
+MICRO_LOG_DEF const char *_micro_log_hostname(void)
+{
+  pthread_once(&_micro_log_hostname_once, _micro_log_hostname_read);
+  return _micro_log_hostname_cache;
+}
+
+static char _micro_log_app_name_cache[49];
+static pthread_once_t _micro_log_app_name_once = PTHREAD_ONCE_INIT;
+
+MICRO_LOG_DEF void _micro_log_app_name_read(void)
+{
+  const char *name = "-";
+  #ifdef __linux__
+  if (program_invocation_short_name != NULL
+      && program_invocation_short_name[0] != '\0')
+    name = program_invocation_short_name;
+  #endif // __linux__
+  size_t len = 0;
+  for (; name[len] != '\0' && len < sizeof(_micro_log_app_name_cache) - 1;
+       ++len)
+  {
+    // Only printable characters, and no spaces
+    unsigned char c = (unsigned char) name[len];
+    _micro_log_app_name_cache[len] = (c > ' ' && c < 0x7f) ? (char) c : '_';
+  }
+  _micro_log_app_name_cache[len] = '\0';
+}
+
+// Get the cached name of this program, up to 48 characters
+MICRO_LOG_DEF const char *_micro_log_app_name(void)
+{
+  pthread_once(&_micro_log_app_name_once, _micro_log_app_name_read);
+  return _micro_log_app_name_cache;
+}
+
+// Syslog severity of [level]: debug, info, warning, error or critical
+MICRO_LOG_DEF unsigned int _micro_log_syslog_severity(MicroLogLevel level)
+{
+  static const unsigned int severities[] = { 7, 7, 6, 4, 3, 2 };
+  return (level < MICRO_LOG_LEVEL_DISABLED) ? severities[level] : 7;
+}
+
+// Append the message of [entry] as it was formatted, without escapes
+MICRO_LOG_DEF micro_log_error
+_micro_log_encode_raw_msg(_MicroLogBuf *buf, const _MicroLogEntry *entry)
+{
+  // Escaped if the record was rendered as json
+  if (_MICRO_LOG_FLAGS(entry->record->flags) & MICRO_LOG_FLAG_JSON)
+    return _micro_log_buf_append_unescaped(buf, entry->msg, entry->msg_len);
+  return _micro_log_buf_append(buf, entry->msg, entry->msg_len);
+}
+
+// Append the message of [entry] escaped for a json string
+MICRO_LOG_DEF micro_log_error
+_micro_log_encode_msg(_MicroLogBuf *buf, const _MicroLogEntry *entry)
+{
+  // Already escaped if the record was rendered as json
+  if (_MICRO_LOG_FLAGS(entry->record->flags) & MICRO_LOG_FLAG_JSON)
+    return _micro_log_buf_append(buf, entry->msg, entry->msg_len);
+  return _micro_log_buf_append_json(buf, entry->msg, entry->msg_len);
+}
+
+// Append [len] bytes of [str] as a logfmt value, in quotes if needed
+MICRO_LOG_DEF micro_log_error
+_micro_log_encode_logfmt_value(_MicroLogBuf *buf, const char *str, size_t len)
+{
+  bool quote = (len == 0);
+  for (size_t i = 0; i < len && !quote; ++i)
+    quote = (str[i] == ' ' || str[i] == '=' || str[i] == '"'
+             || (unsigned char) str[i] < 0x20);
+  if (!quote)
+    return _micro_log_buf_append(buf, str, len);
+
+  micro_log_error error = _micro_log_buf_puts(buf, "\"");
+  if (error == MICRO_LOG_OK)
+    error = _micro_log_buf_append_json(buf, str, len);
+  if (error == MICRO_LOG_OK)
+    error = _micro_log_buf_puts(buf, "\"");
+  return error;
+}
+
+// Encode [entry] as logfmt, without the newline
+MICRO_LOG_DEF micro_log_error
+_micro_log_encode_logfmt(_MicroLogBuf *buf, const _MicroLogEntry *entry)
+{
+  static const char *levels[] = {
+    "trace", "debug", "info", "warn", "error", "fatal",
+  };
+  const MicroLogRecord *record = entry->record;
+  long unsigned int flags = _MICRO_LOG_FLAGS(record->flags);
+  micro_log_error error = MICRO_LOG_OK;
+  char digits[24];
+  int n;
+
+#define CHECK_ERROR() if (error != MICRO_LOG_OK) { goto done; }
+#define PUTS(str)                                              \
+  error = _micro_log_buf_puts(buf, (str));                     \
+  CHECK_ERROR();
+#define APPEND(str, len)                                       \
+  error = _micro_log_buf_append(buf, (str), (len));            \
+  CHECK_ERROR();
+
+  if (flags & (MICRO_LOG_FLAG_DATE | MICRO_LOG_FLAG_TIME))
+  {
+    const _MicroLogTimeCache *time_cache = _micro_log_time_cache(record->time);
+    PUTS("time=");
+    APPEND(time_cache->date, time_cache->date_len);
+    PUTS("T");
+    APPEND(time_cache->time, time_cache->time_len);
+    if (flags & (MICRO_LOG_FLAG_USEC | MICRO_LOG_FLAG_NSEC))
+    {
+      bool nsec = (flags & MICRO_LOG_FLAG_NSEC);
+      digits[0] = '.';
+      n = 1 + _micro_log_format_uint(digits + 1,
+                                     nsec ? (uint64_t) record->nsec
+                                          : (uint64_t) record->nsec / 1000,
+                                     nsec ? 9 : 6);
+      APPEND(digits, n);
+    }
+    PUTS(" ");
+  }
+
+  PUTS("level=");
+  PUTS(record->level < MICRO_LOG_LEVEL_DISABLED
+       ? levels[record->level] : "unknown");
+  PUTS(" ");
+
+  if (flags & MICRO_LOG_FLAG_MONO)
+  {
+    PUTS("mono=");
+    n = _micro_log_format_uint(digits, (uint64_t) record->mono, 0);
+    APPEND(digits, n);
+    PUTS(" ");
+  }
+  if (flags & MICRO_LOG_FLAG_PID)
+  {
+    PUTS("pid=");
+    n = _micro_log_format_int(digits, (int64_t) record->pid);
+    APPEND(digits, n);
+    PUTS(" ");
+  }
+  if (flags & MICRO_LOG_FLAG_TID)
+  {
+    PUTS("tid=");
+    n = _micro_log_format_int(digits, (int64_t) record->tid);
+    APPEND(digits, n);
+    PUTS(" ");
+  }
+  if (flags & MICRO_LOG_FLAG_FILE)
+  {
+    PUTS("file=");
+    error = _micro_log_encode_logfmt_value(buf, record->file,
+                                           strlen(record->file));
+    CHECK_ERROR();
+    PUTS(" ");
+  }
+  if (flags & MICRO_LOG_FLAG_LINE)
+  {
+    PUTS("line=");
+    n = _micro_log_format_int(digits, (int64_t) record->line);
+    APPEND(digits, n);
+    PUTS(" ");
+  }
+  if (record->sample_rate > 1)
+  {
+    PUTS("sample_rate=");
+    n = _micro_log_format_uint(digits, (uint64_t) record->sample_rate, 0);
+    APPEND(digits, n);
+    PUTS(" ");
+  }
+  for (size_t i = 0; i < entry->fields_count; ++i)
+  {
+    error = _micro_log_render_field(buf, &entry->fields[i], false, "");
+    CHECK_ERROR();
+  }
+
+  PUTS("msg=\"");
+  error = _micro_log_encode_msg(buf, entry);
+  CHECK_ERROR();
+  PUTS("\"");
+
+ done:
+  return error;
+
+#undef CHECK_ERROR
+#undef PUTS
+#undef APPEND
+}
+
+// Encode [entry] as a GELF 1.1 object, without a terminator
+//
+// The metadata other than the level, the time and the message are
+// additional fields, prefixed by an underscore.
+MICRO_LOG_DEF micro_log_error
+_micro_log_encode_gelf(_MicroLogBuf *buf, const _MicroLogEntry *entry)
+{
+  const MicroLogRecord *record = entry->record;
+  long unsigned int flags = _MICRO_LOG_FLAGS(record->flags);
+  micro_log_error error = MICRO_LOG_OK;
+  char digits[32];
+  int n;
+
+#define CHECK_ERROR() if (error != MICRO_LOG_OK) { goto done; }
+#define PUTS(str)                                              \
+  error = _micro_log_buf_puts(buf, (str));                     \
+  CHECK_ERROR();
+#define APPEND(str, len)                                       \
+  error = _micro_log_buf_append(buf, (str), (len));            \
+  CHECK_ERROR();
+
+  PUTS("{ \"version\": \"1.1\", \"host\": \"");
+  const char *host = _micro_log_hostname();
+  error = _micro_log_buf_append_json(buf, host, strlen(host));
+  CHECK_ERROR();
+  PUTS("\", \"level\": ");
+  digits[0] = (char) ('0' + _micro_log_syslog_severity(record->level));
+  APPEND(digits, 1);
+  PUTS(", ");
+
+  // The time is only captured if the flags use it
+  if (flags & (MICRO_LOG_FLAG_DATE | MICRO_LOG_FLAG_TIME
+               | MICRO_LOG_FLAG_USEC | MICRO_LOG_FLAG_NSEC))
+  {
+    PUTS("\"timestamp\": ");
+    n = _micro_log_format_int(digits, (int64_t) record->time);
+    digits[n++] = '.';
+    n += _micro_log_format_uint(digits + n,
+                                (uint64_t) record->nsec / 1000, 6);
+    APPEND(digits, n);
+    PUTS(", ");
+  }
+  if (flags & MICRO_LOG_FLAG_MONO)
+  {
+    PUTS("\"_mono\": ");
+    n = _micro_log_format_uint(digits, (uint64_t) record->mono, 0);
+    APPEND(digits, n);
+    PUTS(", ");
+  }
+  if (flags & MICRO_LOG_FLAG_PID)
+  {
+    PUTS("\"_pid\": ");
+    n = _micro_log_format_int(digits, (int64_t) record->pid);
+    APPEND(digits, n);
+    PUTS(", ");
+  }
+  if (flags & MICRO_LOG_FLAG_TID)
+  {
+    PUTS("\"_tid\": ");
+    n = _micro_log_format_int(digits, (int64_t) record->tid);
+    APPEND(digits, n);
+    PUTS(", ");
+  }
+  if (flags & MICRO_LOG_FLAG_FILE)
+  {
+    PUTS("\"_file\": \"");
+    error = _micro_log_buf_append_json(buf, record->file,
+                                       strlen(record->file));
+    CHECK_ERROR();
+    PUTS("\", ");
+  }
+  if (flags & MICRO_LOG_FLAG_LINE)
+  {
+    PUTS("\"_line\": ");
+    n = _micro_log_format_int(digits, (int64_t) record->line);
+    APPEND(digits, n);
+    PUTS(", ");
+  }
+  if (record->sample_rate > 1)
+  {
+    PUTS("\"_sample_rate\": ");
+    n = _micro_log_format_uint(digits, (uint64_t) record->sample_rate, 0);
+    APPEND(digits, n);
+    PUTS(", ");
+  }
+  for (size_t i = 0; i < entry->fields_count; ++i)
+  {
+    error = _micro_log_render_field(buf, &entry->fields[i], true, "_");
+    CHECK_ERROR();
+  }
+
+  PUTS("\"short_message\": \"");
+  error = _micro_log_encode_msg(buf, entry);
+  CHECK_ERROR();
+  PUTS("\" }");
+
+ done:
+  return error;
+
+#undef CHECK_ERROR
+#undef PUTS
+#undef APPEND
+}
+
+// Append a journal field [key] with the [len] bytes of [value]
+//
+// Values with a newline are written in the binary form of the
+// protocol: the key, a newline, the length as a little endian 64 bit
+// integer and the value.
+MICRO_LOG_DEF micro_log_error
+_micro_log_encode_journald_field(_MicroLogBuf *buf,
+                                 const char *key,
+                                 const char *value,
+                                 size_t len)
+{
+  micro_log_error error = _micro_log_buf_puts(buf, key);
+  if (error != MICRO_LOG_OK)
+    return error;
+  if (memchr(value, '\n', len) == NULL)
+  {
+    error = _micro_log_buf_puts(buf, "=");
+  }
+  else
+  {
+    char size[9] = { '\n' };
+    for (int i = 0; i < 8; ++i)
+      size[1 + i] = (char) (((uint64_t) len >> (8 * i)) & 0xff);
+    error = _micro_log_buf_append(buf, size, sizeof(size));
+  }
+  if (error == MICRO_LOG_OK)
+    error = _micro_log_buf_append(buf, value, len);
+  if (error == MICRO_LOG_OK)
+    error = _micro_log_buf_puts(buf, "\n");
+  return error;
+}
+
+// Encode [entry] in the native protocol of systemd-journald
+//
+// The keys of the fields are upper cased, with the characters that
+// the journal does not take replaced by underscores. The fields
+// whose key does not start with a letter are left out, since the
+// journal would drop them.
+MICRO_LOG_DEF micro_log_error
+_micro_log_encode_journald(_MicroLogBuf *buf, const _MicroLogEntry *entry)
+{
+  const MicroLogRecord *record = entry->record;
+  long unsigned int flags = _MICRO_LOG_FLAGS(record->flags);
+  micro_log_error error = MICRO_LOG_OK;
+  char digits[32];
+  int n;
+
+#define CHECK_ERROR() if (error != MICRO_LOG_OK) { goto done; }
+#define FIELD(key, value, len)                                          \
+  error = _micro_log_encode_journald_field(buf, (key), (value), (len)); \
+  CHECK_ERROR();
+
+  digits[0] = (char) ('0' + _micro_log_syslog_severity(record->level));
+  FIELD("PRIORITY", digits, 1);
+  const char *app = _micro_log_app_name();
+  FIELD("SYSLOG_IDENTIFIER", app, strlen(app));
+  FIELD("CODE_FILE", record->file, strlen(record->file));
+  n = _micro_log_format_int(digits, (int64_t) record->line);
+  FIELD("CODE_LINE", digits, (size_t) n);
+  if (flags & MICRO_LOG_FLAG_TID)
+  {
+    n = _micro_log_format_int(digits, (int64_t) record->tid);
+    FIELD("TID", digits, (size_t) n);
+  }
+  if (record->sample_rate > 1)
+  {
+    n = _micro_log_format_uint(digits, (uint64_t) record->sample_rate, 0);
+    FIELD("SAMPLE_RATE", digits, (size_t) n);
+  }
+  for (size_t i = 0; i < entry->fields_count; ++i)
+  {
+    const MicroLogField *field = &entry->fields[i];
+    char key[65];
+    size_t key_len = 0;
+    for (; field->key[key_len] != '\0' && key_len < sizeof(key) - 1;
+         ++key_len)
+    {
+      char c = field->key[key_len];
+      if (c >= 'a' && c <= 'z')
+        c = (char) (c - 'a' + 'A');
+      key[key_len] = ((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
+        ? c : '_';
+    }
+    key[key_len] = '\0';
+    if (key[0] < 'A' || key[0] > 'Z')
+      continue;
+
+    n = _micro_log_format_field(digits, field);
+    if (n >= 0)
+    {
+      FIELD(key, digits, (size_t) n);
+    }
+    else
+    {
+      FIELD(key, field->value.s, strlen(field->value.s));
+    }
+  }
+
+  // The message is written in the binary form, so that it does not
+  // need to be searched for newlines
+  error = _micro_log_buf_append(buf, "MESSAGE\n\0\0\0\0\0\0\0\0", 16);
+  CHECK_ERROR();
+  size_t begin = buf->len;
+  error = _micro_log_encode_raw_msg(buf, entry);
+  CHECK_ERROR();
+  uint64_t len = (uint64_t) (buf->len - begin);
+  for (int i = 0; i < 8; ++i)
+    buf->data[begin - 8 + i] = (char) ((len >> (8 * i)) & 0xff);
+  error = _micro_log_buf_puts(buf, "\n");
+
+ done:
+  return error;
+
+#undef CHECK_ERROR
+#undef FIELD
+}
+
+// Append the [len] bytes of [str] as the value of a syslog
+// structured data parameter, with quotes, backslashes and closing
+// brackets escaped
+MICRO_LOG_DEF micro_log_error
+_micro_log_encode_sd_value(_MicroLogBuf *buf, const char *str, size_t len)
+{
+  micro_log_error error = MICRO_LOG_OK;
+  size_t begin = 0;
+  for (size_t i = 0; i < len && error == MICRO_LOG_OK; ++i)
+  {
+    if (str[i] != '"' && str[i] != '\\' && str[i] != ']')
+      continue;
+    error = _micro_log_buf_append(buf, str + begin, i - begin);
+    if (error == MICRO_LOG_OK)
+      error = _micro_log_buf_puts(buf, "\\");
+    begin = i;
+  }
+  if (error == MICRO_LOG_OK)
+    error = _micro_log_buf_append(buf, str + begin, len - begin);
+  return error;
+}
+
+// Encode [entry] as a syslog message of RFC 5424, without a
+// terminator
+//
+// The header has the time in UTC if the flags capture it, the host,
+// the name of the program and its pid. The file, the line, the
+// thread id and the fields of the record are the parameters of the
+// MICRO_LOG_SYSLOG_SD_ID element, with their name cut to 32
+// characters.
+MICRO_LOG_DEF micro_log_error
+_micro_log_encode_syslog(_MicroLogBuf *buf, const _MicroLogEntry *entry)
+{
+  const MicroLogRecord *record = entry->record;
+  long unsigned int flags = _MICRO_LOG_FLAGS(record->flags);
+  micro_log_error error = MICRO_LOG_OK;
+  char digits[40];
+  int n;
+
+#define CHECK_ERROR() if (error != MICRO_LOG_OK) { goto done; }
+#define PUTS(str)                                              \
+  error = _micro_log_buf_puts(buf, (str));                     \
+  CHECK_ERROR();
+#define APPEND(str, len)                                       \
+  error = _micro_log_buf_append(buf, (str), (len));            \
+  CHECK_ERROR();
+
+  _Static_assert(MICRO_LOG_SYSLOG_FACILITY >= 0
+                 && MICRO_LOG_SYSLOG_FACILITY <= 23,
+                 "MICRO_LOG_SYSLOG_FACILITY must be between 0 and 23");
+  digits[0] = '<';
+  n = 1 + _micro_log_format_uint(digits + 1,
+                                 MICRO_LOG_SYSLOG_FACILITY * 8
+                                 + _micro_log_syslog_severity(record->level),
+                                 0);
+  APPEND(digits, n);
+  PUTS(">1 ");
+
+  // The time is only captured if the flags use it
+  if (flags & (MICRO_LOG_FLAG_DATE | MICRO_LOG_FLAG_TIME
+               | MICRO_LOG_FLAG_USEC | MICRO_LOG_FLAG_NSEC))
+  {
+    struct tm tm;
+    time_t sec = record->time;
+    gmtime_r(&sec, &tm);
+    n = _micro_log_format_date(digits, &tm);
+    digits[n++] = 'T';
+    n += _micro_log_format_time(digits + n, &tm);
+    digits[n++] = '.';
+    n += _micro_log_format_uint(digits + n,
+                                (uint64_t) record->nsec / 1000, 6);
+    digits[n++] = 'Z';
+    digits[n++] = ' ';
+    APPEND(digits, n);
+  }
+  else
+  {
+    PUTS("- ");
+  }
+
+  PUTS(_micro_log_hostname());
+  PUTS(" ");
+  PUTS(_micro_log_app_name());
+  PUTS(" ");
+  n = _micro_log_format_int(digits, (int64_t) _micro_log_pid()->id);
+  APPEND(digits, n);
+  PUTS(" - [" MICRO_LOG_SYSLOG_SD_ID " file=\"");
+  error = _micro_log_encode_sd_value(buf, record->file, strlen(record->file));
+  CHECK_ERROR();
+  PUTS("\" line=\"");
+  n = _micro_log_format_int(digits, (int64_t) record->line);
+  APPEND(digits, n);
+  PUTS("\"");
+  if (flags & MICRO_LOG_FLAG_TID)
+  {
+    PUTS(" tid=\"");
+    n = _micro_log_format_int(digits, (int64_t) record->tid);
+    APPEND(digits, n);
+    PUTS("\"");
+  }
+  if (record->sample_rate > 1)
+  {
+    PUTS(" sample_rate=\"");
+    n = _micro_log_format_uint(digits, (uint64_t) record->sample_rate, 0);
+    APPEND(digits, n);
+    PUTS("\"");
+  }
+  for (size_t i = 0; i < entry->fields_count; ++i)
+  {
+    const MicroLogField *field = &entry->fields[i];
+    char name[33];
+    size_t name_len = 0;
+    for (; field->key[name_len] != '\0' && name_len < sizeof(name) - 1;
+         ++name_len)
+    {
+      unsigned char c = (unsigned char) field->key[name_len];
+      name[name_len] = (c > ' ' && c < 0x7f && c != '=' && c != ']'
+                        && c != '"') ? (char) c : '_';
+    }
+    if (name_len == 0)
+      continue;
+    PUTS(" ");
+    APPEND(name, name_len);
+    PUTS("=\"");
+    n = _micro_log_format_field(digits, field);
+    if (n >= 0)
+    {
+      APPEND(digits, n);
+    }
+    else
+    {
+      error = _micro_log_encode_sd_value(buf, field->value.s,
+                                         strlen(field->value.s));
+      CHECK_ERROR();
+    }
+    PUTS("\"");
+  }
+  PUTS("] ");
+
+  error = _micro_log_encode_raw_msg(buf, entry);
+
+ done:
+  return error;
+
+#undef CHECK_ERROR
+#undef PUTS
+#undef APPEND
+}
+
+// What ends a record of [encoding] in [sink] when it is not framed,
+// [len] is set to its length
+MICRO_LOG_DEF const char *
+_micro_log_encode_end(MicroLog *micro_log,
+                      long unsigned int sink,
+                      MicroLogEncoding encoding,
+                      size_t *len)
+{
+  // Each journal field already ends with a newline
+  *len = (encoding == MICRO_LOG_ENCODING_JOURNALD) ? 0 : 1;
+  if (encoding != MICRO_LOG_ENCODING_GELF
+      && encoding != MICRO_LOG_ENCODING_SYSLOG)
+    return "\n";
+
+  #ifdef MICRO_LOG_SOCKETS
+  // Graylog reads GELF separated by null bytes from a stream, and
+  // one record per datagram. Syslog records are one per datagram too.
+  const MicroLogSocket *sock = NULL;
+  if (sink == MICRO_LOG_OUT_SOCK_INET)
+    sock = &micro_log->inet_sock;
+  #if defined(__unix__) || defined(__unix)
+  if (sink == MICRO_LOG_OUT_SOCK_UNIX)
+    sock = &micro_log->unix_sock;
+  #endif // __unix__
+  if (sock != NULL && sock->type == SOCK_DGRAM)
+    *len = 0;
+  if (sock != NULL && encoding == MICRO_LOG_ENCODING_GELF)
+    return "";
+  #else
+  (void) micro_log;
+  (void) sink;
+  #endif // MICRO_LOG_SOCKETS
+  return "\n";
+}
+
+// Encode [entry] in [buf] with [encoding] and [framing], a record
+// that is not framed ends with the [end_len] bytes of [end]
+MICRO_LOG_DEF micro_log_error
+_micro_log_encode_as(_MicroLogBuf *buf,
+                     const _MicroLogEntry *entry,
+                     MicroLogEncoding encoding,
+                     MicroLogFraming framing,
+                     const char *end,
+                     size_t end_len)
+{
+  size_t begin = buf->len;
+  micro_log_error error;
+
+  switch (encoding)
+  {
+  case MICRO_LOG_ENCODING_LOGFMT:
+    error = _micro_log_encode_logfmt(buf, entry);
+    break;
+  case MICRO_LOG_ENCODING_GELF:
+    error = _micro_log_encode_gelf(buf, entry);
+    break;
+  case MICRO_LOG_ENCODING_JOURNALD:
+    error = _micro_log_encode_journald(buf, entry);
+    break;
+  case MICRO_LOG_ENCODING_SYSLOG:
+    error = _micro_log_encode_syslog(buf, entry);
+    break;
+  default:
+  {
+    // Without the newline, which depends on the framing
+    size_t len = entry->text_len;
+    if (len > 0 && entry->text[len - 1] == '\n')
+      len--;
+    error = _micro_log_buf_append(buf, entry->text, len);
+    break;
+  }
+  }
+  if (error != MICRO_LOG_OK)
+    return error;
+
+  if (framing != MICRO_LOG_FRAMING_OCTET_COUNTED)
+    return _micro_log_buf_append(buf, end, end_len);
+
+  char prefix[24];
+  int n = _micro_log_format_uint(prefix, (uint64_t) (buf->len - begin), 0);
+  prefix[n++] = ' ';
+  error = _micro_log_buf_reserve(buf, (size_t) n);
+  if (error != MICRO_LOG_OK)
+    return error;
+  memmove(buf->data + begin + n, buf->data + begin, buf->len - begin);
+  memcpy(buf->data + begin, prefix, (size_t) n);
+  buf->len += (size_t) n;
+  return MICRO_LOG_OK;
+}
+
+// Encode [entry] for the output [sink] in [buf], with the encoding
+// and the framing of the output
+MICRO_LOG_DEF micro_log_error
+_micro_log_encode(MicroLog *micro_log,
+                  _MicroLogBuf *buf,
+                  const _MicroLogEntry *entry,
+                  long unsigned int sink)
+{
+  int index = _micro_log_out_index(sink);
+  MicroLogEncoding encoding = _MICRO_LOG_LOAD(micro_log->encodings[index]);
+  MicroLogFraming framing = _MICRO_LOG_LOAD(micro_log->framings[index]);
+  size_t end_len;
+  const char *end = _micro_log_encode_end(micro_log, sink, encoding,
+                                          &end_len);
+  return _micro_log_encode_as(buf, entry, encoding, framing, end, end_len);
+}
+
+// Write [entry] to the sinks of at most its level, the caller holds
+// the write mutex
+MICRO_LOG_DEF micro_log_error
+_micro_log_sinks_write(MicroLog *micro_log, const _MicroLogEntry *entry)
+{
+  micro_log_error error = MICRO_LOG_OK;
+
+  for (size_t i = 0; i < micro_log->sinks_count; ++i)
+  {
+    const MicroLogSink *sink = &micro_log->sinks[i];
+    if (entry->record->level < sink->level)
+      continue;
+
+    micro_log_error sink_error;
+    if (sink->encoding == MICRO_LOG_ENCODING_TEXT
+        && sink->framing == MICRO_LOG_FRAMING_NONE)
+    {
+      _MICRO_LOG_STATS_START(start);
+      sink_error = sink->write(sink->user, entry->text, entry->text_len);
+      _MICRO_LOG_STATS_WRITE(micro_log, MICRO_LOG_OUT_SINKS, entry->text_len,
+                             start, sink_error);
+    }
+    else
+    {
+      char stack[MICRO_LOG_RECORD_SIZE];
+      _MicroLogBuf buf;
+      _micro_log_buf_init(&buf, stack, sizeof(stack));
+      size_t end_len;
+      const char *end = _micro_log_encode_end(micro_log, MICRO_LOG_OUT_SINKS,
+                                              sink->encoding, &end_len);
+      sink_error = _micro_log_encode_as(&buf, entry, sink->encoding,
+                                        sink->framing, end, end_len);
+      if (sink_error == MICRO_LOG_OK)
+      {
+        _MICRO_LOG_STATS_START(start);
+        sink_error = sink->write(sink->user, buf.data, buf.len);
+        _MICRO_LOG_STATS_WRITE(micro_log, MICRO_LOG_OUT_SINKS, buf.len,
+                               start, sink_error);
+      }
+      _micro_log_buf_free(&buf);
+    }
+    // A failing sink does not keep the record from the other ones
+    if (error == MICRO_LOG_OK)
+      error = sink_error;
+  }
+
+  return error;
+}
+
+// Write [entry] to the binary output, the caller holds the write mutex
+MICRO_LOG_DEF micro_log_error
+_micro_log_write_binary(MicroLog *micro_log, const _MicroLogEntry *entry)
+{
+  _MICRO_LOG_STATS_START(start);
+  micro_log_error error = MICRO_LOG_OK;
+  char record[_MICRO_LOG_BINARY_RECORD_SIZE];
+  _micro_log_binary_record(record, entry->record);
+
+  // The type and the length of the frame, then its parts
+  size_t len = 1 + sizeof(uint32_t);
+  if (entry->fmt != NULL)
+  {
+    uint32_t id;
+    error = _micro_log_binary_format_id(micro_log, entry->fmt,
+                                        entry->record->file,
+                                        entry->record->line, &id);
+    if (error != MICRO_LOG_OK)
+      goto done;
+
+    const void *parts[] = { &id, record, entry->args };
+    size_t sizes[] = { sizeof(id), sizeof(record), entry->args_len };
+    len += sizes[0] + sizes[1] + sizes[2];
+    error = _micro_log_binary_frame(micro_log->binary_file,
+                                    _MICRO_LOG_BINARY_RECORD,
+                                    3, parts, sizes);
+    goto done;
+  }
+
+  int32_t line = entry->record->line;
+  uint32_t file_len = (uint32_t) strlen(entry->record->file);
+  const void *parts[] = { record, &line, &file_len, entry->record->file,
+                          entry->msg };
+  size_t sizes[] = { sizeof(record), sizeof(line), sizeof(file_len),
+                     file_len, entry->msg_len };
+  len += sizes[0] + sizes[1] + sizes[2] + sizes[3] + sizes[4];
+  error = _micro_log_binary_frame(micro_log->binary_file,
+                                  _MICRO_LOG_BINARY_TEXT,
+                                  5, parts, sizes);
+
+ done:
+  _MICRO_LOG_STATS_WRITE(micro_log, MICRO_LOG_OUT_BINARY, len, start, error);
+  #ifndef MICRO_LOG_STATS
+  (void) len;
+  #endif // MICRO_LOG_STATS
+  return error;
+}
+
+// Write [entry] to all the enabled outputs, the caller holds the
+// write mutex
+MICRO_LOG_DEF micro_log_error
+_micro_log_write_entry(MicroLog *micro_log, const _MicroLogEntry *entry)
+{
+  micro_log_error error = MICRO_LOG_OK;
+
+  if (entry->text != NULL)
+  {
+    long unsigned int plain = 0;
+    long unsigned int encoded = 0;
+    for (long unsigned int sink = 1; sink < MICRO_LOG_OUT_SINKS; sink <<= 1)
+      if ((entry->out & _MICRO_LOG_OUT_TEXT & sink))
+      {
+        if (_micro_log_out_plain(micro_log, sink)) plain |= sink;
+        else                                       encoded |= sink;
+      }
+
+    if (plain != 0)
+      error = _micro_log_write_outputs(micro_log, plain, entry->text,
+                                       entry->text_len);
+    for (long unsigned int sink = 1;
+         error == MICRO_LOG_OK && sink < MICRO_LOG_OUT_SINKS; sink <<= 1)
+    {
+      if (!(encoded & sink))
+        continue;
+      char stack[MICRO_LOG_RECORD_SIZE];
+      _MicroLogBuf buf;
+      _micro_log_buf_init(&buf, stack, sizeof(stack));
+      error = _micro_log_encode(micro_log, &buf, entry, sink);
+      if (error == MICRO_LOG_OK)
+        error = _micro_log_write_outputs(micro_log, sink, buf.data, buf.len);
+      _micro_log_buf_free(&buf);
+    }
+    if (error == MICRO_LOG_OK && (entry->out & MICRO_LOG_OUT_SINKS))
+      error = _micro_log_sinks_write(micro_log, entry);
+    if (error != MICRO_LOG_OK)
+      return error;
+  }
+
+  if (entry->out & MICRO_LOG_OUT_BINARY)
+    error = _micro_log_write_binary(micro_log, entry);
+
+  return error;
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_binary_file2(MicroLog *micro_log,
+                           char* filename)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+
+  micro_log_error error = MICRO_LOG_OK;
+
+  FILE *file = fopen(filename, "wb");
+  if (file == NULL)
+  {
+    perror("Error opening binary file");
+    return MICRO_LOG_ERROR_OPEN_FILE;
+  }
+
+  _MicroLogBinaryHeader header;
+  _micro_log_binary_header(&header);
+  if (fwrite(&header, sizeof(header), 1, file) != 1)
+  {
+    fclose(file);
+    return MICRO_LOG_ERROR_PRINTF_BINARY;
+  }
+
+  FILE *old_file = NULL;
+  MicroLogBinaryFormat *old_formats = NULL;
+  __MICRO_LOG_LOCK(micro_log);
+
+  old_file = micro_log->binary_file;
+  micro_log->binary_file = file;
+  file = NULL;
+
+  // The call sites have to be described again in the new file
+  old_formats = micro_log->binary_formats;
+  micro_log->binary_formats = NULL;
+  micro_log->binary_formats_cap = 0;
+  micro_log->binary_formats_count = 0;
+
+  _MICRO_LOG_STORE(micro_log->out_bitfield,
+                   _MICRO_LOG_LOAD(micro_log->out_bitfield)
+                   | MICRO_LOG_OUT_BINARY);
+
+  goto done;
+ done:
+  __MICRO_LOG_UNLOCK(micro_log);
+
+  if (file != NULL)
+    fclose(file);
+  free(old_formats);
+  if (old_file != NULL && fclose(old_file) != 0)
+  {
+    perror("Error closing binary file");
+    error = MICRO_LOG_ERROR_CLOSE_FILE;
+  }
+
+  if (error == MICRO_LOG_OK)
+    micro_log_trace2(micro_log, "Set binary output file to \"%s\"",
+                     filename);
+  return error;
+}
+
+#ifdef MICRO_LOG_MMAP
+
+//
+// Memory mapped file
+//
+// The file is written through segments of MICRO_LOG_MMAP_SEGMENT
+// bytes mapped in memory. A thread writes a record by reserving its
+// place in the file with an atomic add on [pos] and copying it into
+// the segments that cover it, without taking the write mutex. The
+// background thread maps the next segments before they are needed,
+// syncs the mapped ones every MICRO_LOG_MMAP_SYNC_MS milliseconds,
+// and unmaps a segment when all of its bytes are written.
+//
+// The segments are mapped in _MICRO_LOG_MMAP_SLOTS slots, segment i
+// in slot i % _MICRO_LOG_MMAP_SLOTS. A thread that needs a slot
+// still used by an older segment waits for it to be unmapped.
+//
+
+#define _MICRO_LOG_MMAP_SLOTS 4
+
+_Static_assert(MICRO_LOG_MMAP_SEGMENT % 65536 == 0,
+               "MICRO_LOG_MMAP_SEGMENT should be a multiple of 64KiB");
+
+typedef struct {
+  // Index of the segment in the slot, SIZE_MAX if the slot is free
+  size_t index;
+  char *data;
+  // Bytes of the segment written so far
+  size_t written;
+  char _pad[64 - 2 * sizeof(size_t) - sizeof(char *)];
+} _MicroLogMmapSlot;
+
+struct MicroLogMmap {
+  // Threads writing to this file, it is closed when they are done
+  size_t writers;
+  char _pad0[64 - sizeof(size_t)];
+  // Bytes reserved in the file, the records are in [0, pos)
+  size_t pos;
+  char _pad1[64 - sizeof(size_t)];
+  _MicroLogMmapSlot slots[_MICRO_LOG_MMAP_SLOTS];
+  int fd;
+  // Protects the mapping of the slots and [stop]
+  pthread_mutex_t mutex;
+  // Wakes up the background thread, and the threads waiting for a
+  // slot
+  pthread_cond_t cond;
+  pthread_t thread;
+  bool stop;
+  // Next file replaced by this one, kept until the logger is closed
+  // because late writers may still look at it
+  MicroLogMmap *next;
+};
+
+// Map the segment [index] in its slot, the caller holds the mutex
+MICRO_LOG_DEF micro_log_error
+_micro_log_mmap_map(MicroLogMmap *mm, size_t index)
+{
+  _MicroLogMmapSlot *slot = &mm->slots[index % _MICRO_LOG_MMAP_SLOTS];
+  off_t offset = (off_t) index * MICRO_LOG_MMAP_SEGMENT;
+
+  // Allocate the blocks now, so that a full disk is an error here
+  // instead of a SIGBUS when writing to the memory
+  if (posix_fallocate(mm->fd, offset, MICRO_LOG_MMAP_SEGMENT) != 0)
+    return MICRO_LOG_ERROR_MMAP;
+
+  int flags = MAP_SHARED;
+  #ifdef MAP_POPULATE
+  // Fault the pages in now rather than in the threads that log
+  flags |= MAP_POPULATE;
+  #endif
+  char *data = mmap(NULL, MICRO_LOG_MMAP_SEGMENT, PROT_READ | PROT_WRITE,
+                    flags, mm->fd, offset);
+  if (data == MAP_FAILED)
+    return MICRO_LOG_ERROR_MMAP;
+  (void) madvise(data, MICRO_LOG_MMAP_SEGMENT, MADV_SEQUENTIAL);
+
+  slot->data = data;
+  __atomic_store_n(&slot->written, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->index, index, __ATOMIC_RELEASE);
+  return MICRO_LOG_OK;
+}
+
+// Unmap the segment in [slot], the caller holds the mutex
+MICRO_LOG_DEF void _micro_log_mmap_unmap(_MicroLogMmapSlot *slot, int sync)
+{
+  (void) msync(slot->data, MICRO_LOG_MMAP_SEGMENT, sync);
+  munmap(slot->data, MICRO_LOG_MMAP_SEGMENT);
+  slot->data = NULL;
+  __atomic_store_n(&slot->index, SIZE_MAX, __ATOMIC_RELEASE);
+}
+
+// The slot where the segment [index] is mapped, mapping it if needed
+MICRO_LOG_DEF _MicroLogMmapSlot *
+_micro_log_mmap_slot(MicroLogMmap *mm, size_t index)
+{
+  _MicroLogMmapSlot *slot = &mm->slots[index % _MICRO_LOG_MMAP_SLOTS];
+  if (__atomic_load_n(&slot->index, __ATOMIC_ACQUIRE) == index)
+    return slot;
+
+  pthread_mutex_lock(&mm->mutex);
+  while (slot->index != index)
+  {
+    if (slot->index != SIZE_MAX)
+    {
+      // An older segment is still being written
+      pthread_cond_wait(&mm->cond, &mm->mutex);
+    }
+    else if (_micro_log_mmap_map(mm, index) != MICRO_LOG_OK)
+    {
+      slot = NULL;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&mm->mutex);
+  return slot;
+}
+
+MICRO_LOG_DEF void *_micro_log_mmap_thread(void *arg)
+{
+  MicroLogMmap *mm = arg;
+
+  pthread_mutex_lock(&mm->mutex);
+  while (!mm->stop)
+  {
+    // Unmap the segments that are complete, and sync the others
+    for (int i = 0; i < _MICRO_LOG_MMAP_SLOTS; ++i)
+    {
+      _MicroLogMmapSlot *slot = &mm->slots[i];
+      if (slot->index == SIZE_MAX)
+        continue;
+      if (__atomic_load_n(&slot->written, __ATOMIC_ACQUIRE)
+          == MICRO_LOG_MMAP_SEGMENT)
+        _micro_log_mmap_unmap(slot, MS_ASYNC);
+      else
+        (void) msync(slot->data, MICRO_LOG_MMAP_SEGMENT, MS_ASYNC);
+    }
+    pthread_cond_broadcast(&mm->cond);
+
+    // Map the current and the next segment before they are needed
+    size_t index = __atomic_load_n(&mm->pos, __ATOMIC_RELAXED)
+      / MICRO_LOG_MMAP_SEGMENT;
+    for (size_t i = index; i < index + 2; ++i)
+    {
+      if (mm->slots[i % _MICRO_LOG_MMAP_SLOTS].index == SIZE_MAX)
+        (void) _micro_log_mmap_map(mm, i);
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec  += MICRO_LOG_MMAP_SYNC_MS / 1000;
+    deadline.tv_nsec += (long) (MICRO_LOG_MMAP_SYNC_MS % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    if (!mm->stop)
+      pthread_cond_timedwait(&mm->cond, &mm->mutex, &deadline);
+  }
+  pthread_mutex_unlock(&mm->mutex);
+  return NULL;
+}
+
+// Write [len] bytes of [buf] to the memory mapped file
+MICRO_LOG_DEF micro_log_error
+_micro_log_mmap_write(MicroLog *micro_log, const char *buf, size_t len)
+{
+  micro_log_error error = MICRO_LOG_OK;
+
+  // Register as a writer of the current file, so that it is not
+  // closed under our feet if it is replaced
+  MicroLogMmap *mm;
+  for (;;)
+  {
+    mm = __atomic_load_n(&micro_log->mmap, __ATOMIC_SEQ_CST);
+    if (mm == NULL)
+      return MICRO_LOG_OK;
+    __atomic_add_fetch(&mm->writers, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&micro_log->mmap, __ATOMIC_SEQ_CST) == mm)
+      break;
+    __atomic_sub_fetch(&mm->writers, 1, __ATOMIC_SEQ_CST);
+  }
+
+  size_t pos = __atomic_fetch_add(&mm->pos, len, __ATOMIC_RELAXED);
+  while (len > 0)
+  {
+    size_t index = pos / MICRO_LOG_MMAP_SEGMENT;
+    size_t offset = pos % MICRO_LOG_MMAP_SEGMENT;
+    size_t n = MICRO_LOG_MMAP_SEGMENT - offset;
+    if (n > len)
+      n = len;
+
+    _MicroLogMmapSlot *slot = _micro_log_mmap_slot(mm, index);
+    if (slot == NULL)
+    {
+      error = MICRO_LOG_ERROR_MMAP;
+      break;
+    }
+    memcpy(slot->data + offset, buf, n);
+    if (__atomic_add_fetch(&slot->written, n, __ATOMIC_RELEASE)
+        == MICRO_LOG_MMAP_SEGMENT)
+    {
+      // The segment is complete, let the background thread unmap it
+      pthread_mutex_lock(&mm->mutex);
+      pthread_cond_broadcast(&mm->cond);
+      pthread_mutex_unlock(&mm->mutex);
+    }
+    buf += n;
+    len -= n;
+    pos += n;
+  }
+
+  __atomic_sub_fetch(&mm->writers, 1, __ATOMIC_SEQ_CST);
+  return error;
+}
+
+// Schedule the write of the mapped segments of the file
+MICRO_LOG_DEF void _micro_log_mmap_sync(MicroLog *micro_log)
+{
+  MicroLogMmap *mm = __atomic_load_n(&micro_log->mmap, __ATOMIC_SEQ_CST);
+  if (mm == NULL)
+    return;
+  pthread_mutex_lock(&mm->mutex);
+  for (int i = 0; i < _MICRO_LOG_MMAP_SLOTS; ++i)
+    if (mm->slots[i].index != SIZE_MAX)
+      (void) msync(mm->slots[i].data, MICRO_LOG_MMAP_SEGMENT, MS_ASYNC);
+  pthread_mutex_unlock(&mm->mutex);
+}
+
+// Stop the background thread of [mm] once its writers are done, and
+// close the file at the end of the records
+MICRO_LOG_DEF micro_log_error _micro_log_mmap_close(MicroLogMmap *mm)
+{
+  micro_log_error error = MICRO_LOG_OK;
+
+  while (__atomic_load_n(&mm->writers, __ATOMIC_SEQ_CST) != 0)
+    sched_yield();
+
+  pthread_mutex_lock(&mm->mutex);
+  mm->stop = true;
+  pthread_cond_broadcast(&mm->cond);
+  pthread_mutex_unlock(&mm->mutex);
+  if (pthread_join(mm->thread, NULL) != 0)
+    error = MICRO_LOG_ERROR_THREAD_JOIN;
+
+  for (int i = 0; i < _MICRO_LOG_MMAP_SLOTS; ++i)
+    if (mm->slots[i].index != SIZE_MAX)
+      _micro_log_mmap_unmap(&mm->slots[i], MS_SYNC);
+
+  // Remove the space preallocated after the last record
+  if (ftruncate(mm->fd, (off_t) mm->pos) != 0 && error == MICRO_LOG_OK)
+    error = MICRO_LOG_ERROR_CLOSE_FILE;
+  if (close(mm->fd) != 0 && error == MICRO_LOG_OK)
+    error = MICRO_LOG_ERROR_CLOSE_FILE;
+  mm->fd = -1;
+  pthread_cond_destroy(&mm->cond);
+  pthread_mutex_destroy(&mm->mutex);
+  return error;
+}
+
+// Close the memory mapped file of [micro_log] and free the ones it
+// replaced, the caller made sure no thread is logging
+MICRO_LOG_DEF micro_log_error _micro_log_mmap_stop(MicroLog *micro_log)
+{
+  micro_log_error error = MICRO_LOG_OK;
+  MicroLogMmap *mm = __atomic_exchange_n(&micro_log->mmap, NULL,
+                                         __ATOMIC_SEQ_CST);
+  if (mm != NULL)
+  {
+    error = _micro_log_mmap_close(mm);
+    mm->next = micro_log->mmap_retired;
+    micro_log->mmap_retired = mm;
+  }
+
+  while (micro_log->mmap_retired != NULL)
+  {
+    MicroLogMmap *next = micro_log->mmap_retired->next;
+    free(micro_log->mmap_retired);
+    micro_log->mmap_retired = next;
+  }
+  return error;
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_mmap_file2(MicroLog *micro_log, char *filename)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+
+  micro_log_error error = MICRO_LOG_OK;
+
+  MicroLogMmap *mm = calloc(1, sizeof(*mm));
+  if (mm == NULL)
+    return MICRO_LOG_ERROR_ALLOC;
+  for (int i = 0; i < _MICRO_LOG_MMAP_SLOTS; ++i)
+    mm->slots[i].index = SIZE_MAX;
+
+  mm->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (mm->fd < 0)
+  {
+    perror("Error opening memory mapped file");
+    free(mm);
+    return MICRO_LOG_ERROR_OPEN_FILE;
+  }
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&mm->cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+  pthread_mutex_init(&mm->mutex, NULL);
+
+  // Map the first segment now, to report an error right away
+  pthread_mutex_lock(&mm->mutex);
+  error = _micro_log_mmap_map(mm, 0);
+  pthread_mutex_unlock(&mm->mutex);
+  if (error == MICRO_LOG_OK
+      && pthread_create(&mm->thread, NULL, _micro_log_mmap_thread, mm) != 0)
+  {
+    _micro_log_mmap_unmap(&mm->slots[0], MS_ASYNC);
+    error = MICRO_LOG_ERROR_THREAD_CREATE;
+  }
+  if (error != MICRO_LOG_OK)
+  {
+    pthread_cond_destroy(&mm->cond);
+    pthread_mutex_destroy(&mm->mutex);
+    close(mm->fd);
+    free(mm);
+    return error;
+  }
+
+  // The writing threads do not take the write mutex, the file it
+  // replaces is closed once they are not using it anymore
+  __MICRO_LOG_LOCK(micro_log);
+
+  MicroLogMmap *old = __atomic_exchange_n(&micro_log->mmap, mm,
+                                          __ATOMIC_SEQ_CST);
+  _MICRO_LOG_STORE(micro_log->out_bitfield,
+                   _MICRO_LOG_LOAD(micro_log->out_bitfield)
+                   | MICRO_LOG_OUT_MMAP);
+  if (old != NULL)
+  {
+    error = _micro_log_mmap_close(old);
+    old->next = micro_log->mmap_retired;
+    micro_log->mmap_retired = old;
+  }
+
+  goto done;
+ done:
+  __MICRO_LOG_UNLOCK(micro_log);
+
+  if (error == MICRO_LOG_OK)
+    micro_log_trace2(micro_log, "Set memory mapped output file to \"%s\"",
+                     filename);
+  return error;
+}
+
+#endif // MICRO_LOG_MMAP
+
+#ifdef MICRO_LOG_THREAD_BUFFER
+
+//
+// Thread buffers
+//
+// Each thread stages the records it writes to the file in its own
+// buffer, and writes the whole buffer to the file with a single
+// acquisition of the write mutex. The buffers of a logger are kept
+// in a list, so that `micro_log_flush2` and `micro_log_close2` can
+// write them from any thread.
+//
+// Locks are always taken in this order:
+// _micro_log_thread_buffer_detach_mutex, [thread_buffers_mutex] of
+// the logger, [mutex] of a buffer, [write_mutex] of the logger.
+//
+
+struct MicroLogThreadBuffer {
+  // Next buffer of the same logger
+  MicroLogThreadBuffer *next;
+  // The logger the records are staged for, NULL if the buffer is
+  // not registered in any logger
+  MicroLog *micro_log;
+  // Protects the records from a flush from other threads
+  pthread_mutex_t mutex;
+  // When the oldest record in the buffer was staged, in milliseconds
+  // of CLOCK_MONOTONIC
+  int64_t oldest;
+  size_t len;
+  char data[MICRO_LOG_THREAD_BUFFER];
+};
+
+static _MICRO_LOG_THREAD_LOCAL MicroLogThreadBuffer *_micro_log_thread_buffer;
+static pthread_key_t _micro_log_thread_buffer_key;
+static pthread_once_t _micro_log_thread_buffer_once = PTHREAD_ONCE_INIT;
+// Held by a thread that exits while it uses the logger of its
+// buffer, and by `micro_log_close2` while it detaches the buffers,
+// so that the logger is not closed under the exiting thread
+static pthread_mutex_t _micro_log_thread_buffer_detach_mutex =
+  PTHREAD_MUTEX_INITIALIZER;
+
+// Write the staged records of [thread_buffer] to the file, the
+// caller holds the mutex of the buffer
+MICRO_LOG_DEF micro_log_error
+_micro_log_thread_buffer_flush(MicroLogThreadBuffer *thread_buffer)
+{
+  micro_log_error error = MICRO_LOG_OK;
+  MicroLog *micro_log = thread_buffer->micro_log;
+  if (thread_buffer->len == 0)
+    return MICRO_LOG_OK;
+
+  __MICRO_LOG_LOCK(micro_log);
+  if (micro_log->file != NULL)
+  {
+    _MICRO_LOG_STATS_START(start);
+    error = _micro_log_file_write(micro_log, thread_buffer->data,
+                                  thread_buffer->len);
+    _MICRO_LOG_STATS_WRITE(micro_log, MICRO_LOG_OUT_FILE, thread_buffer->len,
+                           start, error);
+  }
+  thread_buffer->len = 0;
+  __MICRO_LOG_UNLOCK(micro_log);
+
+ done:
+  return error;
+}
+
+// Remove [thread_buffer] from the list of its logger, the caller
+// holds [thread_buffers_mutex]
+MICRO_LOG_DEF void
+_micro_log_thread_buffer_unlink(MicroLogThreadBuffer *thread_buffer)
+{
+  MicroLogThreadBuffer **it = &thread_buffer->micro_log->thread_buffers;
+  while (*it != NULL && *it != thread_buffer)
+    it = &(*it)->next;
+  if (*it != NULL)
+    *it = thread_buffer->next;
+  thread_buffer->next = NULL;
+}
+
+// Called when a thread with a buffer exits
+MICRO_LOG_DEF void _micro_log_thread_buffer_destroy(void *arg)
+{
+  MicroLogThreadBuffer *thread_buffer = arg;
+
+  // The logger can only be detached, and closed, once this is done
+  pthread_mutex_lock(&_micro_log_thread_buffer_detach_mutex);
+  MicroLog *micro_log =
+    __atomic_load_n(&thread_buffer->micro_log, __ATOMIC_ACQUIRE);
+  if (micro_log != NULL)
+  {
+    pthread_mutex_lock(&micro_log->thread_buffers_mutex);
+    pthread_mutex_lock(&thread_buffer->mutex);
+    (void) _micro_log_thread_buffer_flush(thread_buffer);
+    _micro_log_thread_buffer_unlink(thread_buffer);
+    pthread_mutex_unlock(&thread_buffer->mutex);
+    pthread_mutex_unlock(&micro_log->thread_buffers_mutex);
+  }
+  pthread_mutex_unlock(&_micro_log_thread_buffer_detach_mutex);
+
+  pthread_mutex_destroy(&thread_buffer->mutex);
+  free(thread_buffer);
+}
+
+MICRO_LOG_DEF void _micro_log_thread_buffer_key_create(void)
+{
+  pthread_key_create(&_micro_log_thread_buffer_key,
+                     _micro_log_thread_buffer_destroy);
+}
+
+struct MicroLogThreadFlusher {
+  pthread_t thread;
+  // Protects [stop]
+  pthread_mutex_t mutex;
+  // Wakes up the thread to stop it
+  pthread_cond_t cond;
+  bool stop;
+  MicroLog *micro_log;
+};
+
+MICRO_LOG_DEF void *_micro_log_thread_flusher_thread(void *arg)
+{
+  MicroLogThreadFlusher *flusher = arg;
+  MicroLog *micro_log = flusher->micro_log;
+
+  pthread_mutex_lock(&flusher->mutex);
+  while (!flusher->stop)
+  {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec  += MICRO_LOG_THREAD_BUFFER_MS / 1000;
+    deadline.tv_nsec += (long) (MICRO_LOG_THREAD_BUFFER_MS % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    while (!flusher->stop
+           && pthread_cond_timedwait(&flusher->cond, &flusher->mutex,
+                                     &deadline) != ETIMEDOUT)
+      ;
+    if (flusher->stop)
+      break;
+
+    pthread_mutex_unlock(&flusher->mutex);
+    // There is no caller to report write errors to
+    (void) _micro_log_thread_buffer_flush_all(micro_log, false);
+    pthread_mutex_lock(&flusher->mutex);
+  }
+  pthread_mutex_unlock(&flusher->mutex);
+  return NULL;
+}
+
+// Start the flusher thread of [micro_log] if it is not running, the
+// caller holds [thread_buffers_mutex]
+//
+// If it can not be started, the buffers are still written when they
+// fill up, and on `micro_log_flush2`.
+MICRO_LOG_DEF void _micro_log_thread_flusher_start(MicroLog *micro_log)
+{
+  if (micro_log->thread_flusher != NULL)
+    return;
+
+  MicroLogThreadFlusher *flusher = calloc(1, sizeof(*flusher));
+  if (flusher == NULL)
+    return;
+  flusher->micro_log = micro_log;
+  pthread_mutex_init(&flusher->mutex, NULL);
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&flusher->cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  micro_log->thread_flusher = flusher;
+  if (pthread_create(&flusher->thread, NULL,
+                     _micro_log_thread_flusher_thread, flusher) != 0)
+  {
+    micro_log->thread_flusher = NULL;
+    pthread_cond_destroy(&flusher->cond);
+    pthread_mutex_destroy(&flusher->mutex);
+    free(flusher);
+  }
+}
+
+// Stop the flusher thread of [micro_log]
+MICRO_LOG_DEF micro_log_error
+_micro_log_thread_flusher_stop(MicroLog *micro_log)
+{
+  pthread_mutex_lock(&micro_log->thread_buffers_mutex);
+  MicroLogThreadFlusher *flusher = micro_log->thread_flusher;
+  micro_log->thread_flusher = NULL;
+  pthread_mutex_unlock(&micro_log->thread_buffers_mutex);
+  if (flusher == NULL)
+    return MICRO_LOG_OK;
+
+  pthread_mutex_lock(&flusher->mutex);
+  flusher->stop = true;
+  pthread_cond_signal(&flusher->cond);
+  pthread_mutex_unlock(&flusher->mutex);
+  if (pthread_join(flusher->thread, NULL) != 0)
+    return MICRO_LOG_ERROR_THREAD_JOIN;
+
+  pthread_cond_destroy(&flusher->cond);
+  pthread_mutex_destroy(&flusher->mutex);
+  free(flusher);
+  return MICRO_LOG_OK;
+}
+
+// Get the buffer of the calling thread, registered in [micro_log]
+//
+// Returns NULL if the buffer could not be allocated, or if it is
+// already staging records for another logger.
+MICRO_LOG_DEF MicroLogThreadBuffer *
+_micro_log_thread_buffer_get(MicroLog *micro_log)
+{
+  MicroLogThreadBuffer *thread_buffer = _micro_log_thread_buffer;
+  if (thread_buffer == NULL)
+  {
+    pthread_once(&_micro_log_thread_buffer_once,
+                 _micro_log_thread_buffer_key_create);
+    thread_buffer = malloc(sizeof(*thread_buffer));
+    if (thread_buffer == NULL)
+      return NULL;
+    *thread_buffer = (MicroLogThreadBuffer){0};
+    pthread_mutex_init(&thread_buffer->mutex, NULL);
+    pthread_setspecific(_micro_log_thread_buffer_key, thread_buffer);
+    _micro_log_thread_buffer = thread_buffer;
+  }
+
+  // Detached buffers are only attached by their own thread, so
+  // nothing can attach it between the check and the lock
+  MicroLog *owner =
+    __atomic_load_n(&thread_buffer->micro_log, __ATOMIC_ACQUIRE);
+  if (owner == NULL)
+  {
+    pthread_mutex_lock(&micro_log->thread_buffers_mutex);
+    pthread_mutex_lock(&thread_buffer->mutex);
+    __atomic_store_n(&thread_buffer->micro_log, micro_log, __ATOMIC_RELEASE);
+    thread_buffer->next = micro_log->thread_buffers;
+    micro_log->thread_buffers = thread_buffer;
+    pthread_mutex_unlock(&thread_buffer->mutex);
+    _micro_log_thread_flusher_start(micro_log);
+    pthread_mutex_unlock(&micro_log->thread_buffers_mutex);
+  }
+  else if (owner != micro_log)
+  {
+    return NULL;
+  }
+  return thread_buffer;
+}
+
+// Stage the rendered record [text] of [level] in the buffer of the
+// calling thread
+//
+// Returns false if the record was not staged and must be written to
+// the file directly.
+MICRO_LOG_DEF bool
+_micro_log_thread_buffer_stage(MicroLog *micro_log,
+                               MicroLogLevel level,
+                               const char *text,
+                               size_t len,
+                               micro_log_error *error)
+{
+  MicroLogThreadBuffer *thread_buffer = _micro_log_thread_buffer_get(micro_log);
+  if (thread_buffer == NULL)
+    return false;
+
+  pthread_mutex_lock(&thread_buffer->mutex);
+  if (thread_buffer->micro_log != micro_log)
+  {
+    // Detached by `micro_log_close2` in the meantime
+    pthread_mutex_unlock(&thread_buffer->mutex);
+    return false;
+  }
+
+  *error = MICRO_LOG_OK;
+  int64_t now = _micro_log_monotonic_ms();
+  if (thread_buffer->len + len > sizeof(thread_buffer->data))
+    *error = _micro_log_thread_buffer_flush(thread_buffer);
+
+  bool staged = (len <= sizeof(thread_buffer->data));
+  if (staged)
+  {
+    if (thread_buffer->len == 0)
+      thread_buffer->oldest = now;
+    memcpy(thread_buffer->data + thread_buffer->len, text, len);
+    thread_buffer->len += len;
+    // The records that matter most are not left behind
+    if (level >= MICRO_LOG_LEVEL_WARN
+        || now - thread_buffer->oldest >= MICRO_LOG_THREAD_BUFFER_MS)
+      *error = _micro_log_thread_buffer_flush(thread_buffer);
+  }
+  pthread_mutex_unlock(&thread_buffer->mutex);
+  return staged;
+}
+
+// Write the buffers of all the threads to the file
+//
+// If [detach] is true, the buffers are also removed from the logger.
+MICRO_LOG_DEF micro_log_error
+_micro_log_thread_buffer_flush_all(MicroLog *micro_log, bool detach)
+{
+  micro_log_error error = MICRO_LOG_OK;
+
+  if (detach)
+    pthread_mutex_lock(&_micro_log_thread_buffer_detach_mutex);
+  pthread_mutex_lock(&micro_log->thread_buffers_mutex);
+  MicroLogThreadBuffer *thread_buffer = micro_log->thread_buffers;
+  while (thread_buffer != NULL)
+  {
+    MicroLogThreadBuffer *next = thread_buffer->next;
+    pthread_mutex_lock(&thread_buffer->mutex);
+    micro_log_error flush_error =
+      _micro_log_thread_buffer_flush(thread_buffer);
+    if (error == MICRO_LOG_OK)
+      error = flush_error;
+    if (detach)
+    {
+      thread_buffer->next = NULL;
+      __atomic_store_n(&thread_buffer->micro_log, NULL, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&thread_buffer->mutex);
+    thread_buffer = next;
+  }
+  if (detach)
+    micro_log->thread_buffers = NULL;
+  pthread_mutex_unlock(&micro_log->thread_buffers_mutex);
+  if (detach)
+    pthread_mutex_unlock(&_micro_log_thread_buffer_detach_mutex);
+
+  return error;
+}
+
+#endif // MICRO_LOG_THREAD_BUFFER
+
+MICRO_LOG_DEF micro_log_error
+_micro_log_write_impl(MicroLog *micro_log,
+                      MicroLogLevel level,
+                      const char* file,
+                      int line,
+                      const char *fmt, ...)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+  MicroLogLevel min = _MICRO_LOG_LOAD(micro_log->log_level);
+  if (level < _micro_log_level_min(micro_log, min)
+      || level >= MICRO_LOG_LEVEL_DISABLED)
+    return MICRO_LOG_OK;
+
+  va_list args;
+  va_start(args, fmt);
+  micro_log_error error = _micro_log_write_record(micro_log, level, min, 0,
+                                                  file, line, fmt, args);
+  va_end(args);
+  return error;
+}
+
+MICRO_LOG_DEF micro_log_error
+_micro_log_write_category_impl(MicroLog *micro_log,
+                               MicroLogCategory *category,
+                               MicroLogLevel level,
+                               const char* file,
+                               int line,
+                               const char *fmt, ...)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+  MicroLogLevel min = _micro_log_category_level(micro_log, category);
+  if (level < _micro_log_level_min(micro_log, min)
+      || level >= MICRO_LOG_LEVEL_DISABLED)
+    return MICRO_LOG_OK;
+
+  va_list args;
+  va_start(args, fmt);
+  micro_log_error error = _micro_log_write_record(micro_log, level, min, 0,
+                                                  file, line, fmt, args);
+  va_end(args);
+  return error;
+}
+
+MICRO_LOG_DEF micro_log_error
+_micro_log_write_sampled_impl(MicroLog *micro_log,
+                              MicroLogLevel level,
+                              unsigned int sample_rate,
+                              const char* file,
+                              int line,
+                              const char *fmt, ...)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+  MicroLogLevel min = _MICRO_LOG_LOAD(micro_log->log_level);
+  if (level < _micro_log_level_min(micro_log, min)
+      || level >= MICRO_LOG_LEVEL_DISABLED)
+    return MICRO_LOG_OK;
+
+  va_list args;
+  va_start(args, fmt);
+  micro_log_error error = _micro_log_write_record(micro_log, level, min,
+                                                  sample_rate, file, line,
+                                                  fmt, args);
+  va_end(args);
+  return error;
+}
+
+// Capture a record that passed the level check, and hand it to the
+// async backend if it is running or write it from this thread
+//
+// Records below [min] are only kept by the flight recorder.
+MICRO_LOG_DEF micro_log_error
+_micro_log_write_record(MicroLog *micro_log,
+                        MicroLogLevel level,
+                        MicroLogLevel min,
+                        unsigned int sample_rate,
+                        const char* file,
+                        int line,
+                        const char *fmt,
+                        va_list args)
+{
+  micro_log_error error = MICRO_LOG_OK;
+  MicroLogRecord record;
+  _micro_log_record_capture(micro_log, &record, level, file, line);
+  record.sample_rate = sample_rate;
+
+  #ifdef MICRO_LOG_FLIGHT_RECORDER
+  if (level < min)
+  {
+    _MICRO_LOG_STATS_ADD(micro_log, filtered[level], 1);
+    return _micro_log_flight_push(micro_log, &record, fmt, args);
+  }
+  // Write what led to this record first
+  if (level >= _MICRO_LOG_LOAD(micro_log->flight.trigger))
+    error = _micro_log_flight_dump(micro_log);
+  #else
+  (void) min;
+  #endif // MICRO_LOG_FLIGHT_RECORDER
+
+  if (_MICRO_LOG_LOAD(micro_log->collapse.enabled)
+      && _micro_log_collapse(micro_log, &record, fmt, args))
+  {
+    _MICRO_LOG_STATS_ADD(micro_log, filtered[level], 1);
+    return error;
+  }
+
+  micro_log_error write_error;
+  #ifdef MICRO_LOG_ASYNC
+  if (__atomic_load_n(&micro_log->async.slots, __ATOMIC_ACQUIRE) != NULL)
+    write_error = _micro_log_async_push(micro_log, &record, fmt, args);
+  else
+  #endif // MICRO_LOG_ASYNC
+    write_error = _micro_log_write_sync(micro_log, &record, fmt, args);
+
+  #ifdef MICRO_LOG_STATS
+  _micro_log_stats_report(micro_log);
+  #endif // MICRO_LOG_STATS
+
+  return (error != MICRO_LOG_OK) ? error : write_error;
+}
+
+// Write a rendered [entry] to the outputs from the calling thread
+MICRO_LOG_DEF micro_log_error
+_micro_log_write_entry_sync(MicroLog *micro_log, _MicroLogEntry *entry)
+{
+  micro_log_error error = MICRO_LOG_OK;
+  if (entry->out == 0)
+  {
+    _MICRO_LOG_STATS_ADD(micro_log, filtered[entry->record->level], 1);
+    return MICRO_LOG_OK;
+  }
+  _MICRO_LOG_STATS_ADD(micro_log, emitted[entry->record->level], 1);
+
+  #ifdef MICRO_LOG_THREAD_BUFFER
+  if ((entry->out & MICRO_LOG_OUT_FILE)
+      && _micro_log_out_plain(micro_log, MICRO_LOG_OUT_FILE)
+      && _micro_log_thread_buffer_stage(micro_log, entry->record->level,
+                                        entry->text, entry->text_len,
+                                        &error))
+  {
+    entry->out &= ~MICRO_LOG_OUT_FILE;
+    if (error != MICRO_LOG_OK || entry->out == 0)
+      return error;
+  }
+  #endif // MICRO_LOG_THREAD_BUFFER
+
+  #ifdef MICRO_LOG_MMAP
+  // The memory mapped file does not need the write mutex
+  if (entry->out & MICRO_LOG_OUT_MMAP)
+  {
+    if (_micro_log_out_plain(micro_log, MICRO_LOG_OUT_MMAP))
+    {
+      _MICRO_LOG_STATS_START(start);
+      error = _micro_log_mmap_write(micro_log, entry->text, entry->text_len);
+      _MICRO_LOG_STATS_WRITE(micro_log, MICRO_LOG_OUT_MMAP, entry->text_len,
+                             start, error);
+    }
+    else
+    {
+      char stack[MICRO_LOG_RECORD_SIZE];
+      _MicroLogBuf buf;
+      _micro_log_buf_init(&buf, stack, sizeof(stack));
+      error = _micro_log_encode(micro_log, &buf, entry, MICRO_LOG_OUT_MMAP);
+      if (error == MICRO_LOG_OK)
+      {
+        _MICRO_LOG_STATS_START(start);
+        error = _micro_log_mmap_write(micro_log, buf.data, buf.len);
+        _MICRO_LOG_STATS_WRITE(micro_log, MICRO_LOG_OUT_MMAP, buf.len,
+                               start, error);
+      }
+      _micro_log_buf_free(&buf);
+    }
+    entry->out &= ~MICRO_LOG_OUT_MMAP;
+    if (error != MICRO_LOG_OK || entry->out == 0)
+      return error;
+  }
+  #endif // MICRO_LOG_MMAP
+
+  __MICRO_LOG_LOCK(micro_log);
+  error = _micro_log_write_entry(micro_log, entry);
+  __MICRO_LOG_UNLOCK(micro_log);
+
+  goto done;
+ done:
+  return error;
+}
+
+// Render a record and write it to the outputs from the calling thread
+MICRO_LOG_DEF micro_log_error
+_micro_log_write_sync(MicroLog *micro_log,
+                      const MicroLogRecord *record,
+                      const char *fmt,
+                      va_list args)
+{
+  micro_log_error error = MICRO_LOG_OK;
+  long unsigned int out =
+    _micro_log_out_for_level(micro_log,
+                             _MICRO_LOG_LOAD(micro_log->out_bitfield),
+                             record->level);
+  if (out == 0)
+  {
+    _MICRO_LOG_STATS_ADD(micro_log, filtered[record->level], 1);
+    return MICRO_LOG_OK;
+  }
+
+  // Render outside of the lock, only the writes need to be serialized
+  char stack[MICRO_LOG_RECORD_SIZE];
+  _MicroLogBuf buf;
+  _micro_log_buf_init(&buf, stack, sizeof(stack));
+  char args_stack[MICRO_LOG_RECORD_SIZE];
+  _MicroLogBuf args_buf;
+  _micro_log_buf_init(&args_buf, args_stack, sizeof(args_stack));
+
+  _MicroLogEntry entry = {
+    .record = record,
+    .out    = out,
+  };
+
+  if (out & MICRO_LOG_OUT_BINARY)
+  {
+    // Keep the raw arguments, if the format allows it
+    va_list copy;
+    va_copy(copy, args);
+    if (_micro_log_deferred_pack(&args_buf, fmt, copy) == MICRO_LOG_OK)
+    {
+      entry.fmt      = fmt;
+      entry.args     = args_buf.data;
+      entry.args_len = args_buf.len;
+    }
+    va_end(copy);
+  }
+
+  // The text is only needed by the text outputs, or by the binary
+  // output when the arguments could not be packed
+  if ((out & _MICRO_LOG_OUT_TEXT) || entry.fmt == NULL)
+  {
+    size_t msg_begin, msg_len;
+    error = _micro_log_render(&buf, record, fmt, args, &msg_begin, &msg_len);
+    if (error != MICRO_LOG_OK)
+      goto done;
+    if (out & _MICRO_LOG_OUT_TEXT)
+    {
+      entry.text     = buf.data;
+      entry.text_len = buf.len;
+    }
+    entry.msg      = buf.data + msg_begin;
+    entry.msg_len  = msg_len;
+  }
+
+  error = _micro_log_write_entry_sync(micro_log, &entry);
+
+ done:
+  _micro_log_buf_free(&args_buf);
+  _micro_log_buf_free(&buf);
+  return error;
+}
+
+// Write a record of the logger itself from the calling thread,
+// bypassing the async ring, like the ones of the writer thread
+MICRO_LOG_DEF void
+_micro_log_report(MicroLog *micro_log,
+                  MicroLogLevel level,
+                  const char *fmt, ...)
+{
+  MicroLogRecord record;
+  _micro_log_record_capture(micro_log, &record, level, __FILE__, __LINE__);
+
+  va_list args;
+  va_start(args, fmt);
+  (void) _micro_log_write_sync(micro_log, &record, fmt, args);
+  va_end(args);
+}
+
+// Write the record rendered in [buf] to the outputs from the calling
+// thread, with its message at [msg_begin] and its [count] [fields]
+MICRO_LOG_DEF micro_log_error
+_micro_log_write_entry_text(MicroLog *micro_log,
+                            const MicroLogRecord *record,
+                            const _MicroLogBuf *buf,
+                            size_t msg_begin,
+                            size_t msg_len,
+                            const MicroLogField *fields,
+                            size_t count)
+{
+  long unsigned int out =
+    _micro_log_out_for_level(micro_log,
+                             _MICRO_LOG_LOAD(micro_log->out_bitfield),
+                             record->level);
+  _MicroLogEntry entry = {
+    .record   = record,
+    .out      = out,
+    .text     = (out & _MICRO_LOG_OUT_TEXT) ? buf->data : NULL,
+    .text_len = (out & _MICRO_LOG_OUT_TEXT) ? buf->len : 0,
+    .msg      = buf->data + msg_begin,
+    .msg_len  = msg_len,
+    .fields       = fields,
+    .fields_count = count,
+  };
+  return _micro_log_write_entry_sync(micro_log, &entry);
+}
+
+// Tags of the records that are rendered before they are written, to
+// collapse them, see `_micro_log_write_rendered`
+static const char _micro_log_kind_kv[]  = "kv";
+static const char _micro_log_kind_raw[] = "raw";
+static const char _micro_log_kind_hex[] = "hex";
+
+// Hand the record rendered in [buf] to the async writer, or to the
+// outputs, with its message at [msg_begin] and its [count] [fields]
+//
+// Like `_micro_log_write_record` does for a format string, records
+// below [min] are only kept by the flight recorder, and the others
+// are collapsed if they repeat the previous one. What repeats is
+// told by [kind], one of the _micro_log_kind_ tags, and by the
+// [key_len] bytes of [key], which are compared instead of packed
+// arguments. [key] is NULL if it did not fit in
+// MICRO_LOG_COLLAPSE_SIZE, then the record is never collapsed.
+MICRO_LOG_DEF micro_log_error
+_micro_log_write_rendered(MicroLog *micro_log,
+                          const MicroLogRecord *record,
+                          MicroLogLevel min,
+                          const _MicroLogBuf *buf,
+                          size_t msg_begin,
+                          size_t msg_len,
+                          const MicroLogField *fields,
+                          size_t count,
+                          const char *kind,
+                          const char *key,
+                          size_t key_len)
+{
+  micro_log_error error = MICRO_LOG_OK;
+
+  #ifdef MICRO_LOG_FLIGHT_RECORDER
+  if (record->level < min)
+  {
+    _MICRO_LOG_STATS_ADD(micro_log, filtered[record->level], 1);
+    _micro_log_flight_push_text(micro_log, record, buf->data, buf->len,
+                                msg_begin, msg_len);
+    return MICRO_LOG_OK;
+  }
+  // Write what led to this record first
+  if (record->level >= _MICRO_LOG_LOAD(micro_log->flight.trigger))
+    error = _micro_log_flight_dump(micro_log);
+  #else
+  (void) min;
+  #endif // MICRO_LOG_FLIGHT_RECORDER
+
+  if (_MICRO_LOG_LOAD(micro_log->collapse.enabled)
+      && _micro_log_collapse_packed(micro_log, record, kind, key != NULL,
+                                    key, key_len))
+  {
+    _MICRO_LOG_STATS_ADD(micro_log, filtered[record->level], 1);
+    return error;
+  }
+
+  micro_log_error write_error = MICRO_LOG_OK;
+  #ifdef MICRO_LOG_ASYNC
+  if (__atomic_load_n(&micro_log->async.slots, __ATOMIC_ACQUIRE) != NULL)
+    _micro_log_async_push_text(micro_log, record, buf->data, buf->len,
+                               msg_begin, msg_len);
+  else
+  #endif // MICRO_LOG_ASYNC
+    write_error = _micro_log_write_entry_text(micro_log, record, buf,
+                                              msg_begin, msg_len,
+                                              fields, count);
+
+  #ifdef MICRO_LOG_STATS
+  _micro_log_stats_report(micro_log);
+  #endif // MICRO_LOG_STATS
+
+  return (error != MICRO_LOG_OK) ? error : write_error;
+}
+
+// Store [msg] and the values of its [count] [fields] in the [size]
+// bytes of [data], to tell a structured record from the previous one
+//
+// Returns false if they do not fit.
+MICRO_LOG_DEF bool
+_micro_log_kv_key(char *data,
+                  size_t size,
+                  const char *msg,
+                  const MicroLogField *fields,
+                  size_t count,
+                  size_t *len)
+{
+  *len = 0;
+
+#define KEY(src, n)                                           \
   do {                                                        \
-    if (pthread_mutex_unlock(&__micro_log_ptr->write_mutex) != 0) \
-    {                                                         \
-      error = MICRO_LOG_ERROR_MUTEX_UNLOCK;                   \
-      goto done;                                              \
-    }                                                         \
-  } while(0)
+    if ((n) > size - *len)                                    \
+      return false;                                           \
+    memcpy(data + *len, (src), (n));                          \
+    *len += (n);                                              \
+  } while (0)
+
+  KEY(msg, strlen(msg) + 1);
+  for (size_t i = 0; i < count; ++i)
+  {
+    const MicroLogField *field = &fields[i];
+    KEY(field->key, strlen(field->key) + 1);
+    KEY(&field->type, sizeof(field->type));
+    if (field->type == MICRO_LOG_FIELD_STR)
+    {
+      if (field->value.s == NULL)
+        KEY("", 1);
+      else
+      {
+        // Tells "" from NULL
+        KEY("s", 1);
+        KEY(field->value.s, strlen(field->value.s) + 1);
+      }
+    }
+    else
+      KEY(&field->value, sizeof(field->value));
+  }
+  return true;
+
+#undef KEY
+}
+
+MICRO_LOG_DEF micro_log_error
+_micro_log_write_kv_impl(MicroLog *micro_log,
+                         MicroLogLevel level,
+                         const char* file,
+                         int line,
+                         const char *msg,
+                         const MicroLogField *fields,
+                         size_t count)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+  MicroLogLevel min = _MICRO_LOG_LOAD(micro_log->log_level);
+  if (level < _micro_log_level_min(micro_log, min)
+      || level >= MICRO_LOG_LEVEL_DISABLED)
+    return MICRO_LOG_OK;
+
+  MicroLogRecord record;
+  _micro_log_record_capture(micro_log, &record, level, file, line);
+
+  // The fields are rendered right away, so the record is handed to
+  // the outputs as text
+  char stack[MICRO_LOG_RECORD_SIZE];
+  _MicroLogBuf buf;
+  _micro_log_buf_init(&buf, stack, sizeof(stack));
+
+  micro_log_error error =
+    _micro_log_render_header_kv(&buf, &record, fields, count);
+  size_t msg_begin = buf.len;
+  if (error == MICRO_LOG_OK)
+    error = (_MICRO_LOG_FLAGS(record.flags) & MICRO_LOG_FLAG_JSON)
+      ? _micro_log_buf_append_json(&buf, msg, strlen(msg))
+      : _micro_log_buf_puts(&buf, msg);
+  size_t msg_len = buf.len - msg_begin;
+  if (error == MICRO_LOG_OK)
+    error = _micro_log_render_footer(&buf, &record);
+  if (error == MICRO_LOG_OK)
+  {
+    char key[MICRO_LOG_COLLAPSE_SIZE];
+    size_t key_len = 0;
+    bool keyed = _MICRO_LOG_LOAD(micro_log->collapse.enabled)
+      && _micro_log_kv_key(key, sizeof(key), msg, fields, count, &key_len);
+    error = _micro_log_write_rendered(micro_log, &record, min, &buf,
+                                      msg_begin, msg_len, fields, count,
+                                      _micro_log_kind_kv,
+                                      keyed ? key : NULL, key_len);
+  }
+
+  _micro_log_buf_free(&buf);
+  return error;
+}
+
+MICRO_LOG_DEF micro_log_error
+_micro_log_write_raw_impl(MicroLog *micro_log,
+                          MicroLogLevel level,
+                          const char* file,
+                          int line,
+                          const char *data,
+                          size_t len,
+                          bool hex)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+  MicroLogLevel min = _MICRO_LOG_LOAD(micro_log->log_level);
+  if (level < _micro_log_level_min(micro_log, min)
+      || level >= MICRO_LOG_LEVEL_DISABLED)
+    return MICRO_LOG_OK;
+  if (data == NULL && len > 0)
+    return MICRO_LOG_ERROR_RAW_NULL;
+
+  MicroLogRecord record;
+  _micro_log_record_capture(micro_log, &record, level, file, line);
+
+  // The bytes are only copied here, every output gets this buffer
+  char stack[MICRO_LOG_RECORD_SIZE];
+  _MicroLogBuf buf;
+  _micro_log_buf_init(&buf, stack, sizeof(stack));
+
+  micro_log_error error = _micro_log_render_header(&buf, &record);
+  size_t msg_begin = buf.len;
+  if (error == MICRO_LOG_OK)
+  {
+    if (hex)
+      error = _micro_log_buf_append_hex(&buf, data, len);
+    else if (_MICRO_LOG_FLAGS(record.flags) & MICRO_LOG_FLAG_JSON)
+      error = _micro_log_buf_append_json(&buf, data, len);
+    else
+      error = _micro_log_buf_append(&buf, data, len);
+  }
+  size_t msg_len = buf.len - msg_begin;
+  if (error == MICRO_LOG_OK)
+    error = _micro_log_render_footer(&buf, &record);
+  if (error == MICRO_LOG_OK)
+    error = _micro_log_write_rendered(micro_log, &record, min, &buf,
+                                      msg_begin, msg_len, NULL, 0,
+                                      hex ? _micro_log_kind_hex
+                                          : _micro_log_kind_raw,
+                                      (len <= MICRO_LOG_COLLAPSE_SIZE)
+                                      ? data : NULL, len);
+
+  _micro_log_buf_free(&buf);
+  return error;
+}
+
+#ifdef MICRO_LOG_FLIGHT_RECORDER
+
+//
+// Flight recorder
+//
+// Records below the level of the logger are captured like the other
+// ones but, instead of being written, they are copied in a ring with
+// the packed arguments of their format string. They are formatted
+// only if a record of the trigger level is logged, which writes the
+// whole ring to the outputs before it.
+//
+// Locks are always taken in this order: the mutex of the flight
+// recorder, then the ones taken to write a record.
+//
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_flight_recorder2(MicroLog *micro_log,
+                               MicroLogLevel level,
+                               MicroLogLevel trigger,
+                               size_t capacity)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+  if (level >= MICRO_LOG_LEVEL_MAX || trigger >= MICRO_LOG_LEVEL_MAX)
+    return MICRO_LOG_ERROR_UNKNOWN_LEVEL;
+
+  MicroLogFlight *flight = &micro_log->flight;
+  MicroLogFlightSlot *slots = NULL;
+  if (capacity > 0)
+  {
+    slots = calloc(capacity, sizeof(*slots));
+    if (slots == NULL)
+      return MICRO_LOG_ERROR_ALLOC;
+  }
+  else
+  {
+    level = MICRO_LOG_LEVEL_DISABLED;
+    trigger = MICRO_LOG_LEVEL_DISABLED;
+  }
+
+  #ifdef MICRO_LOG_MULTITHREADED
+  pthread_mutex_lock(&flight->mutex);
+  #endif // MICRO_LOG_MULTITHREADED
+  MicroLogFlightSlot *old_slots = flight->slots;
+  flight->slots = slots;
+  flight->capacity = capacity;
+  flight->head = 0;
+  flight->count = 0;
+  _MICRO_LOG_STORE(flight->level, level);
+  _MICRO_LOG_STORE(flight->trigger, trigger);
+  #ifdef MICRO_LOG_MULTITHREADED
+  pthread_mutex_unlock(&flight->mutex);
+  #endif // MICRO_LOG_MULTITHREADED
+
+  free(old_slots);
+  return MICRO_LOG_OK;
+}
+
+// Copy [slot] in the ring of the flight recorder of [micro_log],
+// over the oldest record if it is full
+MICRO_LOG_DEF void
+_micro_log_flight_insert(MicroLog *micro_log, const MicroLogFlightSlot *slot)
+{
+  MicroLogFlight *flight = &micro_log->flight;
+
+  #ifdef MICRO_LOG_MULTITHREADED
+  pthread_mutex_lock(&flight->mutex);
+  #endif // MICRO_LOG_MULTITHREADED
+  if (flight->slots != NULL)
+  {
+    size_t index = (flight->head + flight->count) % flight->capacity;
+    memcpy(&flight->slots[index], slot,
+           offsetof(MicroLogFlightSlot, data) + slot->len);
+    if (flight->count < flight->capacity)
+      flight->count++;
+    else
+      flight->head = (flight->head + 1) % flight->capacity;
+  }
+  #ifdef MICRO_LOG_MULTITHREADED
+  pthread_mutex_unlock(&flight->mutex);
+  #endif // MICRO_LOG_MULTITHREADED
+}
+
+// Keep [record] in the flight recorder, in place of the oldest one
+// if it is full
+MICRO_LOG_DEF micro_log_error
+_micro_log_flight_push(MicroLog *micro_log,
+                       const MicroLogRecord *record,
+                       const char *fmt,
+                       va_list args)
+{
+  micro_log_error error = MICRO_LOG_OK;
+
+  // Fill the slot outside of the lock
+  MicroLogFlightSlot slot;
+  slot.record    = *record;
+  slot.fmt       = fmt;
+  slot.msg_begin = 0;
+  slot.msg_len   = 0;
+  if (!_micro_log_pack_truncated(slot.data, sizeof(slot.data),
+                                 fmt, args, &slot.len))
+  {
+    slot.fmt = NULL;
+    error = _micro_log_render_truncated(slot.data, sizeof(slot.data),
+                                        record, fmt, args, &slot.len,
+                                        &slot.msg_begin, &slot.msg_len);
+    if (slot.len == 0)
+      return error;
+  }
+
+  _micro_log_flight_insert(micro_log, &slot);
+  return error;
+}
+
+// Keep the record rendered in the [len] bytes of [text], with its
+// message at [msg_begin], in the flight recorder of [micro_log]
+//
+// A record that does not fit in a slot is cut, and its line ended.
+MICRO_LOG_DEF void
+_micro_log_flight_push_text(MicroLog *micro_log,
+                            const MicroLogRecord *record,
+                            const char *text,
+                            size_t len,
+                            size_t msg_begin,
+                            size_t msg_len)
+{
+  MicroLogFlightSlot slot;
+  slot.record    = *record;
+  slot.fmt       = NULL;
+  slot.len       = (len < sizeof(slot.data)) ? len : sizeof(slot.data);
+  slot.msg_begin = msg_begin;
+  slot.msg_len   = msg_len;
+  if (slot.len == 0)
+    return;
+  memcpy(slot.data, text, slot.len);
+  if (slot.len < len)
+  {
+    slot.data[slot.len - 1] = '\n';
+    if (msg_begin + msg_len > slot.len - 1)
+      slot.msg_len = (msg_begin < slot.len - 1) ? slot.len - 1 - msg_begin : 0;
+  }
+  _micro_log_flight_insert(micro_log, &slot);
+}
+
+// Write the records in the flight recorder to the outputs, oldest
+// first, and empty it
+MICRO_LOG_DEF micro_log_error _micro_log_flight_dump(MicroLog *micro_log)
+{
+  MicroLogFlight *flight = &micro_log->flight;
+  micro_log_error error = MICRO_LOG_OK;
+  long unsigned int out = _MICRO_LOG_LOAD(micro_log->out_bitfield);
+
+  char stack[MICRO_LOG_RECORD_SIZE];
+  _MicroLogBuf buf;
+  _micro_log_buf_init(&buf, stack, sizeof(stack));
+
+  #ifdef MICRO_LOG_MULTITHREADED
+  pthread_mutex_lock(&flight->mutex);
+  #endif // MICRO_LOG_MULTITHREADED
+  for (; flight->count > 0; flight->count--)
+  {
+    MicroLogFlightSlot *slot = &flight->slots[flight->head];
+    flight->head = (flight->head + 1) % flight->capacity;
+
+    micro_log_error slot_error = MICRO_LOG_OK;
+    _MicroLogEntry entry = {
+      .record = &slot->record,
+      .out    = _micro_log_out_for_level(micro_log, out, slot->record.level),
+    };
+    if (slot->fmt == NULL)
+    {
+      if (out & _MICRO_LOG_OUT_TEXT)
+      {
+        entry.text     = slot->data;
+        entry.text_len = slot->len;
+      }
+      entry.msg      = slot->data + slot->msg_begin;
+      entry.msg_len  = slot->msg_len;
+    }
+    else
+    {
+      entry.fmt      = slot->fmt;
+      entry.args     = slot->data;
+      entry.args_len = slot->len;
+      if (out & _MICRO_LOG_OUT_TEXT)
+      {
+        size_t msg_begin, msg_len;
+        buf.len = 0;
+        slot_error = _micro_log_render_packed(&buf, &slot->record,
+                                              slot->fmt, slot->data,
+                                              slot->len, &msg_begin,
+                                              &msg_len);
+        if (slot_error == MICRO_LOG_OK)
+        {
+          entry.text     = buf.data;
+          entry.text_len = buf.len;
+          entry.msg      = buf.data + msg_begin;
+          entry.msg_len  = msg_len;
+        }
+      }
+    }
+
+    if (slot_error == MICRO_LOG_OK)
+      slot_error = _micro_log_write_entry_sync(micro_log, &entry);
+    if (error == MICRO_LOG_OK)
+      error = slot_error;
+  }
+  #ifdef MICRO_LOG_MULTITHREADED
+  pthread_mutex_unlock(&flight->mutex);
+  #endif // MICRO_LOG_MULTITHREADED
+
+  _micro_log_buf_free(&buf);
+  return error;
+}
+
+// Forget the records in the flight recorder and turn it off
+MICRO_LOG_DEF void _micro_log_flight_free(MicroLog *micro_log)
+{
+  MicroLogFlight *flight = &micro_log->flight;
+  free(flight->slots);
+  flight->slots = NULL;
+  flight->count = 0;
+  flight->level = MICRO_LOG_LEVEL_DISABLED;
+  flight->trigger = MICRO_LOG_LEVEL_DISABLED;
+  #ifdef MICRO_LOG_MULTITHREADED
+  pthread_mutex_destroy(&flight->mutex);
+  #endif // MICRO_LOG_MULTITHREADED
+}
+
+#endif // MICRO_LOG_FLIGHT_RECORDER
+
+//
+// Rate limits and repeated records
+//
+// Both hold back records before they are rendered, and count them.
+// The counts are reported with a record of the same call site, which
+// skips the flight recorder and is never collapsed itself.
+//
+
+// Write a report about held back records, bypassing the rate limits
+// and the collapsing of repeated records
+MICRO_LOG_DEF micro_log_error
+_micro_log_write_suppressed(MicroLog *micro_log,
+                            MicroLogLevel level,
+                            const char *file,
+                            int line,
+                            const char *fmt, ...)
+{
+  MicroLogRecord record;
+  _micro_log_record_capture(micro_log, &record, level, file, line);
+
+  micro_log_error error;
+  va_list args;
+  va_start(args, fmt);
+  #ifdef MICRO_LOG_ASYNC
+  if (__atomic_load_n(&micro_log->async.slots, __ATOMIC_ACQUIRE) != NULL)
+    error = _micro_log_async_push(micro_log, &record, fmt, args);
+  else
+  #endif // MICRO_LOG_ASYNC
+    error = _micro_log_write_sync(micro_log, &record, fmt, args);
+  va_end(args);
+  return error;
+}
+
+MICRO_LOG_DEF bool
+_micro_log_rate_limit_pass(MicroLog *micro_log,
+                           MicroLogRateLimit *rate_limit,
+                           MicroLogLevel level,
+                           double per_sec,
+                           const char *file,
+                           int line)
+{
+  if (micro_log == NULL)
+    return true;
+
+  // Each record adds [cost] nanoseconds to the bucket, which empties
+  // in real time and holds one second
+  //
+  // Without a positive rate only the first record passes, and the
+  // bucket is full forever after it. The cost of any other rate is
+  // capped, so that [start] + [cost] can not overflow: the bucket
+  // is only filled from [now] at most [cost] ahead.
+  int64_t now_ms = _micro_log_monotonic_ms();
+  int64_t now = now_ms * 1000000;
+  double cost_ns = (per_sec > 0) ? 1e9 / per_sec : 0;
+  int64_t cost = (cost_ns < (double) (INT64_MAX / 4))
+    ? (int64_t) cost_ns : INT64_MAX / 4;
+  int64_t full_at = __atomic_load_n(&rate_limit->full_at, __ATOMIC_RELAXED);
+  for (;;)
+  {
+    int64_t start = (full_at > now) ? full_at : now;
+    bool full = (per_sec > 0)
+      ? (start > now && start - now > 1000000000 - cost)
+      : (full_at == INT64_MAX);
+    if (full)
+    {
+      __atomic_add_fetch(&rate_limit->suppressed, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&micro_log->suppressed, 1, __ATOMIC_RELAXED);
+      _MICRO_LOG_STATS_ADD(micro_log, filtered[level], 1);
+      return false;
+    }
+    if (__atomic_compare_exchange_n(&rate_limit->full_at, &full_at,
+                                    (per_sec > 0) ? start + cost : INT64_MAX,
+                                    true,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      break;
+  }
+
+  if (__atomic_load_n(&rate_limit->suppressed, __ATOMIC_RELAXED) == 0)
+    return true;
+  int64_t reported_at =
+    __atomic_load_n(&rate_limit->reported_at, __ATOMIC_RELAXED);
+  if (now_ms - reported_at < MICRO_LOG_SUPPRESSED_REPORT_MS
+      || !__atomic_compare_exchange_n(&rate_limit->reported_at,
+                                      &reported_at, now_ms, false,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    return true;
+
+  size_t suppressed = __atomic_exchange_n(&rate_limit->suppressed, 0,
+                                          __ATOMIC_RELAXED);
+  if (suppressed > 0)
+    _micro_log_write_suppressed(micro_log, level, file, line,
+                                "%zu records held back by the rate limit",
+                                suppressed);
+  return true;
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_collapse2(MicroLog *micro_log, bool enabled)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+
+  // Report what was collapsed so far, even if turned off
+  micro_log_error error = _micro_log_collapse_flush(micro_log);
+
+  MicroLogCollapse *collapse = &micro_log->collapse;
+  #ifdef MICRO_LOG_MULTITHREADED
+  pthread_mutex_lock(&collapse->mutex);
+  #endif // MICRO_LOG_MULTITHREADED
+  collapse->fmt = NULL;
+  _MICRO_LOG_STORE(collapse->enabled, enabled);
+  #ifdef MICRO_LOG_MULTITHREADED
+  pthread_mutex_unlock(&collapse->mutex);
+  #endif // MICRO_LOG_MULTITHREADED
+
+  return error;
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_get_suppressed2(MicroLog *micro_log, size_t *suppressed)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+
+  *suppressed = __atomic_load_n(&micro_log->suppressed, __ATOMIC_RELAXED);
+  return MICRO_LOG_OK;
+}
+
+#ifdef MICRO_LOG_STATS
+
+MICRO_LOG_DEF micro_log_error
+micro_log_get_stats2(MicroLog *micro_log, MicroLogStats *stats)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+
+  const MicroLogStats *counters = &micro_log->stats;
+  for (int i = 0; i < MICRO_LOG_LEVEL_MAX; ++i)
+  {
+    stats->emitted[i] = __atomic_load_n(&counters->emitted[i],
+                                        __ATOMIC_RELAXED);
+    stats->filtered[i] = __atomic_load_n(&counters->filtered[i],
+                                         __ATOMIC_RELAXED);
+    #ifdef MICRO_LOG_ASYNC
+    stats->dropped[i] = __atomic_load_n(&micro_log->async.dropped[i],
+                                        __ATOMIC_RELAXED);
+    #else
+    stats->dropped[i] = 0;
+    #endif // MICRO_LOG_ASYNC
+  }
+  for (int i = 0; i < _MICRO_LOG_OUT_COUNT; ++i)
+  {
+    stats->bytes[i]  = __atomic_load_n(&counters->bytes[i], __ATOMIC_RELAXED);
+    stats->errors[i] = __atomic_load_n(&counters->errors[i], __ATOMIC_RELAXED);
+    stats->io_ns[i]  = __atomic_load_n(&counters->io_ns[i], __ATOMIC_RELAXED);
+  }
+  stats->lock_ns = __atomic_load_n(&counters->lock_ns, __ATOMIC_RELAXED);
+  stats->lock_contended = __atomic_load_n(&counters->lock_contended,
+                                          __ATOMIC_RELAXED);
+  stats->queue_high_water = __atomic_load_n(&counters->queue_high_water,
+                                            __ATOMIC_RELAXED);
+  stats->queue_capacity = 0;
+  #ifdef MICRO_LOG_ASYNC
+  if (__atomic_load_n(&micro_log->async.slots, __ATOMIC_ACQUIRE) != NULL)
+    stats->queue_capacity = micro_log->async.mask + 1;
+  #endif // MICRO_LOG_ASYNC
+  return MICRO_LOG_OK;
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_stats_interval2(MicroLog *micro_log, int seconds)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+  if (seconds < 0)
+    return MICRO_LOG_ERROR_INVALID_INTERVAL;
+
+  int64_t interval = (int64_t) seconds * 1000;
+  __atomic_store_n(&micro_log->stats_report_at,
+                   _micro_log_monotonic_ms() + interval, __ATOMIC_RELAXED);
+  __atomic_store_n(&micro_log->stats_interval_ms, interval, __ATOMIC_RELAXED);
+  return MICRO_LOG_OK;
+}
+
+// Write a record with the counters of [micro_log] if it is time to,
+// see `micro_log_set_stats_interval2`
+//
+// Only one of the threads that get here at the same time writes it.
+MICRO_LOG_DEF void _micro_log_stats_report(MicroLog *micro_log)
+{
+  int64_t interval = __atomic_load_n(&micro_log->stats_interval_ms,
+                                     __ATOMIC_RELAXED);
+  if (interval <= 0)
+    return;
+  int64_t now = _micro_log_monotonic_ms();
+  int64_t due = __atomic_load_n(&micro_log->stats_report_at,
+                                __ATOMIC_RELAXED);
+  if (now < due
+      || !__atomic_compare_exchange_n(&micro_log->stats_report_at, &due,
+                                      now + interval, false,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    return;
+  if (!_micro_log_level_enabled(micro_log, MICRO_LOG_LEVEL_INFO))
+    return;
+
+  MicroLogStats stats;
+  (void) micro_log_get_stats2(micro_log, &stats);
+  size_t emitted = 0, filtered = 0, dropped = 0, bytes = 0, errors = 0;
+  uint64_t io_ns = 0;
+  for (int i = 0; i < MICRO_LOG_LEVEL_MAX; ++i)
+  {
+    emitted  += stats.emitted[i];
+    filtered += stats.filtered[i];
+    dropped  += stats.dropped[i];
+  }
+  for (int i = 0; i < _MICRO_LOG_OUT_COUNT; ++i)
+  {
+    bytes  += stats.bytes[i];
+    errors += stats.errors[i];
+    io_ns  += stats.io_ns[i];
+  }
+
+  _micro_log_report(micro_log, MICRO_LOG_LEVEL_INFO,
+                    "Logger stats: emitted=%zu filtered=%zu dropped=%zu "
+                    "bytes=%zu errors=%zu io_ms=%llu lock_ms=%llu "
+                    "contended=%zu queue_high_water=%zu",
+                    emitted, filtered, dropped, bytes, errors,
+                    (unsigned long long) (io_ns / 1000000),
+                    (unsigned long long) (stats.lock_ns / 1000000),
+                    stats.lock_contended, stats.queue_high_water);
+}
+
+#endif // MICRO_LOG_STATS
+
+// Whether [record] repeats the previous one and is held back
+//
+// A different record first reports how many times the previous one
+// was repeated, and takes its place.
+MICRO_LOG_DEF bool
+_micro_log_collapse(MicroLog *micro_log,
+                    const MicroLogRecord *record,
+                    const char *fmt,
+                    va_list args)
+{
+  // Compare the packed arguments, nothing is formatted
+  char args_data[MICRO_LOG_COLLAPSE_SIZE];
+  size_t args_len;
+  bool packed = _micro_log_pack_truncated(args_data, sizeof(args_data),
+                                          fmt, args, &args_len);
+  return _micro_log_collapse_packed(micro_log, record, fmt, packed,
+                                    args_data, args_len);
+}
+
+// Like `_micro_log_collapse`, with the [args_len] bytes of
+// [args_data] compared instead of the packed arguments of [fmt], if
+// [packed]
+MICRO_LOG_DEF bool
+_micro_log_collapse_packed(MicroLog *micro_log,
+                           const MicroLogRecord *record,
+                           const char *fmt,
+                           bool packed,
+                           const char *args_data,
+                           size_t args_len)
+{
+  MicroLogCollapse *collapse = &micro_log->collapse;
+
+  size_t repeated = 0;
+  MicroLogLevel level = 0;
+  const char *file = NULL;
+  int line = 0;
+
+  #ifdef MICRO_LOG_MULTITHREADED
+  pthread_mutex_lock(&collapse->mutex);
+  #endif // MICRO_LOG_MULTITHREADED
+  bool repeat = packed
+    && collapse->fmt == fmt
+    && collapse->level == record->level
+    && collapse->file == record->file
+    && collapse->line == record->line
+    && collapse->args_len == args_len
+    && memcmp(collapse->args, args_data, args_len) == 0;
+  if (repeat)
+  {
+    int64_t now = _micro_log_monotonic_ms();
+    if (collapse->repeated++ == 0)
+      collapse->repeated_since = now;
+    __atomic_add_fetch(&micro_log->suppressed, 1, __ATOMIC_RELAXED);
+    // Report a record that keeps repeating from time to time
+    if (now - collapse->repeated_since >= MICRO_LOG_SUPPRESSED_REPORT_MS)
+    {
+      repeated = collapse->repeated;
+      collapse->repeated = 0;
+    }
+  }
+  else
+  {
+    repeated = collapse->repeated;
+    collapse->repeated = 0;
+  }
+  if (repeated > 0)
+  {
+    level = collapse->level;
+    file = collapse->file;
+    line = collapse->line;
+  }
+  if (!repeat)
+  {
+    collapse->fmt = packed ? fmt : NULL;
+    collapse->level = record->level;
+    collapse->file = record->file;
+    collapse->line = record->line;
+    collapse->args_len = args_len;
+    if (packed)
+      memcpy(collapse->args, args_data, args_len);
+  }
+  #ifdef MICRO_LOG_MULTITHREADED
+  pthread_mutex_unlock(&collapse->mutex);
+  #endif // MICRO_LOG_MULTITHREADED
+
+  if (repeated > 0)
+    _micro_log_write_suppressed(micro_log, level, file, line,
+                                "Last record repeated %zu times",
+                                repeated);
+  return repeat;
+}
+
+// Report how many times the last record was repeated, if it was
+MICRO_LOG_DEF micro_log_error _micro_log_collapse_flush(MicroLog *micro_log)
+{
+  MicroLogCollapse *collapse = &micro_log->collapse;
+
+  #ifdef MICRO_LOG_MULTITHREADED
+  pthread_mutex_lock(&collapse->mutex);
+  #endif // MICRO_LOG_MULTITHREADED
+  size_t repeated = collapse->repeated;
+  MicroLogLevel level = collapse->level;
+  const char *file = collapse->file;
+  int line = collapse->line;
+  collapse->repeated = 0;
+  #ifdef MICRO_LOG_MULTITHREADED
+  pthread_mutex_unlock(&collapse->mutex);
+  #endif // MICRO_LOG_MULTITHREADED
+
+  if (repeated == 0)
+    return MICRO_LOG_OK;
+  return _micro_log_write_suppressed(micro_log, level, file, line,
+                                     "Last record repeated %zu times",
+                                     repeated);
+}
+
+#ifdef MICRO_LOG_SOCKETS
+
+//
+// Socket outputs
+//
+// Sockets are non-blocking and writes never wait: whatever can not
+// be sent right away is kept in a bounded queue, and sent before new
+// records once the socket is writable again. When the connection is
+// lost the socket is closed and, after an exponential backoff, a
+// new non-blocking connect is started by the next write, so the
+// connection is re-established in the background while logging
+// goes on.
+//
+// The queue holds whole records, each prefixed by its length, so a
+// record that was only partially sent can be discarded when the
+// connection is lost instead of corrupting the next connection.
+//
+
+#ifndef MSG_NOSIGNAL
+  #define MSG_NOSIGNAL 0
+#endif
+
+#define _MICRO_LOG_SOCKET_DISCONNECTED 0
+#define _MICRO_LOG_SOCKET_CONNECTING   1
+#define _MICRO_LOG_SOCKET_CONNECTED    2
+
+MICRO_LOG_DEF void _micro_log_socket_init(MicroLogSocket *sock)
+{
+  *sock = (MicroLogSocket){
+    .fd = -1,
+    .state = _MICRO_LOG_SOCKET_DISCONNECTED,
+    .backoff_ms = MICRO_LOG_SOCKET_BACKOFF_MIN_MS,
+  };
+}
+
+// Close [sock] and forget about its queue
+MICRO_LOG_DEF int _micro_log_socket_close(MicroLogSocket *sock)
+{
+  int ret = 0;
+  if (sock->fd >= 0)
+    ret = close_socket(sock->fd);
+  free(sock->pending);
+  _micro_log_socket_init(sock);
+  return ret;
+}
+
+// Drop the first record in the queue of [sock]
+MICRO_LOG_DEF void _micro_log_socket_pop(MicroLogSocket *sock, bool dropped)
+{
+  uint32_t len;
+  memcpy(&len, sock->pending, sizeof(len));
+  size_t unsent = len - sock->pending_sent;
+  sock->queued -= unsent;
+  if (dropped)
+    sock->dropped += unsent;
+  sock->pending_len -= sizeof(len) + len;
+  memmove(sock->pending, sock->pending + sizeof(len) + len,
+          sock->pending_len);
+  sock->pending_sent = 0;
+}
+
+// The connection was lost, try again later
+MICRO_LOG_DEF void _micro_log_socket_lost(MicroLogSocket *sock, int64_t now)
+{
+  if (sock->fd >= 0)
+    close_socket(sock->fd);
+  sock->fd = -1;
+  sock->state = _MICRO_LOG_SOCKET_DISCONNECTED;
+  sock->lost = true;
+  sock->retry_at = now + sock->backoff_ms;
+  sock->backoff_ms = (2 * sock->backoff_ms < MICRO_LOG_SOCKET_BACKOFF_MAX_MS)
+                     ? 2 * sock->backoff_ms : MICRO_LOG_SOCKET_BACKOFF_MAX_MS;
+
+  // The rest of a partially sent record would be garbage for the
+  // other end of the new connection
+  if (sock->pending_sent > 0)
+    _micro_log_socket_pop(sock, true);
+}
+
+// The connection of [sock] is established
+MICRO_LOG_DEF void _micro_log_socket_connected(MicroLogSocket *sock)
+{
+  sock->state = _MICRO_LOG_SOCKET_CONNECTED;
+  sock->backoff_ms = MICRO_LOG_SOCKET_BACKOFF_MIN_MS;
+  if (sock->lost)
+    sock->reconnects++;
+  sock->lost = false;
+}
+
+// Start a non-blocking connect to the address of [sock]
+//
+// Returns 0 if the socket is connected or connecting, -1 if the
+// socket could not be created and -2 if the connection was refused,
+// with errno set.
+MICRO_LOG_DEF int _micro_log_socket_connect(MicroLogSocket *sock, int64_t now)
+{
+  int ret = -1;
+  sock->fd = socket(sock->addr.ss_family, sock->type, 0);
+  if (sock->fd < 0)
+    goto fail;
+  int flags = fcntl(sock->fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(sock->fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    goto fail;
+
+  if (connect(sock->fd, (struct sockaddr *) &sock->addr,
+              sock->addr_len) == 0)
+  {
+    _micro_log_socket_connected(sock);
+    return 0;
+  }
+  if (errno == EINPROGRESS)
+  {
+    sock->state = _MICRO_LOG_SOCKET_CONNECTING;
+    return 0;
+  }
+  ret = -2;
+
+ fail:
+  {
+    int saved = errno;
+    _micro_log_socket_lost(sock, now);
+    errno = saved;
+  }
+  return ret;
+}
+
+// Open [sock] to [addr], closing it first if it was open
+//
+// Returns like `_micro_log_socket_connect`.
+MICRO_LOG_DEF int
+_micro_log_socket_open(MicroLogSocket *sock,
+                       int type,
+                       const struct sockaddr *addr,
+                       socklen_t addr_len)
+{
+  _micro_log_socket_close(sock);
+  sock->type = type;
+  memcpy(&sock->addr, addr, addr_len);
+  sock->addr_len = addr_len;
+  return _micro_log_socket_connect(sock, _micro_log_monotonic_ms());
+}
+
+// Make progress on a pending connect, or start a new one if the
+// backoff expired
+MICRO_LOG_DEF void _micro_log_socket_poll(MicroLogSocket *sock, int64_t now)
+{
+  if (sock->state == _MICRO_LOG_SOCKET_CONNECTING)
+  {
+    struct pollfd pollfd = { .fd = sock->fd, .events = POLLOUT };
+    if (poll(&pollfd, 1, 0) != 1)
+      return;
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    if (getsockopt(sock->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0
+        || err != 0)
+    {
+      _micro_log_socket_lost(sock, now);
+      return;
+    }
+    _micro_log_socket_connected(sock);
+  }
+  else if (sock->state == _MICRO_LOG_SOCKET_DISCONNECTED
+           && sock->addr_len > 0 && now >= sock->retry_at)
+  {
+    _micro_log_socket_connect(sock, now);
+  }
+}
+
+// Queue the record [data], of which [sent] bytes were already sent
+//
+// Returns false if it did not fit in the queue.
+MICRO_LOG_DEF bool
+_micro_log_socket_queue(MicroLogSocket *sock,
+                        const char *data,
+                        size_t len,
+                        size_t sent)
+{
+  uint32_t len32 = (uint32_t) len;
+  if (sock->pending_len + sizeof(len32) + len > MICRO_LOG_SOCKET_QUEUE)
+  {
+    sock->dropped += len - sent;
+    return false;
+  }
+  if (sock->pending == NULL)
+  {
+    sock->pending = malloc(MICRO_LOG_SOCKET_QUEUE);
+    if (sock->pending == NULL)
+    {
+      sock->dropped += len - sent;
+      return false;
+    }
+  }
+
+  memcpy(sock->pending + sock->pending_len, &len32, sizeof(len32));
+  memcpy(sock->pending + sock->pending_len + sizeof(len32), data, len);
+  if (sock->pending_len == 0)
+    sock->pending_sent = sent;
+  sock->pending_len += sizeof(len32) + len;
+  sock->queued += len - sent;
+  return true;
+}
+
+// Send as much of the queue as the socket accepts
+MICRO_LOG_DEF void _micro_log_socket_flush(MicroLogSocket *sock, int64_t now)
+{
+  while (sock->pending_len > 0
+         && sock->state == _MICRO_LOG_SOCKET_CONNECTED)
+  {
+    uint32_t len;
+    memcpy(&len, sock->pending, sizeof(len));
+    ssize_t n = send(sock->fd,
+                     sock->pending + sizeof(len) + sock->pending_sent,
+                     len - sock->pending_sent,
+                     MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0)
+    {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        _micro_log_socket_lost(sock, now);
+      return;
+    }
+
+    sock->pending_sent += (size_t) n;
+    sock->queued -= (size_t) n;
+    if (sock->pending_sent < len)
+      return; // The socket buffer is full
+    _micro_log_socket_pop(sock, false);
+  }
+}
+
+// Reconnect [sock] if needed and send its queue without blocking
+MICRO_LOG_DEF void _micro_log_socket_resume(MicroLogSocket *sock)
+{
+  int64_t now = _micro_log_monotonic_ms();
+  _micro_log_socket_poll(sock, now);
+  _micro_log_socket_flush(sock, now);
+}
+
+// Write [count] records laid out one after the other in [data] to
+// [sock], the i-th one ending at [ends][i]
+//
+// On a datagram socket each record is sent as a datagram. This never
+// blocks: records are queued, or dropped if the queue is full.
+MICRO_LOG_DEF void
+_micro_log_socket_write(MicroLogSocket *sock,
+                        const char *data,
+                        const size_t *ends,
+                        size_t count)
+{
+  int64_t now = _micro_log_monotonic_ms();
+  _micro_log_socket_poll(sock, now);
+  _micro_log_socket_flush(sock, now);
+
+  // Records sent, and bytes sent of the next one
+  size_t done = 0;
+  size_t sent = 0;
+  if (sock->state == _MICRO_LOG_SOCKET_CONNECTED && sock->pending_len == 0)
+  {
+    if (sock->type == SOCK_STREAM)
+    {
+      ssize_t n;
+      do {
+        n = send(sock->fd, data, ends[count - 1],
+                 MSG_NOSIGNAL | MSG_DONTWAIT);
+      } while (n < 0 && errno == EINTR);
+
+      if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        _micro_log_socket_lost(sock, now);
+      else if (n > 0)
+      {
+        while (done < count && ends[done] <= (size_t) n)
+          done++;
+        sent = (done < count) ? (size_t) n - (done ? ends[done - 1] : 0)
+                              : 0;
+      }
+    }
+    else
+    {
+      #ifdef __linux__
+      struct mmsghdr msgs[MICRO_LOG_ASYNC_BATCH];
+      struct iovec iov[MICRO_LOG_ASYNC_BATCH];
+      while (done < count)
+      {
+        size_t batch = (count - done < MICRO_LOG_ASYNC_BATCH)
+                       ? count - done : MICRO_LOG_ASYNC_BATCH;
+        memset(msgs, 0, batch * sizeof(*msgs));
+        for (size_t i = 0; i < batch; ++i)
+        {
+          size_t begin = (done + i) ? ends[done + i - 1] : 0;
+          iov[i].iov_base = (char *) data + begin;
+          iov[i].iov_len  = ends[done + i] - begin;
+          msgs[i].msg_hdr.msg_iov    = &iov[i];
+          msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = sendmmsg(sock->fd, msgs, (unsigned int) batch,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0)
+        {
+          if (errno == EINTR) continue;
+          if (errno != EAGAIN && errno != EWOULDBLOCK)
+            _micro_log_socket_lost(sock, now);
+          break;
+        }
+        done += (size_t) n;
+        if ((size_t) n < batch)
+          break;
+      }
+      #else
+      for (; done < count; ++done)
+      {
+        size_t begin = done ? ends[done - 1] : 0;
+        if (send(sock->fd, data + begin, ends[done] - begin,
+                 MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+        {
+          if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            _micro_log_socket_lost(sock, now);
+          break;
+        }
+      }
+      #endif // __linux__
+    }
+  }
+
+  for (size_t i = done; i < count; ++i)
+  {
+    size_t begin = i ? ends[i - 1] : 0;
+    size_t len = ends[i] - begin;
+    size_t already = (i == done) ? sent : 0;
+    if (!_micro_log_socket_queue(sock, data + begin, len, already)
+        && already > 0)
+    {
+      // The rest of the record can not be sent, start over with a
+      // new connection rather than mixing records
+      sock->pending_sent = 0;
+      _micro_log_socket_lost(sock, now);
+    }
+  }
+}
+
+// Whether GELF records are sent to the inet socket over UDP
+MICRO_LOG_DEF bool _micro_log_gelf_udp(MicroLog *micro_log)
+{
+  int index = _micro_log_out_index(MICRO_LOG_OUT_SOCK_INET);
+  return micro_log->inet_proto == MICRO_LOG_PROTO_UDP
+    && _MICRO_LOG_LOAD(micro_log->encodings[index]) == MICRO_LOG_ENCODING_GELF;
+}
+
+#define _MICRO_LOG_GELF_CHUNK_HEADER 12
+#define _MICRO_LOG_GELF_CHUNKS_MAX   128
+
+_Static_assert(MICRO_LOG_GELF_CHUNK_SIZE > _MICRO_LOG_GELF_CHUNK_HEADER,
+               "MICRO_LOG_GELF_CHUNK_SIZE is smaller than a chunk header");
+
+// Send the GELF record [data] to the inet socket in chunks
+//
+// Each chunk is a datagram that starts with the magic bytes 0x1e
+// 0x0f, an id shared by the chunks of the record, and the sequence
+// number and count of the chunk. Records that need more than 128
+// chunks are dropped.
+MICRO_LOG_DEF void
+_micro_log_gelf_write_chunked(MicroLog *micro_log,
+                              const char *data,
+                              size_t len)
+{
+  static uint64_t counter;
+  MicroLogSocket *sock = &micro_log->inet_sock;
+  size_t payload = MICRO_LOG_GELF_CHUNK_SIZE - _MICRO_LOG_GELF_CHUNK_HEADER;
+  size_t count = (len + payload - 1) / payload;
+  if (count > _MICRO_LOG_GELF_CHUNKS_MAX)
+  {
+    sock->dropped += len;
+    return;
+  }
+
+  // Unique enough for the receiver to tell the records apart
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  uint64_t id = (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+  id ^= __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED)
+        * 0x9E3779B97F4A7C15ull;
+
+  char stack[MICRO_LOG_RECORD_SIZE];
+  _MicroLogBuf buf;
+  _micro_log_buf_init(&buf, stack, sizeof(stack));
+  if (_micro_log_buf_reserve(&buf, len + count * _MICRO_LOG_GELF_CHUNK_HEADER)
+      != MICRO_LOG_OK)
+    goto done;
+
+  size_t ends[_MICRO_LOG_GELF_CHUNKS_MAX];
+  for (size_t i = 0; i < count; ++i)
+  {
+    size_t begin = i * payload;
+    size_t size = (len - begin < payload) ? len - begin : payload;
+    char *chunk = buf.data + buf.len;
+    chunk[0] = 0x1e;
+    chunk[1] = 0x0f;
+    memcpy(chunk + 2, &id, sizeof(id));
+    chunk[10] = (char) i;
+    chunk[11] = (char) count;
+    memcpy(chunk + _MICRO_LOG_GELF_CHUNK_HEADER, data + begin, size);
+    buf.len += _MICRO_LOG_GELF_CHUNK_HEADER + size;
+    ends[i] = buf.len;
+  }
+  _micro_log_socket_write(sock, buf.data, ends, count);
+
+ done:
+  _micro_log_buf_free(&buf);
+}
+
+MICRO_LOG_DEF void
+_micro_log_socket_state(const MicroLogSocket *sock,
+                        MicroLogSocketState *state)
+{
+  *state = (MicroLogSocketState){
+    .connected     = (sock->state == _MICRO_LOG_SOCKET_CONNECTED),
+    .bytes_queued  = sock->queued,
+    .bytes_dropped = sock->dropped,
+    .reconnects    = sock->reconnects,
+  };
+}
+
+#ifdef __unix__
+
+//
+// Syslog and journald sinks
+//
+// Both send a datagram per record to a local unix socket, through a
+// MicroLogSocket of their own, so they never block and reconnect
+// when the daemon is restarted.
+//
+
+MICRO_LOG_DEF int _micro_log_unix_sink_flush(void *user)
+{
+  _micro_log_socket_resume((MicroLogSocket *) user);
+  return MICRO_LOG_OK;
+}
+
+MICRO_LOG_DEF void _micro_log_unix_sink_close(void *user)
+{
+  _micro_log_socket_close((MicroLogSocket *) user);
+  free(user);
+}
+
+MICRO_LOG_DEF int
+_micro_log_syslog_sink_write(void *user, const char *buf, size_t len)
+{
+  // The datagram is the record, without the newline of the encoding
+  if (len > 0 && buf[len - 1] == '\n')
+    len--;
+  _micro_log_socket_write((MicroLogSocket *) user, buf, &len, 1);
+  return MICRO_LOG_OK;
+}
+
+// Add a sink that writes the records of at least [level] encoded
+// with [encoding] to the unix datagram socket [path]
+MICRO_LOG_DEF micro_log_error
+_micro_log_add_unix_sink(MicroLog *micro_log,
+                         const char *path,
+                         MicroLogLevel level,
+                         MicroLogEncoding encoding,
+                         int (*write)(void *user, const char *buf, size_t len))
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+  if (level >= MICRO_LOG_LEVEL_MAX)
+    return MICRO_LOG_ERROR_UNKNOWN_LEVEL;
+
+  MicroLogSocket *sock = malloc(sizeof(*sock));
+  if (sock == NULL)
+    return MICRO_LOG_ERROR_ALLOC;
+  _micro_log_socket_init(sock);
+
+  struct sockaddr_un sockaddr_un;
+  memset(&sockaddr_un, 0, sizeof(sockaddr_un));
+  sockaddr_un.sun_family = AF_UNIX;
+  strncpy(sockaddr_un.sun_path, path, sizeof(sockaddr_un.sun_path) - 1);
+
+  int ret = _micro_log_socket_open(sock, SOCK_DGRAM,
+                                   (struct sockaddr *) &sockaddr_un,
+                                   sizeof(sockaddr_un));
+  if (ret < 0)
+  {
+    perror("Error connecting to unix socket");
+    _micro_log_unix_sink_close(sock);
+    return (ret == -1) ? MICRO_LOG_ERROR_OPEN_UNIX_SOCK
+                       : MICRO_LOG_ERROR_UNIX_CONNECT;
+  }
+
+  MicroLogSink sink = {
+    .write    = write,
+    .flush    = _micro_log_unix_sink_flush,
+    .close    = _micro_log_unix_sink_close,
+    .user     = sock,
+    .level    = level,
+    .encoding = encoding,
+  };
+  micro_log_error error = micro_log_add_sink2(micro_log, &sink);
+  if (error != MICRO_LOG_OK)
+    _micro_log_unix_sink_close(sock);
+  return error;
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_add_syslog2(MicroLog *micro_log,
+                      char* path,
+                      MicroLogLevel level)
+{
+  if (path == NULL)
+    path = "/dev/log";
+  micro_log_error error =
+    _micro_log_add_unix_sink(micro_log, path, level,
+                             MICRO_LOG_ENCODING_SYSLOG,
+                             _micro_log_syslog_sink_write);
+  if (error == MICRO_LOG_OK)
+    micro_log_trace2(micro_log, "Added syslog sink at \"%s\"", path);
+  return error;
+}
+
+#ifdef __linux__
+
+_Static_assert(MICRO_LOG_JOURNALD_DATAGRAM_SIZE < MICRO_LOG_SOCKET_QUEUE,
+               "MICRO_LOG_JOURNALD_DATAGRAM_SIZE does not fit in the socket queue");
+
+// Pass the journal record [data] to [sock] in a sealed memfd, for the
+// records too large for a datagram
+//
+// The journal reads the record from the memfd. This is sent right
+// away even if older records are still queued, and the record is
+// dropped if the socket is not connected.
+MICRO_LOG_DEF void
+_micro_log_journald_write_memfd(MicroLogSocket *sock,
+                                const char *data,
+                                size_t len)
+{
+  int fd = memfd_create("micro-log", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+    goto dropped;
+  for (size_t written = 0; written < len;)
+  {
+    ssize_t n = write(fd, data + written, len - written);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      goto dropped;
+    written += (size_t) n;
+  }
+  // The journal only takes memfds that can not change anymore
+  if (fcntl(fd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+    goto dropped;
+
+  _micro_log_socket_resume(sock);
+  if (sock->state != _MICRO_LOG_SOCKET_CONNECTED)
+    goto dropped;
+
+  union {
+    struct cmsghdr header;
+    char data[CMSG_SPACE(sizeof(int))];
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct msghdr msg = {
+    .msg_control    = control.data,
+    .msg_controllen = sizeof(control.data),
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type  = SCM_RIGHTS;
+  cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  ssize_t ret;
+  do {
+    ret = sendmsg(sock->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+  } while (ret < 0 && errno == EINTR);
+  if (ret < 0)
+    goto dropped;
+  close(fd);
+  return;
+
+ dropped:
+  sock->dropped += len;
+  if (fd >= 0)
+    close(fd);
+}
+
+MICRO_LOG_DEF int
+_micro_log_journald_sink_write(void *user, const char *buf, size_t len)
+{
+  MicroLogSocket *sock = (MicroLogSocket *) user;
+  if (len > MICRO_LOG_JOURNALD_DATAGRAM_SIZE)
+    _micro_log_journald_write_memfd(sock, buf, len);
+  else
+    _micro_log_socket_write(sock, buf, &len, 1);
+  return MICRO_LOG_OK;
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_add_journald2(MicroLog *micro_log, MicroLogLevel level)
+{
+  micro_log_error error =
+    _micro_log_add_unix_sink(micro_log, "/run/systemd/journal/socket", level,
+                             MICRO_LOG_ENCODING_JOURNALD,
+                             _micro_log_journald_sink_write);
+  if (error == MICRO_LOG_OK)
+    micro_log_trace2(micro_log, "Added journald sink");
+  return error;
+}
+
+#endif // __linux__
+
+#endif // __unix__
+
+#endif // MICRO_LOG_SOCKETS
+
+//
+// File rotation
+//
+// The writer only renames the output file to a pending name and
+// opens it again, which is cheap. Shifting the names of the rotated
+// files, removing the old ones and compressing the new one happen
+// later on the rotator thread when MICRO_LOG_MULTITHREADED is
+// defined, or right away otherwise.
+//
+
+static const char *_micro_log_compress_programs[] = {
+  [MICRO_LOG_COMPRESS_NONE] = NULL,
+  [MICRO_LOG_COMPRESS_GZIP] = "gzip",
+  [MICRO_LOG_COMPRESS_ZSTD] = "zstd",
+};
+
+static const char *_micro_log_compress_exts[] = {
+  [MICRO_LOG_COMPRESS_NONE] = "",
+  [MICRO_LOG_COMPRESS_GZIP] = ".gz",
+  [MICRO_LOG_COMPRESS_ZSTD] = ".zst",
+};
+
+_Static_assert(sizeof(_micro_log_compress_exts)
+               / sizeof(_micro_log_compress_exts[0])
+               == _MICRO_LOG_COMPRESS_MAX,
+               "Updated MicroLogCompress, should also update _micro_log_compress_exts");
+
+// A rotated file waiting to get its final name
+typedef struct _MicroLogRotateJob {
+  struct _MicroLogRotateJob *next;
+  // Name of the output file
+  char *path;
+  // Name the output file was renamed to by the writer
+  char *pending;
+  int keep;
+  MicroLogCompress compress;
+} _MicroLogRotateJob;
+
+#ifdef MICRO_LOG_MULTITHREADED
+struct MicroLogRotator {
+  pthread_t thread;
+  // Protects the jobs and [stop]
+  pthread_mutex_t mutex;
+  // Wakes up the thread when there are new jobs
+  pthread_cond_t cond;
+  _MicroLogRotateJob *jobs;
+  _MicroLogRotateJob **jobs_tail;
+  bool stop;
+};
+#endif // MICRO_LOG_MULTITHREADED
+
+MICRO_LOG_DEF void _micro_log_rotate_job_free(_MicroLogRotateJob *job)
+{
+  free(job->path);
+  free(job->pending);
+  free(job);
+}
+
+// Allocate "[path].[index][ext]", the name of a rotated file
+MICRO_LOG_DEF char *
+_micro_log_rotated_name(const char *path, int index, const char *ext)
+{
+  size_t size = strlen(path) + strlen(ext) + 16;
+  char *name = malloc(size);
+  if (name != NULL)
+    snprintf(name, size, "%s.%d%s", path, index, ext);
+  return name;
+}
+
+// Whether the rotated file [index] of [path] exists, [ext] is
+// the extension of the compressed files
+MICRO_LOG_DEF bool
+_micro_log_rotated_exists(const char *path, int index, const char *ext)
+{
+  bool exists = false;
+  const char *exts[] = { "", ext };
+  for (int i = 0; i < 2 && !exists; ++i)
+  {
+    char *name = _micro_log_rotated_name(path, index, exts[i]);
+    exists = (name != NULL && access(name, F_OK) == 0);
+    free(name);
+  }
+  return exists;
+}
+
+// Rename the rotated file [index] of [path] to [index + 1], or
+// remove it if [index + 1] is more than [keep]
+MICRO_LOG_DEF void
+_micro_log_rotated_shift(const char *path, int index, int keep,
+                         const char *ext)
+{
+  const char *exts[] = { "", ext };
+  for (int i = 0; i < 2; ++i)
+  {
+    char *from = _micro_log_rotated_name(path, index, exts[i]);
+    char *to = _micro_log_rotated_name(path, index + 1, exts[i]);
+    if (from != NULL && to != NULL && access(from, F_OK) == 0)
+    {
+      if (keep > 0 && index >= keep)
+        (void) remove(from);
+      else
+        (void) rename(from, to);
+    }
+    free(from);
+    free(to);
+  }
+}
+
+// Compress [src] into [dst] with the program of [compress]
+//
+// The program runs with the lowest priority, so that compressing a
+// large file does not slow down the application.
+MICRO_LOG_DEF bool
+_micro_log_compress_file(const char *src,
+                         const char *dst,
+                         MicroLogCompress compress)
+{
+  char *argv[] = {
+    "nice", "-n", "19",
+    (char *) _micro_log_compress_programs[compress], "-c", "-q",
+    (char *) src, NULL,
+  };
+  posix_spawn_file_actions_t actions;
+  if (posix_spawn_file_actions_init(&actions) != 0)
+    return false;
+
+  bool ok = false;
+  pid_t pid;
+  int status;
+  if (posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, dst,
+                                       O_WRONLY | O_CREAT | O_TRUNC,
+                                       0644) == 0
+      && posix_spawnp(&pid, "nice", &actions, NULL, argv, environ) == 0
+      && waitpid(pid, &status, 0) == pid)
+    ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+  posix_spawn_file_actions_destroy(&actions);
+  if (!ok)
+    (void) remove(dst);
+  return ok;
+}
+
+// Give the file rotated by [job] its final name "[path].1", after
+// shifting the names of the files rotated before
+MICRO_LOG_DEF void _micro_log_rotate_finish(const _MicroLogRotateJob *job)
+{
+  const char *ext = _micro_log_compress_exts[job->compress];
+
+  int count = 0;
+  while (_micro_log_rotated_exists(job->path, count + 1, ext))
+    count++;
+  for (int i = count; i >= 1; --i)
+    _micro_log_rotated_shift(job->path, i, job->keep, ext);
+
+  char *dst = _micro_log_rotated_name(job->path, 1, "");
+  size_t compressed_size = strlen(job->pending) + strlen(ext) + 1;
+  char *compressed = malloc(compressed_size);
+  if (dst == NULL || compressed == NULL)
+    goto done;
+  snprintf(compressed, compressed_size, "%s%s", job->pending, ext);
+
+  if (job->compress != MICRO_LOG_COMPRESS_NONE
+      && _micro_log_compress_file(job->pending, compressed, job->compress))
+  {
+    char *compressed_dst = _micro_log_rotated_name(job->path, 1, ext);
+    if (compressed_dst != NULL && rename(compressed, compressed_dst) == 0)
+    {
+      (void) remove(job->pending);
+      free(compressed_dst);
+      goto done;
+    }
+    free(compressed_dst);
+    (void) remove(compressed);
+  }
+  // Not compressed, or compressing failed
+  if (rename(job->pending, dst) != 0)
+    perror("Error renaming rotated file");
+
+ done:
+  free(dst);
+  free(compressed);
+}
+
+#ifdef MICRO_LOG_MULTITHREADED
+
+MICRO_LOG_DEF void *_micro_log_rotator_thread(void *arg)
+{
+  MicroLogRotator *rotator = arg;
+
+  pthread_mutex_lock(&rotator->mutex);
+  for (;;)
+  {
+    while (rotator->jobs == NULL && !rotator->stop)
+      pthread_cond_wait(&rotator->cond, &rotator->mutex);
+    // The jobs left are finished before stopping
+    if (rotator->jobs == NULL)
+      break;
+
+    _MicroLogRotateJob *job = rotator->jobs;
+    rotator->jobs = job->next;
+    if (rotator->jobs == NULL)
+      rotator->jobs_tail = &rotator->jobs;
+
+    pthread_mutex_unlock(&rotator->mutex);
+    _micro_log_rotate_finish(job);
+    _micro_log_rotate_job_free(job);
+    pthread_mutex_lock(&rotator->mutex);
+  }
+  pthread_mutex_unlock(&rotator->mutex);
+  return NULL;
+}
+
+// Start the rotator thread of [micro_log] if it is not running, the
+// caller holds the write mutex
+MICRO_LOG_DEF micro_log_error _micro_log_rotator_start(MicroLog *micro_log)
+{
+  if (micro_log->rotator != NULL)
+    return MICRO_LOG_OK;
+
+  MicroLogRotator *rotator = calloc(1, sizeof(*rotator));
+  if (rotator == NULL)
+    return MICRO_LOG_ERROR_ALLOC;
+  rotator->jobs_tail = &rotator->jobs;
+  pthread_mutex_init(&rotator->mutex, NULL);
+  pthread_cond_init(&rotator->cond, NULL);
+  if (pthread_create(&rotator->thread, NULL, _micro_log_rotator_thread,
+                     rotator) != 0)
+  {
+    pthread_cond_destroy(&rotator->cond);
+    pthread_mutex_destroy(&rotator->mutex);
+    free(rotator);
+    return MICRO_LOG_ERROR_THREAD_CREATE;
+  }
+  micro_log->rotator = rotator;
+  return MICRO_LOG_OK;
+}
+
+// Wait for the rotator thread of [micro_log] to finish its jobs, and
+// stop it
+MICRO_LOG_DEF micro_log_error _micro_log_rotator_stop(MicroLog *micro_log)
+{
+  MicroLogRotator *rotator = micro_log->rotator;
+  if (rotator == NULL)
+    return MICRO_LOG_OK;
+
+  pthread_mutex_lock(&rotator->mutex);
+  rotator->stop = true;
+  pthread_cond_signal(&rotator->cond);
+  pthread_mutex_unlock(&rotator->mutex);
+  if (pthread_join(rotator->thread, NULL) != 0)
+    return MICRO_LOG_ERROR_THREAD_JOIN;
+
+  pthread_cond_destroy(&rotator->cond);
+  pthread_mutex_destroy(&rotator->mutex);
+  free(rotator);
+  micro_log->rotator = NULL;
+  return MICRO_LOG_OK;
+}
+
+#endif // MICRO_LOG_MULTITHREADED
+
+// When a file with [rotation] has to be rotated after [now], 0 if
+// it is not rotated over time
+//
+// Rotations every few minutes are aligned to multiples of the
+// period, so that hourly files start at the hour.
+MICRO_LOG_DEF time_t
+_micro_log_rotate_next(const MicroLogRotation *rotation, time_t now)
+{
+  time_t next = 0;
+  if (rotation->minutes > 0)
+  {
+    time_t period = (time_t) rotation->minutes * 60;
+    next = (now / period + 1) * period;
+  }
+  if (rotation->daily)
+  {
+    struct tm tm;
+    localtime_r(&now, &tm);
+    tm.tm_mday += 1;
+    tm.tm_hour = 0;
+    tm.tm_min = 0;
+    tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+    time_t midnight = mktime(&tm);
+    if (next == 0 || midnight < next)
+      next = midnight;
+  }
+  return next;
+}
+
+// Rename the output file and open it again, the caller holds the
+// write mutex
+MICRO_LOG_DEF micro_log_error _micro_log_file_rotate(MicroLog *micro_log)
+{
+  micro_log_error error = MICRO_LOG_OK;
+  if (micro_log->file == NULL || micro_log->file_path == NULL)
+    return MICRO_LOG_OK;
+
+  // Start counting again even if the rotation fails, so that it is
+  // not tried again for every record
+  micro_log->file_size = 0;
+  micro_log->rotate_at = _micro_log_rotate_next(&micro_log->rotation,
+                                                time(NULL));
+
+  _MicroLogRotateJob *job = calloc(1, sizeof(*job));
+  if (job == NULL)
+    return MICRO_LOG_ERROR_ALLOC;
+  size_t path_len = strlen(micro_log->file_path);
+  job->path = malloc(path_len + 1);
+  job->pending = malloc(path_len + 32);
+  if (job->path == NULL || job->pending == NULL)
+  {
+    error = MICRO_LOG_ERROR_ALLOC;
+    goto done;
+  }
+  memcpy(job->path, micro_log->file_path, path_len + 1);
+  snprintf(job->pending, path_len + 32, "%s.rotating.%u",
+           micro_log->file_path, micro_log->rotate_seq++);
+  job->keep = micro_log->rotation.keep;
+  job->compress = micro_log->rotation.compress;
+
+  #ifdef MICRO_LOG_IO_URING
+  // The records batched so far belong to the rotated file
+  if (micro_log->async.uring.batching)
+    (void) _micro_log_io_uring_submit(micro_log);
+  #endif // MICRO_LOG_IO_URING
+  if (fflush(micro_log->file) != 0
+      || rename(job->path, job->pending) != 0)
+  {
+    perror("Error rotating file");
+    error = MICRO_LOG_ERROR_ROTATE_FILE;
+    goto done;
+  }
+  FILE *file = fopen(job->path, "a");
+  if (file == NULL)
+  {
+    perror("Error opening file");
+    (void) rename(job->pending, job->path);
+    error = MICRO_LOG_ERROR_OPEN_FILE;
+    goto done;
+  }
+  fclose(micro_log->file);
+  micro_log->file = file;
+
+  #ifdef MICRO_LOG_MULTITHREADED
+  MicroLogRotator *rotator = micro_log->rotator;
+  if (rotator != NULL)
+  {
+    pthread_mutex_lock(&rotator->mutex);
+    *rotator->jobs_tail = job;
+    rotator->jobs_tail = &job->next;
+    pthread_cond_signal(&rotator->cond);
+    pthread_mutex_unlock(&rotator->mutex);
+    return MICRO_LOG_OK;
+  }
+  #endif // MICRO_LOG_MULTITHREADED
+
+  _micro_log_rotate_finish(job);
+
+ done:
+  _micro_log_rotate_job_free(job);
+  return error;
+}
+
+// Write [len] bytes of [buf] to the output file, rotating it before
+// if needed. The caller holds the write mutex
+MICRO_LOG_DEF micro_log_error
+_micro_log_file_write(MicroLog *micro_log, const char *buf, size_t len)
+{
+  micro_log_error error = MICRO_LOG_OK;
+
+  if ((micro_log->rotation.max_bytes > 0 && micro_log->file_size > 0
+       && micro_log->file_size + len > micro_log->rotation.max_bytes)
+      || (micro_log->rotate_at != 0 && time(NULL) >= micro_log->rotate_at))
+    error = _micro_log_file_rotate(micro_log);
+
+  // The record is written even if the rotation failed
+  #ifdef MICRO_LOG_IO_URING
+  if (micro_log->async.uring.batching)
+  {
+    micro_log_error write_error =
+      _micro_log_io_uring_append(micro_log, _MICRO_LOG_IO_URING_FILE,
+                                 fileno(micro_log->file), buf, len);
+    if (write_error != MICRO_LOG_OK)
+      return write_error;
+  }
+  else
+  #endif // MICRO_LOG_IO_URING
+  if (fwrite(buf, 1, len, micro_log->file) != len)
+    return MICRO_LOG_ERROR_PRINTF_FILE;
+  micro_log->file_size += len;
+  return error;
+}
+
+_Static_assert(_MICRO_LOG_COMPRESS_MAX == 3,
+               "Updated MicroLogCompress, should also update micro_log_set_file_rotation2");
+MICRO_LOG_DEF micro_log_error
+micro_log_set_file_rotation2(MicroLog *micro_log,
+                             const MicroLogRotation *rotation)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+  if (rotation == NULL || rotation->minutes < 0 || rotation->keep < 0
+      || rotation->compress >= _MICRO_LOG_COMPRESS_MAX)
+    return MICRO_LOG_ERROR_INVALID_ROTATION;
+  #ifndef MICRO_LOG_MULTITHREADED
+  // Compressing would block the thread that logs
+  if (rotation->compress != MICRO_LOG_COMPRESS_NONE)
+    return MICRO_LOG_ERROR_INVALID_ROTATION;
+  #endif // MICRO_LOG_MULTITHREADED
+
+  micro_log_error error = MICRO_LOG_OK;
+
+  __MICRO_LOG_LOCK(micro_log);
+
+  #ifdef MICRO_LOG_MULTITHREADED
+  error = _micro_log_rotator_start(micro_log);
+  if (error != MICRO_LOG_OK)
+    goto done;
+  #endif // MICRO_LOG_MULTITHREADED
+  micro_log->rotation = *rotation;
+  micro_log->rotate_at = _micro_log_rotate_next(rotation, time(NULL));
+
+  goto done;
+ done:
+  __MICRO_LOG_UNLOCK(micro_log);
+
+  if (error == MICRO_LOG_OK)
+    micro_log_trace2(micro_log, "Set file rotation");
+  return error;
+}
+
+MICRO_LOG_DEF micro_log_error micro_log_rotate_file2(MicroLog *micro_log)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+
+  micro_log_error error = micro_log_flush2(micro_log);
+  if (error != MICRO_LOG_OK)
+    return error;
+
+  __MICRO_LOG_LOCK(micro_log);
+  error = _micro_log_file_rotate(micro_log);
+
+  goto done;
+ done:
+  __MICRO_LOG_UNLOCK(micro_log);
+  return error;
+}
+
+_Static_assert(_MICRO_LOG_OUT_MAX == (1 << 7),
+               "Updated MICRO_LOG_OUT, should also update _micro_log_write_outputs");
+// MICRO_LOG_OUT_SINKS is left to `_micro_log_sinks_write`, each sink
+// has its own level and encoding
+MICRO_LOG_DEF micro_log_error
+_micro_log_write_outputs(MicroLog *micro_log,
+                         long unsigned int out,
+                         const char* buf,
+                         size_t len)
+{
+  micro_log_error error = MICRO_LOG_OK;
+
+  if (out & MICRO_LOG_OUT_STDOUT)
+  {
+    _MICRO_LOG_STATS_START(start);
+    #ifdef MICRO_LOG_IO_URING
+    if (micro_log->async.uring.batching)
+      error = _micro_log_io_uring_append(micro_log,
+                                         _MICRO_LOG_IO_URING_STDOUT,
+                                         fileno(stdout), buf, len);
+    else
+    #endif // MICRO_LOG_IO_URING
+    if (fwrite(buf, 1, len, stdout) != len)
+      error = MICRO_LOG_ERROR_PRINTF_STDOUT;
+    _MICRO_LOG_STATS_WRITE(micro_log, MICRO_LOG_OUT_STDOUT, len, start, error);
+    if (error != MICRO_LOG_OK)
+      goto done;
+  }
+  if (out & MICRO_LOG_OUT_FILE)
+  {
+    _MICRO_LOG_STATS_START(start);
+    error = _micro_log_file_write(micro_log, buf, len);
+    _MICRO_LOG_STATS_WRITE(micro_log, MICRO_LOG_OUT_FILE, len, start, error);
+    if (error != MICRO_LOG_OK)
+      goto done;
+  }
+  #ifdef MICRO_LOG_MMAP
+  if (out & MICRO_LOG_OUT_MMAP)
+  {
+    _MICRO_LOG_STATS_START(start);
+    error = _micro_log_mmap_write(micro_log, buf, len);
+    _MICRO_LOG_STATS_WRITE(micro_log, MICRO_LOG_OUT_MMAP, len, start, error);
+    if (error != MICRO_LOG_OK)
+      goto done;
+  }
+  #endif // MICRO_LOG_MMAP
+  #ifdef MICRO_LOG_SOCKETS
+  // Socket writes are queued if they can not be sent right away
+  if (out & MICRO_LOG_OUT_SOCK_INET)
+  {
+    _MICRO_LOG_STATS_START(start);
+    if (len > MICRO_LOG_GELF_CHUNK_SIZE && _micro_log_gelf_udp(micro_log))
+      _micro_log_gelf_write_chunked(micro_log, buf, len);
+    else
+      _micro_log_socket_write(&micro_log->inet_sock, buf, &len, 1);
+    _MICRO_LOG_STATS_WRITE(micro_log, MICRO_LOG_OUT_SOCK_INET, len, start,
+                           MICRO_LOG_OK);
+  }
+  #if defined(__unix__) || defined(__unix)
+  if (out & MICRO_LOG_OUT_SOCK_UNIX)
+  {
+    _MICRO_LOG_STATS_START(start);
+    _micro_log_socket_write(&micro_log->unix_sock, buf, &len, 1);
+    _MICRO_LOG_STATS_WRITE(micro_log, MICRO_LOG_OUT_SOCK_UNIX, len, start,
+                           MICRO_LOG_OK);
+  }
+  #endif // __unix__
+  #endif // MICRO_LOG_SOCKETS
 
-#else
-  
-#define __MICRO_LOG_LOCK(__micro_log_ptr) ;
-#define __MICRO_LOG_UNLOCK(__micro_log_ptr) ;
+ done:
+  return error;
+}
 
-#endif // MICRO_LOG_MULTITHREADED
+#ifdef MICRO_LOG_ASYNC
 
-MicroLog micro_log_global;
+//
+// Asynchronous backend
+//
 
-MICRO_LOG_DEF micro_log_error micro_log_init(void)
+MICRO_LOG_DEF void _micro_log_async_wake(MicroLog *micro_log)
 {
-  return micro_log_init2(&micro_log_global);
+  MicroLogAsync *async = &micro_log->async;
+  pthread_mutex_lock(&async->mutex);
+  pthread_cond_signal(&async->cond);
+  pthread_mutex_unlock(&async->mutex);
 }
 
-MICRO_LOG_DEF micro_log_error micro_log_from_file(char *filename)
+// Wait on [cond] for at most [ms] milliseconds, the caller holds the
+// async mutex
+MICRO_LOG_DEF void
+_micro_log_async_timedwait(MicroLog *micro_log, pthread_cond_t *cond, long ms)
 {
-  return micro_log_from_file2(&micro_log_global, filename);
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec  += ms / 1000;
+  deadline.tv_nsec += (ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L)
+  {
+    deadline.tv_sec  += 1;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  pthread_cond_timedwait(cond, &micro_log->async.mutex, &deadline);
 }
 
-MICRO_LOG_DEF micro_log_error micro_log_close(void)
+// Whether the oldest slot in the ring has been published
+MICRO_LOG_DEF bool _micro_log_async_ready(MicroLog *micro_log)
 {
-  return micro_log_close2(&micro_log_global);
+  MicroLogAsync *async = &micro_log->async;
+  size_t pos = __atomic_load_n(&async->dequeue_pos, __ATOMIC_SEQ_CST);
+  MicroLogSlot *slot = &async->slots[pos & async->mask];
+  return __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == pos + 1;
 }
 
-MICRO_LOG_DEF micro_log_error micro_log_flush(void)
+// Discard the oldest published record to make space in the ring
+//
+// Returns false if there was nothing that could be discarded, for
+// example because the writer is already busy with it.
+MICRO_LOG_DEF bool _micro_log_async_drop_oldest(MicroLog *micro_log)
 {
-  return micro_log_flush2(&micro_log_global);
+  MicroLogAsync *async = &micro_log->async;
+  size_t pos = __atomic_load_n(&async->dequeue_pos, __ATOMIC_RELAXED);
+  MicroLogSlot *slot = &async->slots[pos & async->mask];
+  if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+    return false;
+  if (!__atomic_compare_exchange_n(&async->dequeue_pos, &pos, pos + 1,
+                                   false, __ATOMIC_RELAXED,
+                                   __ATOMIC_RELAXED))
+    return false;
+
+  __atomic_add_fetch(&async->dropped[slot->record.level], 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->seq, pos + async->mask + 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&async->done_pos, 1, __ATOMIC_RELEASE);
+  return true;
 }
 
-MICRO_LOG_DEF micro_log_error
-micro_log_set_flags(long unsigned int flags_bitfield)
+// Store the packed arguments of [fmt] in [slot]
+//
+// Returns false if the arguments can not be packed or do not fit in
+// the slot, and the record must be rendered right away.
+MICRO_LOG_DEF bool
+_micro_log_async_push_packed(MicroLogSlot *slot,
+                             const char *fmt,
+                             va_list args)
 {
-  return micro_log_set_flags2(&micro_log_global, flags_bitfield);
+  bool ok = _micro_log_pack_truncated(slot->data, sizeof(slot->data),
+                                      fmt, args, &slot->len);
+  slot->fmt = ok ? fmt : NULL;
+  return ok;
 }
 
-MICRO_LOG_DEF micro_log_error micro_log_set_level(MicroLogLevel level)
+// Claim a slot in the ring for [record], at the position [pos]
+//
+// Returns NULL if the record was dropped because the ring is full.
+MICRO_LOG_DEF MicroLogSlot *
+_micro_log_async_claim(MicroLog *micro_log,
+                       const MicroLogRecord *record,
+                       size_t *claimed)
 {
-  return micro_log_set_level2(&micro_log_global, level);
-}
+  MicroLogAsync *async = &micro_log->async;
+  MicroLogSlot *slot;
+  size_t pos = __atomic_load_n(&async->enqueue_pos, __ATOMIC_RELAXED);
 
-MICRO_LOG_DEF micro_log_error micro_log_set_out(int out_flags)
-{
-  return micro_log_set_out2(&micro_log_global, out_flags);
+  for (;;)
+  {
+    slot = &async->slots[pos & async->mask];
+    size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+    if (dif == 0)
+    {
+      if (__atomic_compare_exchange_n(&async->enqueue_pos, &pos, pos + 1,
+                                      true, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED))
+        break;
+    }
+    else if (dif < 0)
+    {
+      // The ring is full
+      MicroLogOverflow policy =
+        __atomic_load_n(&micro_log->overflow, __ATOMIC_RELAXED);
+      if (policy == MICRO_LOG_OVERFLOW_DROP_NEWEST
+          || (policy == MICRO_LOG_OVERFLOW_DROP_BELOW
+              && record->level < __atomic_load_n(&micro_log->overflow_level,
+                                                 __ATOMIC_RELAXED)))
+      {
+        __atomic_add_fetch(&async->dropped[record->level], 1,
+                           __ATOMIC_RELAXED);
+        _micro_log_async_wake(micro_log);
+        return NULL;
+      }
+      if (policy != MICRO_LOG_OVERFLOW_DROP_OLDEST
+          || !_micro_log_async_drop_oldest(micro_log))
+      {
+        // Let the writer catch up
+        _micro_log_async_wake(micro_log);
+        sched_yield();
+      }
+      pos = __atomic_load_n(&async->enqueue_pos, __ATOMIC_RELAXED);
+    }
+    else
+    {
+      pos = __atomic_load_n(&async->enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  #ifdef MICRO_LOG_STATS
+  size_t waiting = pos + 1
+    - __atomic_load_n(&async->dequeue_pos, __ATOMIC_RELAXED);
+  size_t high = __atomic_load_n(&micro_log->stats.queue_high_water,
+                                __ATOMIC_RELAXED);
+  while (waiting > high
+         && !__atomic_compare_exchange_n(&micro_log->stats.queue_high_water,
+                                         &high, waiting, true,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+  #endif // MICRO_LOG_STATS
+
+  slot->record = *record;
+  *claimed = pos;
+  return slot;
 }
 
-MICRO_LOG_DEF micro_log_error micro_log_set_file(char* filename)
+// Publish the [slot] claimed at [pos] to the writer
+//
+// The slot must always be published, even if rendering failed, or
+// the writer would stop there forever.
+MICRO_LOG_DEF void
+_micro_log_async_publish(MicroLog *micro_log, MicroLogSlot *slot, size_t pos)
 {
-  return micro_log_set_file2(&micro_log_global, filename);
+  MicroLogAsync *async = &micro_log->async;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&async->sleeping, __ATOMIC_SEQ_CST))
+    _micro_log_async_wake(micro_log);
 }
 
-#ifdef MICRO_LOG_SOCKETS
+// Claim a slot, render the record into it and publish it
 MICRO_LOG_DEF micro_log_error
-micro_log_set_socket_inet(char* addr,
-                          int port,
-                          MicroLogProto protocol)
+_micro_log_async_push(MicroLog *micro_log,
+                      const MicroLogRecord *record,
+                      const char *fmt,
+                      va_list args)
 {
-  return micro_log_set_socket_inet2(&micro_log_global, addr, port, protocol);
-}
+  size_t pos;
+  MicroLogSlot *slot = _micro_log_async_claim(micro_log, record, &pos);
+  if (slot == NULL)
+    return MICRO_LOG_OK;
 
-#if defined(__unix__) || defined(__unix)
+  micro_log_error error = MICRO_LOG_OK;
 
-MICRO_LOG_DEF micro_log_error micro_log_set_socket_unix(char* path)
+  // Defer the formatting to the writer thread when asked to, or
+  // when the binary output can use the packed arguments
+  bool pack =
+    (_MICRO_LOG_LOAD(micro_log->out_bitfield) & MICRO_LOG_OUT_BINARY) != 0;
+  #ifdef MICRO_LOG_DEFERRED
+  pack = true;
+  #endif // MICRO_LOG_DEFERRED
+  if (pack && _micro_log_async_push_packed(slot, fmt, args))
+    goto publish;
+
+  slot->fmt = NULL;
+  error = _micro_log_render_truncated(slot->data, sizeof(slot->data),
+                                     record, fmt, args, &slot->len,
+                                     &slot->msg_begin, &slot->msg_len);
+
+ publish:
+  _micro_log_async_publish(micro_log, slot, pos);
+  return error;
+}
+
+// Claim a slot, copy the rendered record [text] into it and publish it
+//
+// A record that does not fit in a slot is truncated.
+MICRO_LOG_DEF void
+_micro_log_async_push_text(MicroLog *micro_log,
+                           const MicroLogRecord *record,
+                           const char *text,
+                           size_t len,
+                           size_t msg_begin,
+                           size_t msg_len)
 {
-  return micro_log_set_socket_unix2(&micro_log_global, path);
+  size_t pos;
+  MicroLogSlot *slot = _micro_log_async_claim(micro_log, record, &pos);
+  if (slot == NULL)
+    return;
+
+  size_t kept = (len < sizeof(slot->data)) ? len : sizeof(slot->data);
+  memcpy(slot->data, text, kept);
+  if (kept < len)
+  {
+    // Keep what fits and end the line
+    slot->data[kept - 1] = '\n';
+    if (msg_begin + msg_len > kept - 1)
+      msg_len = (msg_begin < kept - 1) ? kept - 1 - msg_begin : 0;
+  }
+  slot->fmt       = NULL;
+  slot->len       = kept;
+  slot->msg_begin = msg_begin;
+  slot->msg_len   = msg_len;
+
+  _micro_log_async_publish(micro_log, slot, pos);
 }
 
-#endif // __unix__
+#ifdef MICRO_LOG_IO_URING
 
-#endif // MICRO_LOG_SOCKETS
+//
+// io_uring writer
+//
+// While draining a batch, the writer copies the records for stdout
+// and the file in a buffer for each output instead of writing them
+// with stdio. At the end of the batch both buffers are written with a
+// single io_uring_enter, which also waits for the writes to complete.
+// There is at most one write in flight for each output, so the
+// writes of an output never need to be linked to keep their order.
+//
 
-MICRO_LOG_DEF micro_log_error micro_log_init2(MicroLog *micro_log)
+// Set up the ring of [uring] and its buffers
+//
+// Returns false if io_uring can not be used, and the writer then
+// uses stdio.
+MICRO_LOG_DEF bool _micro_log_io_uring_init(MicroLogIoUring *uring)
 {
-  if (micro_log == NULL)
-    return MICRO_LOG_ERROR_LOGGER_NULL;
+  memset(uring, 0, sizeof(*uring));
+  uring->fd = -1;
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = (int) syscall(__NR_io_uring_setup, 2 * _MICRO_LOG_IO_URING_COUNT,
+                         &params);
+  if (fd < 0)
+    return false;
+  // Writing at the current position of the file needs Linux 5.6
+  if (!(params.features & IORING_FEAT_RW_CUR_POS))
+    goto fail;
+
+  uring->fd = fd;
+  uring->sq_ring_size =
+    params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  uring->cq_ring_size =
+    params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (uring->cq_ring_size > uring->sq_ring_size)
+      uring->sq_ring_size = uring->cq_ring_size;
+    uring->cq_ring_size = 0;
+  }
 
-  *micro_log = (MicroLog){
-    .log_level = MICRO_LOG_LEVEL_TRACE,
-    .flags_bitfield = 0,
-    .out_bitfield = MICRO_LOG_OUT_STDOUT,
-    .file = NULL,
-    #ifdef MICRO_LOG_SOCKETS
-    .inet_sock_fd = 0,
-    #if defined(__unix__) || defined(__unix)
-    .unix_sock_fd = 0,
-    #endif // __unix__
-    #endif // MICRO_LOG_SOCKETS
-  };
+  uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (uring->sq_ring == MAP_FAILED)
+  {
+    uring->sq_ring = NULL;
+    goto fail;
+  }
+  uring->cq_ring = uring->sq_ring;
+  if (uring->cq_ring_size > 0)
+  {
+    uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (uring->cq_ring == MAP_FAILED)
+    {
+      uring->cq_ring = NULL;
+      goto fail;
+    }
+  }
+  uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (uring->sqes == MAP_FAILED)
+  {
+    uring->sqes = NULL;
+    goto fail;
+  }
 
-  #ifdef MICRO_LOG_MULTITHREADED
-  pthread_mutex_init(&micro_log->write_mutex, NULL);
-  #endif
+  char *sq = uring->sq_ring;
+  char *cq = uring->cq_ring;
+  uring->sq_head  = (unsigned int *) (sq + params.sq_off.head);
+  uring->sq_tail  = (unsigned int *) (sq + params.sq_off.tail);
+  uring->sq_mask  = (unsigned int *) (sq + params.sq_off.ring_mask);
+  uring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+  uring->cq_head  = (unsigned int *) (cq + params.cq_off.head);
+  uring->cq_tail  = (unsigned int *) (cq + params.cq_off.tail);
+  uring->cq_mask  = (unsigned int *) (cq + params.cq_off.ring_mask);
+  uring->cqes     = cq + params.cq_off.cqes;
+
+  char *bufs = malloc(_MICRO_LOG_IO_URING_COUNT * MICRO_LOG_IO_URING_BUFFER);
+  if (bufs == NULL)
+    goto fail;
+  struct iovec iov[_MICRO_LOG_IO_URING_COUNT];
+  for (int i = 0; i < _MICRO_LOG_IO_URING_COUNT; ++i)
+  {
+    uring->bufs[i] = bufs + i * MICRO_LOG_IO_URING_BUFFER;
+    iov[i].iov_base = uring->bufs[i];
+    iov[i].iov_len  = MICRO_LOG_IO_URING_BUFFER;
+  }
+  // The kernel can then read the buffers without mapping them for
+  // every write. Registering may fail because of RLIMIT_MEMLOCK, the
+  // buffers are passed with every write instead.
+  uring->fixed = (syscall(__NR_io_uring_register, fd,
+                          IORING_REGISTER_BUFFERS, iov,
+                          _MICRO_LOG_IO_URING_COUNT) == 0);
+  return true;
+
+ fail:
+  if (uring->sqes != NULL)
+    munmap(uring->sqes, uring->sqes_size);
+  if (uring->cq_ring != NULL && uring->cq_ring != uring->sq_ring)
+    munmap(uring->cq_ring, uring->cq_ring_size);
+  if (uring->sq_ring != NULL)
+    munmap(uring->sq_ring, uring->sq_ring_size);
+  close(fd);
+  memset(uring, 0, sizeof(*uring));
+  uring->fd = -1;
+  return false;
+}
 
-  micro_log_info2(micro_log, "Logger initialized");
-  return MICRO_LOG_OK;
+MICRO_LOG_DEF void _micro_log_io_uring_free(MicroLogIoUring *uring)
+{
+  if (uring->fd < 0)
+    return;
+  munmap(uring->sqes, uring->sqes_size);
+  if (uring->cq_ring != uring->sq_ring)
+    munmap(uring->cq_ring, uring->cq_ring_size);
+  munmap(uring->sq_ring, uring->sq_ring_size);
+  // Also unregisters the buffers
+  close(uring->fd);
+  // The kernel may still be reading the buffers of a broken ring
+  if (!uring->broken)
+    free(uring->bufs[0]);
+  memset(uring, 0, sizeof(*uring));
+  uring->fd = -1;
 }
 
-MICRO_LOG_DEF int _micro_log_get_spaces(char* str, int max)
+// Queue a write of the output [index] from byte [done] of its buffer
+MICRO_LOG_DEF void
+_micro_log_io_uring_prepare(MicroLogIoUring *uring, int index, size_t done)
 {
-  int spaces = 0;
-  while((*(str + spaces) == ' ' || *(str + spaces) == '\t') && spaces < max)
-    spaces++;
-  return spaces;
+  unsigned int tail = *uring->sq_tail;
+  unsigned int pos = tail & *uring->sq_mask;
+  struct io_uring_sqe *sqe = (struct io_uring_sqe *) uring->sqes + pos;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode    = uring->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+  sqe->fd        = uring->fds[index];
+  sqe->addr      = (uint64_t) (uintptr_t) (uring->bufs[index] + done);
+  sqe->len       = (uint32_t) (uring->lens[index] - done);
+  // At the current position of the file, like write(2)
+  sqe->off       = (uint64_t) -1;
+  sqe->buf_index = (uint16_t) index;
+  sqe->user_data = (uint64_t) index;
+  uring->sq_array[pos] = pos;
+  __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
 }
 
-MICRO_LOG_DEF int _micro_log_get_word_len(char* str, int max)
+// Whether io_uring_enter failed with [err] only for now
+MICRO_LOG_DEF bool _micro_log_io_uring_transient(int err)
 {
-  int letters = 0;
-  while(*(str+letters) != ' '
-        && *(str+letters) != '\n'
-        && *(str+letters) != '\t'
-        && letters < max)
-    letters++;
-  return letters;
+  return err == EINTR || err == EAGAIN || err == EBUSY || err == ENOMEM;
 }
 
-MICRO_LOG_DEF micro_log_error
-micro_log_from_file2(MicroLog *micro_log, char *filename)
+// Write [len] bytes of [buf] to [fd] with write(2), when the ring can
+// not be used
+MICRO_LOG_DEF bool
+_micro_log_io_uring_write_fd(int fd, const char *buf, size_t len)
 {
-  if (micro_log == NULL)
-    return MICRO_LOG_ERROR_LOGGER_NULL;
-  if (filename == NULL)
-    return MICRO_LOG_ERROR_FROM_FILE_NULL;
+  while (len > 0)
+  {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    buf += n;
+    len -= (size_t) n;
+  }
+  return true;
+}
 
+// Write the records batched for stdout and the file, and wait for
+// the writes to complete. The caller holds the write mutex
+//
+// If the ring fails, the writes the kernel did not read yet are taken
+// back from the submission queue, and the ones it did read are waited
+// for. Only the bytes no completion confirmed are then written with
+// write(2), so that no record is written twice.
+MICRO_LOG_DEF micro_log_error _micro_log_io_uring_submit(MicroLog *micro_log)
+{
+  MicroLogIoUring *uring = &micro_log->async.uring;
   micro_log_error error = MICRO_LOG_OK;
-  
-  FILE* file = fopen(filename, "r");
-  if (file == NULL)
+  size_t done[_MICRO_LOG_IO_URING_COUNT] = {0};
+  // Whether a write of the output is in the ring, submitted or not
+  bool queued[_MICRO_LOG_IO_URING_COUNT] = {0};
+  unsigned int inflight = 0;
+  bool failed = false;
+
+  for (int i = 0; i < _MICRO_LOG_IO_URING_COUNT; ++i)
   {
-    perror("Error opening file");
-    error = MICRO_LOG_ERROR_OPEN_FILE;
-    goto done;
+    if (uring->lens[i] == 0)
+      continue;
+    _micro_log_io_uring_prepare(uring, i, 0);
+    queued[i] = true;
+    inflight++;
   }
 
-  // Example file:
-  //
-  // level: debug
-  // flags: level date time tid pid
-  // file: output.txt
-  // inet: 127.0.0.1 5000 TCP
-  // unix: /tmp/a-socket
-  // # A comment
-  //
-  char *line = NULL;
-  size_t len;
-  int spaces;
-  while(getline(&line, &len, file) >= 0)
+  unsigned int to_submit = inflight;
+  while (inflight > 0)
   {
-    if (strncmp(line, "#", 1) == 0)
-    {
-      goto next;
-    }
-    if (strncmp(line, "\n", 1) == 0)
-    {
-      goto next;
-    }
-    if (strncmp(line, "level:", 6) == 0)
+    long ret = syscall(__NR_io_uring_enter, uring->fd, to_submit, 1,
+                       IORING_ENTER_GETEVENTS, NULL, 0);
+    int err = (ret < 0) ? errno : 0;
+    if (ret < 0 && err != EINTR && !failed)
     {
-      spaces = _micro_log_get_spaces(line + 6, len - 6);
-      
-      if (strncmp(line + 6 + spaces, "trace", 5) == 0)
-      {
-        micro_log_set_level2(micro_log, MICRO_LOG_LEVEL_TRACE);
-      }
-      else if (strncmp(line + 6 + spaces, "debug", 5) == 0)
-      {
-        micro_log_set_level2(micro_log, MICRO_LOG_LEVEL_DEBUG);
-      }
-      else if (strncmp(line + 6 + spaces, "info", 4) == 0)
-      {
-        micro_log_set_level2(micro_log, MICRO_LOG_LEVEL_INFO);
-      }
-      else if (strncmp(line + 6 + spaces, "warn", 4) == 0)
-      {
-        micro_log_set_level2(micro_log, MICRO_LOG_LEVEL_WARN);
-      }
-      else if (strncmp(line + 6 + spaces, "error", 5) == 0)
-      {
-        micro_log_set_level2(micro_log, MICRO_LOG_LEVEL_ERROR);
-      }
-      else if (strncmp(line + 6 + spaces, "fatal", 5) == 0)
-      {
-        micro_log_set_level2(micro_log, MICRO_LOG_LEVEL_FATAL);
-      }
-      else if (strncmp(line + 6 + spaces, "disabled", 8) == 0)
+      // No SQPOLL thread, the kernel only reads the queue in
+      // io_uring_enter
+      failed = true;
+      unsigned int head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+      for (unsigned int pos = head; pos != *uring->sq_tail; ++pos)
       {
-        micro_log_set_level2(micro_log, MICRO_LOG_LEVEL_DISABLED);
-      } else {
-        error = MICRO_LOG_ERROR_UNKNOWN_LEVEL;
-        free(line);
-        goto done;
+        const struct io_uring_sqe *sqe =
+          (const struct io_uring_sqe *) uring->sqes + (pos & *uring->sq_mask);
+        queued[sqe->user_data] = false;
+        inflight--;
       }
+      __atomic_store_n(uring->sq_tail, head, __ATOMIC_RELEASE);
     }
-    else if (strncmp(line, "flags:", 6) == 0)
+    if (failed)
+      to_submit = 0;
+    else
+      to_submit = *uring->sq_tail
+                  - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+    if (ret < 0 && !_micro_log_io_uring_transient(err))
     {
-      int pos = 6;
-      long unsigned int flags = 0;
-      pos += _micro_log_get_spaces(line + 6, len - 6);
-      while (pos <= len)
-      {
-        if (strncmp(line + pos, "level", 5) == 0)
-        {
-          flags |= MICRO_LOG_FLAG_LEVEL;
-          pos += 5;
-        }
-        else if (strncmp(line + pos, "date", 4) == 0)
-        {
-          flags |= MICRO_LOG_FLAG_DATE;
-          pos += 4;
-        }
-        else if (strncmp(line + pos, "time", 4) == 0)
-        {
-          flags |= MICRO_LOG_FLAG_TIME;
-          pos += 4;
-        }
-        else if (strncmp(line + pos, "pid", 3) == 0)
-        {
-          flags |= MICRO_LOG_FLAG_PID;
-          pos += 3;
-        }
-        else if (strncmp(line + pos, "tid", 3) == 0)
-        {
-          flags |= MICRO_LOG_FLAG_TID;
-          pos += 3;
-        }
-        else if (strncmp(line + pos, "json", 4) == 0)
-        {
-          flags |= MICRO_LOG_FLAG_JSON;
-          pos += 4;
-        }
-        else if (strncmp(line + pos, "color", 5) == 0)
-        {
-          flags |= MICRO_LOG_FLAG_COLOR;
-          pos += 5;
-        }
-        else if (strncmp(line + pos, "file", 4) == 0)
-        {
-          flags |= MICRO_LOG_FLAG_FILE;
-          pos += 4;
-        }
-        else if (strncmp(line + pos, "line", 4) == 0)
-        {
-          flags |= MICRO_LOG_FLAG_LINE;
-          pos += 4;
-        }
-        else {
-          error = MICRO_LOG_ERROR_UNKNOWN_FLAG;
-          free(line);
-          goto done;
-        }
-
-        if (*(line + pos) == '\n') break;
-        pos += _micro_log_get_spaces(line + pos, len - pos);
-      }
-      error = micro_log_set_flags2(micro_log, flags);
-      if (error != MICRO_LOG_OK) { free(line); goto done; }
+      // The writes in flight can not be waited for
+      if (inflight > 0)
+        uring->broken = true;
+      break;
     }
-    else if (strncmp(line, "file:", 5) == 0)
-    {
-      int pos = 5;
-      pos += _micro_log_get_spaces(line + pos, len - 6);
-      int file_str_len = _micro_log_get_word_len(line + pos, len - pos);
-      if (pos + file_str_len < len)
-      {
-        line[pos + file_str_len] = '\0';
-      }
-      
-      error = micro_log_set_file2(micro_log, line + pos);
-      if (error != MICRO_LOG_OK) { free(line); goto done; }
-    }
-    #ifdef MICRO_LOG_SOCKETS
-    else if (strncmp(line, "inet:", 5) == 0)
-    {
-      char* addr;
-      int port;
-      MicroLogProto proto;
-      
-      int pos = 6;
-      pos += _micro_log_get_spaces(line + 6, len - 6);
-      int addr_len = _micro_log_get_word_len(line + pos, len - pos);
-      if (addr_len == 0)
-      {
-        error = MICRO_LOG_ERROR_INVALID_INET_ADDR;
-        free(line);
-        goto done;
-      }
-
-      addr = malloc(addr_len + 1);
-      strncpy(addr, line + pos, addr_len);
-      addr[addr_len] = '\0';
-      
-      pos += addr_len;
-
-      pos += _micro_log_get_spaces(line + pos, len - pos);
-      int port_len = _micro_log_get_word_len(line + pos, len - pos);
-      if (port_len == 0)
-      {
-        error = MICRO_LOG_ERROR_INVALID_PORT;
-        free(line); free(addr);
-        goto done;
-      }
 
-      char *port_str = malloc(port_len + 1);
-      strncpy(port_str, line + pos, port_len);
-      port_str[port_len] = '\0';
-
-      port = atoi(port_str);
-      if (port_len == 0)
-      {
-        error = MICRO_LOG_ERROR_INVALID_PORT;
-        free(port_str); free(line); free(addr);
-        goto done;
-      }
-      
-      free(port_str);
-      pos += port_len;
-
-      pos += _micro_log_get_spaces(line + pos, len - pos);
-      int proto_len = _micro_log_get_word_len(line + pos, len - pos);
-      if (proto_len == 0)
-      {
-        error = MICRO_LOG_ERROR_INVALID_PROTOCOL;
-        free(line); free(addr);
-        goto done;
-      }
-
-      if (strncmp(line + pos, "tcp", 3) == 0)
+    unsigned int head = *uring->cq_head;
+    unsigned int tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head)
+    {
+      const struct io_uring_cqe *cqe =
+        (const struct io_uring_cqe *) uring->cqes + (head & *uring->cq_mask);
+      int index = (int) cqe->user_data;
+      queued[index] = false;
+      inflight--;
+      if (cqe->res > 0)
+        done[index] += (size_t) cqe->res;
+      else if (cqe->res != -EINTR && cqe->res != -EAGAIN)
       {
-        proto = MICRO_LOG_PROTO_TCP;
+        // Including a write of 0 bytes, which would be retried forever
+        error = (index == _MICRO_LOG_IO_URING_FILE)
+          ? MICRO_LOG_ERROR_PRINTF_FILE : MICRO_LOG_ERROR_PRINTF_STDOUT;
+        done[index] = uring->lens[index];
       }
-      else if (strncmp(line + pos, "udp", 3) == 0)
+      // Short write
+      if (!failed && done[index] < uring->lens[index])
       {
-        proto = MICRO_LOG_PROTO_UDP;
-      }
-      else {
-        error = MICRO_LOG_ERROR_INVALID_PROTOCOL;
-        free(line); free(addr);
-        goto done;
+        _micro_log_io_uring_prepare(uring, index, done[index]);
+        queued[index] = true;
+        inflight++;
+        to_submit++;
       }
-      
-      error = micro_log_set_socket_inet(addr, port, proto);
-      if (error != MICRO_LOG_OK) { free(line); free(addr); goto done; }
-      
-      free(addr);
-    }
-    #if defined(__unix__) || defined(__unix)
-    else if (strncmp(line, "unix:", 5) == 0)
-    {
-      spaces = _micro_log_get_spaces(line + 5, len - 6);
-      error = micro_log_set_socket_unix2(micro_log, line + 5 + spaces);
-      if (error != MICRO_LOG_OK) { free(line); goto done; }
-    }
-    #endif // __unix__
-    #endif // MICRO_LOG_SOCKETS
-    else {
-      free(line);
-      error = MICRO_LOG_ERROR_INVALID_FILE_SETTING;
-      goto done;
-    }
-
-    next:
-    free(line);
-    line = NULL;
-  }
-  
-  if (fclose(file) != 0)
-  {
-    error = MICRO_LOG_ERROR_CLOSE_FILE;
-    goto done;
-  }
-  
- done:
-
-  if (error == MICRO_LOG_OK)
-    micro_log_trace("Initialized logger from file \"%s\"", filename);
-  return error;
-}
-
-MICRO_LOG_DEF micro_log_error micro_log_close2(MicroLog *micro_log)
-{
-  if (micro_log == NULL)
-    return MICRO_LOG_ERROR_LOGGER_NULL;
-
-  micro_log_error error = MICRO_LOG_OK;
-
-  micro_log_info2(micro_log, "Closing logger");
-  
-  __MICRO_LOG_LOCK(micro_log);
-  
-  if (micro_log->file != NULL)
-  {
-    if (fclose(micro_log->file) != 0)
-    {
-      perror("Error closing file");
-      error = MICRO_LOG_ERROR_CLOSE_FILE;
-      goto done;
-    }
-  }
-
-  #ifdef MICRO_LOG_SOCKETS
-  if (micro_log->inet_sock_fd > 0)
-  {
-    if (close_socket(micro_log->inet_sock_fd) < 0)
-    {
-      perror("Error closeing socket");
-      error = MICRO_LOG_ERROR_CLOSE_INET_SOCK;
-      goto done;
-    }
-  }
-  #if defined(__unix__) || defined(__unix)
-  if (micro_log->unix_sock_fd > 0)
-  {
-    if (close(micro_log->unix_sock_fd) < 0)
-    {
-      error = MICRO_LOG_ERROR_CLOSE_UNIX_SOCK;
-      goto done;
     }
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
   }
-  #endif // __unix__
-  #endif // MICRO_LOG_SOCKETS
 
- done:
-  __MICRO_LOG_UNLOCK(micro_log);
-  
-  #ifdef MICRO_LOG_MULTITHREADED
-  pthread_mutex_destroy(&micro_log->write_mutex);
-  #endif
-  
+  // The ring failed, this is the only way left to write the records
+  for (int i = 0; i < _MICRO_LOG_IO_URING_COUNT; ++i)
+  {
+    if (queued[i]
+        || (done[i] < uring->lens[i]
+            && !_micro_log_io_uring_write_fd(uring->fds[i],
+                                             uring->bufs[i] + done[i],
+                                             uring->lens[i] - done[i])))
+      error = (i == _MICRO_LOG_IO_URING_FILE)
+        ? MICRO_LOG_ERROR_PRINTF_FILE : MICRO_LOG_ERROR_PRINTF_STDOUT;
+  }
+
+  // A broken ring keeps its buffers, which the kernel may still read
+  if (uring->broken)
+  {
+    uring->batching = false;
+    for (int i = 0; i < _MICRO_LOG_IO_URING_COUNT; ++i)
+      uring->bufs[i] = NULL;
+  }
+  for (int i = 0; i < _MICRO_LOG_IO_URING_COUNT; ++i)
+    uring->lens[i] = 0;
   return error;
 }
 
-_Static_assert(_MICRO_LOG_OUT_MAX == (1 << 4),
-               "Updated MICRO_LOG_OUT_MAX, maybe should also update micro_log_flush2");
-MICRO_LOG_DEF micro_log_error micro_log_flush2(MicroLog *micro_log)
+// Batch [len] bytes of [buf] for the output [index], writing to [fd].
+// The caller holds the write mutex
+MICRO_LOG_DEF micro_log_error
+_micro_log_io_uring_append(MicroLog *micro_log,
+                           int index,
+                           int fd,
+                           const char *buf,
+                           size_t len)
 {
-  if (micro_log == NULL)
-    return MICRO_LOG_ERROR_LOGGER_NULL;
-
+  MicroLogIoUring *uring = &micro_log->async.uring;
   micro_log_error error = MICRO_LOG_OK;
 
-  if (micro_log->out_bitfield & MICRO_LOG_OUT_STDOUT)
+  // Records are written whole when they fit in the buffer
+  if (uring->lens[index] > 0
+      && (uring->fds[index] != fd
+          || uring->lens[index] + len > MICRO_LOG_IO_URING_BUFFER))
+    error = _micro_log_io_uring_submit(micro_log);
+
+  while (len > 0)
   {
-    if (fflush(stdout) != 0)
+    if (uring->lens[index] == MICRO_LOG_IO_URING_BUFFER)
     {
-      perror("Error flushing stdout");
-      error = MICRO_LOG_ERROR_FLUSH_STDOUT;
-      goto done;
+      micro_log_error submit_error = _micro_log_io_uring_submit(micro_log);
+      if (error == MICRO_LOG_OK)
+        error = submit_error;
     }
-  }
-  if (micro_log->out_bitfield & MICRO_LOG_OUT_FILE)
-  {
-    if (fflush(micro_log->file) != 0)
+    if (uring->broken)
     {
-      perror("Error flushing file");
-      error = MICRO_LOG_ERROR_FLUSH_FILE;
-      goto done;
+      if (!_micro_log_io_uring_write_fd(fd, buf, len) && error == MICRO_LOG_OK)
+        error = (index == _MICRO_LOG_IO_URING_FILE)
+          ? MICRO_LOG_ERROR_PRINTF_FILE : MICRO_LOG_ERROR_PRINTF_STDOUT;
+      break;
     }
+    size_t n = MICRO_LOG_IO_URING_BUFFER - uring->lens[index];
+    if (n > len)
+      n = len;
+    memcpy(uring->bufs[index] + uring->lens[index], buf, n);
+    uring->lens[index] += n;
+    uring->fds[index] = fd;
+    buf += n;
+    len -= n;
   }
-
- done:
   return error;
 }
-  
-MICRO_LOG_DEF micro_log_error
-micro_log_set_flags2(MicroLog *micro_log,
-                     long unsigned int flags_bitfield)
-{
-  if (micro_log == NULL)
-    return MICRO_LOG_ERROR_LOGGER_NULL;
-  
-  micro_log_error error = MICRO_LOG_OK;
-  
-  __MICRO_LOG_LOCK(micro_log);
-  
-  micro_log->flags_bitfield = flags_bitfield;
 
-  goto done;
- done:
-  __MICRO_LOG_UNLOCK(micro_log);
-  return error;
+// Start batching the writes to stdout and the file, the caller holds
+// the write mutex
+MICRO_LOG_DEF void _micro_log_io_uring_begin(MicroLog *micro_log)
+{
+  MicroLogIoUring *uring = &micro_log->async.uring;
+  if (uring->fd < 0 || uring->broken)
+    return;
+  // What was written with stdio goes first, this is free when the
+  // stdio buffers are empty
+  (void) fflush(stdout);
+  if (micro_log->file != NULL)
+    (void) fflush(micro_log->file);
+  uring->batching = true;
 }
 
-MICRO_LOG_DEF micro_log_error
-micro_log_set_level2(MicroLog *micro_log,
-                     MicroLogLevel level)
+// Write the batch, the caller holds the write mutex
+MICRO_LOG_DEF void _micro_log_io_uring_end(MicroLog *micro_log)
 {
-  if (micro_log == NULL)
-    return MICRO_LOG_ERROR_LOGGER_NULL;
-
-  if (level > MICRO_LOG_LEVEL_MAX)
-    return MICRO_LOG_ERROR_UNKNOWN_LEVEL;
-  
-  micro_log_error error = MICRO_LOG_OK;
-
-  __MICRO_LOG_LOCK(micro_log);
-  
-  micro_log->log_level = level;
+  MicroLogIoUring *uring = &micro_log->async.uring;
+  if (!uring->batching)
+    return;
+  #ifdef MICRO_LOG_STATS
+  // The outputs are written at once, each one gets a share of the time
+  static const long unsigned int outs[_MICRO_LOG_IO_URING_COUNT] = {
+    [_MICRO_LOG_IO_URING_STDOUT] = MICRO_LOG_OUT_STDOUT,
+    [_MICRO_LOG_IO_URING_FILE]   = MICRO_LOG_OUT_FILE,
+  };
+  bool pending[_MICRO_LOG_IO_URING_COUNT];
+  int64_t outputs = 0;
+  for (int i = 0; i < _MICRO_LOG_IO_URING_COUNT; ++i)
+  {
+    pending[i] = (uring->lens[i] > 0);
+    outputs += pending[i];
+  }
+  int64_t start = _micro_log_stats_now();
+  #endif // MICRO_LOG_STATS
+  // There is no caller to report write errors to
+  (void) _micro_log_io_uring_submit(micro_log);
+  uring->batching = false;
+  #ifdef MICRO_LOG_STATS
+  for (int i = 0; i < _MICRO_LOG_IO_URING_COUNT && outputs > 0; ++i)
+    if (pending[i])
+      __atomic_add_fetch(&micro_log->stats.io_ns[__builtin_ctzl(outs[i])],
+                         (uint64_t) ((_micro_log_stats_now() - start)
+                                     / outputs),
+                         __ATOMIC_RELAXED);
+  #endif // MICRO_LOG_STATS
+}
 
-  goto done;
- done:
-  __MICRO_LOG_UNLOCK(micro_log);
+#endif // MICRO_LOG_IO_URING
 
-  if (error == MICRO_LOG_OK)
-    micro_log_trace2(micro_log, "Set log level to %s",
-                     micro_log_level_string(level, false));
-  return error;
-}
+#ifdef MICRO_LOG_SOCKETS
 
+// Queue the rendered record [text] in [batch] to be written at the
+// end of the drain, the caller holds the write mutex
 MICRO_LOG_DEF micro_log_error
-micro_log_set_out2(MicroLog *micro_log, int out_flags)
+_micro_log_async_batch_add(MicroLogSocketBatch *batch,
+                           const char *text,
+                           size_t len)
 {
-  if (micro_log == NULL)
-    return MICRO_LOG_ERROR_LOGGER_NULL;
-
-  micro_log_error error = MICRO_LOG_OK;
-
-  __MICRO_LOG_LOCK(micro_log);
-  
-  micro_log->out_bitfield = out_flags;
+  if (batch->len + len > batch->cap)
+  {
+    size_t cap = batch->cap ? 2 * batch->cap : MICRO_LOG_RECORD_SIZE;
+    while (cap < batch->len + len)
+      cap *= 2;
+    char *data = realloc(batch->data, cap);
+    if (data == NULL)
+      return MICRO_LOG_ERROR_ALLOC;
+    batch->data = data;
+    batch->cap = cap;
+  }
 
-  goto done;
- done:
-  __MICRO_LOG_UNLOCK(micro_log);
-  return error;
+  memcpy(batch->data + batch->len, text, len);
+  batch->len += len;
+  batch->ends[batch->count++] = batch->len;
+  return MICRO_LOG_OK;
 }
 
-MICRO_LOG_DEF micro_log_error
-micro_log_set_file2(MicroLog *micro_log,
-                    char* filename)
+// Write the queued records to the sockets, the caller holds the
+// write mutex
+MICRO_LOG_DEF void _micro_log_async_batch_send(MicroLog *micro_log)
 {
-  if (micro_log == NULL)
-    return MICRO_LOG_ERROR_LOGGER_NULL;
+  MicroLogAsync *async = &micro_log->async;
+  MicroLogSocketBatch *batch = &async->inet_batch;
 
-  micro_log_error error = MICRO_LOG_OK;
-  
-  __MICRO_LOG_LOCK(micro_log);
-  
-  if (micro_log->file != NULL)
+  if (batch->count > 0)
   {
-    if (fclose(micro_log->file) != 0)
+    _MICRO_LOG_STATS_START(start);
+    if (micro_log->inet_proto == MICRO_LOG_PROTO_UDP)
     {
-      perror("Error closing file");
-      error = MICRO_LOG_ERROR_CLOSE_FILE;
-      goto done;
+      // Group the records in datagrams of whole records
+      size_t ends[MICRO_LOG_ASYNC_BATCH];
+      size_t datagrams = 0;
+      size_t begin = 0;
+      for (size_t i = 0; i < batch->count; ++i)
+      {
+        size_t end = batch->ends[i];
+        // Append the next records while they fit in the datagram
+        while (i + 1 < batch->count
+               && batch->ends[i + 1] - begin <= MICRO_LOG_UDP_DATAGRAM_SIZE)
+          end = batch->ends[++i];
+        ends[datagrams++] = end;
+        begin = end;
+      }
+      _micro_log_socket_write(&micro_log->inet_sock, batch->data,
+                              ends, datagrams);
+    }
+    else
+    {
+      _micro_log_socket_write(&micro_log->inet_sock, batch->data,
+                              batch->ends, batch->count);
     }
+    _MICRO_LOG_STATS_WRITE(micro_log, MICRO_LOG_OUT_SOCK_INET, batch->len,
+                           start, MICRO_LOG_OK);
+    batch->len   = 0;
+    batch->count = 0;
   }
-  
-  FILE *file = fopen(filename, "w+");
-  if (file == NULL)
+
+  #if defined(__unix__) || defined(__unix)
+  batch = &async->unix_batch;
+  if (batch->count > 0)
   {
-    perror("Error opening file");
-    error = MICRO_LOG_ERROR_OPEN_FILE;
-    goto done;
+    _MICRO_LOG_STATS_START(start);
+    _micro_log_socket_write(&micro_log->unix_sock, batch->data,
+                            batch->ends, batch->count);
+    _MICRO_LOG_STATS_WRITE(micro_log, MICRO_LOG_OUT_SOCK_UNIX, batch->len,
+                           start, MICRO_LOG_OK);
+    batch->len   = 0;
+    batch->count = 0;
   }
+  #endif // __unix__
+}
 
-  micro_log->out_bitfield |= MICRO_LOG_OUT_FILE;
-  micro_log->file = file;
+// Queue the record of [entry] for the socket [sink], in the encoding
+// of the socket
+MICRO_LOG_DEF micro_log_error
+_micro_log_async_batch_entry(MicroLog *micro_log,
+                             const _MicroLogEntry *entry,
+                             long unsigned int sink)
+{
+  MicroLogSocketBatch *batch = (sink == MICRO_LOG_OUT_SOCK_INET)
+    ? &micro_log->async.inet_batch : &micro_log->async.unix_batch;
+  if (_micro_log_out_plain(micro_log, sink))
+    return _micro_log_async_batch_add(batch, entry->text, entry->text_len);
+
+  char stack[MICRO_LOG_RECORD_SIZE];
+  _MicroLogBuf buf;
+  _micro_log_buf_init(&buf, stack, sizeof(stack));
+  micro_log_error error = _micro_log_encode(micro_log, &buf, entry, sink);
+  if (error != MICRO_LOG_OK)
+    goto done;
 
- done:
-  __MICRO_LOG_UNLOCK(micro_log);
+  // GELF records are datagrams of their own, maybe in chunks
+  if (sink == MICRO_LOG_OUT_SOCK_INET && _micro_log_gelf_udp(micro_log))
+    error = _micro_log_write_outputs(micro_log, sink, buf.data, buf.len);
+  else
+    error = _micro_log_async_batch_add(batch, buf.data, buf.len);
 
-  if (error == MICRO_LOG_OK)
-    micro_log_trace("Set output file to \"%s\"", filename);
+ done:
+  _micro_log_buf_free(&buf);
   return error;
 }
 
-#ifdef MICRO_LOG_SOCKETS
+#endif // MICRO_LOG_SOCKETS
 
-_Static_assert(_MICRO_LOG_PROTO_MAX == 2,
-               "Updated MicroLogProto, should also update micro_log_set_socket_inet2");
+// Write the record in [slot] to the outputs, the caller holds the
+// write mutex
+//
+// The records for the sockets are only queued, see
+// `_micro_log_async_batch_send`.
 MICRO_LOG_DEF micro_log_error
-micro_log_set_socket_inet2(MicroLog *micro_log,
-                           char* addr,
-                           int port,
-                           MicroLogProto protocol)
+_micro_log_async_write_slot(MicroLog *micro_log, MicroLogSlot *slot)
 {
-  if (micro_log == NULL)
-    return MICRO_LOG_ERROR_LOGGER_NULL;
-  if (addr == NULL)
-    return MICRO_LOG_ERROR_INET_ADDR_NULL;
-
   micro_log_error error = MICRO_LOG_OK;
+  long unsigned int out =
+    _micro_log_out_for_level(micro_log,
+                             _MICRO_LOG_LOAD(micro_log->out_bitfield),
+                             slot->record.level);
+  _MicroLogEntry entry = {
+    .record = &slot->record,
+    .out    = out & ~_MICRO_LOG_OUT_SOCK,
+  };
+  #ifdef MICRO_LOG_SOCKETS
+  long unsigned int sock = out & _MICRO_LOG_OUT_SOCK;
+  #endif // MICRO_LOG_SOCKETS
+  if (out == 0)
+    _MICRO_LOG_STATS_ADD(micro_log, filtered[slot->record.level], 1);
+  else
+    _MICRO_LOG_STATS_ADD(micro_log, emitted[slot->record.level], 1);
 
-  __MICRO_LOG_LOCK(micro_log);
+  char stack[MICRO_LOG_RECORD_SIZE];
+  _MicroLogBuf buf;
+  _micro_log_buf_init(&buf, stack, sizeof(stack));
 
-  if (micro_log->inet_sock_fd > 0)
+  if (slot->fmt == NULL)
   {
-    if (close_socket(micro_log->inet_sock_fd) < 0)
-    {
-      perror("Error closing inet socket");
-      error = MICRO_LOG_ERROR_CLOSE_INET_SOCK;
+    if (slot->len == 0)
       goto done;
-    }
+    entry.text     = slot->data;
+    entry.text_len = slot->len;
+    entry.msg      = slot->data + slot->msg_begin;
+    entry.msg_len  = slot->msg_len;
+    goto write;
   }
 
-  switch (protocol)
-  {
-  case MICRO_LOG_PROTO_TCP:
-    micro_log->inet_sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-    break;
-  case MICRO_LOG_PROTO_UDP:
-    micro_log->inet_sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
-    break;
-  default:
-    fprintf(stderr, "Inet Protocol unrecognized");
-    goto done;
-  }
-  if (micro_log->inet_sock_fd < 0)
+  entry.fmt      = slot->fmt;
+  entry.args     = slot->data;
+  entry.args_len = slot->len;
+
+  if (out & _MICRO_LOG_OUT_TEXT)
   {
-    perror("Error creating socket");
-    error = MICRO_LOG_ERROR_OPEN_INET_SOCK;
-    goto done;
+    size_t msg_begin, msg_len;
+    error = _micro_log_render_packed(&buf, &slot->record, slot->fmt,
+                                     slot->data, slot->len,
+                                     &msg_begin, &msg_len);
+    if (error != MICRO_LOG_OK)
+      goto done;
+    entry.text     = buf.data;
+    entry.text_len = buf.len;
+    entry.msg      = buf.data + msg_begin;
+    entry.msg_len  = msg_len;
   }
 
-  struct sockaddr_in sockaddr_in;
-  sockaddr_in.sin_family = AF_INET;
-  sockaddr_in.sin_port = htons(port);
-
-  if(inet_pton(AF_INET, addr, &sockaddr_in.sin_addr) <= 0)
-  {
-    perror("Error setting inet socket addr");
-    error = MICRO_LOG_ERROR_INET_ADDR;
-    goto done;
-  } 
-  
-  if (connect(micro_log->inet_sock_fd, (struct sockaddr *) &sockaddr_in,
-              sizeof(sockaddr_in)) < 0)
+ write:
+  error = _micro_log_write_entry(micro_log, &entry);
+  #ifdef MICRO_LOG_SOCKETS
+  for (long unsigned int sink = MICRO_LOG_OUT_SOCK_INET;
+       sink <= MICRO_LOG_OUT_SOCK_UNIX && entry.text != NULL; sink <<= 1)
   {
-    perror("Error connecting to inet socket");
-    error = MICRO_LOG_ERROR_INET_CONNECT;
-    goto done;
+    if (!(sock & sink))
+      continue;
+    micro_log_error sock_error =
+      _micro_log_async_batch_entry(micro_log, &entry, sink);
+    if (error == MICRO_LOG_OK)
+      error = sock_error;
   }
+  #endif // MICRO_LOG_SOCKETS
 
-  micro_log->out_bitfield |= MICRO_LOG_OUT_SOCK_INET;
-  
  done:
-  __MICRO_LOG_UNLOCK(micro_log);
-
-  if (error == MICRO_LOG_OK)
-    micro_log_trace2(micro_log,
-                     "Set output to inet socket at address \"%s\" port %d",
-                     addr, port);
+  _micro_log_buf_free(&buf);
   return error;
 }
 
-#if defined(__unix__) || defined(__unix)
-
-MICRO_LOG_DEF micro_log_error
-micro_log_set_socket_unix2(MicroLog* micro_log, char* path)
+// Write up to MICRO_LOG_ASYNC_BATCH published records to the outputs
+//
+// Returns the number of records consumed.
+MICRO_LOG_DEF size_t _micro_log_async_drain(MicroLog *micro_log)
 {
-  if (micro_log == NULL)
-    return MICRO_LOG_ERROR_LOGGER_NULL;
-  if (path == NULL)
-    return MICRO_LOG_ERROR_SOCK_PATH_NULL;
-
-  micro_log_error error = MICRO_LOG_OK;
-
-  __MICRO_LOG_LOCK(micro_log);
+  MicroLogAsync *async = &micro_log->async;
+  size_t count = 0;
+
+  _micro_log_write_lock(micro_log);
+  #ifdef MICRO_LOG_IO_URING
+  _micro_log_io_uring_begin(micro_log);
+  #endif // MICRO_LOG_IO_URING
+  while (count < MICRO_LOG_ASYNC_BATCH)
+  {
+    size_t pos = __atomic_load_n(&async->dequeue_pos, __ATOMIC_RELAXED);
+    MicroLogSlot *slot = &async->slots[pos & async->mask];
+    size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    intptr_t dif = (intptr_t) seq - (intptr_t) (pos + 1);
+    if (dif < 0)
+      break; // Empty, or the next record is still being rendered
+    if (dif > 0)
+      continue;
+    if (!__atomic_compare_exchange_n(&async->dequeue_pos, &pos, pos + 1,
+                                     true, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED))
+      continue;
+
+    // There is no caller to report write errors to, the record is
+    // simply lost
+    (void) _micro_log_async_write_slot(micro_log, slot);
+
+    __atomic_store_n(&slot->seq, pos + async->mask + 1, __ATOMIC_RELEASE);
+    count++;
+  }
+  #ifdef MICRO_LOG_SOCKETS
+  _micro_log_async_batch_send(micro_log);
+  #endif // MICRO_LOG_SOCKETS
+  #ifdef MICRO_LOG_IO_URING
+  _micro_log_io_uring_end(micro_log);
+  #endif // MICRO_LOG_IO_URING
+  _micro_log_write_unlock(micro_log);
 
-  if (micro_log->unix_sock_fd > 0)
+  if (count > 0)
   {
-    if (close(micro_log->unix_sock_fd) < 0)
+    __atomic_add_fetch(&async->done_pos, count, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&async->waiters, __ATOMIC_ACQUIRE) > 0)
     {
-      perror("Error closing unix socket");
-      error = MICRO_LOG_ERROR_CLOSE_UNIX_SOCK;
-      goto done;
+      pthread_mutex_lock(&async->mutex);
+      pthread_cond_broadcast(&async->flush_cond);
+      pthread_mutex_unlock(&async->mutex);
     }
   }
+  return count;
+}
+
+// Log how many records were dropped since the last report
+//
+// Reports are sent at most once per second, unless [force] is set,
+// so that they do not add to the pressure on the ring.
+MICRO_LOG_DEF void
+_micro_log_async_report_dropped(MicroLog *micro_log, bool force)
+{
+  MicroLogAsync *async = &micro_log->async;
+  size_t total = 0;
+  for (int i = 0; i < MICRO_LOG_LEVEL_MAX; ++i)
+    total += __atomic_load_n(&async->dropped[i], __ATOMIC_RELAXED);
+  if (total == async->dropped_reported)
+    return;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (!force && now.tv_sec == async->dropped_report_time)
+    return;
+
+  size_t dropped = total - async->dropped_reported;
+  async->dropped_reported = total;
+  async->dropped_report_time = now.tv_sec;
+  if (!_micro_log_level_enabled(micro_log, MICRO_LOG_LEVEL_WARN))
+    return;
+
+  _micro_log_report(micro_log, MICRO_LOG_LEVEL_WARN,
+                          "%zu records dropped, the async queue was full",
+                          dropped);
+}
+
+MICRO_LOG_DEF void* _micro_log_async_writer(void *arg)
+{
+  MicroLog *micro_log = (MicroLog*) arg;
+  MicroLogAsync *async = &micro_log->async;
 
-  micro_log->unix_sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
-  if (micro_log->unix_sock_fd < 0)
+  for (;;)
   {
-    perror("Error creating unix socket");
-    error = MICRO_LOG_ERROR_OPEN_UNIX_SOCK;
-    goto done;
+    // Read the stop flag before draining, so that all the records
+    // published before it was set are written
+    int stop = __atomic_load_n(&async->stop, __ATOMIC_ACQUIRE);
+    if (_micro_log_async_drain(micro_log) > 0)
+      continue;
+
+    // Caught up
+    _micro_log_async_report_dropped(micro_log, stop);
+    if (stop)
+      break;
+
+    pthread_mutex_lock(&async->mutex);
+    __atomic_store_n(&async->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (!_micro_log_async_ready(micro_log)
+        && !__atomic_load_n(&async->stop, __ATOMIC_ACQUIRE))
+      _micro_log_async_timedwait(micro_log, &async->cond, 100);
+    __atomic_store_n(&async->sleeping, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&async->mutex);
   }
 
-  struct sockaddr_un sockaddr_un;
-  memset(&sockaddr_un, 0, sizeof(sockaddr_un));
-  sockaddr_un.sun_family = AF_UNIX;
-  strncpy(sockaddr_un.sun_path, path, sizeof(sockaddr_un.sun_path) - 1);
-  
-  if (connect(micro_log->unix_sock_fd, (struct sockaddr *) &sockaddr_un,
-              sizeof(sockaddr_un)) < 0)
+  return NULL;
+}
+
+// Wait for the writer to write all the records pushed so far
+MICRO_LOG_DEF void _micro_log_async_wait(MicroLog *micro_log)
+{
+  MicroLogAsync *async = &micro_log->async;
+  if (__atomic_load_n(&async->slots, __ATOMIC_ACQUIRE) == NULL)
+    return;
+
+  size_t target = __atomic_load_n(&async->enqueue_pos, __ATOMIC_ACQUIRE);
+
+  pthread_mutex_lock(&async->mutex);
+  __atomic_add_fetch(&async->waiters, 1, __ATOMIC_ACQ_REL);
+  while (__atomic_load_n(&async->done_pos, __ATOMIC_ACQUIRE) < target)
   {
-    perror("Error connecting to unix socket");
-    error = MICRO_LOG_ERROR_UNIX_CONNECT;
-    goto done;
+    pthread_cond_signal(&async->cond);
+    _micro_log_async_timedwait(micro_log, &async->flush_cond, 10);
   }
+  __atomic_sub_fetch(&async->waiters, 1, __ATOMIC_ACQ_REL);
+  pthread_mutex_unlock(&async->mutex);
+}
 
-  micro_log->out_bitfield |= MICRO_LOG_OUT_SOCK_UNIX;
+// Drain the ring and stop the writer thread
+MICRO_LOG_DEF micro_log_error _micro_log_async_stop(MicroLog *micro_log)
+{
+  MicroLogAsync *async = &micro_log->async;
+  if (__atomic_load_n(&async->slots, __ATOMIC_ACQUIRE) == NULL)
+    return MICRO_LOG_OK;
 
- done:
-  __MICRO_LOG_UNLOCK(micro_log);
+  __atomic_store_n(&async->stop, 1, __ATOMIC_RELEASE);
+  _micro_log_async_wake(micro_log);
+  if (pthread_join(async->thread, NULL) != 0)
+    return MICRO_LOG_ERROR_THREAD_JOIN;
 
-  if (error == MICRO_LOG_OK)
-    micro_log_trace2(micro_log,
-                     "Set output to unix socket \"%s\"", path);
-  return error;
-}
-#endif // __unix__
+  // From now on records are written synchronously
+  MicroLogSlot *slots = async->slots;
+  __atomic_store_n(&async->slots, NULL, __ATOMIC_RELEASE);
+  free(slots);
+  #ifdef MICRO_LOG_SOCKETS
+  free(async->inet_batch.data);
+  async->inet_batch = (MicroLogSocketBatch){0};
+  free(async->unix_batch.data);
+  async->unix_batch = (MicroLogSocketBatch){0};
+  #endif // MICRO_LOG_SOCKETS
+  #ifdef MICRO_LOG_IO_URING
+  _micro_log_io_uring_free(&async->uring);
+  #endif // MICRO_LOG_IO_URING
 
-#endif // MICRO_LOG_SOCKETS
+  pthread_cond_destroy(&async->flush_cond);
+  pthread_cond_destroy(&async->cond);
+  pthread_mutex_destroy(&async->mutex);
+  return MICRO_LOG_OK;
+}
 
-_Static_assert(MICRO_LOG_LEVEL_MAX == 7,
-               "Updated MICRO_LOG_LEVEL, should also update micro_log_level_string");
-MICRO_LOG_DEF const char*
-micro_log_level_string(MicroLogLevel level, bool color)
+MICRO_LOG_DEF micro_log_error
+micro_log_init_async2(MicroLog *micro_log, size_t capacity)
 {
-  switch(level)
+  micro_log_error error = micro_log_init2(micro_log);
+  if (error != MICRO_LOG_OK)
+    return error;
+
+  if (capacity == 0)
+    capacity = MICRO_LOG_ASYNC_CAPACITY;
+  size_t slots_count = 2;
+  while (slots_count < capacity)
+    slots_count *= 2;
+
+  MicroLogSlot *slots = malloc(slots_count * sizeof(MicroLogSlot));
+  if (slots == NULL)
+    return MICRO_LOG_ERROR_ALLOC;
+  for (size_t i = 0; i < slots_count; ++i)
+    slots[i].seq = i;
+
+  MicroLogAsync *async = &micro_log->async;
+  memset(async, 0, sizeof(*async));
+  async->mask = slots_count - 1;
+  pthread_mutex_init(&async->mutex, NULL);
+  pthread_cond_init(&async->cond, NULL);
+  pthread_cond_init(&async->flush_cond, NULL);
+  async->slots = slots;
+  #ifdef MICRO_LOG_IO_URING
+  if (!_micro_log_io_uring_init(&async->uring))
+    micro_log_trace2(micro_log, "io_uring is not available, using stdio");
+  #endif // MICRO_LOG_IO_URING
+
+  if (pthread_create(&async->thread, NULL,
+                     _micro_log_async_writer, micro_log) != 0)
   {
-  case MICRO_LOG_LEVEL_TRACE:
-    return color ? MICRO_LOG_MAG("TRACE") : "TRACE";
-  case MICRO_LOG_LEVEL_DEBUG:
-    return color ? MICRO_LOG_GRN("DEBUG") : "DEBUG";
-  case MICRO_LOG_LEVEL_INFO:
-    return color ? MICRO_LOG_CYN("INFO") : "INFO";
-  case MICRO_LOG_LEVEL_WARN:
-    return color ? MICRO_LOG_YEL("WARN") : "WARN";
-  case MICRO_LOG_LEVEL_ERROR:
-    return color ? MICRO_LOG_RED("ERROR") : "ERROR";
-  case MICRO_LOG_LEVEL_FATAL:
-    return color ? MICRO_LOG_BOLD(MICRO_LOG_RED("FATAL")) : "FATAL";
-  case MICRO_LOG_LEVEL_DISABLED:
-    return "DISABLED";
-  default:
-    break;
+    __atomic_store_n(&async->slots, NULL, __ATOMIC_RELEASE);
+    free(slots);
+    #ifdef MICRO_LOG_IO_URING
+    _micro_log_io_uring_free(&async->uring);
+    #endif // MICRO_LOG_IO_URING
+    pthread_cond_destroy(&async->flush_cond);
+    pthread_cond_destroy(&async->cond);
+    pthread_mutex_destroy(&async->mutex);
+    return MICRO_LOG_ERROR_THREAD_CREATE;
   }
-  return "UNKNOWN";
+
+  micro_log_trace2(micro_log, "Started async writer with %zu slots",
+                   slots_count);
+  return MICRO_LOG_OK;
+}
+
+MICRO_LOG_DEF micro_log_error
+micro_log_set_overflow2(MicroLog *micro_log,
+                        MicroLogOverflow policy,
+                        MicroLogLevel level)
+{
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
+  if (policy >= _MICRO_LOG_OVERFLOW_MAX)
+    return MICRO_LOG_ERROR_UNKNOWN_OVERFLOW;
+  if (level >= MICRO_LOG_LEVEL_MAX)
+    return MICRO_LOG_ERROR_UNKNOWN_LEVEL;
+
+  __atomic_store_n(&micro_log->overflow_level, level, __ATOMIC_RELAXED);
+  __atomic_store_n(&micro_log->overflow, policy, __ATOMIC_RELAXED);
+  return MICRO_LOG_OK;
 }
 
 MICRO_LOG_DEF micro_log_error
-_micro_log_write_impl(MicroLog *micro_log,
-                      MicroLogLevel level,
-                      const char* file,
-                      int line,
-                      const char *fmt, ...)
+micro_log_get_dropped2(MicroLog *micro_log, size_t *dropped)
 {
   if (micro_log == NULL)
     return MICRO_LOG_ERROR_LOGGER_NULL;
-  if (level < micro_log->log_level
-      || micro_log->log_level == MICRO_LOG_LEVEL_DISABLED)
-    return MICRO_LOG_OK;
 
-  micro_log_error error = MICRO_LOG_OK;
-  
-  __MICRO_LOG_LOCK(micro_log);
+  for (int i = 0; i < MICRO_LOG_LEVEL_MAX; ++i)
+    dropped[i] = __atomic_load_n(&micro_log->async.dropped[i],
+                                 __ATOMIC_RELAXED);
+  return MICRO_LOG_OK;
+}
 
-#define COLOR(x) color ? MICRO_LOG_LGRAY(x) : x
-#define COLOR2(x) color ? MICRO_LOG_BOLD(x) : x
-#define CHECK_ERROR() if (error != MICRO_LOG_OK) { goto done; }
+#endif // MICRO_LOG_ASYNC
 
-  // Handle flags
-  bool json = false;
-  bool color = false;
-  
-  if (micro_log->flags_bitfield == MICRO_LOG_FLAG_NONE)
-  {
-    // Skip other flags
-    goto do_print;
-  }
-  
-  if (micro_log->flags_bitfield & MICRO_LOG_FLAG_COLOR)
-  {
-    color = true;
-  }
-  
-  if (micro_log->flags_bitfield & MICRO_LOG_FLAG_JSON)
-  {
-    json = true;
-    color = false;  // json disables color
-    error = _micro_log_print_outputs(micro_log, "{ ");
-    CHECK_ERROR();
-  }
+#ifndef _WIN32
 
-  if (micro_log->flags_bitfield & MICRO_LOG_FLAG_DATE)
-  {
-    if (json)
-    {
-      error = _micro_log_print_outputs(micro_log, "\"date\": \"");
-      CHECK_ERROR();
-    }
+//
+// Crash handler
+//
+// The signal handler only uses functions that are safe in a signal
+// handler, with the exception of flushing the stdio buffers: it
+// writes the records with write(2), and claims the records in the
+// async ring like the writer thread does, without taking a lock.
+// The records still waiting in the ring with their arguments packed
+// are formatted by `_micro_log_crash_format`, in a buffer on the
+// stack.
+//
 
-    time_t t = time(NULL);
-    struct tm tm = *localtime(&t);
-    error = _micro_log_print_outputs(micro_log, COLOR("%d-%02d-%02d"),
-            tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
-    CHECK_ERROR();
-    
-    if (json)
-    {
-      error = _micro_log_print_outputs(micro_log, "\",");
-      CHECK_ERROR();
-    }
+static const int _micro_log_crash_signals[] = {
+  SIGSEGV, SIGABRT, SIGBUS, SIGFPE, SIGILL,
+};
+static const char *_micro_log_crash_signal_names[] = {
+  "SIGSEGV", "SIGABRT", "SIGBUS", "SIGFPE", "SIGILL",
+};
+#define _MICRO_LOG_CRASH_SIGNALS \
+  (int) (sizeof(_micro_log_crash_signals) / sizeof(_micro_log_crash_signals[0]))
+
+// The logger drained on a crash, NULL if there is none
+static MicroLog *_micro_log_crash_logger;
+static struct sigaction _micro_log_crash_old[_MICRO_LOG_CRASH_SIGNALS];
+static bool _micro_log_crash_installed;
+// So that the handler can run after a stack overflow
+#define _MICRO_LOG_CRASH_STACK_SIZE 65536
+static char _micro_log_crash_stack[_MICRO_LOG_CRASH_STACK_SIZE];
+#ifdef MICRO_LOG_MULTITHREADED
+// The stacks of the other threads, see micro_log_install_crash_stack
+static pthread_key_t _micro_log_crash_stack_key;
+static pthread_once_t _micro_log_crash_stack_once = PTHREAD_ONCE_INIT;
+#endif // MICRO_LOG_MULTITHREADED
 
-    error = _micro_log_print_outputs(micro_log, " ");
-    CHECK_ERROR();
+#ifdef __GLIBC__
+  // Does not wait for the lock of the stream, which the crashed
+  // thread may hold
+  #define _MICRO_LOG_CRASH_FFLUSH(stream) fflush_unlocked(stream)
+#else
+  #define _MICRO_LOG_CRASH_FFLUSH(stream) fflush(stream)
+#endif
+
+MICRO_LOG_DEF void _micro_log_crash_write_fd(int fd, const char *buf, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return;
+    buf += n;
+    len -= (size_t) n;
   }
+}
 
-  if (micro_log->flags_bitfield & MICRO_LOG_FLAG_TIME)
+// Write [buf] to the text outputs in [out] with system calls only
+MICRO_LOG_DEF void
+_micro_log_crash_write(MicroLog *micro_log,
+                       long unsigned int out,
+                       const char *buf,
+                       size_t len)
+{
+  if (out & MICRO_LOG_OUT_STDOUT)
+    _micro_log_crash_write_fd(STDOUT_FILENO, buf, len);
+  if ((out & MICRO_LOG_OUT_FILE) && micro_log->file != NULL)
+    _micro_log_crash_write_fd(fileno(micro_log->file), buf, len);
+  #ifdef MICRO_LOG_MMAP
+  MicroLogMmap *mm = __atomic_load_n(&micro_log->mmap, __ATOMIC_SEQ_CST);
+  if ((out & MICRO_LOG_OUT_MMAP) && mm != NULL)
   {
-    if (json)
-    {
-      error = _micro_log_print_outputs(micro_log, "\"time\": \"");
-      CHECK_ERROR();
-    }
+    // The file and its mapping share the page cache
+    size_t pos = __atomic_fetch_add(&mm->pos, len, __ATOMIC_RELAXED);
+    (void) pwrite(mm->fd, buf, len, (off_t) pos);
+  }
+  #endif // MICRO_LOG_MMAP
+  #ifdef MICRO_LOG_SOCKETS
+  if ((out & MICRO_LOG_OUT_SOCK_INET)
+      && micro_log->inet_sock.state == _MICRO_LOG_SOCKET_CONNECTED)
+    (void) send(micro_log->inet_sock.fd, buf, len,
+                MSG_NOSIGNAL | MSG_DONTWAIT);
+  #if defined(__unix__) || defined(__unix)
+  if ((out & MICRO_LOG_OUT_SOCK_UNIX)
+      && micro_log->unix_sock.state == _MICRO_LOG_SOCKET_CONNECTED)
+    (void) send(micro_log->unix_sock.fd, buf, len,
+                MSG_NOSIGNAL | MSG_DONTWAIT);
+  #endif // __unix__
+  #endif // MICRO_LOG_SOCKETS
+}
 
-    time_t t = time(NULL);
-    struct tm tm = *localtime(&t);
-    error = _micro_log_print_outputs(micro_log, COLOR("%02d:%02d:%02d"),
-                                     tm.tm_hour, tm.tm_min, tm.tm_sec);
-    CHECK_ERROR();
-    
-    if (json)
-    {
-      error = _micro_log_print_outputs(micro_log, "\",");
-      CHECK_ERROR();
-    }
+// Format [fmt] in the [size] bytes of [out] using the arguments
+// packed by `_micro_log_deferred_pack`, with functions that are safe
+// in a signal handler
+//
+// The flags, widths and precisions of the conversions are ignored,
+// the strings were already cut to their precision when packed.
+// Floating point numbers are written with 6 decimals, or as "inf"
+// when they do not fit in 64 bits. When [json], the message is
+// escaped. The message is cut if it does not fit.
+//
+// Returns the length of the message, or -1 if [args] do not match
+// [fmt].
+MICRO_LOG_DEF int
+_micro_log_crash_format(char *out,
+                        size_t size,
+                        const char *fmt,
+                        const char *args,
+                        size_t args_len,
+                        bool json)
+{
+  const char *end = args + args_len;
+  size_t len = 0;
+  char digits[32];
 
-    error = _micro_log_print_outputs(micro_log, " ");
-    CHECK_ERROR();
-  }
+#define READ(dst)                                             \
+  do {                                                        \
+    if ((size_t) (end - args) < sizeof(dst))                  \
+      return -1;                                              \
+    memcpy(&(dst), args, sizeof(dst));                        \
+    args += sizeof(dst);                                      \
+  } while (0)
+#define PUT(str, n)                                                \
+  do {                                                             \
+    for (size_t _i = 0; _i < (size_t) (n); ++_i)                   \
+      PUTC((str)[_i]);                                             \
+  } while (0)
+#define PUTC(c)                                                    \
+  do {                                                             \
+    unsigned char _c = (unsigned char) (c);                        \
+    if (json && (_c == '"' || _c == '\\' || _c < 0x20))           \
+    {                                                              \
+      if (len + 6 > size)                                          \
+        return (int) len;                                          \
+      out[len++] = '\\';                                          \
+      if (_c == '"' || _c == '\\')                                \
+        out[len++] = (char) _c;                                    \
+      else                                                         \
+      {                                                            \
+        memcpy(out + len, "u00", 3);                               \
+        out[len + 3] = "0123456789abcdef"[_c >> 4];                \
+        out[len + 4] = "0123456789abcdef"[_c & 0xf];               \
+        len += 5;                                                  \
+      }                                                            \
+    }                                                              \
+    else                                                           \
+    {                                                              \
+      if (len + 1 > size)                                          \
+        return (int) len;                                          \
+      out[len++] = (char) _c;                                      \
+    }                                                              \
+  } while (0)
 
-  if (micro_log->flags_bitfield & MICRO_LOG_FLAG_LEVEL)
+  const char *p = fmt;
+  while (*p != '\0')
   {
-    if (json)
+    if (*p != '%')
     {
-      error = _micro_log_print_outputs(micro_log, "\"log_level\": \"");
-      CHECK_ERROR();
+      PUTC(*p++);
+      continue;
     }
-
-    error = _micro_log_print_outputs(micro_log, "%-5s",
-                                     micro_log_level_string(level, color));
-    CHECK_ERROR();
-    
-    if (json)
+    if (p[1] == '%')
     {
-      error = _micro_log_print_outputs(micro_log, "\",");
-      CHECK_ERROR();
+      PUTC('%');
+      p += 2;
+      continue;
     }
 
-    error = _micro_log_print_outputs(micro_log, " ");
-    CHECK_ERROR();
-  }
+    _MicroLogSpec spec;
+    _micro_log_parse_spec(p + 1, &spec);
+    if (spec.arg == _MICRO_LOG_ARG_INVALID)
+      return -1;
+    char conversion = p[spec.len];
+    p += spec.len + 1;
 
-  if (micro_log->flags_bitfield & MICRO_LOG_FLAG_PID)
-  {
-    if (json)
+    int star;
+    for (int i = 0; i < spec.stars; ++i)
+      READ(star);
+
+    uint64_t value = 0;
+    bool negative = false;
+    switch (spec.arg)
     {
-      error = _micro_log_print_outputs(micro_log, "\"pid\": \"");
-      CHECK_ERROR();
+    case _MICRO_LOG_ARG_INT:
+    {
+      int v;
+      READ(v);
+      if (conversion == 'c')
+      {
+        PUTC(v);
+        continue;
+      }
+      negative = (v < 0 && (conversion == 'd' || conversion == 'i'));
+      value = negative ? 0 - (uint64_t) (int64_t) v : (uint64_t) (unsigned int) v;
+      break;
     }
-
-    error = _micro_log_print_outputs(micro_log, COLOR("%d"), getpid());
-    CHECK_ERROR();
-    
-    if (json)
+#define INTEGER(type, utype)                                                \
+    {                                                                       \
+      type v;                                                               \
+      READ(v);                                                              \
+      negative = (v < 0 && (conversion == 'd' || conversion == 'i'));       \
+      value = negative ? 0 - (uint64_t) (int64_t) v : (uint64_t) (utype) v; \
+      break;                                                                \
+    }
+    case _MICRO_LOG_ARG_LONG:    INTEGER(long, unsigned long)
+    case _MICRO_LOG_ARG_LLONG:   INTEGER(long long, unsigned long long)
+    case _MICRO_LOG_ARG_INTMAX:  INTEGER(intmax_t, uintmax_t)
+    case _MICRO_LOG_ARG_PTRDIFF: INTEGER(ptrdiff_t, size_t)
+#undef INTEGER
+    case _MICRO_LOG_ARG_SIZE:
     {
-      error = _micro_log_print_outputs(micro_log, "\",");
-      CHECK_ERROR();
+      size_t v;
+      READ(v);
+      value = (uint64_t) v;
+      break;
     }
-    
-    error = _micro_log_print_outputs(micro_log, " ");
-    CHECK_ERROR();
-  }
-
-  if (micro_log->flags_bitfield & MICRO_LOG_FLAG_TID)
-  {
-    if (json)
+    case _MICRO_LOG_ARG_POINTER:
     {
-      error = _micro_log_print_outputs(micro_log, "\"tid\": \"");
-      CHECK_ERROR();
+      void *v;
+      READ(v);
+      PUT("0x", 2);
+      value = (uint64_t) (uintptr_t) v;
+      conversion = 'x';
+      break;
     }
-
-    error = _micro_log_print_outputs(micro_log, COLOR("%ld"), pthread_self());
-    CHECK_ERROR();
-    
-    if (json)
+    case _MICRO_LOG_ARG_DOUBLE:
+    case _MICRO_LOG_ARG_LDOUBLE:
     {
-      error = _micro_log_print_outputs(micro_log, "\",");
-      CHECK_ERROR();
+      double v;
+      if (spec.arg == _MICRO_LOG_ARG_DOUBLE)
+        READ(v);
+      else
+      {
+        long double lv;
+        READ(lv);
+        v = (double) lv;
+      }
+      if (v != v)
+      {
+        PUT("nan", 3);
+        continue;
+      }
+      if (v < 0)
+      {
+        PUTC('-');
+        v = -v;
+      }
+      if (v >= 18446744073709551616.0)
+      {
+        PUT("inf", 3);
+        continue;
+      }
+      uint64_t integer = (uint64_t) v;
+      uint64_t fraction = (uint64_t) ((v - (double) integer) * 1e6 + 0.5);
+      if (fraction >= 1000000)
+      {
+        integer++;
+        fraction -= 1000000;
+      }
+      PUT(digits, _micro_log_format_uint(digits, integer, 0));
+      PUTC('.');
+      PUT(digits, _micro_log_format_uint(digits, fraction, 6));
+      continue;
     }
-    
-    error = _micro_log_print_outputs(micro_log, " ");
-    CHECK_ERROR();
-  }
-
-  if (micro_log->flags_bitfield & MICRO_LOG_FLAG_FILE)
-  {
-    if (json)
+    case _MICRO_LOG_ARG_STRING:
     {
-      error = _micro_log_print_outputs(micro_log, "\"file\": \"");
-      CHECK_ERROR();
+      size_t str_len;
+      READ(str_len);
+      if (str_len == SIZE_MAX)
+      {
+        PUT("(null)", 6);
+        continue;
+      }
+      if (str_len >= (size_t) (end - args) || args[str_len] != '\0')
+        return -1;
+      PUT(args, str_len);
+      args += str_len + 1;
+      continue;
+    }
+    default:
+      return -1;
     }
 
-    error = _micro_log_print_outputs(micro_log, COLOR("%s"), file);
-    CHECK_ERROR();
-    
-    if (json)
+    if (negative)
+      PUTC('-');
+    if (conversion == 'x' || conversion == 'X' || conversion == 'o')
     {
-      error = _micro_log_print_outputs(micro_log, "\",");
-      CHECK_ERROR();
+      const char *hex = (conversion == 'X') ? "0123456789ABCDEF"
+                                            : "0123456789abcdef";
+      unsigned int shift = (conversion == 'o') ? 3 : 4;
+      int n = 0;
+      do {
+        digits[sizeof(digits) - 1 - n++] = hex[value & ((1u << shift) - 1)];
+        value >>= shift;
+      } while (value != 0);
+      PUT(digits + sizeof(digits) - n, n);
     }
-    
-    error = _micro_log_print_outputs(micro_log, " ");
-    CHECK_ERROR();
+    else
+      PUT(digits, _micro_log_format_uint(digits, value, 0));
   }
 
-  if (micro_log->flags_bitfield & MICRO_LOG_FLAG_LINE)
+  return (int) len;
+
+#undef READ
+#undef PUT
+#undef PUTC
+}
+
+#ifdef MICRO_LOG_ASYNC
+// Write the record of [slot], whose arguments are packed, to the text
+// outputs in [out], like the last record of `_micro_log_crash_report`
+//
+// Returns false if the arguments could not be read.
+MICRO_LOG_DEF bool
+_micro_log_crash_write_packed(MicroLog *micro_log,
+                              long unsigned int out,
+                              const MicroLogSlot *slot)
+{
+  bool json = (_MICRO_LOG_LOAD(micro_log->flags_bitfield) & MICRO_LOG_FLAG_JSON);
+  const char *level = micro_log_level_string(slot->record.level, false);
+  char buf[MICRO_LOG_ASYNC_SLOT_SIZE + 64];
+  size_t len = 0;
+
+  const char *begin = json ? "{ \"log_level\": \"" : "";
+  memcpy(buf, begin, strlen(begin));
+  len += strlen(begin);
+  memcpy(buf + len, level, strlen(level));
+  len += strlen(level);
+  const char *sep = json ? "\", \"log\": \"" : " | ";
+  memcpy(buf + len, sep, strlen(sep));
+  len += strlen(sep);
+
+  const char *tail = json ? "\" }\n" : "\n";
+  int n = _micro_log_crash_format(buf + len, sizeof(buf) - len - strlen(tail),
+                                  slot->fmt, slot->data, slot->len, json);
+  if (n < 0)
+    return false;
+  len += (size_t) n;
+  memcpy(buf + len, tail, strlen(tail));
+  len += strlen(tail);
+
+  _micro_log_crash_write(micro_log, out & _MICRO_LOG_OUT_TEXT, buf, len);
+  return true;
+}
+#endif // MICRO_LOG_ASYNC
+
+// Write the records that are still in memory, in the order they were
+// logged as much as possible
+//
+// Returns the number of records that could not be written.
+MICRO_LOG_DEF size_t _micro_log_crash_drain(MicroLog *micro_log)
+{
+  size_t lost = 0;
+  long unsigned int out = _MICRO_LOG_LOAD(micro_log->out_bitfield);
+
+  #ifdef MICRO_LOG_MULTITHREADED
+  // Give the thread that is writing, like the async writer, some time
+  // to finish its records. A thread that crashed while writing never
+  // will, so this gives up after a while.
+  bool locked = false;
+  for (int i = 0; i < 100 && !locked; ++i)
   {
-    if (json)
+    locked = (pthread_mutex_trylock(&micro_log->write_mutex) == 0);
+    if (!locked)
     {
-      error = _micro_log_print_outputs(micro_log, "\"line\": \"");
-      CHECK_ERROR();
+      struct timespec wait = { .tv_sec = 0, .tv_nsec = 1000000 };
+      nanosleep(&wait, NULL);
     }
+  }
+  #endif // MICRO_LOG_MULTITHREADED
 
-    error = _micro_log_print_outputs(micro_log, COLOR("%d"), line);
-    CHECK_ERROR();
-    
-    if (json)
+  if (out & MICRO_LOG_OUT_STDOUT)
+    (void) _MICRO_LOG_CRASH_FFLUSH(stdout);
+  if ((out & MICRO_LOG_OUT_FILE) && micro_log->file != NULL)
+    (void) _MICRO_LOG_CRASH_FFLUSH(micro_log->file);
+  if ((out & MICRO_LOG_OUT_BINARY) && micro_log->binary_file != NULL)
+    (void) _MICRO_LOG_CRASH_FFLUSH(micro_log->binary_file);
+
+  #ifdef MICRO_LOG_IO_URING
+  // The batch of a writer that did not finish it, a part of it may
+  // have been written already
+  MicroLogIoUring *uring = &micro_log->async.uring;
+  if (uring->batching)
+  {
+    for (int i = 0; i < _MICRO_LOG_IO_URING_COUNT; ++i)
     {
-      error = _micro_log_print_outputs(micro_log, "\",");
-      CHECK_ERROR();
+      _micro_log_crash_write_fd(uring->fds[i], uring->bufs[i], uring->lens[i]);
+      uring->lens[i] = 0;
     }
-
-    error = _micro_log_print_outputs(micro_log, " ");
-    CHECK_ERROR();
   }
+  #endif // MICRO_LOG_IO_URING
 
-  if (json)
+  #ifdef MICRO_LOG_THREAD_BUFFER
+  for (MicroLogThreadBuffer *thread_buffer = micro_log->thread_buffers;
+       thread_buffer != NULL;
+       thread_buffer = thread_buffer->next)
   {
-    error = _micro_log_print_outputs(micro_log, "\"log\": \"");
-    CHECK_ERROR();
+    if (thread_buffer->len > 0 && micro_log->file != NULL)
+      _micro_log_crash_write_fd(fileno(micro_log->file),
+                                thread_buffer->data, thread_buffer->len);
+    thread_buffer->len = 0;
   }
-  else if (micro_log->flags_bitfield > 1)
+  #endif // MICRO_LOG_THREAD_BUFFER
+
+  #ifdef MICRO_LOG_ASYNC
+  MicroLogAsync *async = &micro_log->async;
+  while (__atomic_load_n(&async->slots, __ATOMIC_ACQUIRE) != NULL)
   {
-    error = _micro_log_print_outputs(micro_log, COLOR2("| "));
-    CHECK_ERROR();
+    size_t pos = __atomic_load_n(&async->dequeue_pos, __ATOMIC_RELAXED);
+    MicroLogSlot *slot = &async->slots[pos & async->mask];
+    size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    intptr_t dif = (intptr_t) seq - (intptr_t) (pos + 1);
+    if (dif < 0)
+      break;
+    if (dif > 0
+        || !__atomic_compare_exchange_n(&async->dequeue_pos, &pos, pos + 1,
+                                        false, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED))
+      continue;
+
+    if (slot->fmt == NULL && slot->len > 0)
+      _micro_log_crash_write(micro_log, out & _MICRO_LOG_OUT_TEXT,
+                             slot->data, slot->len);
+    else if (slot->fmt == NULL
+             || !_micro_log_crash_write_packed(micro_log, out, slot))
+      lost++;
+    __atomic_store_n(&slot->seq, pos + async->mask + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&async->done_pos, 1, __ATOMIC_RELEASE);
   }
-  
- do_print:;
-  va_list args;
-  va_start(args, fmt);
-  error = _micro_log_print_outputs_args(micro_log, fmt, args);
-  if (error != MICRO_LOG_OK) { va_end(args); goto done; }
-  va_end(args);
+  #endif // MICRO_LOG_ASYNC
 
-  if (json)
+  #ifdef MICRO_LOG_MULTITHREADED
+  if (locked)
+    pthread_mutex_unlock(&micro_log->write_mutex);
+  #endif // MICRO_LOG_MULTITHREADED
+  return lost;
+}
+
+// Write the last record, about the signal [index] of
+// _micro_log_crash_signals
+MICRO_LOG_DEF void
+_micro_log_crash_report(MicroLog *micro_log, int index, size_t lost)
+{
+  long unsigned int flags = _MICRO_LOG_LOAD(micro_log->flags_bitfield);
+  bool json = (flags & MICRO_LOG_FLAG_JSON);
+  char buf[256];
+  size_t len = 0;
+
+#define _MICRO_LOG_CRASH_PUTS(str)              \
+  do {                                          \
+    size_t _len = strlen(str);                  \
+    memcpy(buf + len, (str), _len);             \
+    len += _len;                                \
+  } while (0)
+
+  _MICRO_LOG_CRASH_PUTS(json ? "{ \"log_level\": \"FATAL\", \"log\": \""
+                             : "FATAL | ");
+  _MICRO_LOG_CRASH_PUTS("Caught signal ");
+  len += _micro_log_format_uint(buf + len,
+                                (uint64_t) _micro_log_crash_signals[index], 0);
+  _MICRO_LOG_CRASH_PUTS(" (");
+  _MICRO_LOG_CRASH_PUTS(_micro_log_crash_signal_names[index]);
+  _MICRO_LOG_CRASH_PUTS(")");
+  if (lost > 0)
   {
-    error = _micro_log_print_outputs(micro_log, "\" }");
-    CHECK_ERROR();
+    _MICRO_LOG_CRASH_PUTS(", ");
+    len += _micro_log_format_uint(buf + len, (uint64_t) lost, 0);
+    _MICRO_LOG_CRASH_PUTS(" records lost");
   }
-  
-  error = _micro_log_print_outputs(micro_log, "\n");
-  CHECK_ERROR();
-  
- done:
-  __MICRO_LOG_UNLOCK(micro_log);
-  return error;
+  _MICRO_LOG_CRASH_PUTS(json ? "\" }\n" : "\n");
 
-#undef COLOR
-#undef COLOR2
+#undef _MICRO_LOG_CRASH_PUTS
+
+  _micro_log_crash_write(micro_log,
+                         _MICRO_LOG_LOAD(micro_log->out_bitfield)
+                         & _MICRO_LOG_OUT_TEXT,
+                         buf, len);
 }
 
-MICRO_LOG_DEF micro_log_error
-_micro_log_print_outputs(MicroLog *micro_log, const char* fmt, ...)
+MICRO_LOG_DEF void _micro_log_crash_signal(int sig)
 {
-  micro_log_error error;
-  va_list args;
+  int saved_errno = errno;
 
-  va_start(args, fmt);
-  error = _micro_log_print_outputs_args(micro_log, fmt, args);
-  va_end(args);
-  
-  return error;
+  int index = 0;
+  while (index < _MICRO_LOG_CRASH_SIGNALS - 1
+         && _micro_log_crash_signals[index] != sig)
+    index++;
+
+  // Only the first crash is reported, in case draining crashes too
+  MicroLog *micro_log = __atomic_exchange_n(&_micro_log_crash_logger, NULL,
+                                            __ATOMIC_SEQ_CST);
+  if (micro_log != NULL)
+  {
+    size_t lost = _micro_log_crash_drain(micro_log);
+    _micro_log_crash_report(micro_log, index, lost);
+  }
+
+  // Let the previous handler, or the default action, end the program
+  sigaction(sig, &_micro_log_crash_old[index], NULL);
+  raise(sig);
+  errno = saved_errno;
+}
+
+MICRO_LOG_DEF void _micro_log_crash_exit(void)
+{
+  MicroLog *micro_log = __atomic_exchange_n(&_micro_log_crash_logger, NULL,
+                                            __ATOMIC_SEQ_CST);
+  if (micro_log != NULL)
+    (void) micro_log_flush2(micro_log);
 }
 
-_Static_assert(_MICRO_LOG_OUT_MAX == (1 << 4),
-               "Updated MICRO_LOG_OUT, should also update _micro_log_print_outputs_args");
 MICRO_LOG_DEF micro_log_error
-_micro_log_print_outputs_args(MicroLog *micro_log,
-                              const char* fmt,
-                              va_list args)
+micro_log_install_crash_handler2(MicroLog *micro_log)
 {
-  micro_log_error error = MICRO_LOG_OK;
+  if (micro_log == NULL)
+    return MICRO_LOG_ERROR_LOGGER_NULL;
 
-  if (micro_log->out_bitfield & MICRO_LOG_OUT_STDOUT)
-  {
-    va_list copy;
-    va_copy(copy, args);
-    if (vfprintf(stdout, fmt, copy) < 0)
-    {
-      error = MICRO_LOG_ERROR_PRINTF_STDOUT;
-      va_end(copy);
-      goto done;
-    }
-    va_end(copy);
-  }
-  if (micro_log->out_bitfield & MICRO_LOG_OUT_FILE)
-  {
-    va_list copy;
-    va_copy(copy, args);
-    if (vfprintf(micro_log->file, fmt, copy) < 0)
-    {
-      error = MICRO_LOG_ERROR_PRINTF_FILE;
-      va_end(copy);
-      goto done;
-    }
-    va_end(copy);
-  }
-  #ifdef MICRO_LOG_SOCKETS
-  if (micro_log->out_bitfield & MICRO_LOG_OUT_SOCK_INET)
+  __atomic_store_n(&_micro_log_crash_logger, micro_log, __ATOMIC_SEQ_CST);
+  if (_micro_log_crash_installed)
+    return MICRO_LOG_OK;
+
+  stack_t stack = {
+    .ss_sp    = _micro_log_crash_stack,
+    .ss_size  = _MICRO_LOG_CRASH_STACK_SIZE,
+    .ss_flags = 0,
+  };
+  if (sigaltstack(&stack, NULL) != 0)
+    return MICRO_LOG_ERROR_CRASH_HANDLER;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = _micro_log_crash_signal;
+  action.sa_flags = SA_ONSTACK;
+  sigemptyset(&action.sa_mask);
+  for (int i = 0; i < _MICRO_LOG_CRASH_SIGNALS; ++i)
   {
-    va_list copy; va_copy(copy, args);
-    if (vdprintf(micro_log->inet_sock_fd, fmt, copy) < 0)
-    {
-      error = MICRO_LOG_ERROR_VPRINTF_SOCK_INET;
-      va_end(copy);
-      goto done;
-    }
-    va_end(copy); 
+    if (sigaction(_micro_log_crash_signals[i], &action,
+                  &_micro_log_crash_old[i]) != 0)
+      return MICRO_LOG_ERROR_CRASH_HANDLER;
   }
-  #if defined(__unix__) || defined(__unix)
-  if (micro_log->out_bitfield & MICRO_LOG_OUT_SOCK_UNIX)
+  if (atexit(_micro_log_crash_exit) != 0)
+    return MICRO_LOG_ERROR_CRASH_HANDLER;
+
+  _micro_log_crash_installed = true;
+  micro_log_trace2(micro_log, "Installed crash handler");
+  return MICRO_LOG_OK;
+}
+
+#ifdef MICRO_LOG_MULTITHREADED
+// Free the alternate stack of a thread that exits
+MICRO_LOG_DEF void _micro_log_crash_stack_destroy(void *arg)
+{
+  stack_t stack = { .ss_sp = NULL, .ss_size = 0, .ss_flags = SS_DISABLE };
+  (void) sigaltstack(&stack, NULL);
+  free(arg);
+}
+
+MICRO_LOG_DEF void _micro_log_crash_stack_key_create(void)
+{
+  pthread_key_create(&_micro_log_crash_stack_key,
+                     _micro_log_crash_stack_destroy);
+}
+#endif // MICRO_LOG_MULTITHREADED
+
+MICRO_LOG_DEF micro_log_error micro_log_install_crash_stack(void)
+{
+  stack_t stack;
+  if (sigaltstack(NULL, &stack) != 0)
+    return MICRO_LOG_ERROR_CRASH_HANDLER;
+  if (!(stack.ss_flags & SS_DISABLE))
+    return MICRO_LOG_OK;
+
+  stack = (stack_t) {
+    .ss_sp    = malloc(_MICRO_LOG_CRASH_STACK_SIZE),
+    .ss_size  = _MICRO_LOG_CRASH_STACK_SIZE,
+    .ss_flags = 0,
+  };
+  if (stack.ss_sp == NULL)
+    return MICRO_LOG_ERROR_ALLOC;
+  if (sigaltstack(&stack, NULL) != 0)
   {
-    va_list copy; va_copy(copy, args);
-    if (vdprintf(micro_log->unix_sock_fd, fmt, copy) < 0)
-    {
-      error = MICRO_LOG_ERROR_VPRINTF_SOCK_INET;
-      va_end(copy);
-      goto done;
-    }
-    va_end(copy);
+    free(stack.ss_sp);
+    return MICRO_LOG_ERROR_CRASH_HANDLER;
   }
-  #endif // __unix__
-  #endif // MICRO_LOG_SOCKETS
 
- done:
-  return error;  
+  #ifdef MICRO_LOG_MULTITHREADED
+  pthread_once(&_micro_log_crash_stack_once,
+               _micro_log_crash_stack_key_create);
+  pthread_setspecific(_micro_log_crash_stack_key, stack.ss_sp);
+  #endif // MICRO_LOG_MULTITHREADED
+  return MICRO_LOG_OK;
 }
 
+// Stop draining [micro_log] on a crash, it is being closed
+MICRO_LOG_DEF void _micro_log_crash_forget(MicroLog *micro_log)
+{
+  MicroLog *expected = micro_log;
+  __atomic_compare_exchange_n(&_micro_log_crash_logger, &expected, NULL,
+                              false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+#endif // _WIN32
+
 #undef __MICRO_LOG_LOCK
 #undef __MICRO_LOG_UNLOCK
 